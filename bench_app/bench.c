@@ -0,0 +1,776 @@
+/*
+bench program measures the performance of the server.
+It generates the test files, starts the server on the loopback interface in the directory with the files
+and drives it with concurrent clients: every client has its own connection and sends download or update requests
+(binary frames from common/protocol.h), keeping the given number of requests in flight.
+The file data is received and dropped, so the numbers show the server and the network stack, not the disk of the client.
+At the end the results are printed as JSON: throughput in MB/s and requests/s, p50/p99/p999 latency of the requests
+and the CPU time the server spent per GB of sent data (from /proc/<pid>/stat of the server).
+The server can also be started separately (-x), then its CPU time is not measured.
+The resident memory of the server (VmRSS from /proc/<pid>/status) is read before the run, after -i idle connections
+are opened and at its peak during the run, so the report shows the memory of one idle and of one active connection.
+With -l the clients talk to the server through a relay (common/relay.h) which holds every byte for half of the given round trip time
+in each direction, so the effect of the latency on the request pipelining and the chunk sizes can be seen on one box.
+The relay runs in user space: the kernel of the server still sees the loopback round trip, the TCP window is not limited
+by the latency (that needs netem, which is not available everywhere).
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../common/protocol.h"
+#include "../common/relay.h"
+
+#define DEFAULT_SERVER "../server_app/server"
+#define DEFAULT_DATA_DIR "bench_data"
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 12346          // Not the default port of the server, so the bench doesn't hit a running server
+#define BUFFER_SIZE 1024
+#define RECEIVE_BUFFER_SIZE (256 * 1024)
+#define MAX_DEPTH 64                // Maximum requests in flight on one connection
+#define FILE_NAME_FORMAT "bench_%05d.bin"
+#define IDLE_SETTLE_US 200000       // Time the server gets to accept the idle connections before its memory is read
+#define MEMORY_SAMPLE_US 10000      // Resident memory of the server is read this often during the run
+
+// Distribution of the sizes of the test files
+typedef enum {
+    SIZE_FIXED,             // every file has the same size
+    SIZE_UNIFORM,           // size is uniform between min and max
+    SIZE_LOGNORMAL          // log of the size is normal, median and sigma of the log
+} SizeDistribution;
+
+// Benchmark settings from the command line
+typedef struct {
+    const char *server_path;    // server binary started by the bench
+    const char *server_args;    // extra arguments for the server, for example "-m uring"
+    const char *data_dir;       // directory with the test files, the server runs there
+    const char *host;           // server address
+    int port;                   // server port
+    int external_server;        // flag that the server is already running, the bench doesn't start it
+    int clients;                // concurrent connections
+    int depth;                  // requests in flight on one connection
+    int file_count;             // number of test files
+    const char *size_spec;      // size distribution as given on the command line
+    SizeDistribution size_distribution;
+    double size_a;              // fixed size, min size or median size
+    double size_b;              // max size or sigma
+    double update_ratio;        // part of the requests which are update requests for the unchanged file
+    double duration;            // seconds of the measurement, used if requests is 0
+    long requests;              // requests per client, 0 - run for the duration
+    const char *output;         // JSON file, NULL - standard output
+    double latency_ms;          // Round trip time added by the relay, 0 - the clients connect to the server directly
+    int relay_port;             // Port of the relay, the clients connect to it if latency_ms > 0
+    int idle_connections;       // Connections opened before the run which never send a request
+} BenchConfig;
+
+// Resident memory of the server in KB during the run, -1 if it is not known (external server)
+typedef struct {
+    long start;                 // Before any connection
+    long idle;                  // With the idle connections
+    long peak;                  // Highest value during the run
+} ServerMemory;
+
+// Connection of the client to the relay and of the relay to the server, freed when both directions are over
+typedef struct {
+    RelayDirection directions[2];
+    atomic_int running;         // Directions still moving the data
+} RelayConnection;
+
+// Results of one client thread
+typedef struct {
+    const BenchConfig *config;
+    const uint64_t *file_sizes;
+    int index;                  // number of the client, seeds its random generator
+    uint64_t requests;          // completed requests
+    uint64_t errors;            // failed requests and broken connections
+    uint64_t bytes;             // file data received
+    uint32_t *latencies;        // latency of every request in microseconds
+    size_t latency_count;
+    size_t latency_capacity;
+} ClientResult;
+
+atomic_int stop_clients;        // Set when the duration is over
+atomic_int clients_running;     // Client threads which didn't finish yet
+int relay_socket = -1;          // Listening socket of the relay, -1 if it doesn't run
+
+// Function prototypes
+void printUsage(const char *program);
+int parseSizeSpec(BenchConfig *config);
+uint64_t pickFileSize(const BenchConfig *config, uint64_t *state);
+int createTestFiles(const BenchConfig *config, uint64_t *file_sizes);
+double serverCpuSeconds(pid_t server_pid);
+long serverResidentKb(pid_t server_pid);
+void raiseFileLimit(void);
+int *openIdleConnections(const BenchConfig *config);
+int connectToServer(const BenchConfig *config);
+void relayDirectionDone(RelayDirection *direction);
+void *relayThread(void *arg);
+int startRelay(BenchConfig *config);
+int sendAll(int socket_fd, const void *buffer, size_t size);
+int receiveAll(int socket_fd, void *buffer, size_t size);
+int recordLatency(ClientResult *result, uint64_t latency);
+void *clientThread(void *arg);
+int compareLatency(const void *a, const void *b);
+uint32_t percentile(const uint32_t *sorted, size_t count, double fraction);
+void writeReport(FILE *output, const BenchConfig *config, ClientResult *results, double elapsed, double server_cpu,
+                 const ServerMemory *memory);
+
+// Function prints the command line options
+void printUsage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -c clients      concurrent connections (default 4)\n"
+            "  -q depth        requests in flight on one connection, 1-%d (default 1)\n"
+            "  -f files        number of test files (default 100)\n"
+            "  -z sizes        file sizes: fixed:SIZE, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA (default fixed:1M)\n"
+            "  -u ratio        part of the requests which are update polls of unchanged files, 0-1 (default 0)\n"
+            "  -t seconds      duration of the measurement (default 5)\n"
+            "  -n requests     requests per client instead of the duration\n"
+            "  -s path         server binary (default %s)\n"
+            "  -a \"args\"       extra arguments for the server, for example \"-m uring\"\n"
+            "  -d dir          directory with the test files (default %s)\n"
+            "  -p port         server port (default %d)\n"
+            "  -x host         don't start the server, use the running server on the host\n"
+            "  -l ms           round trip time added by a relay between the clients and the server\n"
+            "  -i connections  idle connections opened before the run, the report shows the memory per connection\n"
+            "  -o file         write the JSON report to the file instead of the standard output\n",
+            program, MAX_DEPTH, DEFAULT_SERVER, DEFAULT_DATA_DIR, DEFAULT_PORT);
+}
+
+// Function reads the size distribution: fixed:SIZE, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA
+int parseSizeSpec(BenchConfig *config) {
+    const char *spec = config->size_spec;
+    const char *second;
+    if (strncmp(spec, "fixed:", 6) == 0) {
+        config->size_distribution = SIZE_FIXED;
+        return parseSize(spec + 6, &config->size_a, '\0');
+    }
+    if (strncmp(spec, "uniform:", 8) == 0 && (second = strchr(spec + 8, ':')) != NULL) {
+        config->size_distribution = SIZE_UNIFORM;
+        if (parseSize(spec + 8, &config->size_a, ':') == -1 || parseSize(second + 1, &config->size_b, '\0') == -1) {
+            return -1;
+        }
+        return config->size_b >= config->size_a ? 0 : -1;
+    }
+    if (strncmp(spec, "lognormal:", 10) == 0 && (second = strchr(spec + 10, ':')) != NULL) {
+        config->size_distribution = SIZE_LOGNORMAL;
+        config->size_b = atof(second + 1);
+        return parseSize(spec + 10, &config->size_a, ':') == -1 || config->size_b < 0 ? -1 : 0;
+    }
+    return -1;
+}
+
+// Function picks the size of the next test file from the distribution
+uint64_t pickFileSize(const BenchConfig *config, uint64_t *state) {
+    if (config->size_distribution == SIZE_UNIFORM) {
+        return (uint64_t)(config->size_a + randomUnit(state) * (config->size_b - config->size_a));
+    }
+    if (config->size_distribution == SIZE_LOGNORMAL) {
+        // Box-Muller transform gives the normal number from two uniform numbers
+        double u1 = randomUnit(state);
+        double u2 = randomUnit(state);
+        double normal = sqrt(-2.0 * log(1.0 - u1)) * cos(2 * M_PI * u2);
+        return (uint64_t)(config->size_a * exp(config->size_b * normal));
+    }
+    return (uint64_t)config->size_a;
+}
+
+// Function creates the test files in the data directory, the files of the right size from the last run are kept
+int createTestFiles(const BenchConfig *config, uint64_t *file_sizes) {
+    if (mkdir(config->data_dir, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating data directory");
+        return -1;
+    }
+    char *buffer = malloc(RECEIVE_BUFFER_SIZE);
+    if (buffer == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ULL;     // Same seed every run, so the files are the same
+    for (int i = 0; i < config->file_count; i++) {
+        char path[BUFFER_SIZE];
+        snprintf(path, sizeof(path), "%s/" FILE_NAME_FORMAT, config->data_dir, i);
+        file_sizes[i] = pickFileSize(config, &state);
+
+        struct stat file_stat;
+        if (stat(path, &file_stat) == 0 && (uint64_t)file_stat.st_size == file_sizes[i]) {
+            continue;
+        }
+        int file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file_fd == -1) {
+            perror("Error creating test file");
+            free(buffer);
+            return -1;
+        }
+        uint64_t written = 0;
+        while (written < file_sizes[i]) {
+            size_t chunk = file_sizes[i] - written < RECEIVE_BUFFER_SIZE ? file_sizes[i] - written : RECEIVE_BUFFER_SIZE;
+            for (size_t j = 0; j + 8 <= chunk; j += 8) {
+                uint64_t value = nextRandom(&state);
+                memcpy(buffer + j, &value, 8);
+            }
+            if (write(file_fd, buffer, chunk) != (ssize_t)chunk) {
+                perror("Error writing test file");
+                close(file_fd);
+                free(buffer);
+                return -1;
+            }
+            written += chunk;
+        }
+        close(file_fd);
+    }
+    free(buffer);
+    return 0;
+}
+
+// Function returns the CPU time (user and system) the server used so far, -1 if it is not known
+double serverCpuSeconds(pid_t server_pid) {
+    char path[64];
+    char stat_line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)server_pid);
+    FILE *stat_file = fopen(path, "r");
+    if (stat_file == NULL) {
+        return -1;
+    }
+    size_t length = fread(stat_line, 1, sizeof(stat_line) - 1, stat_file);
+    fclose(stat_file);
+    stat_line[length] = '\0';
+
+    // Fields after the command name in brackets: state is field 3, utime and stime are fields 14 and 15
+    char *position = strrchr(stat_line, ')');
+    unsigned long user_ticks, system_ticks;
+    if (position == NULL ||
+        sscanf(position + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &user_ticks, &system_ticks) != 2) {
+        return -1;
+    }
+    return (double)(user_ticks + system_ticks) / sysconf(_SC_CLK_TCK);
+}
+
+// Function returns the resident memory of the server in KB, -1 if it is not known
+long serverResidentKb(pid_t server_pid) {
+    char path[64];
+    char line[256];
+    long resident = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)server_pid);
+    FILE *status_file = fopen(path, "r");
+    if (status_file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), status_file) != NULL) {
+        if (sscanf(line, "VmRSS: %ld", &resident) == 1) {
+            break;
+        }
+    }
+    fclose(status_file);
+    return resident;
+}
+
+// Function raises the limit of open files, the idle connections and the clients need a socket each
+void raiseFileLimit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Function opens the idle connections, returns their sockets or NULL on error
+int *openIdleConnections(const BenchConfig *config) {
+    int *sockets = malloc((config->idle_connections > 0 ? config->idle_connections : 1) * sizeof(int));
+    if (sockets == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (int i = 0; i < config->idle_connections; i++) {
+        sockets[i] = connectToServer(config);
+        if (sockets[i] == -1) {
+            fprintf(stderr, "Error opening idle connection %d: %s\n", i + 1, strerror(errno));
+            while (i-- > 0) {
+                close(sockets[i]);
+            }
+            free(sockets);
+            return NULL;
+        }
+    }
+    return sockets;
+}
+
+// Function connects to the server, through the relay if it runs, returns -1 on error
+int connectToServer(const BenchConfig *config) {
+    return config->latency_ms > 0 ? connectToPort(DEFAULT_HOST, config->relay_port) : connectToPort(config->host, config->port);
+}
+
+// Function closes the relayed connection when the last of its directions is over
+void relayDirectionDone(RelayDirection *direction) {
+    RelayConnection *connection = direction->context;
+    if (atomic_fetch_sub(&connection->running, 1) == 1) {
+        close(connection->directions[0].from_fd);
+        close(connection->directions[0].to_fd);
+        free(connection);
+    }
+}
+
+// Thread function of the relay: accepts the clients and connects every one of them to the server
+void *relayThread(void *arg) {
+    const BenchConfig *config = arg;
+    while (1) {
+        int client_fd = accept(relay_socket, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Relay accept");
+            return NULL;
+        }
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        int server_fd = connectToPort(config->host, config->port);
+        RelayConnection *connection = malloc(sizeof(RelayConnection));
+        if (server_fd == -1 || connection == NULL) {
+            close(client_fd);
+            if (server_fd != -1) {
+                close(server_fd);
+            }
+            free(connection);
+            continue;
+        }
+
+        // Half of the round trip time in each direction
+        uint64_t delay_us = (uint64_t)(config->latency_ms * 500);
+        connection->directions[0] = (RelayDirection){.from_fd = client_fd, .to_fd = server_fd, .chunk_size = RELAY_CHUNK_SIZE,
+            .max_queued = RELAY_MAX_QUEUED, .check_ms = -1, .delay_us = delay_us, .done = relayDirectionDone, .context = connection};
+        connection->directions[1] = connection->directions[0];
+        connection->directions[1].from_fd = server_fd;
+        connection->directions[1].to_fd = client_fd;
+        atomic_init(&connection->running, 2);
+        relayStart(&connection->directions[0]);
+        relayStart(&connection->directions[1]);
+    }
+}
+
+// Function starts the relay on a free port of the loopback interface, returns -1 on error
+int startRelay(BenchConfig *config) {
+    struct sockaddr_in address;
+    socklen_t address_length = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    relay_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (relay_socket == -1 || bind(relay_socket, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(relay_socket, 128) == -1 || getsockname(relay_socket, (struct sockaddr *)&address, &address_length) == -1) {
+        perror("Error starting relay");
+        return -1;
+    }
+    config->relay_port = ntohs(address.sin_port);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, relayThread, config) != 0) {
+        fprintf(stderr, "Error creating relay thread\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Function sends exactly size bytes, returns -1 on error
+int sendAll(int socket_fd, const void *buffer, size_t size) {
+    size_t total_sent = 0;
+    while (total_sent < size) {
+        ssize_t bytes_sent = send(socket_fd, (const char *)buffer + total_sent, size - total_sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            return -1;
+        }
+        total_sent += bytes_sent;
+    }
+    return 0;
+}
+
+// Function receives exactly size bytes, returns -1 if the connection is closed or on error
+int receiveAll(int socket_fd, void *buffer, size_t size) {
+    size_t total_received = 0;
+    while (total_received < size) {
+        ssize_t received_bytes = recv(socket_fd, (char *)buffer + total_received, size - total_received, 0);
+        if (received_bytes <= 0) {
+            return -1;
+        }
+        total_received += received_bytes;
+    }
+    return 0;
+}
+
+// Function adds the latency of the completed request to the results of the client
+int recordLatency(ClientResult *result, uint64_t latency) {
+    if (result->latency_count == result->latency_capacity) {
+        size_t capacity = result->latency_capacity == 0 ? 65536 : result->latency_capacity * 2;
+        uint32_t *latencies = realloc(result->latencies, capacity * sizeof(uint32_t));
+        if (latencies == NULL) {
+            return -1;
+        }
+        result->latencies = latencies;
+        result->latency_capacity = capacity;
+    }
+    result->latencies[result->latency_count++] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+    return 0;
+}
+
+// Thread function of one client: keeps depth requests in flight on its connection until the end of the run
+// Latency of the request is the time from sending it to receiving the whole response
+void *clientThread(void *arg) {
+    ClientResult *result = (ClientResult *)arg;
+    const BenchConfig *config = result->config;
+    uint64_t state = 0x2545F4914F6CDD1DULL * (result->index + 1);
+    uint64_t sent_at[MAX_DEPTH];
+    uint32_t next_id = 0, first_id = 0;
+    long sent = 0;
+    int broken = 0;
+
+    char *buffer = malloc(RECEIVE_BUFFER_SIZE);
+    int socket_fd = buffer == NULL ? -1 : connectToServer(config);
+    if (socket_fd == -1) {
+        result->errors++;
+        free(buffer);
+        atomic_fetch_sub(&clients_running, 1);
+        return NULL;
+    }
+
+    while (!broken) {
+        // Sending requests until depth of them are in flight
+        int running = config->requests > 0 ? sent < config->requests : !atomic_load(&stop_clients);
+        while (running && next_id - first_id < (uint32_t)config->depth) {
+            int file = nextRandom(&state) % config->file_count;
+            int update = randomUnit(&state) < config->update_ratio;
+            char name[64];
+            unsigned char request[FRAME_HEADER_SIZE + sizeof(name)];
+            snprintf(name, sizeof(name), FILE_NAME_FORMAT, file);
+
+            // Update request says the client has the whole file, the server answers that there is no update
+            FrameHeader header;
+            memset(&header, 0, sizeof(header));
+            header.opcode = update ? OP_UPDATE : OP_DOWNLOAD;
+            header.request_id = next_id;
+            header.payload_size = strlen(name);
+            header.offset = update ? result->file_sizes[file] : 0;
+            encodeFrameHeader(&header, request);
+            memcpy(request + FRAME_HEADER_SIZE, name, header.payload_size);
+
+            sent_at[next_id % MAX_DEPTH] = nowMicroseconds();
+            if (sendAll(socket_fd, request, FRAME_HEADER_SIZE + header.payload_size) == -1) {
+                broken = 1;
+                break;
+            }
+            next_id++;
+            sent++;
+            running = config->requests > 0 ? sent < config->requests : !atomic_load(&stop_clients);
+        }
+        if (broken || first_id == next_id) {
+            break;
+        }
+
+        // Receiving the response to the oldest request and dropping the data
+        unsigned char frame[FRAME_HEADER_SIZE];
+        FrameHeader header;
+        if (receiveAll(socket_fd, frame, FRAME_HEADER_SIZE) == -1 || decodeFrameHeader(frame, &header) == -1 ||
+            header.request_id != first_id) {
+            broken = 1;
+            break;
+        }
+        uint64_t remaining = (uint64_t)(header.header_size - FRAME_HEADER_SIZE) + header.payload_size;
+        uint64_t body = (header.flags & FLAG_BODY) ? header.length : 0;
+        remaining += body;
+        while (remaining > 0) {
+            size_t chunk = remaining < RECEIVE_BUFFER_SIZE ? remaining : RECEIVE_BUFFER_SIZE;
+            ssize_t received_bytes = recv(socket_fd, buffer, chunk, 0);
+            if (received_bytes <= 0) {
+                broken = 1;
+                break;
+            }
+            remaining -= received_bytes;
+        }
+        if (broken) {
+            break;
+        }
+        if (header.status != STATUS_OK && header.status != STATUS_NO_UPDATE) {
+            result->errors++;
+        }
+        result->requests++;
+        result->bytes += body;
+        first_id++;
+        if (recordLatency(result, nowMicroseconds() - sent_at[(first_id - 1) % MAX_DEPTH]) == -1) {
+            perror("Error recording latency");
+            broken = 1;
+        }
+    }
+
+    // Requests in flight on the broken connection are failed
+    if (broken) {
+        result->errors += next_id - first_id > 0 ? next_id - first_id : 1;
+    }
+    close(socket_fd);
+    free(buffer);
+    atomic_fetch_sub(&clients_running, 1);
+    return NULL;
+}
+
+// Function compares the latencies for qsort()
+int compareLatency(const void *a, const void *b) {
+    uint32_t first = *(const uint32_t *)a;
+    uint32_t second = *(const uint32_t *)b;
+    return first < second ? -1 : first > second;
+}
+
+// Function returns the latency which the given part of the requests didn't exceed (nearest rank)
+uint32_t percentile(const uint32_t *sorted, size_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)ceil(fraction * count);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Function merges the results of the clients and writes the JSON report
+void writeReport(FILE *output, const BenchConfig *config, ClientResult *results, double elapsed, double server_cpu,
+                 const ServerMemory *memory) {
+    uint64_t requests = 0, errors = 0, bytes = 0;
+    size_t latency_count = 0;
+    for (int i = 0; i < config->clients; i++) {
+        requests += results[i].requests;
+        errors += results[i].errors;
+        bytes += results[i].bytes;
+        latency_count += results[i].latency_count;
+    }
+    uint32_t *latencies = malloc((latency_count > 0 ? latency_count : 1) * sizeof(uint32_t));
+    size_t position = 0;
+    for (int i = 0; latencies != NULL && i < config->clients; i++) {
+        memcpy(latencies + position, results[i].latencies, results[i].latency_count * sizeof(uint32_t));
+        position += results[i].latency_count;
+    }
+    if (latencies == NULL) {
+        latency_count = 0;
+    }
+    qsort(latencies, latency_count, sizeof(uint32_t), compareLatency);
+
+    fprintf(output, "{\n");
+    fprintf(output, "  \"server\": \"%s\",\n", config->external_server ? "external" : config->server_path);
+    fprintf(output, "  \"server_args\": \"%s\",\n", config->server_args);
+    fprintf(output, "  \"clients\": %d,\n", config->clients);
+    fprintf(output, "  \"depth\": %d,\n", config->depth);
+    fprintf(output, "  \"files\": %d,\n", config->file_count);
+    fprintf(output, "  \"sizes\": \"%s\",\n", config->size_spec);
+    fprintf(output, "  \"update_ratio\": %.3f,\n", config->update_ratio);
+    fprintf(output, "  \"latency_ms\": %.1f,\n", config->latency_ms);
+    fprintf(output, "  \"idle_connections\": %d,\n", config->idle_connections);
+    fprintf(output, "  \"duration_s\": %.3f,\n", elapsed);
+    fprintf(output, "  \"requests\": %" PRIu64 ",\n", requests);
+    fprintf(output, "  \"errors\": %" PRIu64 ",\n", errors);
+    fprintf(output, "  \"bytes\": %" PRIu64 ",\n", bytes);
+    fprintf(output, "  \"throughput_mb_s\": %.1f,\n", elapsed > 0 ? bytes / elapsed / 1e6 : 0.0);
+    fprintf(output, "  \"requests_per_s\": %.1f,\n", elapsed > 0 ? requests / elapsed : 0.0);
+    fprintf(output, "  \"latency_us\": {\"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u},\n",
+            percentile(latencies, latency_count, 0.5), percentile(latencies, latency_count, 0.99),
+            percentile(latencies, latency_count, 0.999), latency_count > 0 ? latencies[latency_count - 1] : 0);
+    // Memory of the connections is the growth of the resident memory divided by the connections which caused it
+    if (memory->start >= 0 && memory->idle >= 0 && memory->peak >= 0) {
+        fprintf(output, "  \"server_rss_kb\": {\"start\": %ld, \"idle\": %ld, \"peak\": %ld},\n",
+                memory->start, memory->idle, memory->peak);
+        if (config->idle_connections > 0) {
+            fprintf(output, "  \"rss_per_idle_connection_bytes\": %.0f,\n",
+                    (memory->idle - memory->start) * 1024.0 / config->idle_connections);
+        } else {
+            fprintf(output, "  \"rss_per_idle_connection_bytes\": null,\n");
+        }
+        fprintf(output, "  \"rss_per_active_connection_bytes\": %.0f,\n",
+                (memory->peak - memory->idle) * 1024.0 / config->clients);
+    } else {
+        fprintf(output, "  \"server_rss_kb\": null,\n");
+        fprintf(output, "  \"rss_per_idle_connection_bytes\": null,\n");
+        fprintf(output, "  \"rss_per_active_connection_bytes\": null,\n");
+    }
+    if (server_cpu >= 0) {
+        fprintf(output, "  \"server_cpu_s\": %.3f,\n", server_cpu);
+        fprintf(output, "  \"server_cpu_s_per_gb\": %.3f\n", bytes > 0 ? server_cpu / (bytes / 1e9) : 0.0);
+    } else {
+        fprintf(output, "  \"server_cpu_s\": null,\n");
+        fprintf(output, "  \"server_cpu_s_per_gb\": null\n");
+    }
+    fprintf(output, "}\n");
+    free(latencies);
+}
+
+// Main function
+int main(int argc, char *argv[]) {
+    BenchConfig config = {
+        .server_path = DEFAULT_SERVER,
+        .server_args = "",
+        .data_dir = DEFAULT_DATA_DIR,
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .clients = 4,
+        .depth = 1,
+        .file_count = 100,
+        .size_spec = "fixed:1M",
+        .duration = 5,
+    };
+    int option;
+
+    // Reading command line options
+    while ((option = getopt(argc, argv, "c:q:f:z:u:t:n:s:a:d:p:x:o:l:i:h")) != -1) {
+        switch (option) {
+            case 'c': config.clients = atoi(optarg); break;
+            case 'q': config.depth = atoi(optarg); break;
+            case 'f': config.file_count = atoi(optarg); break;
+            case 'z': config.size_spec = optarg; break;
+            case 'u': config.update_ratio = atof(optarg); break;
+            case 't': config.duration = atof(optarg); break;
+            case 'n': config.requests = atol(optarg); break;
+            case 's': config.server_path = optarg; break;
+            case 'a': config.server_args = optarg; break;
+            case 'd': config.data_dir = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'x': config.host = optarg; config.external_server = 1; break;
+            case 'o': config.output = optarg; break;
+            case 'l': config.latency_ms = atof(optarg); break;
+            case 'i': config.idle_connections = atoi(optarg); break;
+            default: printUsage(argv[0]); return 1;
+        }
+    }
+    if (config.clients <= 0 || config.depth <= 0 || config.depth > MAX_DEPTH || config.file_count <= 0 ||
+        config.update_ratio < 0 || config.update_ratio > 1 || config.duration <= 0 || config.requests < 0 || config.latency_ms < 0 ||
+        config.idle_connections < 0 ||
+        parseSizeSpec(&config) == -1) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Creating the test files, the external server has to serve the same files from its directory
+    uint64_t *file_sizes = malloc(config.file_count * sizeof(uint64_t));
+    if (file_sizes == NULL || createTestFiles(&config, file_sizes) == -1) {
+        return 1;
+    }
+
+    raiseFileLimit();
+    pid_t server_pid = -1;
+    if (!config.external_server) {
+        server_pid = startServer(config.server_path, config.data_dir, config.port, config.server_args);
+        if (server_pid == -1) {
+            return 1;
+        }
+    }
+    if (waitForServer(config.host, config.port, server_pid) == -1) {
+        if (server_pid > 0) {
+            kill(server_pid, SIGTERM);
+            waitpid(server_pid, NULL, 0);
+        }
+        return 1;
+    }
+    if (config.latency_ms > 0 && startRelay(&config) == -1) {
+        if (server_pid > 0) {
+            kill(server_pid, SIGTERM);
+            waitpid(server_pid, NULL, 0);
+        }
+        return 1;
+    }
+
+    ClientResult *results = calloc(config.clients, sizeof(ClientResult));
+    pthread_t *threads = malloc(config.clients * sizeof(pthread_t));
+    if (results == NULL || threads == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    // Idle connections are opened first, the growth of the server memory is their cost
+    ServerMemory memory;
+    memory.start = server_pid > 0 ? serverResidentKb(server_pid) : -1;
+    int *idle_sockets = openIdleConnections(&config);
+    if (idle_sockets == NULL) {
+        if (server_pid > 0) {
+            kill(server_pid, SIGTERM);
+            waitpid(server_pid, NULL, 0);
+        }
+        return 1;
+    }
+    if (config.idle_connections > 0) {
+        usleep(IDLE_SETTLE_US);
+    }
+    memory.idle = server_pid > 0 ? serverResidentKb(server_pid) : -1;
+    memory.peak = memory.idle;
+
+    double cpu_start = server_pid > 0 ? serverCpuSeconds(server_pid) : -1;
+    uint64_t start = nowMicroseconds();
+    int started = 0;
+    atomic_store(&clients_running, config.clients);
+    for (int i = 0; i < config.clients; i++) {
+        results[i].config = &config;
+        results[i].file_sizes = file_sizes;
+        results[i].index = i;
+        if (pthread_create(&threads[i], NULL, clientThread, &results[i]) != 0) {
+            fprintf(stderr, "Error creating client thread\n");
+            atomic_fetch_sub(&clients_running, config.clients - i);
+            break;
+        }
+        started++;
+    }
+
+    // Waiting for the clients or the end of the duration, the memory of the server is sampled meanwhile
+    uint64_t end = start + (uint64_t)(config.duration * 1e6);
+    while (atomic_load(&clients_running) > 0 && (config.requests > 0 || nowMicroseconds() < end)) {
+        long resident = server_pid > 0 ? serverResidentKb(server_pid) : -1;
+        memory.peak = resident > memory.peak ? resident : memory.peak;
+        usleep(MEMORY_SAMPLE_US);
+    }
+    // Stopping the clients after the duration, they finish the requests in flight
+    atomic_store(&stop_clients, 1);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (nowMicroseconds() - start) / 1e6;
+    double cpu_end = server_pid > 0 ? serverCpuSeconds(server_pid) : -1;
+    for (int i = 0; i < config.idle_connections; i++) {
+        close(idle_sockets[i]);
+    }
+    free(idle_sockets);
+    double server_cpu = cpu_start >= 0 && cpu_end >= 0 ? cpu_end - cpu_start : -1;
+
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+    }
+
+    FILE *output = stdout;
+    if (config.output != NULL && (output = fopen(config.output, "w")) == NULL) {
+        perror(config.output);
+        output = stdout;
+    }
+    writeReport(output, &config, results, elapsed, server_cpu, &memory);
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    uint64_t errors = 0;
+    for (int i = 0; i < config.clients; i++) {
+        errors += results[i].errors;
+        free(results[i].latencies);
+    }
+    free(results);
+    free(threads);
+    free(file_sizes);
+    return errors > 0 ? 2 : 0;
+}
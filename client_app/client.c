@@ -1,35 +1,227 @@
 // Client application. It requests file from the server or update for the file on the client side
+// With -d option the update is done with the delta: client sends the signature of its copy
+// and the server sends only the data the client doesn't have (common/delta.h)
+// With -j option the new file is downloaded in ranges over several connections at once
+// With -b option the client takes the list of files and fetches all of them over one connection
+// With -s option the client prints the metrics of the server
+// With -L option the client changes the rate limits of the server (only from the server host)
+// With -z option the server may send the file compressed, the chunks are decompressed by a separate thread
+// The received data is written to the disk by the writer thread, so a slow disk doesn't stall the socket,
+// and a new file gets its name only when it is complete
+// Every response carries the checksum of the data (common/checksum.h), the client checks it while receiving and
+// sends the checksum of its copy with the update request, so a damaged or changed copy is not extended
+// With -f option the client follows the file: it subscribes to it and the server pushes every append as it happens,
+// so the local copy grows within milliseconds of the server copy without polling
+// Large downloads raise the receive buffer of the socket when the bandwidth-delay product of the path needs it
+// With -r option the client mirrors the directory: it gets the manifest of the server tree (common/manifest.h),
+// compares it with the local tree and fetches only the new and changed files over -j pipelined connections
+// An interrupted download is resumed: name.part keeps the received data and name.part.journal the ranges of it
+// which were written and checked, the next run verifies them and requests only the missing ranges
+// An interrupted update keeps the appended data it received, the next update request starts after it
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <limits.h>
+
+#include "../common/protocol.h"
+#include "../common/delta.h"
+#include "../common/compress.h"
+#include "../common/checksum.h"
+#include "../common/manifest.h"
+#include "../common/transfer.h"
 
 #define DEFAULT_SERVER_IP "127.0.0.1"
 #define PORT 12345
 #define BUFFER_SIZE 1024
 #define UPDATE_REQUEST_SIZE 1024
+#define DIVERGED_RESULT 5       // updateFile() result when the client copy can't be updated by appending
+#define COPY_BUFFER_SIZE (64 * 1024)            // Data skipped or copied through the stack buffer at once
+#define RANGE_BUFFER_SIZE (256 * 1024)          // Receive buffer of one stream of the parallel download
+#define MIN_CHUNK_SIZE (256 * 1024)             // Smallest range requested by one request
+#define MAX_CHUNK_SIZE (64 * 1024 * 1024)       // Biggest range requested by one request
+#define TARGET_CHUNK_TIME_MS 250                // Chunk size is adapted so one range takes about this time
+#define STREAM_CHECK_INTERVAL_MS 300            // How often the number of streams is reconsidered
+#define RANGES_IN_FLIGHT 2                      // Requests sent by one stream before the response to the first comes
+#define BATCH_WINDOW 64                         // Batch requests sent before the response to the first comes
+#define BATCH_BUFFER_SIZE (64 * 1024)           // Receive buffer of the batch mode
+#define DECOMPRESS_QUEUE_SIZE 16                // Compressed chunks received and waiting for the decompression
+#define WRITER_BUFFER_SIZE (1024 * 1024)        // Received data handed to the writer thread at once
+#define WRITER_BUFFER_COUNT 4                   // Buffers of the writer: one being received while the others are written
+#define WRITER_ALIGNMENT 4096                   // Writer buffers start at the page boundary
+#define JOURNAL_LINE_SIZE 64                    // Longest line of the download journal
 
 // Declaration of a strcucture to receive arguments for the thread function clientRequest
 typedef struct {
-    int request;                // type of request, 1 - file request, 2 - update request
+    int request;                // type of request, OP_DOWNLOAD - file request, OP_UPDATE - update request, OP_DELTA - delta update,
+                                // OP_SUBSCRIBE - following the file
     const char* file_name;      // file name to request
     size_t file_size;           // size of file to send to server if we request the update
     const char* server_ip;      // server IP to request file from
     int server_port;            // port number to connect with the server
+    uint8_t flags;              // FLAG_LZ4 or FLAG_DEFLATE if the file may come compressed
 } ThreadArgs;
 
+// Range of the partial file with the checksum of its data, one line of the download journal
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t checksum;
+} JournalRange;
+
+// State of the parallel download shared by all streams
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t finished;    // Signaled by the last stream when it ends
+    const char *file_name;      // file name to request
+    const char *server_ip;      // server IP to request file from
+    int server_port;            // port number to connect with the server
+    int file_fd;                // local file, every stream writes its ranges with pwrite()
+    int journal_fd;             // journal of the partial file, every checked range is added to it
+    uint64_t file_size;         // size of the file on the server
+    uint64_t mtime_ns;          // modification time of the file on the server, every range must come from the same file
+    JournalRange *missing;      // ranges of the file which are not in the partial file, in the order of the offsets
+    size_t missing_count;
+    size_t next_missing;        // missing range the next range is taken from
+    JournalRange *ranges;       // ranges of the file which are done: kept from the journal and received
+    size_t range_count;
+    size_t range_capacity;
+    uint64_t chunk_size;        // size of the next range, adapted to the measured speed
+    uint64_t bytes_received;    // file data received by all streams
+    int active_streams;         // streams which are still running
+    int failed;                 // flag that one of the streams failed
+    int restart;                // flag that the partial file is useless (the server file changed), the next run starts again
+} ParallelDownload;
+
+// File of the batch which request is sent and response is not received yet
+typedef struct {
+    char file_name[BUFFER_SIZE];
+    int opcode;                 // OP_DOWNLOAD - file doesn't exist, OP_UPDATE - file exists
+    uint64_t local_size;        // size of the local copy, the update is written after it
+    int mirror;                 // file of the directory sync: a diverged copy is downloaded again and gets the server time
+    uint64_t mtime_ns;          // modification time of the server file from the manifest
+} BatchEntry;
+
+// Files of the batch: the lines of the manifest file or the files of the directory sync which have to be fetched
+// Streams of the directory sync take the files from the same list, so a stream with big files doesn't hold the rest
+typedef struct {
+    pthread_mutex_t mutex;
+    FILE *manifest;             // list of file names, NULL for the directory sync
+    BatchEntry *entries;        // files of the directory sync
+    size_t count;
+    size_t next;                // first file nobody took yet
+} BatchSource;
+
+// One connection of the directory sync
+typedef struct {
+    BatchSource *source;
+    const char *server_ip;
+    int server_port;
+    int counts[4];              // received, up to date, server errors, local errors
+    int broken;                 // connection failed before all files were fetched
+    int started;                // thread of the stream was created and has to be joined, set by the main thread only
+    pthread_t thread;
+} SyncStream;
+
+// Buffers of the received data passed from the receiving thread to the writer thread
+// A slow disk stalls the network only when all buffers wait for the writer
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;     // Signaled when a buffer is filled or written and when the stream ends
+    unsigned char *buffers[WRITER_BUFFER_COUNT];
+    size_t lengths[WRITER_BUFFER_COUNT];    // Bytes of data in the filled buffers
+    int head;                   // Oldest filled buffer, being written
+    int count;                  // Filled buffers not written yet
+    int finished;               // Receiving thread will not fill more buffers
+    int failed;                 // Write failed, the rest of the buffers is dropped
+    int error;                  // errno of the failed write
+    int fd;                     // File the data is written to
+    int journal_fd;             // Journal of the partial file, every written buffer is added to it, -1 - no journal
+    uint64_t offset;            // Position in the file of the next buffer
+    uint32_t checksum;          // Checksum of the written data, computed by the writer thread
+    pthread_t thread;
+} FileWriter;
+
+// Chunks of the compressed body passed from the receiving thread to the decompressing thread
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;     // Signaled when a chunk is added or taken and when the stream ends
+    unsigned char *chunks[DECOMPRESS_QUEUE_SIZE];   // Chunk header and the stored data, owned by the queue
+    int head;                   // Oldest chunk in the queue
+    int count;                  // Chunks in the queue
+    int finished;               // Receiving thread will not add more chunks
+    int failed;                 // Chunk was damaged or the file can't be written, the rest is dropped
+    int method;                 // COMPRESS_LZ4 or COMPRESS_DEFLATE
+    FileWriter *writer;         // Writer of the decompressed data
+} DecompressPipeline;
+
 // Function prototypes
 void getUserInput(int argc, char *argv[], char *file_name, char *server_ip);
 void* client_request(void* arg);
+int connectToServer(const char *server_ip, int server_port);
+size_t encodeRequest(unsigned char *buffer, int opcode, uint32_t request_id, const char *file_name, uint64_t offset, uint64_t length,
+                     uint8_t flags, uint32_t checksum);
+int sendAll(int client_fd, const void *buffer, size_t size);
+int sendRequest(int client_fd, int opcode, uint32_t request_id, const char *file_name, uint64_t offset, uint64_t length,
+                uint8_t flags, uint32_t checksum);
+int receiveAll(int client_fd, void *buffer, size_t size);
+int skipBytes(int client_fd, size_t size);
+int writerStart(FileWriter *writer, int file_fd, int journal_fd, uint64_t offset);
+unsigned char *writerBuffer(FileWriter *writer);
+int writerSubmit(FileWriter *writer, size_t length);
+int writerFinish(FileWriter *writer, uint32_t *checksum);
+void *writerStage(void *arg);
+int receiveBody(int client_fd, FileWriter *writer, uint64_t size);
+void *decompressStage(void *arg);
+int receiveCompressedBody(int client_fd, FileWriter *writer, uint8_t flags, uint64_t size);
+int receiveResponse(int client_fd, FrameHeader *header, FileInfo *info);
+int rangeChecksum(int fd, uint64_t offset, uint64_t length, uint32_t *checksum);
+int fileChecksum(const char *file_name, uint64_t size, uint32_t *checksum);
+int verifyChecksum(const FrameHeader *header, uint32_t checksum, const char *file_name);
+int receiveFileData(int client_fd, int file_fd, int journal_fd, uint64_t offset, const FrameHeader *header, uint32_t *checksum);
+int journalCreate(const char *file_name, const FileInfo *info);
+int journalOpen(const char *file_name);
+void journalAdd(int journal_fd, uint64_t offset, uint64_t length, uint32_t checksum);
+int journalCompare(const void *a, const void *b);
+int journalLoad(const char *file_name, int file_fd, const FileInfo *info, JournalRange **ranges, size_t *count);
+void journalRemove(const char *file_name);
+int journalExists(const char *file_name);
 int downloadFile(int client_fd, const char *file_name);
 int updateFile(int client_fd, const char *file_name);
+int sendDeltaRequest(int client_fd, uint32_t request_id, const char *file_name);
+int deltaUpdateFile(int client_fd, const char *file_name);
+int followFile(int client_fd, const char *file_name);
+uint64_t elapsedMs(const struct timespec *start);
+int takeRange(ParallelDownload *download, uint64_t *offset, uint64_t *length);
+void addRange(ParallelDownload *download, uint64_t offset, uint64_t length, uint32_t checksum);
+void* downloadStream(void* arg);
+int parallelDownload(const char *file_name, const char *server_ip, int server_port, int max_streams);
+int readManifestLine(FILE *manifest, char *file_name);
+int receiveBatchResponse(int client_fd, const BatchEntry *entry, uint32_t request_id, char *buffer, int *result);
+int nextBatchEntry(BatchSource *source, BatchEntry *entry, uint32_t *checksum);
+int batchFetch(int client_fd, BatchSource *source, int counts[4]);
+int batchRequest(const char *manifest_name, const char *server_ip, int server_port);
+int makeParents(const char *path);
+int receiveManifest(int client_fd, const char *directory, unsigned char **manifest, uint64_t *size);
+int planSync(const char *directory, const unsigned char *manifest, uint64_t size, BatchSource *source, int *up_to_date,
+             int *rejected);
+void *syncStream(void *arg);
+int syncDirectory(const char *directory, const char *server_ip, int server_port, int max_streams);
+int printServerStats(const char *server_ip, int server_port);
+int parseRate(const char *text, uint64_t *rate);
+int setServerLimits(const char *limits, const char *server_ip, int server_port);
 
 // Function to process user inputs when starting the client application
 void getUserInput(int argc, char *argv[], char *file_name, char *server_ip) {
@@ -69,40 +261,53 @@ void getUserInput(int argc, char *argv[], char *file_name, char *server_ip) {
     }
 }
 
-// thread function to send client request to the server
-void* client_request(void* arg) {
-    ThreadArgs* args = (ThreadArgs*)arg;
-
+// Function creates the socket and connects it to the server, returns -1 on error
+int connectToServer(const char *server_ip, int server_port) {
     // Creating socket
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if(sockfd == -1) {
         perror("socket");
-        return NULL;
+        return -1;
     }
 
     // Configuring socket parameters
     struct sockaddr_in server_address;
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(args->server_port);
-    inet_pton(AF_INET, args->server_ip, &server_address.sin_addr); // Converting IPv4 format into network format
+    server_address.sin_port = htons(server_port);
+    inet_pton(AF_INET, server_ip, &server_address.sin_addr); // Converting IPv4 format into network format
 
     // Connecting to server
     if(connect(sockfd, (struct sockaddr*)&server_address, sizeof(server_address)) == -1) {
         perror("connect");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// thread function to send client request to the server
+void* client_request(void* arg) {
+    ThreadArgs* args = (ThreadArgs*)arg;
+
+    int sockfd = connectToServer(args->server_ip, args->server_port);
+    if (sockfd == -1) {
         return NULL;
     }
 
-     // Constructing the request string
-     // request - type of request 1 - file request, 2 - update request
-     // file_name - file name to request
-     // file_size - 0 if file doesn't exists, file size if requesting update
-    char request_str[1024];
-    snprintf(request_str, sizeof(request_str), "%d|%s|%zu", args->request, args->file_name, args->file_size);
-    // printf("Debug: client request string: %s\n",request_str);
+    // Checksum of the local copy, the server appends the data only if the copy is the beginning of its file
+    uint32_t checksum = 0;
+    if ((args->request == OP_UPDATE || (args->request == OP_SUBSCRIBE && args->file_size > 0)) &&
+        fileChecksum(args->file_name, args->file_size, &checksum) == -1) {
+        perror("Error reading the local copy");
+        close(sockfd);
+        return NULL;
+    }
 
-    // Sending request to the server
-    ssize_t bytes_sent = send(sockfd, request_str, strlen(request_str), 0);
-    if(bytes_sent == -1) {
+    // Sending request to the server, delta request with the signature is sent below
+    // request - type of request OP_DOWNLOAD - file request, OP_UPDATE - update request
+    // file_size - 0 if file doesn't exists, file size if requesting update
+    if (args->request != OP_DELTA &&
+        sendRequest(sockfd, args->request, 1, args->file_name, args->file_size, 0, args->flags | FLAG_CHECKSUM, checksum) == -1) {
         perror("send");
         return NULL;
     }
@@ -110,10 +315,26 @@ void* client_request(void* arg) {
     // Managing server responses
     // If we requested the file, we call function downloadFile
     // If we requested update for the file, we call function updateFile
-    if (args->request == 1) {
+    // If we requested delta for the file, we call function deltaUpdateFile
+    int result = 0;
+    if (args->request == OP_DOWNLOAD) {
         downloadFile(sockfd, args->file_name);
-    } else {
-        updateFile(sockfd, args->file_name);
+    } else if (args->request == OP_UPDATE) {
+        result = updateFile(sockfd, args->file_name);
+    } else if (args->request == OP_SUBSCRIBE) {
+        followFile(sockfd, args->file_name);
+    }
+
+    // Client copy was changed not only by appending, requesting the delta on the same connection
+    if (result == DIVERGED_RESULT) {
+        printf("Local copy differs from the server copy, requesting the delta\n");
+    }
+    if (args->request == OP_DELTA || result == DIVERGED_RESULT) {
+        if (sendDeltaRequest(sockfd, 2, args->file_name) == -1) {
+            perror("send");
+        } else {
+            deltaUpdateFile(sockfd, args->file_name);
+        }
     }
 
     // Closing the socket
@@ -124,155 +345,1993 @@ void* client_request(void* arg) {
     return NULL;
 }
 
+// Function writes the request frame into the buffer of FRAME_CHECKSUM_HEADER_SIZE + BUFFER_SIZE bytes: header and the file name as the payload
+// The update and subscribe requests with FLAG_CHECKSUM carry the checksum of the local copy in the header
+// Returns the size of the frame, 0 if the file name is too long
+size_t encodeRequest(unsigned char *buffer, int opcode, uint32_t request_id, const char *file_name, uint64_t offset, uint64_t length,
+                     uint8_t flags, uint32_t checksum) {
+    size_t name_length = strlen(file_name);
+    if (name_length >= BUFFER_SIZE) {
+        return 0;
+    }
+
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.opcode = opcode;
+    header.flags = flags;
+    header.request_id = request_id;
+    header.payload_size = name_length;
+    header.offset = offset;
+    header.length = length;
+    if ((opcode == OP_UPDATE || opcode == OP_SUBSCRIBE) && (flags & FLAG_CHECKSUM)) {
+        header.header_size = FRAME_CHECKSUM_HEADER_SIZE;
+        header.checksum = checksum;
+    }
+    size_t header_size = encodeFrameHeader(&header, buffer);
+    memcpy(buffer + header_size, file_name, name_length);
+    return header_size + name_length;
+}
+
+// Function sends exactly size bytes, returns -1 on error
+int sendAll(int client_fd, const void *buffer, size_t size) {
+    size_t total_sent = 0;
+    while (total_sent < size) {
+        ssize_t bytes_sent = send(client_fd, (const char *)buffer + total_sent, size - total_sent, 0);
+        if (bytes_sent == -1) {
+            return -1;
+        }
+        total_sent += bytes_sent;
+    }
+    return 0;
+}
+
+// Function sends the request frame: header and the file name as the payload
+int sendRequest(int client_fd, int opcode, uint32_t request_id, const char *file_name, uint64_t offset, uint64_t length,
+                uint8_t flags, uint32_t checksum) {
+    unsigned char request[FRAME_CHECKSUM_HEADER_SIZE + BUFFER_SIZE];
+    size_t request_size = encodeRequest(request, opcode, request_id, file_name, offset, length, flags, checksum);
+    if (request_size == 0) {
+        return -1;
+    }
+    return sendAll(client_fd, request, request_size);
+}
+
+// Function receives exactly size bytes, returns -1 if the connection is closed or on error
+int receiveAll(int client_fd, void *buffer, size_t size) {
+    size_t total_received = 0;
+    while (total_received < size) {
+        ssize_t received_bytes = recv(client_fd, (char *)buffer + total_received, size - total_received, 0);
+        if (received_bytes <= 0) {
+            return -1;
+        }
+        total_received += received_bytes;
+    }
+    return 0;
+}
+
+// Function reads and drops size bytes from the socket, returns -1 if the connection is closed or on error
+int skipBytes(int client_fd, size_t size) {
+    char buffer[COPY_BUFFER_SIZE];
+    while (size > 0) {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (receiveAll(client_fd, buffer, chunk) == -1) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Function prepares the writer pipeline: allocates the buffers and starts the writer thread
+// Data given to the writer is written to the file from offset on, returns -1 on error
+int writerStart(FileWriter *writer, int file_fd, int journal_fd, uint64_t offset) {
+    memset(writer, 0, sizeof(*writer));
+    for (int i = 0; i < WRITER_BUFFER_COUNT; i++) {
+        void *buffer;
+        if (posix_memalign(&buffer, WRITER_ALIGNMENT, WRITER_BUFFER_SIZE) != 0) {
+            while (i-- > 0) {
+                free(writer->buffers[i]);
+            }
+            fprintf(stderr, "Error allocating the receive buffers\n");
+            return -1;
+        }
+        writer->buffers[i] = buffer;
+    }
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    writer->fd = file_fd;
+    writer->journal_fd = journal_fd;
+    writer->offset = offset;
+    if (pthread_create(&writer->thread, NULL, writerStage, writer) != 0) {
+        fprintf(stderr, "Error creating writer thread\n");
+        pthread_mutex_destroy(&writer->mutex);
+        pthread_cond_destroy(&writer->changed);
+        for (int i = 0; i < WRITER_BUFFER_COUNT; i++) {
+            free(writer->buffers[i]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Function returns the free buffer of WRITER_BUFFER_SIZE bytes to fill, waits while all buffers are being written
+// The buffer belongs to the caller until writerSubmit()
+unsigned char *writerBuffer(FileWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->count == WRITER_BUFFER_COUNT) {
+        pthread_cond_wait(&writer->changed, &writer->mutex);
+    }
+    unsigned char *buffer = writer->buffers[(writer->head + writer->count) % WRITER_BUFFER_COUNT];
+    pthread_mutex_unlock(&writer->mutex);
+    return buffer;
+}
+
+// Function gives the buffer from writerBuffer() with length bytes of data to the writer thread
+// Returns -1 if the writer failed, the rest of the transfer is useless then
+int writerSubmit(FileWriter *writer, size_t length) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->lengths[(writer->head + writer->count) % WRITER_BUFFER_COUNT] = length;
+    writer->count++;
+    int failed = writer->failed;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->mutex);
+    return failed ? -1 : 0;
+}
+
+// Function waits until all submitted data is written and stops the writer thread
+// checksum is set to the checksum of the written data, returns -1 if any write failed
+int writerFinish(FileWriter *writer, uint32_t *checksum) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->finished = 1;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->thread, NULL);
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->changed);
+    for (int i = 0; i < WRITER_BUFFER_COUNT; i++) {
+        free(writer->buffers[i]);
+    }
+    *checksum = writer->checksum;
+    if (writer->failed) {
+        fprintf(stderr, "Error writing the file: %s\n", strerror(writer->error));
+        return -1;
+    }
+    return 0;
+}
+
+// Thread function which writes the filled buffers to the file in order
+// The buffer stays in the queue while it is written, so the receiving thread can't fill it again meanwhile
+void *writerStage(void *arg) {
+    FileWriter *writer = arg;
+
+    while (1) {
+        pthread_mutex_lock(&writer->mutex);
+        while (writer->count == 0 && !writer->finished) {
+            pthread_cond_wait(&writer->changed, &writer->mutex);
+        }
+        if (writer->count == 0) {
+            pthread_mutex_unlock(&writer->mutex);
+            break;
+        }
+        unsigned char *buffer = writer->buffers[writer->head];
+        size_t length = writer->lengths[writer->head];
+        int failed = writer->failed;
+        pthread_mutex_unlock(&writer->mutex);
+
+        // After the failure the buffers are only given back, so the receiving thread never waits for them
+        if (!failed) {
+            size_t written = 0;
+            while (written < length) {
+                ssize_t result = pwrite(writer->fd, buffer + written, length - written, writer->offset + written);
+                if (result <= 0) {
+                    writer->error = result == 0 ? EIO : errno;
+                    failed = 1;
+                    break;
+                }
+                written += result;
+            }
+            // Buffer has its own checksum for the journal, the checksum of the whole data is joined from them
+            uint32_t checksum = crc32c(0, buffer, length);
+            if (!failed) {
+                journalAdd(writer->journal_fd, writer->offset, length, checksum);
+            }
+            writer->checksum = crc32cCombine(writer->checksum, checksum, length);
+            writer->offset += length;
+        }
+
+        pthread_mutex_lock(&writer->mutex);
+        writer->failed = failed;
+        writer->head = (writer->head + 1) % WRITER_BUFFER_COUNT;
+        writer->count--;
+        pthread_cond_broadcast(&writer->changed);
+        pthread_mutex_unlock(&writer->mutex);
+    }
+    return NULL;
+}
+
+// Function receives size bytes of the body into the writer buffers, every full buffer goes to the writer thread
+// The socket is read with big recv() calls and never waits for the disk while a free buffer is left
+// The receive buffer of the socket is tuned to the path while the body comes (common/transfer.h)
+int receiveBody(int client_fd, FileWriter *writer, uint64_t size) {
+    TransferTuner tuner;
+    transferTunerInit(&tuner, client_fd, SO_RCVBUF);
+    while (size > 0) {
+        unsigned char *buffer = writerBuffer(writer);
+        size_t length = size < WRITER_BUFFER_SIZE ? size : WRITER_BUFFER_SIZE;
+        size_t filled = 0;
+        while (filled < length) {
+            ssize_t received_bytes = recv(client_fd, buffer + filled, length - filled, 0);
+            if (received_bytes <= 0) {
+                perror("Error receiving file data or connection closed");
+                writerSubmit(writer, filled);
+                return -1;
+            }
+            filled += received_bytes;
+            transferTune(&tuner, client_fd, SO_RCVBUF, received_bytes);
+        }
+        if (writerSubmit(writer, filled) == -1) {
+            return -1;
+        }
+        size -= filled;
+    }
+    return 0;
+}
+
+// Thread function which decompresses the chunks from the queue straight into the writer buffers
+// It runs beside the receiving loop, so the socket is read while the previous chunks are decompressed and written
+void *decompressStage(void *arg) {
+    DecompressPipeline *pipeline = arg;
+    unsigned char *output = NULL;       // Writer buffer being filled
+    size_t filled = 0;
+
+    while (1) {
+        pthread_mutex_lock(&pipeline->mutex);
+        while (pipeline->count == 0 && !pipeline->finished) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+        }
+        if (pipeline->count == 0) {
+            pthread_mutex_unlock(&pipeline->mutex);
+            break;
+        }
+        unsigned char *chunk = pipeline->chunks[pipeline->head];
+        pipeline->head = (pipeline->head + 1) % DECOMPRESS_QUEUE_SIZE;
+        pipeline->count--;
+        int failed = pipeline->failed;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        // After the failure the chunks are only dropped, so the receiving thread never waits for the space
+        if (!failed) {
+            uint32_t raw_size, stored_size;
+            decodeChunkHeader(chunk, &raw_size, &stored_size);
+            if (output == NULL) {
+                output = writerBuffer(pipeline->writer);
+                filled = 0;
+            }
+            const unsigned char *data = chunk + COMPRESS_CHUNK_HEADER_SIZE;
+            if (stored_size == raw_size) {
+                memcpy(output + filled, data, raw_size);
+            } else if (decompressChunk(pipeline->method, data, stored_size, output + filled, raw_size) == -1) {
+                failed = 1;
+            }
+            filled += raw_size;
+            // Buffer goes to the writer when the next chunk may not fit into it
+            if (!failed && filled + COMPRESS_CHUNK_SIZE > WRITER_BUFFER_SIZE) {
+                failed = writerSubmit(pipeline->writer, filled) == -1;
+                output = NULL;
+            }
+            if (failed) {
+                pthread_mutex_lock(&pipeline->mutex);
+                pipeline->failed = 1;
+                pthread_mutex_unlock(&pipeline->mutex);
+            }
+        }
+        free(chunk);
+    }
+    pthread_mutex_lock(&pipeline->mutex);
+    if (output != NULL && !pipeline->failed && writerSubmit(pipeline->writer, filled) == -1) {
+        pipeline->failed = 1;
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return NULL;
+}
+
+// Function receives the compressed body of size file bytes and gives the decompressed data to the writer
+// Receiving, decompressing and writing are three threads connected by queues, returns -1 on error
+int receiveCompressedBody(int client_fd, FileWriter *writer, uint8_t flags, uint64_t size) {
+    DecompressPipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pthread_mutex_init(&pipeline.mutex, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    pipeline.method = flags & FLAG_LZ4 ? COMPRESS_LZ4 : COMPRESS_DEFLATE;
+    pipeline.writer = writer;
+
+    pthread_t decompressor;
+    if (pthread_create(&decompressor, NULL, decompressStage, &pipeline) != 0) {
+        fprintf(stderr, "Error creating decompression thread\n");
+        return -1;
+    }
+
+    uint64_t received = 0;          // File bytes in the received chunks
+    uint64_t wire_bytes = 0;        // Bytes of the chunks as they came from the server
+    int result = 0;
+    while (received < size) {
+        unsigned char header[COMPRESS_CHUNK_HEADER_SIZE];
+        uint32_t raw_size, stored_size;
+        if (receiveAll(client_fd, header, sizeof(header)) == -1) {
+            fprintf(stderr, "Error receiving file data or connection closed\n");
+            result = -1;
+            break;
+        }
+        decodeChunkHeader(header, &raw_size, &stored_size);
+        // Compressed chunk is always smaller than the raw one, anything else is not our stream
+        if (raw_size == 0 || raw_size > COMPRESS_CHUNK_SIZE || raw_size > size - received || stored_size > raw_size) {
+            fprintf(stderr, "Invalid compressed data from the server\n");
+            result = -1;
+            break;
+        }
+        unsigned char *chunk = malloc(COMPRESS_CHUNK_HEADER_SIZE + stored_size);
+        if (chunk == NULL) {
+            perror("malloc");
+            result = -1;
+            break;
+        }
+        memcpy(chunk, header, sizeof(header));
+        if (receiveAll(client_fd, chunk + COMPRESS_CHUNK_HEADER_SIZE, stored_size) == -1) {
+            fprintf(stderr, "Error receiving file data or connection closed\n");
+            free(chunk);
+            result = -1;
+            break;
+        }
+        received += raw_size;
+        wire_bytes += COMPRESS_CHUNK_HEADER_SIZE + stored_size;
+
+        // Waiting only if the decompression is a whole queue behind
+        pthread_mutex_lock(&pipeline.mutex);
+        while (pipeline.count == DECOMPRESS_QUEUE_SIZE) {
+            pthread_cond_wait(&pipeline.changed, &pipeline.mutex);
+        }
+        pipeline.chunks[(pipeline.head + pipeline.count) % DECOMPRESS_QUEUE_SIZE] = chunk;
+        pipeline.count++;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.mutex);
+    }
+
+    pthread_mutex_lock(&pipeline.mutex);
+    pipeline.finished = 1;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.mutex);
+    pthread_join(decompressor, NULL);
+    pthread_mutex_destroy(&pipeline.mutex);
+    pthread_cond_destroy(&pipeline.changed);
+
+    if (pipeline.failed) {
+        fprintf(stderr, "Error decompressing the file data\n");
+        return -1;
+    }
+    if (result == 0) {
+        printf("Compressed transfer: %" PRIu64 " bytes for %" PRIu64 " bytes of data (%s)\n", wire_bytes, size,
+               pipeline.method == COMPRESS_LZ4 ? "lz4" : "deflate");
+    }
+    return result;
+}
+
+// Function receives the response frame header and its payload, the file data (if any) stays in the socket
+// Returns -1 if the connection is closed or the server sent something which is not a response
+int receiveResponse(int client_fd, FrameHeader *header, FileInfo *info) {
+    unsigned char buffer[BUFFER_SIZE];
+
+    if (receiveAll(client_fd, buffer, FRAME_HEADER_SIZE) == -1) {
+        return -1;
+    }
+    if (decodeFrameHeader(buffer, header) == -1) {
+        fprintf(stderr, "Invalid response from the server\n");
+        return -1;
+    }
+
+    // Reading the checksum field if the server sent it, skipping the header fields of the newer protocol versions
+    size_t extension = header->header_size - FRAME_HEADER_SIZE;
+    size_t known = extension < FRAME_CHECKSUM_HEADER_SIZE - FRAME_HEADER_SIZE ? extension : FRAME_CHECKSUM_HEADER_SIZE - FRAME_HEADER_SIZE;
+    if (receiveAll(client_fd, buffer + FRAME_HEADER_SIZE, known) == -1 || skipBytes(client_fd, extension - known) == -1) {
+        return -1;
+    }
+    if (!decodeFrameChecksum(buffer, header)) {
+        header->flags &= ~FLAG_CHECKSUM;
+    }
+
+    // FileInfo is at the start of the payload, skipping the rest of the payload we don't know
+    size_t payload_size = header->payload_size;
+    memset(info, 0, sizeof(*info));
+    if (payload_size >= FILE_INFO_SIZE) {
+        if (receiveAll(client_fd, buffer, FILE_INFO_SIZE) == -1) {
+            return -1;
+        }
+        decodeFileInfo(buffer, info);
+        payload_size -= FILE_INFO_SIZE;
+    }
+    return skipBytes(client_fd, payload_size);
+}
+
+// Function computes the checksum of length bytes of the open file from offset on, returns -1 if they can't be read
+int rangeChecksum(int fd, uint64_t offset, uint64_t length, uint32_t *checksum) {
+    unsigned char *buffer = malloc(RANGE_BUFFER_SIZE);
+    uint32_t crc = 0;
+    int result = buffer == NULL ? -1 : 0;
+    while (result == 0 && length > 0) {
+        size_t chunk = length < RANGE_BUFFER_SIZE ? length : RANGE_BUFFER_SIZE;
+        ssize_t bytes_read = pread(fd, buffer, chunk, offset);
+        if (bytes_read <= 0) {
+            result = -1;
+            break;
+        }
+        crc = crc32c(crc, buffer, bytes_read);
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    free(buffer);
+    *checksum = crc;
+    return result;
+}
+
+// Function computes the checksum of the first size bytes of the local file, returns -1 if the file can't be read
+int fileChecksum(const char *file_name, uint64_t size, uint32_t *checksum) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = rangeChecksum(fd, 0, size, checksum);
+    close(fd);
+    return result;
+}
+
+// Function compares the checksum of the received data with the checksum from the response header
+// Returns -1 if they differ, 0 if they match or the server didn't send the checksum (older server)
+int verifyChecksum(const FrameHeader *header, uint32_t checksum, const char *file_name) {
+    if ((header->flags & FLAG_CHECKSUM) && checksum != header->checksum) {
+        fprintf(stderr, "Checksum mismatch: data of the file '%s' was damaged on the way (%08x instead of %08x)\n",
+                file_name, checksum, header->checksum);
+        return -1;
+    }
+    return 0;
+}
+
+// Function receives the body of the response into the file from offset on, plain or compressed
+// The written data is added to the journal if journal_fd is not -1
+// checksum is set to the checksum of the data written to the file, returns -1 on error
+int receiveFileData(int client_fd, int file_fd, int journal_fd, uint64_t offset, const FrameHeader *header, uint32_t *checksum) {
+    FileWriter writer;
+    if (writerStart(&writer, file_fd, journal_fd, offset) == -1) {
+        return -1;
+    }
+    int result;
+    if (header->flags & (FLAG_LZ4 | FLAG_DEFLATE)) {
+        result = receiveCompressedBody(client_fd, &writer, header->flags, header->length);
+    } else {
+        result = receiveBody(client_fd, &writer, header->length);
+    }
+    if (writerFinish(&writer, checksum) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+// Function creates the journal of the partial download name.part: name.part.journal with the size
+// and the modification time of the server file on the first line, returns the descriptor to add the ranges or -1
+int journalCreate(const char *file_name, const FileInfo *info) {
+    char journal_name[BUFFER_SIZE + 16];
+    char line[JOURNAL_LINE_SIZE];
+    snprintf(journal_name, sizeof(journal_name), "%s.part.journal", file_name);
+    int journal_fd = open(journal_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (journal_fd == -1) {
+        perror("Journal creation failed");
+        return -1;
+    }
+    int length = snprintf(line, sizeof(line), "%" PRIu64 " %" PRIu64 "\n", info->file_size, info->mtime_ns);
+    if (write(journal_fd, line, length) != length) {
+        perror("Journal creation failed");
+        close(journal_fd);
+        unlink(journal_name);
+        return -1;
+    }
+    return journal_fd;
+}
+
+// Function opens the journal of the resumed download to add the new ranges after the kept ones, -1 on error
+int journalOpen(const char *file_name) {
+    char journal_name[BUFFER_SIZE + 16];
+    snprintf(journal_name, sizeof(journal_name), "%s.part.journal", file_name);
+    int journal_fd = open(journal_name, O_WRONLY | O_APPEND);
+    if (journal_fd == -1) {
+        perror("Journal open failed");
+    }
+    return journal_fd;
+}
+
+// Function adds the range of the partial file to the journal: offset, length and the checksum of the data
+// The data is not synced before, the next run checks every range against the partial file anyway
+void journalAdd(int journal_fd, uint64_t offset, uint64_t length, uint32_t checksum) {
+    if (journal_fd == -1 || length == 0) {
+        return;
+    }
+    char line[JOURNAL_LINE_SIZE];
+    int line_length = snprintf(line, sizeof(line), "%" PRIu64 " %" PRIu64 " %08x\n", offset, length, checksum);
+    // One write per line with O_APPEND, the streams of the parallel download don't mix their lines
+    if (write(journal_fd, line, line_length) != line_length) {
+        perror("Journal write failed");
+    }
+}
+
+// Function compares the journal ranges by the offset for qsort()
+int journalCompare(const void *a, const void *b) {
+    const JournalRange *range_a = a, *range_b = b;
+    return range_a->offset < range_b->offset ? -1 : range_a->offset > range_b->offset;
+}
+
+// Function reads the journal of the partial download and checks its ranges against the partial file
+// Returns -1 if there is no journal or it belongs to another version of the server file, otherwise ranges
+// is the allocated list of the ranges which have the data of the journal, sorted and not overlapping
+int journalLoad(const char *file_name, int file_fd, const FileInfo *info, JournalRange **ranges, size_t *count) {
+    char journal_name[BUFFER_SIZE + 16];
+    char line[JOURNAL_LINE_SIZE];
+    snprintf(journal_name, sizeof(journal_name), "%s.part.journal", file_name);
+    FILE *journal = fopen(journal_name, "r");
+    if (journal == NULL) {
+        return -1;
+    }
+    uint64_t file_size, mtime_ns;
+    if (fgets(line, sizeof(line), journal) == NULL ||
+        sscanf(line, "%" SCNu64 " %" SCNu64, &file_size, &mtime_ns) != 2 ||
+        file_size != info->file_size || mtime_ns != info->mtime_ns) {
+        fclose(journal);
+        return -1;
+    }
+
+    // Lines are added as the data comes, the last line may be cut by the interruption
+    size_t capacity = 0;
+    *ranges = NULL;
+    *count = 0;
+    JournalRange range;
+    while (fgets(line, sizeof(line), journal) != NULL) {
+        if (sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNx32, &range.offset, &range.length, &range.checksum) != 3 ||
+            strchr(line, '\n') == NULL || range.length == 0 || range.offset > file_size || range.length > file_size - range.offset) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            JournalRange *grown = realloc(*ranges, capacity * sizeof(JournalRange));
+            if (grown == NULL) {
+                break;
+            }
+            *ranges = grown;
+        }
+        (*ranges)[(*count)++] = range;
+    }
+    fclose(journal);
+
+    // Range whose data is not in the partial file (written after the last sync of a crashed system) is requested again,
+    // overlapping ranges are dropped, the neighbouring ones are joined
+    qsort(*ranges, *count, sizeof(JournalRange), journalCompare);
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        JournalRange *current = &(*ranges)[i];
+        uint32_t checksum;
+        if ((kept > 0 && (*ranges)[kept - 1].offset + (*ranges)[kept - 1].length > current->offset) ||
+            rangeChecksum(file_fd, current->offset, current->length, &checksum) == -1 || checksum != current->checksum) {
+            continue;
+        }
+        JournalRange *last = kept > 0 ? &(*ranges)[kept - 1] : NULL;
+        if (last != NULL && last->offset + last->length == current->offset) {
+            last->checksum = crc32cCombine(last->checksum, current->checksum, current->length);
+            last->length += current->length;
+        } else {
+            (*ranges)[kept++] = *current;
+        }
+    }
+    *count = kept;
+    return 0;
+}
+
+// Function removes the journal of the download
+void journalRemove(const char *file_name) {
+    char journal_name[BUFFER_SIZE + 16];
+    snprintf(journal_name, sizeof(journal_name), "%s.part.journal", file_name);
+    unlink(journal_name);
+}
+
+// Function returns 1 if the interrupted download of the file left its partial file and the journal
+int journalExists(const char *file_name) {
+    char name[BUFFER_SIZE + 16];
+    snprintf(name, sizeof(name), "%s.part.journal", file_name);
+    if (access(name, F_OK) != 0) {
+        return 0;
+    }
+    snprintf(name, sizeof(name), "%s.part", file_name);
+    return access(name, F_OK) == 0;
+}
+
 // Function to receive file from the server
-// If file not found on the server, we get an error message
+// If file not found on the server, we get an error status
+// The file is received into name.part and renamed when it is complete and verified,
+// so an interrupted download never leaves a short file which the next run would take for a copy to update
+// The written data is added to the journal, the next run resumes the interrupted download (parallelDownload())
 int downloadFile(int client_fd, const char *file_name) {
-    char response[BUFFER_SIZE];
-    ssize_t response_size;
-    
-    // Getting server response 
-    response_size = recv(client_fd, response, BUFFER_SIZE - 1, 0);
-    if (response_size <= 0) {
+    FrameHeader header;
+    FileInfo info;
+
+    // Getting server response
+    if (receiveResponse(client_fd, &header, &info) == -1) {
         perror("Error receiving server response or connection closed");
         close(client_fd);
         return 1;   // Handle the connection error
-    } 
+    }
 
-    // Checking if response from the server contains error message
-    if (strcmp(response, "File not found") == 0) {
-        printf("Server response: %s\n", response);
+    // Checking if response from the server contains error status
+    if (header.status != STATUS_OK) {
+        printf("Server response: %s\n", statusMessage(header.status));
         return 2;   // Handle the "File not found" case
     }
 
-    // Processing data from the response to get file size data
-    uint64_t file_size = 0;
-    memcpy(&file_size, response, sizeof(uint64_t));
-    file_size = be64toh(file_size); // Convert from network byte order to host byte order
+    // Size of the data is in the response header
+    uint64_t file_size = header.length;
 
-    // Opening file to write data received from the server
-    FILE *new_file = fopen(file_name, "wb");
-    if (new_file == NULL) {
+    // Opening the temporary file to write data received from the server
+    char temp_name[BUFFER_SIZE + 16];
+    snprintf(temp_name, sizeof(temp_name), "%s.part", file_name);
+    int file_fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_fd == -1) {
         perror("File creation failed");
         close(client_fd);
         return 3;   // Handle the error with file creation
     }
+    // Allocating the whole file at once: the blocks are contiguous and a full disk is found before the transfer
+    if (file_size > 0 && fallocate(file_fd, 0, 0, file_size) == -1 && errno != EOPNOTSUPP) {
+        perror("File allocation failed");
+        close(file_fd);
+        remove(temp_name);
+        close(client_fd);
+        return 3;
+    }
 
-    ssize_t total_received = 0;
-    char buffer[BUFFER_SIZE];
-
-    // Cycle to receive and write the data to the file
-    // Every iteration we compare number of received bytes with file size.
-    // If the remaining bytes to receive are less than the BUFFER_SIZE, we set bytes_to_receive to the remaining bytes. 
-    // Otherwise, we set bytes_to_receive to the BUFFER_SIZE. 
-    while (total_received < file_size) {
-        ssize_t bytes_to_receive = (file_size - total_received) < BUFFER_SIZE ? (file_size - total_received) : BUFFER_SIZE;
-        ssize_t received_bytes = recv(client_fd, buffer, bytes_to_receive, 0);
-
-        if (received_bytes <= 0) {
-            perror("Error receiving file data or connection closed");
-            fclose(new_file);
-            close(client_fd);
-            return 4;   // Handle error with invalid response from the server
+    // Network and disk work in their own threads
+    uint32_t checksum;
+    int journal_fd = journalCreate(file_name, &info);
+    int result = receiveFileData(client_fd, file_fd, journal_fd, 0, &header, &checksum);
+    close(file_fd);
+    if (journal_fd != -1) {
+        close(journal_fd);
+    }
+    if (result == -1) {
+        // Data received so far stays in name.part, the journal tells the next run which ranges it has
+        if (journal_fd == -1) {
+            remove(temp_name);
+        } else {
+            fprintf(stderr, "Download of '%s' is interrupted, the next run resumes it\n", file_name);
         }
-        // writing received bytes into the file
-        fwrite(buffer, 1, received_bytes, new_file);
-        total_received += received_bytes;
+        close(client_fd);
+        return 4;   // Handle error with invalid response from the server
+    }
+    // Damaged file is not kept, the next request downloads it again
+    journalRemove(file_name);
+    if (verifyChecksum(&header, checksum, file_name) == -1) {
+        remove(temp_name);
+        return 4;
+    }
+    if (rename(temp_name, file_name) == -1) {
+        perror("File creation failed");
+        remove(temp_name);
+        return 3;
     }
-    // Closing file
-    fclose(new_file);
     printf("File '%s' received successfully.\n", file_name);
     return 0;   // Success
 }
 
 // Function to receive updates for the file from the server
+// The update is written after the local copy, a damaged update is cut off again and an interrupted one keeps
+// the data it wrote
 int updateFile(int client_fd, const char *file_name) {
-    char response[BUFFER_SIZE];
+    FrameHeader header;
+    FileInfo info;
+
     // Getting server response
-    ssize_t response_size = recv(client_fd, response, BUFFER_SIZE - 1, 0);
-        if (response_size <= 0) {
-            perror("Connection closed or error");
-            close(client_fd);
-            return 1;
-        } else {
-            response[response_size] = '\0';     // null-terminating the string for correct processing
+    if (receiveResponse(client_fd, &header, &info) == -1) {
+        perror("Connection closed or error");
+        close(client_fd);
+        return 1;
+    }
 
-            // Checking if server tells that no updates available 
-            if (strcmp(response, "NO_UPDATE") == 0) {
-                printf("No updates available from server\n");
-            } else {
-                // Copying data from the server response to the variable update_size
-                uint64_t update_size = 0;
-                memcpy(&update_size, response, sizeof(uint64_t));
-                // Converting update_size from network byte order to host byte order, thus we get the size of the update
-                update_size = be64toh(update_size); 
-                
-                // Opening file to append received data to the file
-                FILE *update_file = fopen(file_name, "ab");
-                if (update_file == NULL) {
-                    perror("File update failed");
-                    close(client_fd);
-                    return 2;
-                }
+    // Checking if server tells that no updates available
+    if (header.status == STATUS_NO_UPDATE) {
+        printf("No updates available from server\n");
+        return 0;
+    }
+    if (header.status == STATUS_DIVERGED) {
+        return DIVERGED_RESULT;
+    }
+    if (header.status != STATUS_OK) {
+        printf("Server response: %s\n", statusMessage(header.status));
+        return 4;
+    }
 
-                ssize_t total_received = 0;
-                char buffer[BUFFER_SIZE];
-
-                // Cycle to receive and write the data to the file
-                // Every iteration we compare number of received bytes with update size.
-                // If the remaining bytes to receive are less than the BUFFER_SIZE, we set bytes_to_receive to the remaining bytes. 
-                // Otherwise, we set bytes_to_receive to the BUFFER_SIZE.  
-                while (total_received < update_size) {
-                ssize_t bytes_to_receive = (update_size - total_received) < BUFFER_SIZE ? (update_size - total_received) : BUFFER_SIZE;
-                ssize_t received_bytes = recv(client_fd, buffer, bytes_to_receive, 0);
-
-                    if (received_bytes <= 0) {
-                        perror("Error receiving file data or connection closed");
-                        fclose(update_file);
-                        close(client_fd);
-                        return 3;
-                    }
-                    // Writing received bytes to the file
-                    fwrite(buffer, 1, received_bytes, update_file);
-                    total_received += received_bytes;
-                }
+    // Size of the update is in the response header, it starts at the size of the local copy (header offset)
+    uint64_t update_size = header.length;
+    uint64_t local_size = header.offset;
 
-                // Closing file
-                fclose(update_file);
-                printf("File '%s' updated successfully.\n", file_name);
-            }
+    // Opening file to write received data after the local copy
+    int file_fd = open(file_name, O_WRONLY);
+    if (file_fd == -1) {
+        perror("File update failed");
+        close(client_fd);
+        return 2;
+    }
+    // Space is reserved without changing the size, so an interrupted update leaves only the data really written,
+    // which is still the beginning of the server file
+    if (update_size > 0 && fallocate(file_fd, FALLOC_FL_KEEP_SIZE, local_size, update_size) == -1 && errno != EOPNOTSUPP) {
+        perror("File allocation failed");
+        close(file_fd);
+        close(client_fd);
+        return 2;
+    }
+
+    uint32_t checksum;
+    int result = receiveFileData(client_fd, file_fd, -1, local_size, &header, &checksum);
+    if (result == -1) {
+        // Data written before the connection broke is kept, the next update continues after it
+        // (the server checks the checksum of the copy, so a damaged part is not extended)
+        fprintf(stderr, "Update of '%s' is interrupted, the next run continues it\n", file_name);
+        close(file_fd);
+        close(client_fd);
+        return 3;
+    }
+    if (verifyChecksum(&header, checksum, file_name) == -1) {
+        // The local copy stays as it was before the request
+        if (ftruncate(file_fd, local_size) == -1) {
+            perror("File update failed");
         }
+        close(file_fd);
+        return 3;
+    }
+    close(file_fd);
+    printf("File '%s' updated successfully.\n", file_name);
     return 0;
-    
 }
 
-// Main function
-int main(int argc, char *argv[]) {
-    char file_name[BUFFER_SIZE];
-    char server_ip[BUFFER_SIZE];
-    int request = 1;    // request = 1 - file doesn't exist, request = 2 = file exists
-    int client_fd;      
-    size_t client_file_size = 0;
-    struct sockaddr_in server_addr;
+// Function follows the file: receives the update of the local copy and then every append the server pushes
+// Runs until the server file is truncated or removed or the connection is closed
+int followFile(int client_fd, const char *file_name) {
+    int file_fd = -1;
+    int result = 0;
+    while (result == 0) {
+        FrameHeader header;
+        FileInfo info;
+        if (receiveResponse(client_fd, &header, &info) == -1) {
+            printf("Connection closed by the server\n");
+            result = 1;
+            break;
+        }
+        if (header.status == STATUS_DIVERGED) {
+            printf("File '%s' on the server was truncated or differs from the local copy\n", file_name);
+            result = DIVERGED_RESULT;
+            break;
+        }
+        if (header.status != STATUS_OK) {
+            printf("Server response: %s\n", statusMessage(header.status));
+            result = 2;
+            break;
+        }
+        // Local copy is created by the first response, a missing server file leaves nothing behind
+        if (file_fd == -1 && (file_fd = open(file_name, O_WRONLY | O_CREAT, 0644)) == -1) {
+            perror("File update failed");
+            result = 2;
+            break;
+        }
+        if (header.length == 0) {
+            continue;
+        }
 
-    // Calling function to get user input for file name and server IP
-    getUserInput(argc, argv, file_name, server_ip);
+        // Every push continues where the previous one ended, a damaged push is cut off and following stops
+        uint32_t checksum;
+        if (receiveFileData(client_fd, file_fd, -1, header.offset, &header, &checksum) == -1 ||
+            verifyChecksum(&header, checksum, file_name) == -1) {
+            if (ftruncate(file_fd, header.offset) == -1) {
+                perror("File update failed");
+            }
+            result = 3;
+            break;
+        }
+        printf("File '%s': %" PRIu64 " new bytes, %" PRIu64 " bytes in total\n", file_name, header.length,
+               header.offset + header.length);
+        fflush(stdout);
+    }
+    if (file_fd != -1) {
+        close(file_fd);
+    }
+    return result;
+}
 
-    // Checking if requested file exists on the client side
+// Function sends the delta request: signature of every block of the local copy of the file
+int sendDeltaRequest(int client_fd, uint32_t request_id, const char *file_name) {
     FILE *file = fopen(file_name, "rb");
-        if (file == NULL) {
-            // File doesn't exist
-            request = 1;
-            client_file_size = 0;
-            printf("Requesting file %s\n", file_name);
-        } else {
-            // File exists, calculating the file size to check if update is available from the server
-            request = 2;
-            fseek(file, 0, SEEK_END);
-            client_file_size = ftell(file);
+    if (file == NULL) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    uint64_t file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint32_t block_size = deltaBlockSize(file_size);
+    uint32_t block_count = (file_size + block_size - 1) / block_size;
+    uint32_t tail_size = file_size % block_size;
+    size_t name_size = strlen(file_name);
+    size_t payload_size = DELTA_SIGNATURE_HEADER_SIZE + name_size + (size_t)block_count * DELTA_BLOCK_SIGNATURE_SIZE;
+    if (name_size >= BUFFER_SIZE || payload_size > DELTA_MAX_SIGNATURE_SIZE) {
+        fclose(file);
+        return -1;
+    }
+
+    // Frame header and payload are sent together
+    unsigned char *request = malloc(FRAME_HEADER_SIZE + payload_size);
+    unsigned char *block = malloc(block_size);
+    if (request == NULL || block == NULL) {
+        free(request);
+        free(block);
+        fclose(file);
+        return -1;
+    }
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.opcode = OP_DELTA;
+    header.flags = FLAG_CHECKSUM;
+    header.request_id = request_id;
+    header.payload_size = payload_size;
+    header.offset = file_size;
+    encodeFrameHeader(&header, request);
+
+    // Signature header and the file name
+    unsigned char *payload = request + FRAME_HEADER_SIZE;
+    uint16_t network_name_size = htobe16(name_size);
+    deltaPut32(payload, block_size);
+    deltaPut32(payload + 4, block_count);
+    deltaPut32(payload + 8, tail_size);
+    memcpy(payload + 12, &network_name_size, 2);
+    memcpy(payload + DELTA_SIGNATURE_HEADER_SIZE, file_name, name_size);
+
+    // Weak checksum and strong hash of every block
+    unsigned char *signature = payload + DELTA_SIGNATURE_HEADER_SIZE + name_size;
+    for (uint32_t i = 0; i < block_count; i++) {
+        size_t bytes_read = fread(block, 1, block_size, file);
+        deltaPut32(signature, rollingChecksum(block, bytes_read));
+        deltaPut64(signature + 4, strongHash(block, bytes_read, 0));
+        signature += DELTA_BLOCK_SIGNATURE_SIZE;
+    }
+    fclose(file);
+    free(block);
+
+    size_t total_sent = 0;
+    int result = 0;
+    while (total_sent < FRAME_HEADER_SIZE + payload_size) {
+        ssize_t bytes_sent = send(client_fd, request + total_sent, FRAME_HEADER_SIZE + payload_size - total_sent, 0);
+        if (bytes_sent == -1) {
+            result = -1;
+            break;
+        }
+        total_sent += bytes_sent;
+    }
+    free(request);
+    printf("Sent signature of %u blocks of %u bytes\n", block_count, block_size);
+    return result;
+}
+
+// Function to receive the delta from the server and build the new copy of the file
+// New copy is written to the temporary file which replaces the local copy when it is complete and its checksum
+// matches the checksum of the server copy
+int deltaUpdateFile(int client_fd, const char *file_name) {
+    FrameHeader header;
+    FileInfo info;
+
+    // Getting server response
+    if (receiveResponse(client_fd, &header, &info) == -1) {
+        perror("Connection closed or error");
+        return 1;
+    }
+    if (header.status == STATUS_NO_UPDATE) {
+        printf("No updates available from server\n");
+        return 0;
+    }
+    if (header.status != STATUS_OK) {
+        printf("Server response: %s\n", statusMessage(header.status));
+        return 4;
+    }
+
+    char temp_name[BUFFER_SIZE + 16];
+    snprintf(temp_name, sizeof(temp_name), "%s.delta", file_name);
+    FILE *old_file = fopen(file_name, "rb");
+    FILE *new_file = fopen(temp_name, "wb");
+    if (old_file == NULL || new_file == NULL) {
+        perror("File update failed");
+        if (old_file != NULL) {
+            fclose(old_file);
+        }
+        if (new_file != NULL) {
+            fclose(new_file);
+        }
+        return 2;
+    }
+    fseek(old_file, 0, SEEK_END);
+    uint64_t old_size = ftell(old_file);
+    uint32_t block_size = deltaBlockSize(old_size);
+
+    // Cycle to apply the instructions: copy the blocks from the local copy or write the literal data from the server
+    char buffer[COPY_BUFFER_SIZE];
+    uint64_t total_received = 0;
+    uint64_t literal_bytes = 0;
+    uint32_t checksum = 0;
+    int result = 0;
+    while (result == 0 && total_received < header.length) {
+        unsigned char instruction[DELTA_COPY_SIZE];
+        if (receiveAll(client_fd, instruction, 1) == -1) {
+            result = 3;
+            break;
+        }
+        if (instruction[0] == DELTA_COPY) {
+            if (receiveAll(client_fd, instruction + 1, DELTA_COPY_SIZE - 1) == -1) {
+                result = 3;
+                break;
+            }
+            total_received += DELTA_COPY_SIZE;
+            // Last block of the local copy may be short
+            uint64_t start = (uint64_t)deltaGet32(instruction + 1) * block_size;
+            uint64_t end = start + (uint64_t)deltaGet32(instruction + 5) * block_size;
+            if (end > old_size) {
+                end = old_size;
+            }
+            fseek(old_file, start, SEEK_SET);
+            while (start < end) {
+                size_t chunk = end - start < sizeof(buffer) ? end - start : sizeof(buffer);
+                if (fread(buffer, 1, chunk, old_file) != chunk) {
+                    result = 3;
+                    break;
+                }
+                fwrite(buffer, 1, chunk, new_file);
+                checksum = crc32c(checksum, buffer, chunk);
+                start += chunk;
+            }
+        } else if (instruction[0] == DELTA_LITERAL) {
+            if (receiveAll(client_fd, instruction + 1, DELTA_LITERAL_HEADER_SIZE - 1) == -1) {
+                result = 3;
+                break;
+            }
+            uint32_t length = deltaGet32(instruction + 1);
+            total_received += DELTA_LITERAL_HEADER_SIZE + length;
+            literal_bytes += length;
+            while (length > 0) {
+                size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+                if (receiveAll(client_fd, buffer, chunk) == -1) {
+                    result = 3;
+                    break;
+                }
+                fwrite(buffer, 1, chunk, new_file);
+                checksum = crc32c(checksum, buffer, chunk);
+                length -= chunk;
+            }
+        } else {
+            fprintf(stderr, "Invalid delta instruction from the server\n");
+            result = 3;
+        }
+    }
+    fclose(old_file);
+    uint64_t new_size = ftell(new_file);
+    fclose(new_file);
+
+    // Replacing the local copy only when the new copy is complete
+    if (result != 0 || new_size != info.file_size) {
+        fprintf(stderr, "Error receiving delta for the file '%s'\n", file_name);
+        remove(temp_name);
+        return result != 0 ? result : 3;
+    }
+    // Size alone doesn't catch a damaged literal or a block of the local copy changed after the signature
+    if (verifyChecksum(&header, checksum, file_name) == -1) {
+        remove(temp_name);
+        return 3;
+    }
+    if (rename(temp_name, file_name) == -1) {
+        perror("File update failed");
+        remove(temp_name);
+        return 2;
+    }
+    printf("File '%s' updated successfully: %" PRIu64 " bytes of delta, %" PRIu64 " bytes of new data.\n",
+           file_name, header.length, literal_bytes);
+    return 0;
+}
+
+// Function returns milliseconds passed since start
+uint64_t elapsedMs(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Function gives the stream the next range of the missing data, returns 0 if all missing data is taken
+int takeRange(ParallelDownload *download, uint64_t *offset, uint64_t *length) {
+    int taken = 0;
+    pthread_mutex_lock(&download->mutex);
+    if (!download->failed && download->next_missing < download->missing_count) {
+        JournalRange *missing = &download->missing[download->next_missing];
+        *offset = missing->offset;
+        *length = missing->length < download->chunk_size ? missing->length : download->chunk_size;
+        missing->offset += *length;
+        missing->length -= *length;
+        if (missing->length == 0) {
+            download->next_missing++;
+        }
+        taken = 1;
+    }
+    pthread_mutex_unlock(&download->mutex);
+    return taken;
+}
+
+// Function records the received range of the file in the journal and in the list of the done ranges
+void addRange(ParallelDownload *download, uint64_t offset, uint64_t length, uint32_t checksum) {
+    journalAdd(download->journal_fd, offset, length, checksum);
+    pthread_mutex_lock(&download->mutex);
+    if (download->range_count == download->range_capacity) {
+        size_t capacity = download->range_capacity == 0 ? 64 : download->range_capacity * 2;
+        JournalRange *grown = realloc(download->ranges, capacity * sizeof(JournalRange));
+        if (grown == NULL) {
+            download->failed = 1;   // The file can't be checked as a whole without its ranges
+            pthread_mutex_unlock(&download->mutex);
+            return;
+        }
+        download->ranges = grown;
+        download->range_capacity = capacity;
+    }
+    download->ranges[download->range_count++] = (JournalRange){ offset, length, checksum };
+    pthread_mutex_unlock(&download->mutex);
+}
+
+// thread function of one stream of the parallel download
+// Stream takes ranges of the file, keeps RANGES_IN_FLIGHT requests on its connection and writes every range at its place
+void* downloadStream(void* arg) {
+    ParallelDownload *download = (ParallelDownload *)arg;
+    uint64_t offsets[RANGES_IN_FLIGHT], lengths[RANGES_IN_FLIGHT];
+    int first = 0, in_flight = 0;
+    uint32_t request_id = 0;
+    int failed = 0;
+
+    char *buffer = malloc(RANGE_BUFFER_SIZE);
+    int sockfd = buffer == NULL ? -1 : connectToServer(download->server_ip, download->server_port);
+    TransferTuner tuner;
+    if (sockfd == -1) {
+        failed = 1;
+    } else {
+        transferTunerInit(&tuner, sockfd, SO_RCVBUF);
+    }
+
+    while (!failed) {
+        // Requesting the next ranges while the response to the first one is coming
+        while (in_flight < RANGES_IN_FLIGHT) {
+            int slot = (first + in_flight) % RANGES_IN_FLIGHT;
+            if (!takeRange(download, &offsets[slot], &lengths[slot])) {
+                break;
+            }
+            if (sendRequest(sockfd, OP_DOWNLOAD, ++request_id, download->file_name, offsets[slot], lengths[slot], FLAG_CHECKSUM, 0) == -1) {
+                failed = 1;
+                break;
+            }
+            in_flight++;
+        }
+        if (failed || in_flight == 0) {
+            break;
+        }
+
+        // Receiving the range and writing it at its offset in the file
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        FrameHeader header;
+        FileInfo info;
+        if (receiveResponse(sockfd, &header, &info) == -1 || header.status != STATUS_OK ||
+            header.offset != offsets[first] || header.length != lengths[first]) {
+            failed = 1;
+            break;
+        }
+        // Ranges of another version of the file don't fit together, the download starts again
+        if (info.file_size != download->file_size || info.mtime_ns != download->mtime_ns) {
+            fprintf(stderr, "File '%s' changed on the server during the download\n", download->file_name);
+            pthread_mutex_lock(&download->mutex);
+            download->restart = 1;
+            pthread_mutex_unlock(&download->mutex);
+            failed = 1;
+            break;
+        }
+        uint64_t offset = header.offset;
+        uint64_t remaining = header.length;
+        uint32_t checksum = 0;
+        while (remaining > 0) {
+            size_t bytes_to_receive = remaining < RANGE_BUFFER_SIZE ? remaining : RANGE_BUFFER_SIZE;
+            ssize_t received_bytes = recv(sockfd, buffer, bytes_to_receive, 0);
+            if (received_bytes <= 0 || pwrite(download->file_fd, buffer, received_bytes, offset) != received_bytes) {
+                failed = 1;
+                break;
+            }
+            transferTune(&tuner, sockfd, SO_RCVBUF, received_bytes);
+            checksum = crc32c(checksum, buffer, received_bytes);
+            offset += received_bytes;
+            remaining -= received_bytes;
+            pthread_mutex_lock(&download->mutex);
+            download->bytes_received += received_bytes;
+            pthread_mutex_unlock(&download->mutex);
+        }
+        // Part of the interrupted range is kept too, the checksum of the whole file checks it at the end
+        if (failed) {
+            journalAdd(download->journal_fd, header.offset, offset - header.offset, checksum);
+            break;
+        }
+        // Every range is checked on its own, the damaged range fails the whole download
+        if (verifyChecksum(&header, checksum, download->file_name) == -1) {
+            failed = 1;
+            break;
+        }
+        addRange(download, header.offset, header.length, checksum);
+
+        // Adapting the chunk size: bigger chunks when ranges come fast, smaller when they are slow
+        uint64_t chunk_time = elapsedMs(&start);
+        pthread_mutex_lock(&download->mutex);
+        if (chunk_time < TARGET_CHUNK_TIME_MS / 2 && download->chunk_size < MAX_CHUNK_SIZE) {
+            download->chunk_size *= 2;
+        } else if (chunk_time > TARGET_CHUNK_TIME_MS * 2 && download->chunk_size > MIN_CHUNK_SIZE) {
+            download->chunk_size /= 2;
+        }
+        pthread_mutex_unlock(&download->mutex);
+
+        first = (first + 1) % RANGES_IN_FLIGHT;
+        in_flight--;
+    }
+
+    if (sockfd != -1) {
+        close(sockfd);
+    }
+    free(buffer);
+    pthread_mutex_lock(&download->mutex);
+    if (failed) {
+        download->failed = 1;
+    }
+    if (--download->active_streams == 0) {
+        pthread_cond_signal(&download->finished);
+    }
+    pthread_mutex_unlock(&download->mutex);
+    return NULL;
+}
+
+// Function downloads the file in ranges over up to max_streams connections
+// It starts with one stream and adds streams while every new stream still increases the total speed
+// Interrupted download of the same version of the file is resumed: the ranges of the journal which still have
+// their data in name.part are kept and only the rest of the file is requested
+int parallelDownload(const char *file_name, const char *server_ip, int server_port, int max_streams) {
+    // Getting the size of the file to split it into ranges and the checksum of the whole file
+    int sockfd = connectToServer(server_ip, server_port);
+    if (sockfd == -1) {
+        return 1;
+    }
+    FrameHeader header;
+    FileInfo info;
+    if (sendRequest(sockfd, OP_STAT, 1, file_name, 0, 0, FLAG_CHECKSUM, 0) == -1 || receiveResponse(sockfd, &header, &info) == -1) {
+        perror("Error receiving server response or connection closed");
+        close(sockfd);
+        return 1;
+    }
+    close(sockfd);
+    if (header.status != STATUS_OK) {
+        printf("Server response: %s\n", statusMessage(header.status));
+        return 2;
+    }
+
+    // Allocating the whole file at once, the streams write their ranges in any order
+    // The file gets its name only when all ranges are received, a file with holes is never left under the real name
+    char temp_name[BUFFER_SIZE + 16];
+    snprintf(temp_name, sizeof(temp_name), "%s.part", file_name);
+    int file_fd = open(temp_name, O_RDWR | O_CREAT, 0644);
+    if (file_fd == -1) {
+        perror("File creation failed");
+        return 3;
+    }
+    ParallelDownload download;
+    memset(&download, 0, sizeof(download));
+    uint64_t kept_bytes = 0;
+    if (journalLoad(file_name, file_fd, &info, &download.ranges, &download.range_count) == 0) {
+        download.range_capacity = download.range_count;
+        for (size_t i = 0; i < download.range_count; i++) {
+            kept_bytes += download.ranges[i].length;
+        }
+        printf("Resuming the download of '%s', %" PRIu64 " of %" PRIu64 " bytes are kept\n", file_name, kept_bytes, info.file_size);
+        download.journal_fd = journalOpen(file_name);
+    } else {
+        download.journal_fd = ftruncate(file_fd, 0) == 0 ? journalCreate(file_name, &info) : -1;
+    }
+    if (info.file_size > 0 && posix_fallocate(file_fd, 0, info.file_size) != 0 && ftruncate(file_fd, info.file_size) == -1) {
+        perror("File allocation failed");
+        download.failed = 1;
+        download.restart = 1;
+    }
+
+    // Missing data is everything between the kept ranges
+    download.missing = malloc((download.range_count + 1) * sizeof(JournalRange));
+    uint64_t missing_end = 0;
+    for (size_t i = 0; download.missing != NULL && i <= download.range_count; i++) {
+        uint64_t next_kept = i < download.range_count ? download.ranges[i].offset : info.file_size;
+        if (next_kept > missing_end) {
+            download.missing[download.missing_count++] = (JournalRange){ missing_end, next_kept - missing_end, 0 };
+        }
+        missing_end = i < download.range_count ? download.ranges[i].offset + download.ranges[i].length : missing_end;
+    }
+    if (download.missing == NULL) {
+        perror("malloc");
+        download.failed = 1;
+    }
+    // The wait for the streams is measured on the same clock as the speed
+    pthread_condattr_t finished_attr;
+    pthread_condattr_init(&finished_attr);
+    pthread_condattr_setclock(&finished_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&download.finished, &finished_attr);
+    pthread_condattr_destroy(&finished_attr);
+    pthread_mutex_init(&download.mutex, NULL);
+    download.file_name = file_name;
+    download.server_ip = server_ip;
+    download.server_port = server_port;
+    download.file_fd = file_fd;
+    download.file_size = info.file_size;
+    download.mtime_ns = info.mtime_ns;
+    download.chunk_size = MIN_CHUNK_SIZE;
+
+    pthread_t *streams = malloc(sizeof(pthread_t) * max_streams);
+    if (streams == NULL) {
+        perror("malloc");
+        download.failed = 1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int stream_count = 0;
+    int growing = 1;                    // Flag that adding streams still helps
+    uint64_t last_bytes = 0;
+    double last_speed = 0;
+    struct timespec deadline = start;
+
+    while (1) {
+        // Adding the stream if the speed grew noticeably since the last stream was added
+        pthread_mutex_lock(&download.mutex);
+        int work_left = !download.failed && download.next_missing < download.missing_count;
+        if (growing && work_left && stream_count < max_streams) {
+            download.active_streams++;
+            if (pthread_create(&streams[stream_count], NULL, downloadStream, &download) != 0) {
+                download.active_streams--;
+                growing = 0;
+            } else {
+                stream_count++;
+            }
+        }
+        pthread_mutex_unlock(&download.mutex);
+        if (stream_count == 0) {
+            break;      // Nothing is missing or no stream could start
+        }
+
+        // Waiting until the streams are reconsidered, a small file is done before that and the last stream ends the wait
+        deadline.tv_nsec += STREAM_CHECK_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_mutex_lock(&download.mutex);
+        while (download.active_streams > 0 &&
+               pthread_cond_timedwait(&download.finished, &download.mutex, &deadline) != ETIMEDOUT) {
+        }
+        int active_streams = download.active_streams;
+        uint64_t bytes_received = download.bytes_received;
+        pthread_mutex_unlock(&download.mutex);
+        if (active_streams == 0) {
+            break;
+        }
+        double speed = (double)(bytes_received - last_bytes) / STREAM_CHECK_INTERVAL_MS;
+        if (speed < last_speed * 1.1) {
+            growing = 0;
+        }
+        last_speed = speed;
+        last_bytes = bytes_received;
+    }
+
+    for (int i = 0; i < stream_count; i++) {
+        pthread_join(streams[i], NULL);
+    }
+    free(streams);
+    free(download.missing);
+    pthread_cond_destroy(&download.finished);
+    pthread_mutex_destroy(&download.mutex);
+    if (download.journal_fd != -1) {
+        close(download.journal_fd);
+    }
+
+    // Kept and received ranges cover the file without gaps, their checksums joined are the checksum of the file
+    uint32_t checksum = 0;
+    uint64_t covered = 0;
+    if (!download.failed) {
+        qsort(download.ranges, download.range_count, sizeof(JournalRange), journalCompare);
+        for (size_t i = 0; i < download.range_count && download.ranges[i].offset == covered; i++) {
+            checksum = crc32cCombine(checksum, download.ranges[i].checksum, download.ranges[i].length);
+            covered += download.ranges[i].length;
+        }
+    }
+    free(download.ranges);
+    close(file_fd);
+
+    if (download.failed || covered != download.file_size) {
+        // The file changed on the server or there is no journal: the partial file is of no use for the next run
+        if (download.restart || download.journal_fd == -1) {
+            journalRemove(file_name);
+            remove(temp_name);
+            fprintf(stderr, "Error receiving file data or connection closed\n");
+        } else {
+            fprintf(stderr, "Download of '%s' is interrupted, %" PRIu64 " bytes are received, the next run resumes it\n",
+                    file_name, download.bytes_received);
+        }
+        return 4;
+    }
+    journalRemove(file_name);
+    if (verifyChecksum(&header, checksum, file_name) == -1) {
+        remove(temp_name);
+        return 4;
+    }
+    if (rename(temp_name, file_name) == -1) {
+        perror("File creation failed");
+        remove(temp_name);
+        return 3;
+    }
+    uint64_t total_time = elapsedMs(&start);
+    printf("File '%s' received successfully over %d streams, last chunk size %" PRIu64 " bytes, %.1f MB/s.\n",
+           file_name, stream_count, download.chunk_size,
+           total_time > 0 ? (double)download.bytes_received / 1000.0 / total_time : 0.0);
+    return 0;
+}
+
+// Function reads the next file name from the manifest: one name per line, empty lines and lines starting with # are skipped
+// Returns 0 at the end of the manifest
+int readManifestLine(FILE *manifest, char *file_name) {
+    while (fgets(file_name, BUFFER_SIZE, manifest) != NULL) {
+        file_name[strcspn(file_name, "\r\n")] = '\0';
+        if (file_name[0] != '\0' && file_name[0] != '#') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function receives the response to one request of the batch and writes the data to the file
+// result is set to 0 - file received, 1 - file is up to date, 2 - server reported an error or the data is damaged,
+// 3 - local file error, 4 - copy of the directory sync diverged and has to be downloaded
+// Returns -1 if the connection is broken and the rest of the batch can't be received
+int receiveBatchResponse(int client_fd, const BatchEntry *entry, uint32_t request_id, char *buffer, int *result) {
+    FrameHeader header;
+    FileInfo info;
+    if (receiveResponse(client_fd, &header, &info) == -1) {
+        return -1;
+    }
+    if (header.request_id != request_id) {
+        fprintf(stderr, "Response %u came instead of the response %u\n", header.request_id, request_id);
+        return -1;
+    }
+    uint64_t body_size = (header.flags & FLAG_BODY) ? header.length : 0;
+
+    if (header.status == STATUS_NO_UPDATE) {
+        *result = 1;
+        return skipBytes(client_fd, body_size);
+    }
+    if (header.status == STATUS_DIVERGED && entry->mirror) {
+        *result = 4;
+        return skipBytes(client_fd, body_size);
+    }
+    if (header.status != STATUS_OK) {
+        printf("%s: %s\n", entry->file_name, statusMessage(header.status));
+        *result = 2;
+        return skipBytes(client_fd, body_size);
+    }
+
+    // Download goes to name.part and replaces the file when it is complete, update is written after the data
+    // the client already has (the files of the batch are small, they are written by this thread)
+    char temp_name[BUFFER_SIZE + 16];
+    snprintf(temp_name, sizeof(temp_name), "%s.part", entry->file_name);
+    const char *target_name = entry->opcode == OP_DOWNLOAD ? temp_name : entry->file_name;
+    int file_fd = open(target_name, O_WRONLY | O_CREAT | (entry->opcode == OP_DOWNLOAD ? O_TRUNC : 0), 0644);
+    if (file_fd == -1) {
+        perror(entry->file_name);
+        *result = 3;
+        return skipBytes(client_fd, body_size);
+    }
+    uint64_t offset = entry->opcode == OP_DOWNLOAD ? 0 : entry->local_size;
+    uint32_t checksum = 0;
+    *result = 0;
+    while (body_size > 0) {
+        size_t bytes_to_receive = body_size < BATCH_BUFFER_SIZE ? body_size : BATCH_BUFFER_SIZE;
+        ssize_t received_bytes = recv(client_fd, buffer, bytes_to_receive, 0);
+        if (received_bytes <= 0) {
+            break;
+        }
+        // After the write error the rest of the body is still received to keep the connection in sync
+        if (*result == 0 && pwrite(file_fd, buffer, received_bytes, offset) != received_bytes) {
+            perror(entry->file_name);
+            *result = 3;
+        }
+        checksum = crc32c(checksum, buffer, received_bytes);
+        offset += received_bytes;
+        body_size -= received_bytes;
+    }
+    // Interrupted or damaged data is dropped, the local copy stays as it was before the request
+    int broken = body_size > 0;
+    if (*result == 0 && !broken && verifyChecksum(&header, checksum, entry->file_name) == -1) {
+        *result = 2;
+    }
+    if (broken || *result != 0) {
+        if (entry->opcode == OP_DOWNLOAD) {
+            remove(temp_name);
+        } else if (ftruncate(file_fd, entry->local_size) == -1) {
+            perror(entry->file_name);
+        }
+    } else if (entry->opcode == OP_DOWNLOAD && rename(temp_name, entry->file_name) == -1) {
+        perror(entry->file_name);
+        remove(temp_name);
+        *result = 3;
+    }
+    // Mirrored file gets the time of the server file, the next sync skips it without reading it
+    if (!broken && *result == 0 && entry->mirror) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {entry->mtime_ns / 1000000000ULL, entry->mtime_ns % 1000000000ULL}};
+        futimens(file_fd, times);
+    }
+    close(file_fd);
+    return broken ? -1 : 0;
+}
+
+// Function takes the next file of the batch and the checksum of its local copy for the update request
+// Returns 1 if the entry is ready, 0 if there are no more files, -1 if the local copy can't be read
+int nextBatchEntry(BatchSource *source, BatchEntry *entry, uint32_t *checksum) {
+    if (source->manifest != NULL) {
+        if (!readManifestLine(source->manifest, entry->file_name)) {
+            return 0;
+        }
+        struct stat file_stat;
+        entry->mirror = 0;
+        entry->mtime_ns = 0;
+        if (stat(entry->file_name, &file_stat) == 0) {
+            entry->opcode = OP_UPDATE;
+            entry->local_size = file_stat.st_size;
+        } else {
+            entry->opcode = OP_DOWNLOAD;
+            entry->local_size = 0;
+        }
+    } else {
+        pthread_mutex_lock(&source->mutex);
+        int taken = source->next < source->count;
+        if (taken) {
+            *entry = source->entries[source->next++];
+        }
+        pthread_mutex_unlock(&source->mutex);
+        if (!taken) {
+            return 0;
+        }
+    }
+    *checksum = 0;
+    if (entry->opcode == OP_UPDATE && fileChecksum(entry->file_name, entry->local_size, checksum) == -1) {
+        perror(entry->file_name);
+        return -1;
+    }
+    return 1;
+}
+
+// Function fetches the files of the batch over the connection and adds the results to counts
+// Requests are pipelined: up to BATCH_WINDOW requests are sent before the responses, and the server sends the responses back to back
+// Returns -1 if the connection is broken
+int batchFetch(int client_fd, BatchSource *source, int counts[4]) {
+    BatchEntry *entries = malloc(sizeof(BatchEntry) * BATCH_WINDOW);
+    unsigned char *requests = malloc((FRAME_CHECKSUM_HEADER_SIZE + BUFFER_SIZE) * BATCH_WINDOW);
+    char *buffer = malloc(BATCH_BUFFER_SIZE);
+    if (entries == NULL || requests == NULL || buffer == NULL) {
+        perror("malloc");
+        free(entries);
+        free(requests);
+        free(buffer);
+        return -1;
+    }
+
+    uint32_t next_id = 1;           // id of the next request to send
+    uint32_t first_id = 1;          // id of the oldest request waiting for the response
+    int source_done = 0;
+    int broken = 0;
+    BatchEntry retry;               // Diverged copy of the directory sync, requested again as the download
+    int has_retry = 0;
+
+    while (!broken) {
+        // Filling the window with new requests and sending them with one send()
+        size_t requests_size = 0;
+        while ((has_retry || !source_done) && next_id - first_id < BATCH_WINDOW) {
+            BatchEntry *entry = &entries[next_id % BATCH_WINDOW];
+            uint32_t checksum = 0;
+            if (has_retry) {
+                *entry = retry;
+                has_retry = 0;
+            } else {
+                int taken = nextBatchEntry(source, entry, &checksum);
+                if (taken == 0) {
+                    source_done = 1;
+                    break;
+                }
+                if (taken == -1) {
+                    counts[3]++;
+                    continue;
+                }
+            }
+            size_t request_size = encodeRequest(requests + requests_size, entry->opcode, next_id, entry->file_name, entry->local_size, 0,
+                                                FLAG_CHECKSUM, checksum);
+            if (request_size == 0) {
+                fprintf(stderr, "%s: file name is too long\n", entry->file_name);
+                counts[3]++;
+                continue;
+            }
+            requests_size += request_size;
+            next_id++;
+        }
+        if (requests_size > 0 && sendAll(client_fd, requests, requests_size) == -1) {
+            perror("send");
+            broken = 1;
+            break;
+        }
+        if (first_id == next_id) {
+            break;  // All files are requested and all responses are received
+        }
+
+        // Receiving the response to the oldest request
+        int result;
+        BatchEntry *entry = &entries[first_id % BATCH_WINDOW];
+        if (receiveBatchResponse(client_fd, entry, first_id, buffer, &result) == -1) {
+            fprintf(stderr, "Error receiving server response or connection closed\n");
+            broken = 1;
+            break;
+        }
+        if (result == 4) {
+            retry = *entry;
+            retry.opcode = OP_DOWNLOAD;
+            retry.local_size = 0;
+            has_retry = 1;
+        } else {
+            counts[result]++;
+        }
+        first_id++;
+    }
+
+    free(entries);
+    free(requests);
+    free(buffer);
+    return broken ? -1 : 0;
+}
+
+// Function fetches all files of the manifest over one connection
+int batchRequest(const char *manifest_name, const char *server_ip, int server_port) {
+    BatchSource source;
+    memset(&source, 0, sizeof(source));
+    source.manifest = strcmp(manifest_name, "-") == 0 ? stdin : fopen(manifest_name, "r");
+    if (source.manifest == NULL) {
+        perror("Manifest open failed");
+        return 1;
+    }
+    int sockfd = connectToServer(server_ip, server_port);
+    if (sockfd == -1) {
+        if (source.manifest != stdin) {
+            fclose(source.manifest);
+        }
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int counts[4] = {0, 0, 0, 0};   // received, up to date, server errors, local errors
+    int broken = batchFetch(sockfd, &source, counts) == -1;
+
+    uint64_t total_time = elapsedMs(&start);
+    int files = counts[0] + counts[1] + counts[2] + counts[3];
+    printf("Batch done: %d files, %d received, %d up to date, %d failed, %" PRIu64 " ms, %.0f files/s.\n",
+           files, counts[0], counts[1], counts[2] + counts[3], total_time,
+           total_time > 0 ? files * 1000.0 / total_time : 0.0);
+
+    close(sockfd);
+    if (source.manifest != stdin) {
+        fclose(source.manifest);
+    }
+    return broken || counts[2] + counts[3] > 0 ? 1 : 0;
+}
+
+// Function creates the missing directories of the path, returns -1 if one of them can't be created
+int makeParents(const char *path) {
+    char directory[PATH_MAX];
+    size_t length = strlen(path);
+    if (length >= sizeof(directory)) {
+        return -1;
+    }
+    memcpy(directory, path, length + 1);
+    for (char *slash = strchr(directory + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+// Function requests the manifest of the server directory and receives it into the allocated buffer
+// Returns -1 if the manifest can't be received or it is damaged
+int receiveManifest(int client_fd, const char *directory, unsigned char **manifest, uint64_t *size) {
+    FrameHeader header;
+    FileInfo info;
+    if (sendRequest(client_fd, OP_MANIFEST, 1, directory, 0, 0, FLAG_CHECKSUM, 0) == -1 ||
+        receiveResponse(client_fd, &header, &info) == -1) {
+        fprintf(stderr, "Error receiving server response or connection closed\n");
+        return -1;
+    }
+    if (header.status != STATUS_OK) {
+        printf("Server response: %s\n", statusMessage(header.status));
+        return -1;
+    }
+    *size = (header.flags & FLAG_BODY) ? header.length : 0;
+    *manifest = malloc(*size > 0 ? *size : 1);
+    if (*manifest == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (receiveAll(client_fd, *manifest, *size) == -1 ||
+        verifyChecksum(&header, crc32c(0, *manifest, *size), directory) == -1) {
+        free(*manifest);
+        return -1;
+    }
+    return 0;
+}
+
+// Function compares the manifest with the local tree and puts the files which have to be fetched into the source
+// Files with the same size and time are skipped without reading them, files with the same size are compared by
+// the checksum, longer server files are updated by appending and other files are downloaded again
+// Entries with a path which would leave the directory or which can't be created count as rejected
+int planSync(const char *directory, const unsigned char *manifest, uint64_t size, BatchSource *source, int *up_to_date,
+             int *rejected) {
+    size_t capacity = 0;
+    ManifestEntry item;
+    for (uint64_t position = 0; position < size; ) {
+        size_t entry_size = decodeManifestEntry(manifest + position, size - position, &item);
+        if (entry_size == 0) {
+            fprintf(stderr, "Manifest of the directory %s is damaged\n", directory);
+            return -1;
+        }
+        position += entry_size;
+        // Absolute paths and ".." parts would write outside the directory (decodeManifestEntry empties such a path)
+        if (item.path[0] == '\0') {
+            fprintf(stderr, "Manifest of the directory %s has a path outside of it, the file is skipped\n", directory);
+            (*rejected)++;
+            continue;
+        }
+
+        if (source->count == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            BatchEntry *entries = realloc(source->entries, capacity * sizeof(BatchEntry));
+            if (entries == NULL) {
+                perror("malloc");
+                return -1;
+            }
+            source->entries = entries;
+        }
+        BatchEntry *entry = &source->entries[source->count];
+        // The local path is the same as the server path, so the requests name the files the server listed
+        int length = strcmp(directory, ".") == 0 ? snprintf(entry->file_name, BUFFER_SIZE, "%s", item.path)
+                                                 : snprintf(entry->file_name, BUFFER_SIZE, "%s/%s", directory, item.path);
+        if (length >= BUFFER_SIZE) {
+            fprintf(stderr, "%s/%s: file name is too long\n", directory, item.path);
+            (*rejected)++;
+            continue;
+        }
+        entry->mirror = 1;
+        entry->mtime_ns = item.mtime_ns;
+        entry->local_size = 0;
+        entry->opcode = OP_DOWNLOAD;
+
+        struct stat file_stat;
+        if (stat(entry->file_name, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+            uint64_t mtime_ns = (uint64_t)file_stat.st_mtim.tv_sec * 1000000000ULL + file_stat.st_mtim.tv_nsec;
+            uint32_t checksum;
+            if ((uint64_t)file_stat.st_size == item.size && mtime_ns == item.mtime_ns) {
+                (*up_to_date)++;
+                continue;
+            }
+            if ((uint64_t)file_stat.st_size == item.size && fileChecksum(entry->file_name, item.size, &checksum) == 0 &&
+                checksum == item.hash) {
+                // Same data with another time, only the time is copied
+                struct timespec times[2] = {{0, UTIME_OMIT}, {item.mtime_ns / 1000000000ULL, item.mtime_ns % 1000000000ULL}};
+                utimensat(AT_FDCWD, entry->file_name, times, 0);
+                (*up_to_date)++;
+                continue;
+            }
+            if ((uint64_t)file_stat.st_size < item.size) {
+                // Server checks that the copy is the beginning of its file, otherwise the file is downloaded
+                entry->opcode = OP_UPDATE;
+                entry->local_size = file_stat.st_size;
+            }
+        } else if (makeParents(entry->file_name) == -1) {
+            perror(entry->file_name);
+            (*rejected)++;
+            continue;
+        }
+        source->count++;
+    }
+    return 0;
+}
+
+// Thread function of one connection of the directory sync, it fetches the files until the list is empty
+void *syncStream(void *arg) {
+    SyncStream *stream = arg;
+    int sockfd = connectToServer(stream->server_ip, stream->server_port);
+    if (sockfd == -1) {
+        stream->broken = 1;
+        return NULL;
+    }
+    stream->broken = batchFetch(sockfd, stream->source, stream->counts) == -1;
+    close(sockfd);
+    return NULL;
+}
+
+// Function mirrors the server directory into the local directory with the same name
+// One connection gets the manifest, then up to max_streams connections fetch the files which differ
+int syncDirectory(const char *directory, const char *server_ip, int server_port, int max_streams) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int sockfd = connectToServer(server_ip, server_port);
+    if (sockfd == -1) {
+        return 1;
+    }
+    unsigned char *manifest;
+    uint64_t manifest_size;
+    if (receiveManifest(sockfd, directory, &manifest, &manifest_size) == -1) {
+        close(sockfd);
+        return 1;
+    }
+
+    BatchSource source;
+    memset(&source, 0, sizeof(source));
+    pthread_mutex_init(&source.mutex, NULL);
+    int up_to_date = 0;
+    int rejected = 0;
+    int planned = planSync(directory, manifest, manifest_size, &source, &up_to_date, &rejected);
+    free(manifest);
+    uint64_t plan_time = elapsedMs(&start);
+
+    // Fewer files than streams don't need more connections, the first stream reuses the manifest connection
+    int streams = source.count < (size_t)max_streams ? (int)source.count : max_streams;
+    SyncStream *stream_list = calloc(streams > 0 ? streams : 1, sizeof(SyncStream));
+    if (planned == -1 || stream_list == NULL) {
+        close(sockfd);
+        free(stream_list);
+        free(source.entries);
+        return 1;
+    }
+    for (int i = 0; i < streams; i++) {
+        stream_list[i].source = &source;
+        stream_list[i].server_ip = server_ip;
+        stream_list[i].server_port = server_port;
+        if (i > 0 && pthread_create(&stream_list[i].thread, NULL, syncStream, &stream_list[i]) != 0) {
+            stream_list[i].broken = 1;
+            streams = i + 1;
+            break;
+        }
+        stream_list[i].started = i > 0;
+    }
+    if (streams > 0) {
+        stream_list[0].broken = batchFetch(sockfd, &source, stream_list[0].counts) == -1;
+    }
+    close(sockfd);
+
+    int counts[4] = {0, 0, 0, 0};
+    int broken = 0;
+    for (int i = 0; i < streams; i++) {
+        // The thread writes broken itself, it is read only after the join
+        if (stream_list[i].started) {
+            pthread_join(stream_list[i].thread, NULL);
+        }
+        for (int result = 0; result < 4; result++) {
+            counts[result] += stream_list[i].counts[result];
+        }
+        broken |= stream_list[i].broken;
+    }
+    uint64_t total_time = elapsedMs(&start);
+    printf("Sync of %s done: %zu files, %d up to date, %d received, %d failed, manifest and comparison %" PRIu64
+           " ms, total %" PRIu64 " ms.\n", directory, up_to_date + rejected + source.count, up_to_date + counts[1],
+           counts[0], counts[2] + counts[3] + rejected, plan_time, total_time);
+    free(stream_list);
+    free(source.entries);
+    pthread_mutex_destroy(&source.mutex);
+    return broken || counts[2] + counts[3] + rejected > 0 ? 1 : 0;
+}
+
+// Function requests the metrics of the server and prints them as the server sends them (Prometheus text format)
+int printServerStats(const char *server_ip, int server_port) {
+    int sockfd = connectToServer(server_ip, server_port);
+    if (sockfd == -1) {
+        return 1;
+    }
+    FrameHeader header;
+    FileInfo info;
+    if (sendRequest(sockfd, OP_STATS, 1, "", 0, 0, 0, 0) == -1 || receiveResponse(sockfd, &header, &info) == -1) {
+        fprintf(stderr, "Connection to the server is broken\n");
+        close(sockfd);
+        return 1;
+    }
+    if (header.status != STATUS_OK) {
+        fprintf(stderr, "%s\n", statusMessage(header.status));
+        close(sockfd);
+        return 1;
+    }
+
+    char buffer[BUFFER_SIZE];
+    uint64_t remaining = header.flags & FLAG_BODY ? header.length : 0;
+    while (remaining > 0) {
+        size_t chunk = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+        if (receiveAll(sockfd, buffer, chunk) == -1) {
+            fprintf(stderr, "Connection to the server is broken\n");
+            close(sockfd);
+            return 1;
+        }
+        fwrite(buffer, 1, chunk, stdout);
+        remaining -= chunk;
+    }
+    close(sockfd);
+    return 0;
+}
+
+// Function reads the rate in bytes per second with an optional K, M or G suffix, returns -1 if the text is not a rate
+int parseRate(const char *text, uint64_t *rate) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || text[0] == '-') {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        value <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value <<= 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        value <<= 30;
+        end++;
+    }
+    if (*end != '\0' && *end != ',') {
+        return -1;
+    }
+    *rate = value;
+    return 0;
+}
+
+// Function sends the new rate limits "global,client" to the server, 0 - no limit
+int setServerLimits(const char *limits, const char *server_ip, int server_port) {
+    uint64_t global_rate, client_rate;
+    const char *comma = strchr(limits, ',');
+    if (comma == NULL || parseRate(limits, &global_rate) == -1 || parseRate(comma + 1, &client_rate) == -1) {
+        fprintf(stderr, "Limits are given as <global rate>,<client rate>, for example 100M,10M\n");
+        return 1;
+    }
+    int sockfd = connectToServer(server_ip, server_port);
+    if (sockfd == -1) {
+        return 1;
+    }
+    FrameHeader header;
+    FileInfo info;
+    if (sendRequest(sockfd, OP_LIMITS, 1, "", global_rate, client_rate, 0, 0) == -1 ||
+        receiveResponse(sockfd, &header, &info) == -1) {
+        fprintf(stderr, "Connection to the server is broken\n");
+        close(sockfd);
+        return 1;
+    }
+    close(sockfd);
+    if (header.status != STATUS_OK) {
+        fprintf(stderr, "Server response: %s\n", statusMessage(header.status));
+        return 1;
+    }
+    printf("Rate limits set: %" PRIu64 " bytes/s for all clients, %" PRIu64 " bytes/s for every client\n",
+           global_rate, client_rate);
+    return 0;
+}
+
+// Main function
+int main(int argc, char *argv[]) {
+    char file_name[BUFFER_SIZE];
+    char server_ip[BUFFER_SIZE];
+    int request = OP_DOWNLOAD;    // OP_DOWNLOAD - file doesn't exist, OP_UPDATE - file exists
+    size_t client_file_size = 0;
+    int use_delta = 0;            // Flag to update the existing file with the delta instead of appending
+    int follow = 0;               // Flag to subscribe to the file and receive its appends until it is stopped
+    int max_streams = 1;          // Maximum number of connections to download the new file
+    const char *manifest_name = NULL;   // List of files for the batch mode, "-" - standard input
+    const char *sync_directory = NULL;  // Directory to mirror from the server
+    int show_stats = 0;           // Flag to print the server metrics instead of requesting a file
+    const char *limits = NULL;    // New rate limits of the server, "global,client"
+    uint8_t compression = 0;      // FLAG_LZ4 or FLAG_DEFLATE if the client accepts the compressed file
+    int port = PORT;              // Server port, another one is used to go through a proxy
+    int option;
+
+    // Reading command line options, file name and server IP go after them
+    while ((option = getopt(argc, argv, "dfj:b:r:sz:L:p:")) != -1) {
+        if (option == 'd') {
+            use_delta = 1;
+        } else if (option == 'f') {
+            follow = 1;
+        } else if (option == 'j' && atoi(optarg) > 0) {
+            max_streams = atoi(optarg);
+        } else if (option == 'b') {
+            manifest_name = optarg;
+        } else if (option == 'r') {
+            sync_directory = optarg;
+        } else if (option == 's') {
+            show_stats = 1;
+        } else if (option == 'L') {
+            limits = optarg;
+        } else if (option == 'p' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+            port = atoi(optarg);
+        } else if (option == 'z' && strcmp(optarg, "lz4") == 0) {
+            compression = FLAG_LZ4;
+        } else if (option == 'z' && strcmp(optarg, "deflate") == 0) {
+            compression = FLAG_DEFLATE;
+        } else {
+            fprintf(stderr, "Usage: %s [-p port] [-d] [-f] [-j streams] [-z lz4|deflate] [file name] [server IP]\n"
+                            "       %s [-p port] -b <manifest|-> [server IP]\n"
+                            "       %s [-p port] -r <directory> [-j streams] [server IP]\n"
+                            "       %s [-p port] -s [server IP]\n"
+                            "       %s [-p port] -L <global rate>,<client rate> [server IP]\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (show_stats) {
+        return printServerStats(optind < argc ? argv[optind] : DEFAULT_SERVER_IP, port);
+    }
+    if (limits != NULL) {
+        return setServerLimits(limits, optind < argc ? argv[optind] : DEFAULT_SERVER_IP, port);
+    }
+
+    // Directory sync gets the file names from the server manifest
+    if (sync_directory != NULL) {
+        return syncDirectory(sync_directory, optind < argc ? argv[optind] : DEFAULT_SERVER_IP, port, max_streams);
+    }
+
+    // In the batch mode file names come from the manifest, only the server IP can be given
+    if (manifest_name != NULL) {
+        return batchRequest(manifest_name, optind < argc ? argv[optind] : DEFAULT_SERVER_IP, port);
+    }
+
+    // Calling function to get user input for file name and server IP
+    getUserInput(argc - optind + 1, argv + optind - 1, file_name, server_ip);
+
+    // Checking if requested file exists on the client side
+    FILE *file = fopen(file_name, "rb");
+        if (file == NULL) {
+            // File doesn't exist
+            request = OP_DOWNLOAD;
+            client_file_size = 0;
+            printf("Requesting file %s\n", file_name);
+        } else {
+            // File exists, calculating the file size to check if update is available from the server
+            request = use_delta ? OP_DELTA : OP_UPDATE;
+            fseek(file, 0, SEEK_END);
+            client_file_size = ftell(file);
             fseek(file, 0, SEEK_SET);
             fclose(file);
             printf("Requesting the update for the file %s\n", file_name);
         }
+    // Following starts from the local copy or from the beginning of the file
+    if (follow) {
+        request = OP_SUBSCRIBE;
+        printf("Following the file %s\n", file_name);
+    }
+
+    // New file is downloaded over several connections, the interrupted download is resumed in ranges
+    if (request == OP_DOWNLOAD && (max_streams > 1 || journalExists(file_name))) {
+        return parallelDownload(file_name, server_ip, port, max_streams) == 0 ? 0 : 1;
+    }
 
     pthread_t client_thread;
    
@@ -287,7 +2346,8 @@ int main(int argc, char *argv[]) {
     args->file_name = strdup(file_name);   // file name
     args->file_size = client_file_size;    //file size
     args->server_ip = strdup(server_ip);   // server IP
-    args->server_port = PORT;              // server port
+    args->server_port = port;              // server port
+    args->flags = compression;             // compression the client accepts
 
     // Checking if memory was allocated
     if (args == NULL) {
@@ -302,7 +2362,7 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // Thread function frees the arguments
     pthread_join(client_thread, NULL);
-    free(args);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+/*
+CRC32C (Castagnoli) checksum of the file data shared by the client and the server.
+The server sends the checksum of the body in the response header, the client computes the checksum
+of the received data on the fly and compares them, so damaged data is never kept silently.
+In the update request the client sends the checksum of its copy, the server compares it with its own file
+and answers STATUS_DIVERGED if the copy is not a prefix of the server copy.
+
+x86-64 processors with SSE4.2 compute CRC32C with the crc32 instruction, three independent streams at once
+to hide the latency of the instruction (several GB/s per core), other processors use the table version.
+Checksums of the neighbouring parts of the data are joined with crc32cCombine(), so the server keeps
+the checksum of every block of the file and computes the checksum of any range without reading it all.
+*/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82f63b78    // Castagnoli polynomial in the reflected bit order
+#define CRC32C_LANE_SIZE 8192           // Bytes of one of the three streams of the SSE4.2 version
+
+// Function multiplies two polynomials modulo the CRC polynomial, x^0 is the highest bit
+static inline uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t mask = 1u << 31; mask != 0; mask >>= 1) {
+        if (a & mask) {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+// Function returns the operator which moves the checksum over length bytes of zeros: x^(8 * length) modulo the polynomial
+static inline uint32_t crc32cShiftOperator(uint64_t length) {
+    uint32_t result = 1u << 31;     // x^0
+    uint32_t square = 1u << 23;     // x^8, squared for every bit of the length
+    while (length != 0) {
+        if (length & 1) {
+            result = crc32cMultiply(square, result);
+        }
+        square = crc32cMultiply(square, square);
+        length >>= 1;
+    }
+    return result;
+}
+
+// Function returns the checksum of A followed by B from the checksums of A and B and the length of B
+// The operator comes from crc32cShiftOperator(length of B), so it is computed once for the blocks of the same size
+static inline uint32_t crc32cCombineWith(uint32_t crc_a, uint32_t crc_b, uint32_t shift) {
+    return crc32cMultiply(shift, crc_a) ^ crc_b;
+}
+
+static inline uint32_t crc32cCombine(uint32_t crc_a, uint32_t crc_b, uint64_t length_b) {
+    return crc32cCombineWith(crc_a, crc_b, crc32cShiftOperator(length_b));
+}
+
+// Function continues the checksum state (not inverted) over the data with the tables, 8 bytes per step
+static inline uint32_t crc32cSoftware(uint32_t state, const unsigned char *data, size_t size) {
+    static uint32_t table[8][256];
+    static int table_ready = 0;
+    if (!__atomic_load_n(&table_ready, __ATOMIC_ACQUIRE)) {
+        // Every thread which comes first computes the same values, so the race is harmless
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = value & 1 ? (value >> 1) ^ CRC32C_POLYNOMIAL : value >> 1;
+            }
+            table[0][i] = value;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+            }
+        }
+        __atomic_store_n(&table_ready, 1, __ATOMIC_RELEASE);
+    }
+
+    while (size >= 8) {
+        uint32_t low = state ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        state = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+                table[3][data[4]] ^ table[2][data[5]] ^ table[1][data[6]] ^ table[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        state = (state >> 8) ^ table[0][(state ^ *data++) & 0xff];
+    }
+    return state;
+}
+
+#if defined(__x86_64__)
+// Function continues the checksum state with the crc32 instruction
+// Big buffers are split into three lanes which are computed together and joined with the shift operators
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32cHardware(uint32_t state, const unsigned char *data, size_t size) {
+    uint64_t state_a = state;
+    if (size >= 3 * CRC32C_LANE_SIZE) {
+        uint32_t shift_one = crc32cShiftOperator(CRC32C_LANE_SIZE);
+        uint32_t shift_two = crc32cShiftOperator(2 * CRC32C_LANE_SIZE);
+        while (size >= 3 * CRC32C_LANE_SIZE) {
+            uint64_t state_b = 0, state_c = 0;
+            for (size_t i = 0; i < CRC32C_LANE_SIZE; i += 8) {
+                uint64_t a, b, c;
+                memcpy(&a, data + i, 8);
+                memcpy(&b, data + CRC32C_LANE_SIZE + i, 8);
+                memcpy(&c, data + 2 * CRC32C_LANE_SIZE + i, 8);
+                state_a = _mm_crc32_u64(state_a, a);
+                state_b = _mm_crc32_u64(state_b, b);
+                state_c = _mm_crc32_u64(state_c, c);
+            }
+            state_a = crc32cMultiply(shift_two, (uint32_t)state_a) ^ crc32cMultiply(shift_one, (uint32_t)state_b) ^
+                      (uint32_t)state_c;
+            data += 3 * CRC32C_LANE_SIZE;
+            size -= 3 * CRC32C_LANE_SIZE;
+        }
+    }
+    while (size >= 8) {
+        uint64_t value;
+        memcpy(&value, data, 8);
+        state_a = _mm_crc32_u64(state_a, value);
+        data += 8;
+        size -= 8;
+    }
+    uint32_t result = (uint32_t)state_a;
+    while (size-- > 0) {
+        result = _mm_crc32_u8(result, *data++);
+    }
+    return result;
+}
+#endif
+
+// Function continues the checksum over the data, the first call takes crc 0
+// crc32c(crc32c(0, A), B) is the checksum of A followed by B, so the data can be checksummed as it arrives
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+#if defined(__x86_64__)
+    static int hardware = -1;
+    int supported = __atomic_load_n(&hardware, __ATOMIC_RELAXED);
+    if (supported == -1) {
+        supported = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+        __atomic_store_n(&hardware, supported, __ATOMIC_RELAXED);
+    }
+    if (supported) {
+        return ~crc32cHardware(~crc, data, size);
+    }
+#endif
+    return ~crc32cSoftware(~crc, data, size);
+}
+
+#endif
@@ -0,0 +1,244 @@
+/*
+Compression of the response body shared by the client and the server.
+The client asks for the compressed body with FLAG_LZ4 or FLAG_DEFLATE in the download or update request,
+the server answers with the same flag if it compressed the body and without it if the file doesn't compress
+(the server samples the file first, media and archives are sent as they are).
+
+Compressed body is a sequence of chunks, every chunk is COMPRESS_CHUNK_SIZE bytes of the file or less for the last one:
+ raw_size     4 bytes   bytes of the file in this chunk
+ stored_size  4 bytes   bytes of the chunk data which follow
+ chunk data   stored_size bytes, the raw file data if stored_size == raw_size, compressed data otherwise
+The sum of raw_size of all chunks is the length from the response header.
+Every chunk is compressed on its own, so the receiver can decompress the chunks while the next ones arrive.
+
+LZ4 - block format of LZ4 (sequences of literals and matches), fast enough to compress at the speed of the network.
+DEFLATE - zlib stream per chunk, slower but compresses text better.
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <zlib.h>
+
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ4 1
+#define COMPRESS_DEFLATE 2
+
+#define COMPRESS_CHUNK_SIZE (64 * 1024)     // Bytes of the file compressed together
+#define COMPRESS_CHUNK_HEADER_SIZE 8
+#define COMPRESS_BUFFER_SIZE (COMPRESS_CHUNK_SIZE + COMPRESS_CHUNK_SIZE / 2)   // Enough for any compressed chunk we keep
+
+#define LZ4_HASH_BITS 12            // Positions remembered by the LZ4 compressor, 2^12 entries
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_LAST_LITERALS 5         // Format rule: the last 5 bytes of the block are always literals
+#define LZ4_MATCH_LIMIT 12          // Format rule: the last match starts at least 12 bytes before the end of the block
+
+// Function reads 4 bytes in the host order for the comparison of the sequences
+static inline uint32_t lz4Read32(const unsigned char *data) {
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return value;
+}
+
+// Function writes the length above 15 as the sequence of bytes: 255 while more is left, then the rest
+static inline unsigned char *lz4PutLength(unsigned char *out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// Function compresses the block into the LZ4 block format
+// Returns the compressed size, 0 if the result doesn't fit into capacity (the data doesn't compress)
+static inline size_t lz4Compress(const unsigned char *source, size_t size, unsigned char *destination, size_t capacity) {
+    uint32_t table[1 << LZ4_HASH_BITS];     // Last position of every hashed 4 byte sequence
+    memset(table, 0, sizeof(table));
+    unsigned char *out = destination;
+    unsigned char *out_end = destination + capacity;
+    size_t anchor = 0;      // Start of the literals not written yet
+
+    if (size > LZ4_MATCH_LIMIT) {
+        size_t match_limit = size - LZ4_MATCH_LIMIT;
+        size_t end_limit = size - LZ4_LAST_LITERALS;
+        size_t position = 1;    // Empty table entries point to position 0
+        while (position < match_limit) {
+            uint32_t sequence = lz4Read32(source + position);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            size_t candidate = table[hash];
+            table[hash] = position;
+            if (position - candidate > LZ4_MAX_OFFSET || lz4Read32(source + candidate) != sequence) {
+                // The longer we find nothing, the bigger the steps: incompressible data is skipped quickly
+                position += 1 + ((position - anchor) >> 6);
+                continue;
+            }
+
+            // Extending the match backwards over the literals and forwards up to the last literals
+            while (position > anchor && candidate > 0 && source[position - 1] == source[candidate - 1]) {
+                position--;
+                candidate--;
+            }
+            size_t match_length = LZ4_MIN_MATCH;
+            while (position + match_length < end_limit && source[position + match_length] == source[candidate + match_length]) {
+                match_length++;
+            }
+
+            // Sequence: token, literal length, literals, offset, match length
+            size_t literals = position - anchor;
+            if ((size_t)(out_end - out) < 1 + literals / 255 + 1 + literals + 2 + match_length / 255 + 1) {
+                return 0;
+            }
+            unsigned char *token = out++;
+            *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+            if (literals >= 15) {
+                out = lz4PutLength(out, literals - 15);
+            }
+            memcpy(out, source + anchor, literals);
+            out += literals;
+            size_t offset = position - candidate;
+            *out++ = (unsigned char)(offset & 0xff);
+            *out++ = (unsigned char)(offset >> 8);
+            size_t extra = match_length - LZ4_MIN_MATCH;
+            *token |= (unsigned char)(extra < 15 ? extra : 15);
+            if (extra >= 15) {
+                out = lz4PutLength(out, extra - 15);
+            }
+
+            position += match_length;
+            anchor = position;
+        }
+    }
+
+    // Last sequence has only literals
+    size_t literals = size - anchor;
+    if ((size_t)(out_end - out) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    *out++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        out = lz4PutLength(out, literals - 15);
+    }
+    memcpy(out, source + anchor, literals);
+    out += literals;
+    return out - destination;
+}
+
+// Function reads the length above 15 written by lz4PutLength(), returns -1 if the block ends in the middle
+static inline int lz4GetLength(const unsigned char **in, const unsigned char *in_end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*in >= in_end) {
+            return -1;
+        }
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Function decompresses the LZ4 block, returns the decompressed size or -1 if the block is damaged
+// Every length and offset is checked, so a damaged block never reads or writes outside the buffers
+static inline long lz4Decompress(const unsigned char *source, size_t size, unsigned char *destination, size_t capacity) {
+    const unsigned char *in = source;
+    const unsigned char *in_end = source + size;
+    size_t out = 0;
+
+    while (in < in_end) {
+        unsigned token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && lz4GetLength(&in, in_end, &literals) == -1) {
+            return -1;
+        }
+        if (literals > (size_t)(in_end - in) || literals > capacity - out) {
+            return -1;
+        }
+        memcpy(destination + out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == in_end) {
+            break;      // Last sequence has no match
+        }
+
+        if (in_end - in < 2) {
+            return -1;
+        }
+        size_t offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && lz4GetLength(&in, in_end, &match_length) == -1) {
+            return -1;
+        }
+        match_length += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > out || match_length > capacity - out) {
+            return -1;
+        }
+        unsigned char *match = destination + out - offset;
+        if (offset >= match_length) {
+            memcpy(destination + out, match, match_length);
+        } else {
+            // Overlapping match repeats the last offset bytes
+            for (size_t i = 0; i < match_length; i++) {
+                destination[out + i] = match[i];
+            }
+        }
+        out += match_length;
+    }
+    return (long)out;
+}
+
+// Function compresses one chunk with the method, returns the compressed size
+// Returns 0 if the compressed chunk would not be smaller than the raw chunk, the chunk is sent raw then
+static inline size_t compressChunk(int method, const unsigned char *source, size_t size, unsigned char *destination,
+                                   size_t capacity) {
+    if (size <= 1) {
+        return 0;
+    }
+    if (capacity > size - 1) {
+        capacity = size - 1;    // Compressed chunk has to be smaller than the raw one, otherwise it is useless
+    }
+    if (method == COMPRESS_LZ4) {
+        return lz4Compress(source, size, destination, capacity);
+    }
+    uLongf compressed_size = capacity;
+    if (compress2(destination, &compressed_size, source, size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return 0;
+    }
+    return compressed_size;
+}
+
+// Function decompresses one chunk into the buffer of exactly raw_size bytes, returns -1 if the chunk is damaged
+static inline int decompressChunk(int method, const unsigned char *source, size_t size, unsigned char *destination,
+                                  size_t raw_size) {
+    if (method == COMPRESS_LZ4) {
+        return lz4Decompress(source, size, destination, raw_size) == (long)raw_size ? 0 : -1;
+    }
+    uLongf decompressed_size = raw_size;
+    if (uncompress(destination, &decompressed_size, source, size) != Z_OK || decompressed_size != raw_size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function writes the chunk header into the buffer of COMPRESS_CHUNK_HEADER_SIZE bytes in network byte order
+static inline void encodeChunkHeader(unsigned char *buffer, uint32_t raw_size, uint32_t stored_size) {
+    uint32_t raw = htobe32(raw_size);
+    uint32_t stored = htobe32(stored_size);
+    memcpy(buffer, &raw, 4);
+    memcpy(buffer + 4, &stored, 4);
+}
+
+// Function reads the chunk header
+static inline void decodeChunkHeader(const unsigned char *buffer, uint32_t *raw_size, uint32_t *stored_size) {
+    uint32_t raw, stored;
+    memcpy(&raw, buffer, 4);
+    memcpy(&stored, buffer + 4, 4);
+    *raw_size = be32toh(raw);
+    *stored_size = be32toh(stored);
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+Delta synchronization shared by the client and the server (rsync algorithm).
+Client splits its copy of the file into blocks of block_size bytes and sends the signature of every block:
+weak rolling checksum and strong hash. The last block may be shorter (tail_size bytes), it can match only at the end
+of the file. Server slides a window over its copy of the file, rolling the weak checksum one byte at a time,
+and when the weak checksum and then the strong hash match a client block, it sends the reference to the block
+instead of the data. Everything between the matched blocks is sent as literal data.
+
+OP_DELTA request payload:
+ signature header (DELTA_SIGNATURE_HEADER_SIZE bytes): block_size 4 bytes, block_count 4 bytes, tail_size 4 bytes, name_size 2 bytes
+ file name (name_size bytes)
+ block_count entries of DELTA_BLOCK_SIGNATURE_SIZE bytes: weak checksum 4 bytes, strong hash 8 bytes
+OP_DELTA response body is a sequence of instructions to build the server copy:
+ DELTA_COPY, first block 4 bytes, block count 4 bytes - copy the blocks of the client copy (the last block may be short)
+ DELTA_LITERAL, length 4 bytes, length bytes of data - data the client doesn't have
+With FLAG_CHECKSUM the response header carries the CRC32C of the whole server copy, not of the instructions,
+so the client checks the file it built before it replaces the local copy.
+*/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define DELTA_SIGNATURE_HEADER_SIZE 14
+#define DELTA_BLOCK_SIGNATURE_SIZE 12
+#define DELTA_MIN_BLOCK_SIZE 1024
+#define DELTA_MAX_BLOCK_SIZE (128 * 1024)
+#define DELTA_MAX_SIGNATURE_SIZE (16 * 1024 * 1024)    // Biggest signature the server accepts
+
+// Delta instructions
+#define DELTA_COPY 1
+#define DELTA_LITERAL 2
+#define DELTA_COPY_SIZE 9
+#define DELTA_LITERAL_HEADER_SIZE 5
+
+// Function picks the block size for the file: about square root of the file size, like rsync does
+static inline uint32_t deltaBlockSize(uint64_t file_size) {
+    uint32_t block_size = DELTA_MIN_BLOCK_SIZE;
+    while ((uint64_t)block_size * block_size < file_size && block_size < DELTA_MAX_BLOCK_SIZE) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+// Function calculates the rolling checksum of the block: a is the sum of bytes, b is the sum of a for every prefix
+static inline uint32_t rollingChecksum(const unsigned char *data, size_t size) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < size; i++) {
+        a += data[i];
+        b += (uint32_t)(size - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Function moves the window of size bytes one byte forward: removes byte_out from the start and adds byte_in at the end
+static inline uint32_t rollChecksum(uint32_t checksum, size_t size, unsigned char byte_out, unsigned char byte_in) {
+    uint32_t a = checksum & 0xffff;
+    uint32_t b = checksum >> 16;
+    a = (a - byte_out + byte_in) & 0xffff;
+    b = (b - (uint32_t)size * byte_out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME64_3 0x165667B19E3779F9ULL
+#define HASH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t hashRotate(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t hashRound(uint64_t accumulator, uint64_t input) {
+    accumulator += input * HASH_PRIME64_2;
+    accumulator = hashRotate(accumulator, 31);
+    return accumulator * HASH_PRIME64_1;
+}
+
+static inline uint64_t hashMergeRound(uint64_t accumulator, uint64_t value) {
+    accumulator ^= hashRound(0, value);
+    return accumulator * HASH_PRIME64_1 + HASH_PRIME64_4;
+}
+
+static inline uint64_t hashRead64(const unsigned char *data) {
+    uint64_t value;
+    memcpy(&value, data, 8);
+    return le64toh(value);
+}
+
+static inline uint32_t hashRead32(const unsigned char *data) {
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return le32toh(value);
+}
+
+// Function calculates the strong 64-bit hash of the data (XXH64 algorithm)
+static inline uint64_t strongHash(const unsigned char *data, size_t size, uint64_t seed) {
+    const unsigned char *end = data + size;
+    uint64_t hash;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + HASH_PRIME64_1 + HASH_PRIME64_2;
+        uint64_t v2 = seed + HASH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_PRIME64_1;
+        while (end - data >= 32) {
+            v1 = hashRound(v1, hashRead64(data));
+            v2 = hashRound(v2, hashRead64(data + 8));
+            v3 = hashRound(v3, hashRead64(data + 16));
+            v4 = hashRound(v4, hashRead64(data + 24));
+            data += 32;
+        }
+        hash = hashRotate(v1, 1) + hashRotate(v2, 7) + hashRotate(v3, 12) + hashRotate(v4, 18);
+        hash = hashMergeRound(hash, v1);
+        hash = hashMergeRound(hash, v2);
+        hash = hashMergeRound(hash, v3);
+        hash = hashMergeRound(hash, v4);
+    } else {
+        hash = seed + HASH_PRIME64_5;
+    }
+    hash += size;
+
+    while (end - data >= 8) {
+        hash ^= hashRound(0, hashRead64(data));
+        hash = hashRotate(hash, 27) * HASH_PRIME64_1 + HASH_PRIME64_4;
+        data += 8;
+    }
+    if (end - data >= 4) {
+        hash ^= (uint64_t)hashRead32(data) * HASH_PRIME64_1;
+        hash = hashRotate(hash, 23) * HASH_PRIME64_2 + HASH_PRIME64_3;
+        data += 4;
+    }
+    while (data < end) {
+        hash ^= (*data) * HASH_PRIME64_5;
+        hash = hashRotate(hash, 11) * HASH_PRIME64_1;
+        data++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Functions to write and read the numbers of the delta messages in network byte order
+static inline void deltaPut32(unsigned char *buffer, uint32_t value) {
+    value = htobe32(value);
+    memcpy(buffer, &value, 4);
+}
+
+static inline void deltaPut64(unsigned char *buffer, uint64_t value) {
+    value = htobe64(value);
+    memcpy(buffer, &value, 8);
+}
+
+static inline uint32_t deltaGet32(const unsigned char *buffer) {
+    uint32_t value;
+    memcpy(&value, buffer, 4);
+    return be32toh(value);
+}
+
+static inline uint64_t deltaGet64(const unsigned char *buffer) {
+    uint64_t value;
+    memcpy(&value, buffer, 8);
+    return be64toh(value);
+}
+
+#endif
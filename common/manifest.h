@@ -0,0 +1,94 @@
+/*
+Directory manifest shared by the client and the server.
+OP_MANIFEST request names a directory of the server, the response body lists every regular file under it
+(subdirectories included, symbolic links skipped), one entry per file:
+ path_size    2 bytes   length of the path
+ size         8 bytes   size of the file
+ mtime_ns     8 bytes   last modification time in nanoseconds
+ hash         4 bytes   CRC32C of the whole file (common/checksum.h)
+ path         path_size bytes, relative to the requested directory, '/' between the parts
+              (never absolute, no empty and no ".." parts, so the path can't leave the directory)
+All numbers are in big-endian (network) byte order.
+Client compares the entries with its own tree: files with the same size and modification time are skipped
+without reading them, files with the same size and another time are compared by the hash,
+and only the missing and changed files are requested.
+*/
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define MANIFEST_ENTRY_HEADER_SIZE 22
+#define MANIFEST_MAX_PATH 1000      // Longer paths are not listed, the request with the directory name must fit into 1 KB
+
+// Manifest entry in host byte order
+typedef struct {
+    char path[MANIFEST_MAX_PATH + 1];
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t hash;
+} ManifestEntry;
+
+// Function checks that the manifest path stays under the directory: it is not absolute and has no empty
+// or ".." parts, returns 1 if the path is safe
+static inline int manifestPathSafe(const char *path) {
+    if (path[0] == '\0' || path[0] == '/') {
+        return 0;
+    }
+    for (const char *part = path; ; ) {
+        const char *end = strchr(part, '/');
+        size_t length = end == NULL ? strlen(part) : (size_t)(end - part);
+        if (length == 0 || (length == 2 && part[0] == '.' && part[1] == '.')) {
+            return 0;
+        }
+        if (end == NULL) {
+            return 1;
+        }
+        part = end + 1;
+    }
+}
+
+// Function writes the fixed part of the entry into buffer of MANIFEST_ENTRY_HEADER_SIZE bytes, the path goes after it
+static inline void encodeManifestEntry(const ManifestEntry *entry, size_t path_size, unsigned char *buffer) {
+    uint16_t path_size_be = htobe16((uint16_t)path_size);
+    uint64_t size = htobe64(entry->size);
+    uint64_t mtime_ns = htobe64(entry->mtime_ns);
+    uint32_t hash = htobe32(entry->hash);
+    memcpy(buffer, &path_size_be, 2);
+    memcpy(buffer + 2, &size, 8);
+    memcpy(buffer + 10, &mtime_ns, 8);
+    memcpy(buffer + 18, &hash, 4);
+}
+
+// Function reads the entry from the manifest, returns its size in bytes or 0 if the manifest is damaged
+// The path of the entry is left empty if it is not safe (manifestPathSafe), the caller skips such an entry
+static inline size_t decodeManifestEntry(const unsigned char *buffer, size_t available, ManifestEntry *entry) {
+    uint16_t path_size;
+    uint64_t size, mtime_ns;
+    uint32_t hash;
+    if (available < MANIFEST_ENTRY_HEADER_SIZE) {
+        return 0;
+    }
+    memcpy(&path_size, buffer, 2);
+    memcpy(&size, buffer + 2, 8);
+    memcpy(&mtime_ns, buffer + 10, 8);
+    memcpy(&hash, buffer + 18, 4);
+    path_size = be16toh(path_size);
+    if (path_size == 0 || path_size > MANIFEST_MAX_PATH || available - MANIFEST_ENTRY_HEADER_SIZE < path_size) {
+        return 0;
+    }
+    entry->size = be64toh(size);
+    entry->mtime_ns = be64toh(mtime_ns);
+    entry->hash = be32toh(hash);
+    memcpy(entry->path, buffer + MANIFEST_ENTRY_HEADER_SIZE, path_size);
+    entry->path[path_size] = '\0';
+    if (memchr(entry->path, '\0', path_size) != NULL || !manifestPathSafe(entry->path)) {
+        entry->path[0] = '\0';
+    }
+    return MANIFEST_ENTRY_HEADER_SIZE + path_size;
+}
+
+#endif
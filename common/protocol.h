@@ -0,0 +1,192 @@
+/*
+Binary protocol shared by the client and the server.
+Every message is a frame: fixed size header, then payload_size bytes of payload,
+then, if FLAG_BODY is set, length bytes of file data.
+All numbers are sent in big-endian (network) byte order.
+
+Header layout (FRAME_HEADER_SIZE bytes):
+ 0  magic        2 bytes   PROTOCOL_MAGIC, anything else is not our protocol
+ 2  version      1 byte    protocol version of the sender
+ 3  opcode       1 byte    OP_* request type, responses repeat the opcode of the request
+ 4  status       1 byte    STATUS_* in responses, 0 in requests
+ 5  flags        1 byte    FLAG_* bits
+ 6  header_size  2 bytes   size of the header, newer versions may append fields, receivers skip the bytes they don't know
+ 8  request_id   4 bytes   chosen by the client, the response carries the same id
+12  payload_size 4 bytes   bytes of payload after the header (file name or signature in requests, FileInfo in responses)
+16  offset       8 bytes   position in the file the frame refers to
+24  length       8 bytes   number of bytes of the file the frame refers to
+Optional field, present if header_size is at least FRAME_CHECKSUM_HEADER_SIZE:
+32  checksum     4 bytes   CRC32C (common/checksum.h): in responses of the body (of the whole rebuilt file for OP_DELTA),
+                         in update and subscribe requests of the client copy
+
+Compatibility rules:
+- fields are never moved or reused, new fields go after the end of the header and header_size grows
+- receiver answers STATUS_UNSUPPORTED to an opcode it doesn't know and keeps the connection
+- flags which the receiver doesn't know are ignored, so a new flag must be safe to ignore
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define PROTOCOL_MAGIC 0x4353       // "CS"
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_SIZE 32
+#define FRAME_CHECKSUM_HEADER_SIZE 36   // Header with the checksum field, the biggest header we send
+
+// Request types
+#define OP_DOWNLOAD 1       // Send length bytes of the file from offset, length 0 - up to the end of the file
+#define OP_UPDATE 2         // Client has offset bytes of the file, send the rest if the file is bigger
+#define OP_DELTA 3          // Client sends signature of its copy, server sends instructions to build its copy (common/delta.h)
+#define OP_STAT 4           // Send only FileInfo of the file (and the checksum of the whole file), used to plan ranged downloads
+#define OP_STATS 5          // Send the server metrics as text in the body, no file name in the request
+#define OP_SUBSCRIBE 6      // Like OP_UPDATE, then the server pushes every append of the file as another response
+                            // with the same request_id until the file is truncated, removed or the connection is closed
+#define OP_MANIFEST 7       // File name is a directory, send the list of the files under it (common/manifest.h) as the body
+#define OP_LIMITS 8         // Set the rate limits in bytes per second: offset - all clients, length - every client, 0 - no limit
+
+// Response status
+#define STATUS_OK 0             // Request succeeded, FileInfo payload and maybe the body follow
+#define STATUS_NOT_FOUND 1      // File doesn't exist on the server
+#define STATUS_NO_UPDATE 2      // Client copy has the same size as the server copy
+#define STATUS_DIVERGED 3       // Client copy is bigger than the server copy or its checksum differs, it can't be updated by appending
+#define STATUS_BAD_REQUEST 4    // Request is malformed or the range is outside the file
+#define STATUS_UNSUPPORTED 5    // Server doesn't know the opcode
+#define STATUS_ERROR 6          // Server failed to process the request
+#define STATUS_BUSY 7           // Server has too many requests of this kind in progress, the client may try again later
+
+// Flags
+#define FLAG_BODY 0x01          // length bytes of file data follow the payload
+#define FLAG_LZ4 0x02           // Request: client accepts the body compressed with LZ4, response: the body is compressed (common/compress.h)
+#define FLAG_DEFLATE 0x04       // Same with deflate, the server uses LZ4 if the client accepts both
+#define FLAG_CHECKSUM 0x08      // Request: client wants the checksum of the body, response: the header has the checksum field
+
+// Frame header in host byte order
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t status;
+    uint8_t flags;
+    uint16_t header_size;
+    uint32_t request_id;
+    uint32_t payload_size;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t checksum;          // Sent only if header_size is FRAME_CHECKSUM_HEADER_SIZE
+} FrameHeader;
+
+// Payload of the successful response: what the server knows about the whole file
+typedef struct {
+    uint64_t file_size;         // Size of the file on the server
+    uint64_t mtime_ns;          // Last modification time of the file in nanoseconds
+} FileInfo;
+
+#define FILE_INFO_SIZE 16
+
+// Function writes the header into the buffer in network byte order, returns the size of the header
+// The checksum field is written only if header_size is FRAME_CHECKSUM_HEADER_SIZE, otherwise the header is FRAME_HEADER_SIZE bytes
+static inline size_t encodeFrameHeader(const FrameHeader *header, unsigned char *buffer) {
+    size_t size = header->header_size == FRAME_CHECKSUM_HEADER_SIZE ? FRAME_CHECKSUM_HEADER_SIZE : FRAME_HEADER_SIZE;
+    uint16_t magic = htobe16(PROTOCOL_MAGIC);
+    uint16_t header_size = htobe16(size);
+    uint32_t request_id = htobe32(header->request_id);
+    uint32_t payload_size = htobe32(header->payload_size);
+    uint64_t offset = htobe64(header->offset);
+    uint64_t length = htobe64(header->length);
+
+    memcpy(buffer, &magic, 2);
+    buffer[2] = PROTOCOL_VERSION;
+    buffer[3] = header->opcode;
+    buffer[4] = header->status;
+    buffer[5] = header->flags;
+    memcpy(buffer + 6, &header_size, 2);
+    memcpy(buffer + 8, &request_id, 4);
+    memcpy(buffer + 12, &payload_size, 4);
+    memcpy(buffer + 16, &offset, 8);
+    memcpy(buffer + 24, &length, 8);
+    if (size == FRAME_CHECKSUM_HEADER_SIZE) {
+        uint32_t checksum = htobe32(header->checksum);
+        memcpy(buffer + 32, &checksum, 4);
+    }
+    return size;
+}
+
+// Function reads the header from the buffer of FRAME_HEADER_SIZE bytes, the optional fields are read by decodeFrameChecksum()
+// Returns -1 if the buffer doesn't contain a frame of our protocol
+static inline int decodeFrameHeader(const unsigned char *buffer, FrameHeader *header) {
+    uint16_t magic, header_size;
+    uint32_t request_id, payload_size;
+    uint64_t offset, length;
+
+    memcpy(&magic, buffer, 2);
+    memcpy(&header_size, buffer + 6, 2);
+    memcpy(&request_id, buffer + 8, 4);
+    memcpy(&payload_size, buffer + 12, 4);
+    memcpy(&offset, buffer + 16, 8);
+    memcpy(&length, buffer + 24, 8);
+
+    header->version = buffer[2];
+    header->opcode = buffer[3];
+    header->status = buffer[4];
+    header->flags = buffer[5];
+    header->header_size = be16toh(header_size);
+    header->request_id = be32toh(request_id);
+    header->payload_size = be32toh(payload_size);
+    header->offset = be64toh(offset);
+    header->length = be64toh(length);
+    header->checksum = 0;
+
+    if (be16toh(magic) != PROTOCOL_MAGIC || header->version == 0 || header->header_size < FRAME_HEADER_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function reads the checksum field, buffer starts at the header and has at least header_size bytes
+// Returns 0 if the sender's header has no checksum field
+static inline int decodeFrameChecksum(const unsigned char *buffer, FrameHeader *header) {
+    if (header->header_size < FRAME_CHECKSUM_HEADER_SIZE) {
+        return 0;
+    }
+    uint32_t checksum;
+    memcpy(&checksum, buffer + 32, 4);
+    header->checksum = be32toh(checksum);
+    return 1;
+}
+
+// Function writes FileInfo into the buffer of FILE_INFO_SIZE bytes
+static inline void encodeFileInfo(const FileInfo *info, unsigned char *buffer) {
+    uint64_t file_size = htobe64(info->file_size);
+    uint64_t mtime_ns = htobe64(info->mtime_ns);
+    memcpy(buffer, &file_size, 8);
+    memcpy(buffer + 8, &mtime_ns, 8);
+}
+
+// Function reads FileInfo from the buffer of FILE_INFO_SIZE bytes
+static inline void decodeFileInfo(const unsigned char *buffer, FileInfo *info) {
+    uint64_t file_size, mtime_ns;
+    memcpy(&file_size, buffer, 8);
+    memcpy(&mtime_ns, buffer + 8, 8);
+    info->file_size = be64toh(file_size);
+    info->mtime_ns = be64toh(mtime_ns);
+}
+
+// Function returns the text description of the response status
+static inline const char *statusMessage(uint8_t status) {
+    switch (status) {
+        case STATUS_OK: return "OK";
+        case STATUS_NOT_FOUND: return "File not found";
+        case STATUS_NO_UPDATE: return "No update";
+        case STATUS_DIVERGED: return "Client copy is not a prefix of the server copy";
+        case STATUS_BAD_REQUEST: return "Bad request";
+        case STATUS_UNSUPPORTED: return "Request type is not supported by the server";
+        case STATUS_ERROR: return "Server error";
+        case STATUS_BUSY: return "Server is busy, try again later";
+        default: return "Unknown status";
+    }
+}
+
+#endif
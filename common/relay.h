@@ -0,0 +1,289 @@
+/*
+Delay relay and helpers shared by the test programs: the bench (bench_app) and the proxy (proxy_app).
+The relay moves the data of one direction of a TCP connection through a queue where every chunk waits for its time,
+the order of the stream is kept. Each program sets the time of the chunk: the bench adds a fixed delay, the proxy
+adds the latency, the jitter and the bandwidth cap and also cuts the writes and resets the connections with the hooks
+of the direction. Reading goes on while the chunks wait, up to max_queued bytes, so the data in flight is not limited
+by the relay.
+The helpers start the server under test, wait until it accepts connections and read the sizes of the command line.
+*/
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RELAY_CHUNK_SIZE (64 * 1024)    // Bytes the relay reads at once
+#define RELAY_MAX_QUEUED (64 * 1024 * 1024)     // Relay stops reading from the socket which has this many bytes waiting
+#define RELAY_MAX_ARGUMENTS 64          // Arguments of the started server, with its path and the port
+#define RELAY_ARGS_SIZE 1024            // Longest text of the extra arguments of the server
+
+// Data read by the relay and waiting for its time
+typedef struct RelayChunk {
+    struct RelayChunk *next;
+    uint64_t due_us;            // Time the chunk may be written to the other side
+    size_t length;
+    size_t written;
+    unsigned char data[];
+} RelayChunk;
+
+// One direction of the relayed connection, the hooks which are NULL keep the plain delay
+typedef struct RelayDirection {
+    int from_fd;
+    int to_fd;
+    size_t chunk_size;          // Bytes read at once
+    size_t max_queued;          // Reading stops while this many bytes wait
+    int check_ms;               // Longest wait before stopped() is asked again, -1 - no limit
+    uint64_t delay_us;          // One way delay of every chunk if chunk_due is NULL
+    uint64_t (*chunk_due)(struct RelayDirection *direction, size_t length);     // Time the chunk just read may be written
+    size_t (*write_size)(struct RelayDirection *direction, size_t length);      // Bytes of the next write, 0 - direction stops
+    void (*sent)(struct RelayDirection *direction, size_t length);              // Bytes written to the other side
+    int (*stopped)(struct RelayDirection *direction);   // Direction stops at once and doesn't close the writing side
+    void (*done)(struct RelayDirection *direction);     // Direction is over, called once from its thread
+    void *context;              // Connection of the program
+} RelayDirection;
+
+// Function reads the size with the optional K, M or G suffix, the size may be followed by the separator
+// Separator 0 - only the end of the text, returns -1 if the text is not a size
+static inline int parseSize(const char *text, double *size, char separator) {
+    char *end;
+    *size = strtod(text, &end);
+    if (end == text || *size < 0) {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        *size *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        *size *= 1024 * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        *size *= 1024.0 * 1024 * 1024;
+        end++;
+    }
+    return *end == '\0' || (separator != '\0' && *end == separator) ? 0 : -1;
+}
+
+// Function returns the next number of the xorshift64* generator
+static inline uint64_t nextRandom(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+// Function returns the random number in [0, 1)
+static inline double randomUnit(uint64_t *state) {
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Function returns the monotonic time in microseconds
+static inline uint64_t nowMicroseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function connects to the port of the host, returns -1 on error
+static inline int connectToPort(const char *host, int port) {
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        return -1;
+    }
+    struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_address.sin_addr) <= 0 ||
+        connect(socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) == -1) {
+        close(socket_fd);
+        return -1;
+    }
+    // Small requests and cut writes go out at once, they shouldn't wait for the acknowledgement of the previous data
+    int nodelay = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return socket_fd;
+}
+
+// Function starts the server in the directory on the port with the extra arguments split by spaces (may be NULL)
+// Output of the server goes to /dev/null, returns its pid or -1 on error
+static inline pid_t startServer(const char *path, const char *directory, int port, const char *extra_args) {
+    pid_t server_pid = fork();
+    if (server_pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (server_pid > 0) {
+        return server_pid;
+    }
+
+    // Child: server binary path is relative to the directory of the program, resolving it before changing the directory
+    char server_path[4096];
+    if (realpath(path, server_path) == NULL) {
+        perror(path);
+        _exit(127);
+    }
+    if (chdir(directory) == -1) {
+        perror(directory);
+        _exit(127);
+    }
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd != -1) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    char *arguments[RELAY_MAX_ARGUMENTS];
+    char port_text[16];
+    char extra[RELAY_ARGS_SIZE];
+    int count = 0;
+    arguments[count++] = server_path;
+    arguments[count++] = "-p";
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    arguments[count++] = port_text;
+    snprintf(extra, sizeof(extra), "%s", extra_args != NULL ? extra_args : "");
+    for (char *token = strtok(extra, " "); token != NULL && count < RELAY_MAX_ARGUMENTS - 1; token = strtok(NULL, " ")) {
+        arguments[count++] = token;
+    }
+    arguments[count] = NULL;
+    execv(server_path, arguments);
+    perror("Error starting server");
+    _exit(127);
+}
+
+// Function waits until the server accepts connections on the port, returns -1 if it exits or doesn't start in 5 seconds
+// Server pid 0 - the server was started by someone else, only the port is checked
+static inline int waitForServer(const char *host, int port, pid_t server_pid) {
+    for (int attempt = 0; attempt < 500; attempt++) {
+        if (server_pid > 0 && waitpid(server_pid, NULL, WNOHANG) == server_pid) {
+            fprintf(stderr, "Server exited on start\n");
+            return -1;
+        }
+        int socket_fd = connectToPort(host, port);
+        if (socket_fd != -1) {
+            close(socket_fd);
+            return 0;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "Server doesn't accept connections\n");
+    return -1;
+}
+
+// Thread function which moves the data of one direction of the relayed connection, every chunk after its time
+static inline void *relayDirection(void *arg) {
+    RelayDirection *direction = arg;
+    RelayChunk *head = NULL, *tail = NULL;
+    size_t queued = 0;
+    int source_open = 1;
+
+    while ((source_open || head != NULL) && (direction->stopped == NULL || !direction->stopped(direction))) {
+        uint64_t now_us = nowMicroseconds();
+        if (head != NULL && head->due_us <= now_us) {
+            size_t length = head->length - head->written;
+            if (direction->write_size != NULL && (length = direction->write_size(direction, length)) == 0) {
+                break;
+            }
+            ssize_t bytes_sent = send(direction->to_fd, head->data + head->written, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (bytes_sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                break;
+            }
+            if (bytes_sent > 0) {
+                if (direction->sent != NULL) {
+                    direction->sent(direction, bytes_sent);
+                }
+                head->written += bytes_sent;
+                if (head->written == head->length) {
+                    RelayChunk *done = head;
+                    head = head->next;
+                    tail = head == NULL ? NULL : tail;
+                    queued -= done->length;
+                    free(done);
+                }
+                continue;
+            }
+        }
+
+        // Waiting for the data to read, the socket to write or the time of the next chunk
+        struct pollfd fds[2];
+        int count = 0;
+        int read_index = -1;
+        if (source_open && queued < direction->max_queued) {
+            fds[count].fd = direction->from_fd;
+            fds[count].events = POLLIN;
+            read_index = count++;
+        }
+        int timeout_ms = direction->check_ms;
+        if (head != NULL && head->due_us <= now_us) {
+            fds[count].fd = direction->to_fd;
+            fds[count].events = POLLOUT;
+            count++;
+        } else if (head != NULL && (timeout_ms < 0 || head->due_us - now_us < (uint64_t)timeout_ms * 1000)) {
+            timeout_ms = (int)((head->due_us - now_us + 999) / 1000);
+        }
+        if (poll(fds, count, timeout_ms) == -1 && errno != EINTR) {
+            break;
+        }
+        if (read_index != -1 && (fds[read_index].revents & (POLLIN | POLLHUP | POLLERR))) {
+            RelayChunk *chunk = malloc(sizeof(RelayChunk) + direction->chunk_size);
+            ssize_t bytes_read = chunk == NULL ? -1 : recv(direction->from_fd, chunk->data, direction->chunk_size, 0);
+            if (bytes_read <= 0) {
+                free(chunk);
+                source_open = 0;
+                continue;
+            }
+            chunk->next = NULL;
+            chunk->due_us = direction->chunk_due != NULL ? direction->chunk_due(direction, bytes_read) :
+                            nowMicroseconds() + direction->delay_us;
+            chunk->length = bytes_read;
+            chunk->written = 0;
+            if (tail != NULL) {
+                tail->next = chunk;
+            } else {
+                head = chunk;
+            }
+            tail = chunk;
+            queued += bytes_read;
+        }
+    }
+
+    // Closing the writing side tells the other end that this direction is over, the stopped direction leaves it
+    if (direction->stopped == NULL || !direction->stopped(direction)) {
+        shutdown(direction->to_fd, SHUT_WR);
+    }
+    while (head != NULL) {
+        RelayChunk *next = head->next;
+        free(head);
+        head = next;
+    }
+    direction->done(direction);
+    return NULL;
+}
+
+// Function starts the thread of the direction, the direction which didn't start is over already
+static inline void relayStart(RelayDirection *direction) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, relayDirection, direction) != 0) {
+        shutdown(direction->to_fd, SHUT_WR);
+        direction->done(direction);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+#endif
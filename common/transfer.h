@@ -0,0 +1,122 @@
+/*
+Tuning of the large transfers shared by the client and the server.
+The side which moves the data counts the bytes of the transfer, and after every TRANSFER_TUNE_INTERVAL bytes
+it estimates the bandwidth-delay product of the path: the rate the application measured since the last tuning
+times the round trip time the kernel measured (TCP_INFO). The socket buffer (SO_SNDBUF of the sender, SO_RCVBUF
+of the receiver) is raised so it holds two BDPs of data. Setting the size turns the autotuning of the kernel off
+for the socket, so the buffer is set only when the autotuning left it smaller than needed and it is never lowered.
+The chunk moved by one read or splice of the sender follows the buffer: half of the socket buffer, 64 KB - 1 MB,
+so one call fills the free space of the socket without reading data which doesn't fit.
+*/
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#define TRANSFER_TUNE_INTERVAL (4 * 1024 * 1024)   // Bytes moved between two tunings
+#define TRANSFER_MIN_CHUNK (64 * 1024)
+#define TRANSFER_MAX_CHUNK (1024 * 1024)            // Also the default limit of the pipe size for splice()
+#define TRANSFER_MAX_BUFFER (64 * 1024 * 1024)      // Kernel limits the buffer further by net.core.wmem_max / rmem_max
+
+// Tuning state of one connection
+typedef struct {
+    uint64_t bytes;             // Bytes moved since the last tuning
+    uint64_t started_us;        // Time of the last tuning, 0 - not started
+    size_t chunk_size;          // Bytes to move with one call
+} TransferTuner;
+
+// Function returns the monotonic time in microseconds
+static inline uint64_t transferNowMicroseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function returns the chunk size for the socket buffer of the given size (as getsockopt() reports it)
+static inline size_t transferChunkSize(int buffer_size) {
+    size_t chunk_size = buffer_size > 0 ? (size_t)buffer_size / 2 : 0;
+    return chunk_size < TRANSFER_MIN_CHUNK ? TRANSFER_MIN_CHUNK :
+           chunk_size > TRANSFER_MAX_CHUNK ? TRANSFER_MAX_CHUNK : chunk_size;
+}
+
+// Function returns the biggest buffer setsockopt() can set without the privileges (as getsockopt() reports it)
+// Bigger value would be cut to this limit, which can be less than the buffer the autotuning already gave the socket
+// Threads which tune at the same time may all read the limit, they store the same value
+static inline uint64_t transferBufferLimit(int option) {
+    static _Atomic int64_t limits[2] = {-1, -1};
+    int index = option == SO_RCVBUF;
+    int64_t known = atomic_load_explicit(&limits[index], memory_order_relaxed);
+    if (known == -1) {
+        FILE *limit_file = fopen(index ? "/proc/sys/net/core/rmem_max" : "/proc/sys/net/core/wmem_max", "r");
+        long long limit = 0;
+        if (limit_file == NULL || fscanf(limit_file, "%lld", &limit) != 1) {
+            limit = 0;
+        }
+        if (limit_file != NULL) {
+            fclose(limit_file);
+        }
+        known = limit * 2;      // Kernel doubles the requested size for its bookkeeping
+        atomic_store_explicit(&limits[index], known, memory_order_relaxed);
+    }
+    return (uint64_t)known;
+}
+
+// Function prepares the tuning of the connection, option is SO_SNDBUF for the sender and SO_RCVBUF for the receiver
+static inline void transferTunerInit(TransferTuner *tuner, int socket_fd, int option) {
+    int buffer_size = 0;
+    socklen_t length = sizeof(buffer_size);
+    getsockopt(socket_fd, SOL_SOCKET, option, &buffer_size, &length);
+    tuner->bytes = 0;
+    tuner->started_us = 0;
+    tuner->chunk_size = transferChunkSize(buffer_size);
+}
+
+// Function counts the bytes moved through the socket and tunes the socket buffer and the chunk size
+// after every TRANSFER_TUNE_INTERVAL bytes
+static inline void transferTune(TransferTuner *tuner, int socket_fd, int option, uint64_t bytes) {
+    uint64_t now_us;
+    if (tuner->started_us == 0) {
+        tuner->started_us = transferNowMicroseconds();  // Rate is measured from the first bytes of the transfer
+    }
+    tuner->bytes += bytes;
+    if (tuner->bytes < TRANSFER_TUNE_INTERVAL || (now_us = transferNowMicroseconds()) == tuner->started_us) {
+        return;
+    }
+
+    struct tcp_info info;
+    socklen_t info_length = sizeof(info);
+    int buffer_size = 0;
+    socklen_t length = sizeof(buffer_size);
+    if (getsockopt(socket_fd, IPPROTO_TCP, TCP_INFO, &info, &info_length) == 0 &&
+        getsockopt(socket_fd, SOL_SOCKET, option, &buffer_size, &length) == 0) {
+        // Receiver knows the round trip time from the data it receives, the sender from the acknowledgements
+        uint64_t rtt_us = option == SO_RCVBUF && info.tcpi_rcv_rtt != 0 ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+        uint64_t bdp = tuner->bytes * rtt_us / (now_us - tuner->started_us);
+        uint64_t wanted = 4 * bdp;      // Two BDPs of data, the kernel reports the size doubled
+        uint64_t limit = transferBufferLimit(option);
+        if (wanted > TRANSFER_MAX_BUFFER) {
+            wanted = TRANSFER_MAX_BUFFER;
+        }
+        if (wanted > limit) {
+            wanted = limit;
+        }
+        if (wanted > (uint64_t)buffer_size) {
+            int requested = (int)(wanted / 2);
+            setsockopt(socket_fd, SOL_SOCKET, option, &requested, sizeof(requested));
+            getsockopt(socket_fd, SOL_SOCKET, option, &buffer_size, &length);
+        }
+        tuner->chunk_size = transferChunkSize(buffer_size);
+    }
+    tuner->bytes = 0;
+    tuner->started_us = now_us;
+}
+
+#endif
@@ -0,0 +1,717 @@
+/*
+proxy program puts a slow and unreliable network between the client and the server on one Linux box.
+It accepts the connections of the clients and connects every one of them to the server, moving the data of each
+direction through a queue where the data waits for its time: half of the round trip time plus the random jitter
+(the order of the stream is kept), and with a bandwidth cap every chunk also waits for the link to send the chunks
+before it; the link is shared by all the connections, like the bottleneck of a real path. With -f every write to the other side is cut to a random 1..N bytes, so the peer gets short reads and
+the frames split at any byte. With -r the connection is reset (RST to both sides) after a random amount of data
+around the given one, so the interrupted transfers and their resume are exercised.
+The proxy runs in user space: the kernels still see the loopback path, so the TCP window is not limited by the
+latency and the losses are not simulated (that needs netem, which is not available everywhere).
+
+With -S the program runs the scenario suite: it creates the test file, starts the server on the upstream port and
+runs the client binary through the proxy for every scenario (clean loopback, broadband, long fat pipe, jitter,
+slow link, short reads, resets and a mobile link with all of them). For every scenario it downloads the file over
+one connection and over several, and updates a copy of the first half. The client is run again while its copy
+differs from the server file (the interrupted downloads resume from the journal), the result is compared byte by byte.
+At the end the results are printed as JSON: success, client runs, completion time and throughput of every transfer.
+Impairment options given with -S replace the built-in scenarios with one "custom" scenario.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../common/relay.h"
+
+#define DEFAULT_LISTEN_PORT 12345       // Default port of the client, so the client works through the proxy unchanged
+#define DEFAULT_UPSTREAM "127.0.0.1"
+#define DEFAULT_UPSTREAM_PORT 12346     // Server is started with -p 12346 behind the proxy
+#define DEFAULT_SERVER "../server_app/server"
+#define DEFAULT_CLIENT "../client_app/client"
+#define DEFAULT_DATA_DIR "proxy_data"
+#define DEFAULT_FILE_SIZE (4 * 1024 * 1024)
+#define DEFAULT_ATTEMPTS 20             // Client runs for one transfer before it counts as failed
+#define BUFFER_SIZE 1024
+#define FILE_BUFFER_SIZE (256 * 1024)
+#define SUITE_FILE_NAME "suite.bin"
+#define PARALLEL_STREAMS "4"            // Connections of the parallel download
+#define PROXY_MIN_CHUNK 1500            // Smallest read with the bandwidth cap, about one packet
+#define PROXY_QUEUE_MS 50               // Queue of the capped link beyond its bandwidth-delay product
+#define RESET_CHECK_MS 100              // Longest wait of a direction before it checks if the connection was reset
+#define CLIENT_TIMEOUT_S 300            // Client run which takes longer is killed
+#define LINK_UP 0                       // Direction from the client to the server
+#define LINK_DOWN 1                     // Direction from the server to the client
+
+// Impairment of the connections: one scenario of the suite or the options of the proxy
+typedef struct {
+    const char *name;           // name of the scenario in the report
+    double latency_ms;          // round trip time added by the proxy, half in each direction
+    double jitter_ms;           // random extra delay of every chunk, up to this value
+    double rate;                // bytes per second in each direction, 0 - no cap
+    size_t fragment;            // largest write to the other side, 0 - writes are not cut
+    double reset_bytes;         // connection is reset after about this many bytes, 0 - never
+} Impairment;
+
+// One direction of the proxied connection
+typedef struct {
+    RelayDirection relay;       // First, the hooks of the relay get the proxy direction back with a cast
+    int link;                   // LINK_UP - to the server, LINK_DOWN - to the client
+    uint64_t random;            // State of the random generator of the direction
+    uint64_t last_due_us;       // Time of the last chunk, the next one never overtakes it
+} ProxyDirection;
+
+// Connection of the client to the proxy and of the proxy to the server, freed when both directions are over
+typedef struct {
+    ProxyDirection directions[2];
+    Impairment impairment;      // Copy taken when the connection was accepted
+    uint64_t reset_after;       // Bytes of both directions after which the connection is reset, 0 - never
+    atomic_uint_fast64_t forwarded;     // Bytes written to both sides so far
+    atomic_int reset;           // Set when the connection is reset, both directions stop
+    atomic_int running;         // Directions still moving the data
+} ProxyConnection;
+
+// Proxy and suite settings from the command line
+typedef struct {
+    int listen_port;            // port of the proxy, 0 - free port (suite)
+    const char *upstream;       // server address
+    int upstream_port;          // server port
+    uint64_t seed;              // seed of the random generators
+    const char *server_path;    // server binary started by the suite
+    const char *client_path;    // client binary run by the suite
+    const char *data_dir;       // directory of the suite: server/ with the test file and client/ with the copies
+    double file_size;           // size of the test file
+    int attempts;               // client runs for one transfer
+    const char *output;         // JSON file, NULL - standard output
+} ProxyConfig;
+
+// Result of one transfer of the suite
+typedef struct {
+    const char *type;           // download, parallel or update
+    int ok;                     // flag that the copy of the client is equal to the server file
+    int attempts;               // client runs
+    uint64_t bytes;             // file data the transfer had to move
+    double seconds;             // time of all the runs
+} TransferResult;
+
+pthread_mutex_t impairment_lock = PTHREAD_MUTEX_INITIALIZER;
+Impairment impairment;          // Impairment of the new connections, the suite changes it between the scenarios
+uint64_t connection_seed;       // Seeds the generators of the next connection
+double link_free_us[2];         // Time the capped link is free in each direction, shared by all the connections
+int proxy_socket = -1;          // Listening socket of the proxy
+
+// Scenarios of the suite, rates are in bytes per second
+const Impairment scenarios[] = {
+    {"loopback", 0, 0, 0, 0, 0},
+    {"broadband", 30, 3, 100e6 / 8, 0, 0},
+    {"long_fat", 200, 0, 200e6 / 8, 0, 0},
+    {"jitter", 40, 40, 0, 0, 0},
+    {"slow", 20, 0, 8e6 / 8, 0, 0},
+    {"short_reads", 0, 0, 0, 100, 0},
+    {"resets", 10, 0, 0, 0, 1024 * 1024},
+    {"mobile", 80, 20, 16e6 / 8, 1400, 3 * 1024 * 1024},
+};
+
+// Function prototypes
+void printUsage(const char *program);
+int parseUpstream(const char *text, ProxyConfig *config);
+int listenOnPort(int port);
+uint64_t chunkDue(RelayDirection *relay, size_t length);
+size_t chunkWriteSize(RelayDirection *relay, size_t length);
+void chunkSent(RelayDirection *relay, size_t length);
+int connectionReset(RelayDirection *relay);
+void resetConnection(ProxyConnection *connection);
+void proxyDirectionDone(RelayDirection *relay);
+void proxyConnection(const ProxyConfig *config, int client_fd);
+void *proxyThread(void *arg);
+void setImpairment(const Impairment *scenario);
+int createTestFile(const ProxyConfig *config, const char *path);
+int runClient(const ProxyConfig *config, int port, int streams);
+int filesEqual(const char *path_a, const char *path_b);
+int prepareCopy(const char *server_file, const char *client_file, uint64_t size);
+void runTransfer(const ProxyConfig *config, int port, TransferResult *result, uint64_t file_size);
+void writeScenario(FILE *output, const Impairment *scenario, const TransferResult *results, int count, int last);
+int runSuite(ProxyConfig *config, const Impairment *custom);
+
+// Function prints the command line options
+void printUsage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]           proxy between the clients and the server\n"
+            "       %s -S [options]        scenario suite\n"
+            "  -p port         port of the proxy (default %d)\n"
+            "  -u host[:port]  server address, the suite starts the server on its port (default %s:%d)\n"
+            "  -l ms           round trip time added by the proxy\n"
+            "  -j ms           random extra delay of every chunk, up to this value\n"
+            "  -b rate         bandwidth cap in bytes per second in each direction, shared by the connections, K, M or G suffix\n"
+            "  -f bytes        largest write to the other side, the peer gets short reads\n"
+            "  -r bytes        reset the connection after about this many bytes\n"
+            "  -e seed         seed of the random delays, writes and resets (default 1)\n"
+            "  -s path         server binary of the suite (default %s)\n"
+            "  -c path         client binary of the suite (default %s)\n"
+            "  -d dir          directory of the suite (default %s)\n"
+            "  -z size         size of the test file of the suite (default 4M)\n"
+            "  -a attempts     client runs for one transfer of the suite (default %d)\n"
+            "  -o file         write the JSON report of the suite to the file instead of the standard output\n",
+            program, program, DEFAULT_LISTEN_PORT, DEFAULT_UPSTREAM, DEFAULT_UPSTREAM_PORT, DEFAULT_SERVER,
+            DEFAULT_CLIENT, DEFAULT_DATA_DIR, DEFAULT_ATTEMPTS);
+}
+
+// Function reads the server address host[:port], returns -1 if the port is wrong
+int parseUpstream(const char *text, ProxyConfig *config) {
+    static char host[BUFFER_SIZE];
+    snprintf(host, sizeof(host), "%s", text);
+    char *colon = strchr(host, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        config->upstream_port = atoi(colon + 1);
+        if (config->upstream_port <= 0 || config->upstream_port >= 65536) {
+            return -1;
+        }
+    }
+    config->upstream = host;
+    return 0;
+}
+
+// Function opens the listening socket of the proxy, port 0 takes a free port of the loopback interface
+// Returns the socket or -1 on error
+int listenOnPort(int port) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = port == 0 ? htonl(INADDR_LOOPBACK) : htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    if (socket_fd == -1 || setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+        bind(socket_fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(socket_fd, 128) == -1) {
+        perror("Error starting proxy");
+        if (socket_fd != -1) {
+            close(socket_fd);
+        }
+        return -1;
+    }
+    return socket_fd;
+}
+
+// Function returns the time the chunk of the given length may be written to the other side
+// The chunk is sent on the capped link after the chunks of all the connections before it, then it travels for half
+// of the round trip time and the jitter; a chunk never overtakes the one before it, TCP keeps the order of the stream
+uint64_t chunkDue(RelayDirection *relay, size_t length) {
+    ProxyDirection *direction = (ProxyDirection *)relay;
+    const Impairment *link = &((ProxyConnection *)relay->context)->impairment;
+    double sent_us = (double)nowMicroseconds();
+    if (link->rate > 0) {
+        pthread_mutex_lock(&impairment_lock);
+        sent_us = sent_us > link_free_us[direction->link] ? sent_us : link_free_us[direction->link];
+        sent_us += length * 1e6 / link->rate;
+        link_free_us[direction->link] = sent_us;
+        pthread_mutex_unlock(&impairment_lock);
+    }
+    uint64_t due_us = (uint64_t)(sent_us + link->latency_ms * 500 + randomUnit(&direction->random) * link->jitter_ms * 1000);
+    if (due_us < direction->last_due_us) {
+        due_us = direction->last_due_us;
+    }
+    direction->last_due_us = due_us;
+    return due_us;
+}
+
+// Function returns the bytes of the next write: a random piece with -f, never beyond the reset point
+// Returns 0 and resets the connection if the reset point is reached, data after it is never delivered
+size_t chunkWriteSize(RelayDirection *relay, size_t length) {
+    ProxyDirection *direction = (ProxyDirection *)relay;
+    ProxyConnection *connection = relay->context;
+    if (connection->impairment.fragment > 0 && length > connection->impairment.fragment) {
+        length = 1 + nextRandom(&direction->random) % connection->impairment.fragment;
+    }
+    if (connection->reset_after > 0) {
+        uint64_t forwarded = atomic_load(&connection->forwarded);
+        if (forwarded >= connection->reset_after) {
+            resetConnection(connection);
+            return 0;
+        }
+        length = connection->reset_after - forwarded < length ? connection->reset_after - forwarded : length;
+    }
+    return length;
+}
+
+// Function counts the bytes written to the other side for the reset point
+void chunkSent(RelayDirection *relay, size_t length) {
+    ProxyConnection *connection = relay->context;
+    atomic_fetch_add(&connection->forwarded, length);
+}
+
+// Function returns 1 if the connection was reset, then both directions stop
+int connectionReset(RelayDirection *relay) {
+    ProxyConnection *connection = relay->context;
+    return atomic_load(&connection->reset);
+}
+
+// Function resets the connection: both directions stop and the sockets are closed with RST instead of FIN
+// Reading ends are shut down, so a direction waiting for the data wakes up at once
+void resetConnection(ProxyConnection *connection) {
+    if (atomic_exchange(&connection->reset, 1) == 0) {
+        shutdown(connection->directions[0].relay.from_fd, SHUT_RD);
+        shutdown(connection->directions[1].relay.from_fd, SHUT_RD);
+    }
+}
+
+// Function closes the proxied connection when the last of its directions is over
+void proxyDirectionDone(RelayDirection *relay) {
+    ProxyConnection *connection = relay->context;
+    if (atomic_fetch_sub(&connection->running, 1) == 1) {
+        // Zero linger time makes close() send RST
+        int client_fd = connection->directions[0].relay.from_fd;
+        int server_fd = connection->directions[0].relay.to_fd;
+        if (atomic_load(&connection->reset)) {
+            struct linger linger = {1, 0};
+            setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+            setsockopt(server_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        }
+        close(client_fd);
+        close(server_fd);
+        free(connection);
+    }
+}
+
+// Function connects the accepted client to the server and starts both directions
+void proxyConnection(const ProxyConfig *config, int client_fd) {
+    int nodelay = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    int server_fd = connectToPort(config->upstream, config->upstream_port);
+    ProxyConnection *connection = malloc(sizeof(ProxyConnection));
+    if (server_fd == -1 || connection == NULL) {
+        close(client_fd);
+        if (server_fd != -1) {
+            close(server_fd);
+        }
+        free(connection);
+        return;
+    }
+
+    // Every connection has its own generators and reset point, the same seed repeats the same run
+    pthread_mutex_lock(&impairment_lock);
+    connection->impairment = impairment;
+    uint64_t seed = nextRandom(&connection_seed);
+    pthread_mutex_unlock(&impairment_lock);
+    const Impairment *link = &connection->impairment;
+    connection->reset_after = 0;
+    if (link->reset_bytes > 0) {
+        connection->reset_after = (uint64_t)(link->reset_bytes * (0.5 + randomUnit(&seed))) + 1;
+    }
+
+    // Connection holds the bandwidth-delay product of the capped link and a short queue, reads are about 10 ms of it
+    size_t max_queued = RELAY_MAX_QUEUED;
+    size_t chunk_size = RELAY_CHUNK_SIZE;
+    if (link->rate > 0) {
+        max_queued = (size_t)(link->rate * (link->latency_ms / 2 + link->jitter_ms + PROXY_QUEUE_MS) / 1000);
+        max_queued = max_queued < RELAY_CHUNK_SIZE ? RELAY_CHUNK_SIZE : max_queued;
+        chunk_size = (size_t)(link->rate / 100);
+        chunk_size = chunk_size < PROXY_MIN_CHUNK ? PROXY_MIN_CHUNK : chunk_size > RELAY_CHUNK_SIZE ? RELAY_CHUNK_SIZE : chunk_size;
+    }
+    RelayDirection relay = {.chunk_size = chunk_size, .max_queued = max_queued, .check_ms = RESET_CHECK_MS,
+        .chunk_due = chunkDue, .write_size = chunkWriteSize, .sent = chunkSent, .stopped = connectionReset,
+        .done = proxyDirectionDone, .context = connection};
+    connection->directions[0] = (ProxyDirection){relay, LINK_UP, nextRandom(&seed) | 1, 0};
+    connection->directions[0].relay.from_fd = client_fd;
+    connection->directions[0].relay.to_fd = server_fd;
+    connection->directions[1] = (ProxyDirection){relay, LINK_DOWN, nextRandom(&seed) | 1, 0};
+    connection->directions[1].relay.from_fd = server_fd;
+    connection->directions[1].relay.to_fd = client_fd;
+    atomic_init(&connection->forwarded, 0);
+    atomic_init(&connection->reset, 0);
+    atomic_init(&connection->running, 2);
+    relayStart(&connection->directions[0].relay);
+    relayStart(&connection->directions[1].relay);
+}
+
+// Thread function of the proxy: accepts the clients and connects every one of them to the server
+void *proxyThread(void *arg) {
+    const ProxyConfig *config = arg;
+    while (1) {
+        int client_fd = accept(proxy_socket, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Proxy accept");
+            return NULL;
+        }
+        proxyConnection(config, client_fd);
+    }
+}
+
+// Function sets the impairment of the connections accepted from now on
+void setImpairment(const Impairment *scenario) {
+    pthread_mutex_lock(&impairment_lock);
+    impairment = *scenario;
+    pthread_mutex_unlock(&impairment_lock);
+}
+
+// Function creates the random test file, the file of the right size from the last run is kept
+int createTestFile(const ProxyConfig *config, const char *path) {
+    struct stat file_stat;
+    uint64_t size = (uint64_t)config->file_size;
+    if (stat(path, &file_stat) == 0 && (uint64_t)file_stat.st_size == size) {
+        return 0;
+    }
+    unsigned char *buffer = malloc(FILE_BUFFER_SIZE);
+    int file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (buffer == NULL || file_fd == -1) {
+        perror("Error creating test file");
+        free(buffer);
+        if (file_fd != -1) {
+            close(file_fd);
+        }
+        return -1;
+    }
+    uint64_t state = config->seed | 1;
+    uint64_t written = 0;
+    while (written < size) {
+        size_t chunk = size - written < FILE_BUFFER_SIZE ? size - written : FILE_BUFFER_SIZE;
+        for (size_t i = 0; i + 8 <= chunk; i += 8) {
+            uint64_t value = nextRandom(&state);
+            memcpy(buffer + i, &value, 8);
+        }
+        if (write(file_fd, buffer, chunk) != (ssize_t)chunk) {
+            perror("Error writing test file");
+            close(file_fd);
+            free(buffer);
+            return -1;
+        }
+        written += chunk;
+    }
+    close(file_fd);
+    free(buffer);
+    return 0;
+}
+
+// Function runs the client in the client directory of the suite to get the test file through the proxy
+// The output of the client is added to client.log of the suite directory
+// Returns the exit status of the client, -1 if it didn't start, crashed or took too long
+int runClient(const ProxyConfig *config, int port, int streams) {
+    char log_name[BUFFER_SIZE];
+    snprintf(log_name, sizeof(log_name), "%s/client.log", config->data_dir);
+    pid_t client_pid = fork();
+    if (client_pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (client_pid == 0) {
+        char client_path[4096];
+        char client_dir[BUFFER_SIZE];
+        char port_text[16];
+        if (realpath(config->client_path, client_path) == NULL) {
+            perror(config->client_path);
+            _exit(127);
+        }
+        int log_fd = open(log_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log_fd != -1) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        snprintf(client_dir, sizeof(client_dir), "%s/client", config->data_dir);
+        if (chdir(client_dir) == -1) {
+            perror(client_dir);
+            _exit(127);
+        }
+        snprintf(port_text, sizeof(port_text), "%d", port);
+        if (streams > 1) {
+            execl(client_path, client_path, "-p", port_text, "-j", PARALLEL_STREAMS, SUITE_FILE_NAME, "127.0.0.1", (char *)NULL);
+        } else {
+            execl(client_path, client_path, "-p", port_text, SUITE_FILE_NAME, "127.0.0.1", (char *)NULL);
+        }
+        perror("Error starting client");
+        _exit(127);
+    }
+
+    // Client which hangs is killed, the transfer counts the run as failed
+    uint64_t deadline = nowMicroseconds() + (uint64_t)CLIENT_TIMEOUT_S * 1000000;
+    int status;
+    while (waitpid(client_pid, &status, WNOHANG) == 0) {
+        if (nowMicroseconds() > deadline) {
+            fprintf(stderr, "Client takes longer than %d s, killing it\n", CLIENT_TIMEOUT_S);
+            kill(client_pid, SIGKILL);
+            waitpid(client_pid, &status, 0);
+            return -1;
+        }
+        usleep(10000);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Function compares two files byte by byte, returns 1 if they are equal, 0 if not or one of them can't be read
+int filesEqual(const char *path_a, const char *path_b) {
+    FILE *file_a = fopen(path_a, "rb");
+    FILE *file_b = fopen(path_b, "rb");
+    unsigned char *buffer_a = malloc(FILE_BUFFER_SIZE);
+    unsigned char *buffer_b = malloc(FILE_BUFFER_SIZE);
+    int equal = file_a != NULL && file_b != NULL && buffer_a != NULL && buffer_b != NULL;
+    while (equal) {
+        size_t length_a = fread(buffer_a, 1, FILE_BUFFER_SIZE, file_a);
+        size_t length_b = fread(buffer_b, 1, FILE_BUFFER_SIZE, file_b);
+        if (length_a != length_b || memcmp(buffer_a, buffer_b, length_a) != 0) {
+            equal = 0;
+        } else if (length_a == 0) {
+            break;
+        }
+    }
+    if (file_a != NULL) {
+        fclose(file_a);
+    }
+    if (file_b != NULL) {
+        fclose(file_b);
+    }
+    free(buffer_a);
+    free(buffer_b);
+    return equal;
+}
+
+// Function prepares the copy of the client for the transfer: the first size bytes of the server file, 0 - no copy
+// The partial file and the journal of the last transfer are removed, returns -1 on error
+int prepareCopy(const char *server_file, const char *client_file, uint64_t size) {
+    char name[BUFFER_SIZE + 16];
+    snprintf(name, sizeof(name), "%s.part", client_file);
+    unlink(name);
+    snprintf(name, sizeof(name), "%s.part.journal", client_file);
+    unlink(name);
+    unlink(client_file);
+    if (size == 0) {
+        return 0;
+    }
+    FILE *source = fopen(server_file, "rb");
+    FILE *copy = fopen(client_file, "wb");
+    unsigned char *buffer = malloc(FILE_BUFFER_SIZE);
+    int result = source != NULL && copy != NULL && buffer != NULL ? 0 : -1;
+    while (result == 0 && size > 0) {
+        size_t chunk = size < FILE_BUFFER_SIZE ? size : FILE_BUFFER_SIZE;
+        if (fread(buffer, 1, chunk, source) != chunk || fwrite(buffer, 1, chunk, copy) != chunk) {
+            result = -1;
+        }
+        size -= chunk;
+    }
+    if (result == -1) {
+        perror("Error preparing the client copy");
+    }
+    if (source != NULL) {
+        fclose(source);
+    }
+    if (copy != NULL && fclose(copy) != 0) {
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+// Function runs one transfer of the scenario: the client is run again until its copy is equal to the server file
+void runTransfer(const ProxyConfig *config, int port, TransferResult *result, uint64_t file_size) {
+    char server_file[BUFFER_SIZE];
+    char client_file[BUFFER_SIZE];
+    snprintf(server_file, sizeof(server_file), "%s/server/%s", config->data_dir, SUITE_FILE_NAME);
+    snprintf(client_file, sizeof(client_file), "%s/client/%s", config->data_dir, SUITE_FILE_NAME);
+
+    // Update starts from the first half of the file, the downloads from nothing
+    uint64_t local_size = strcmp(result->type, "update") == 0 ? file_size / 2 : 0;
+    result->ok = 0;
+    result->attempts = 0;
+    result->bytes = file_size - local_size;
+    result->seconds = 0;
+    if (prepareCopy(server_file, client_file, local_size) == -1) {
+        return;
+    }
+    int streams = strcmp(result->type, "parallel") == 0 ? atoi(PARALLEL_STREAMS) : 1;
+    uint64_t start = nowMicroseconds();
+    while (result->attempts < config->attempts && !result->ok) {
+        result->attempts++;
+        runClient(config, port, streams);
+        result->ok = filesEqual(server_file, client_file);
+    }
+    result->seconds = (nowMicroseconds() - start) / 1e6;
+}
+
+// Function writes the results of one scenario to the JSON report
+void writeScenario(FILE *output, const Impairment *scenario, const TransferResult *results, int count, int last) {
+    fprintf(output, "    {\n");
+    fprintf(output, "      \"name\": \"%s\",\n", scenario->name);
+    fprintf(output, "      \"latency_ms\": %.1f,\n", scenario->latency_ms);
+    fprintf(output, "      \"jitter_ms\": %.1f,\n", scenario->jitter_ms);
+    fprintf(output, "      \"rate_mbit_s\": %.1f,\n", scenario->rate * 8 / 1e6);
+    fprintf(output, "      \"fragment_bytes\": %zu,\n", scenario->fragment);
+    fprintf(output, "      \"reset_bytes\": %.0f,\n", scenario->reset_bytes);
+    fprintf(output, "      \"transfers\": [\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(output, "        {\"type\": \"%s\", \"ok\": %s, \"attempts\": %d, \"bytes\": %" PRIu64
+                ", \"seconds\": %.3f, \"throughput_mb_s\": %.2f}%s\n",
+                results[i].type, results[i].ok ? "true" : "false", results[i].attempts, results[i].bytes,
+                results[i].seconds, results[i].seconds > 0 ? results[i].bytes / results[i].seconds / 1e6 : 0.0,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(output, "      ]\n");
+    fprintf(output, "    }%s\n", last ? "" : ",");
+}
+
+// Function runs the scenario suite, returns the exit status of the program: 0 - all transfers succeeded
+int runSuite(ProxyConfig *config, const Impairment *custom) {
+    char path[BUFFER_SIZE];
+    if (mkdir(config->data_dir, 0755) == -1 && errno != EEXIST) {
+        perror(config->data_dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/server", config->data_dir);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/client", config->data_dir);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/server/%s", config->data_dir, SUITE_FILE_NAME);
+    if (createTestFile(config, path) == -1) {
+        return 1;
+    }
+
+    // Proxy takes a free port, the server is behind it on the upstream port
+    struct sockaddr_in address;
+    socklen_t address_length = sizeof(address);
+    proxy_socket = listenOnPort(0);
+    if (proxy_socket == -1 || getsockname(proxy_socket, (struct sockaddr *)&address, &address_length) == -1) {
+        return 1;
+    }
+    int port = ntohs(address.sin_port);
+    snprintf(path, sizeof(path), "%s/server", config->data_dir);
+    pid_t server_pid = startServer(config->server_path, path, config->upstream_port, NULL);
+    if (server_pid == -1) {
+        return 1;
+    }
+    pthread_t thread;
+    if (waitForServer(config->upstream, config->upstream_port, server_pid) == -1 || pthread_create(&thread, NULL, proxyThread, config) != 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+        return 1;
+    }
+    pthread_detach(thread);
+
+    FILE *output = stdout;
+    if (config->output != NULL && (output = fopen(config->output, "w")) == NULL) {
+        perror(config->output);
+        output = stdout;
+    }
+    const Impairment *list = custom != NULL ? custom : scenarios;
+    int scenario_count = custom != NULL ? 1 : (int)(sizeof(scenarios) / sizeof(scenarios[0]));
+    uint64_t file_size = (uint64_t)config->file_size;
+    int failed = 0;
+    fprintf(output, "{\n");
+    fprintf(output, "  \"file_size\": %" PRIu64 ",\n", file_size);
+    fprintf(output, "  \"seed\": %" PRIu64 ",\n", config->seed);
+    fprintf(output, "  \"scenarios\": [\n");
+    for (int i = 0; i < scenario_count; i++) {
+        TransferResult results[3] = {{.type = "download"}, {.type = "parallel"}, {.type = "update"}};
+        setImpairment(&list[i]);
+        for (int j = 0; j < 3; j++) {
+            runTransfer(config, port, &results[j], file_size);
+            failed += !results[j].ok;
+            fprintf(stderr, "%-12s %-9s %s  %2d run(s)  %8.3f s  %8.2f MB/s\n", list[i].name, results[j].type,
+                    results[j].ok ? "ok    " : "FAILED", results[j].attempts, results[j].seconds,
+                    results[j].seconds > 0 ? results[j].bytes / results[j].seconds / 1e6 : 0.0);
+        }
+        writeScenario(output, &list[i], results, 3, i + 1 == scenario_count);
+        fflush(output);
+    }
+    fprintf(output, "  ]\n");
+    fprintf(output, "}\n");
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+    return failed > 0 ? 2 : 0;
+}
+
+// Main function
+int main(int argc, char *argv[]) {
+    ProxyConfig config = {
+        .listen_port = DEFAULT_LISTEN_PORT,
+        .upstream = DEFAULT_UPSTREAM,
+        .upstream_port = DEFAULT_UPSTREAM_PORT,
+        .seed = 1,
+        .server_path = DEFAULT_SERVER,
+        .client_path = DEFAULT_CLIENT,
+        .data_dir = DEFAULT_DATA_DIR,
+        .file_size = DEFAULT_FILE_SIZE,
+        .attempts = DEFAULT_ATTEMPTS,
+    };
+    Impairment options = {"custom", 0, 0, 0, 0, 0};
+    int suite = 0;
+    int custom = 0;             // Flag that an impairment was given on the command line
+    int error = 0;
+    double fragment = 0;
+    int option;
+
+    // Reading command line options
+    while ((option = getopt(argc, argv, "Sp:u:l:j:b:f:r:e:s:c:d:z:a:o:h")) != -1) {
+        switch (option) {
+            case 'S': suite = 1; break;
+            case 'p': config.listen_port = atoi(optarg); break;
+            case 'u': error |= parseUpstream(optarg, &config); break;
+            case 'l': options.latency_ms = atof(optarg); custom = 1; break;
+            case 'j': options.jitter_ms = atof(optarg); custom = 1; break;
+            case 'b': error |= parseSize(optarg, &options.rate, '\0'); custom = 1; break;
+            case 'f': error |= parseSize(optarg, &fragment, '\0'); custom = 1; break;
+            case 'r': error |= parseSize(optarg, &options.reset_bytes, '\0'); custom = 1; break;
+            case 'e': config.seed = strtoull(optarg, NULL, 10); break;
+            case 's': config.server_path = optarg; break;
+            case 'c': config.client_path = optarg; break;
+            case 'd': config.data_dir = optarg; break;
+            case 'z': error |= parseSize(optarg, &config.file_size, '\0'); break;
+            case 'a': config.attempts = atoi(optarg); break;
+            case 'o': config.output = optarg; break;
+            default: printUsage(argv[0]); return 1;
+        }
+    }
+    options.fragment = (size_t)fragment;
+    if (error || optind < argc || config.listen_port <= 0 || config.listen_port >= 65536 || options.latency_ms < 0 ||
+        options.jitter_ms < 0 || config.file_size < 2 || config.attempts <= 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Broken sockets are reported by send(), the proxy must not die on them
+    signal(SIGPIPE, SIG_IGN);
+    connection_seed = config.seed | 1;
+    setImpairment(&options);
+    if (suite) {
+        return runSuite(&config, custom ? &options : NULL);
+    }
+
+    proxy_socket = listenOnPort(config.listen_port);
+    if (proxy_socket == -1) {
+        return 1;
+    }
+    printf("Proxy on port %d to %s:%d: round trip %.1f ms, jitter %.1f ms, rate %.0f B/s, writes up to %zu B, "
+           "reset after %.0f B\n", config.listen_port, config.upstream, config.upstream_port, options.latency_ms,
+           options.jitter_ms, options.rate, options.fragment, options.reset_bytes);
+    fflush(stdout);
+    proxyThread(&config);
+    return 1;
+}
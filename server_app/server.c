@@ -1,303 +1,5072 @@
 /*
 server program sends requested file or update to the file to the client using TCP sockets.
-client requests processed in handleReadSocket (either file request or update request)
-data sending to the client is done in handleWriteSocket
-handleReadSocket and handleWriteSocket use mutex to synchronize access to the shared resources
-handleReadSocket use buffer to provide data necessary to send file or update to the file to handleWriteSocket
-handleWriteSocket uses function sendFile() to send the requested file or error message if file is not found
-on the server and function updateFile() to send the update for the file client requested. If there is no update,
-function informs the client that there is no update for the client. 
+server runs a non-blocking event loop based on epoll, so thousands of connections are served at once.
+With -w N the server runs N shards: every shard is a thread pinned to its own CPU with its own listening socket
+on the same port (SO_REUSEPORT), its own epoll instance and io_uring instance. The kernel spreads the new connections
+over the listening sockets and a connection stays in the shard which accepted it, so the shards don't lock each other.
+every client connection has its own state machine (Connection structure):
+STATE_READ_REQUEST - no response in progress, waiting for the next client request (either file request or update request)
+STATE_SEND_HEADER - sending the response frame header with the status and the file information to the client
+STATE_SEND_BODY - streaming the file data to the client
+Requests and responses are binary frames described in common/protocol.h,
+the client can send several requests without waiting for the responses.
+Every connection has its own bounded request queue (RequestQueue): the reading side parses requests into the queue,
+the sending side takes them out one by one, so the responses go back in the order of the requests.
+When the queue is full we stop reading from this client only, other connections are not affected.
+The Connection structures and the request buffers with the queues come from the slab pools (Pool) of the shard,
+the buffers only while the connection has requests to parse or to answer, so an idle connection costs a few hundred bytes.
+With -M the pools of all shards share a memory cap: at the cap the shard pauses the reads of the connections which
+need the buffers and stops accepting until the memory comes back, instead of growing without bound.
+sendFile() prepares the connection to send the requested file or error message if file is not found
+on the server and updateFile() prepares the connection to send the update for the file client requested.
+If there is no update, function informs the client that there is no update for the client.
+deltaFile() answers the delta request: a worker thread compares the signature of the client copy with the server copy
+and finds the instructions to build the server copy from the blocks the client already has (common/delta.h).
+Only the steps are kept in memory, the instructions with the literal data are encoded from the file chunk by chunk
+while the body is sent.
+The data itself is sent by the event loop every time the socket is writable, so a slow client never blocks others.
+File data goes to the socket without copying it through the server memory: sendfile() is used by default,
+splice() through a pipe if sendfile() doesn't support the file, and the pread()/send() cycle as the last resort.
+The transfer mode can be selected with the -m option (sendfile, splice, copy or uring).
+In the uring mode the file data goes through io_uring: every chunk is a linked pair of operations,
+read of the file into a registered buffer and send of this buffer to the socket, both on fixed files.
+The operations of all connections are collected during one pass of the event loop and submitted with one
+io_uring_enter() call, the completions come through an eventfd watched by the same epoll instance.
+If io_uring is not available the server uses sendfile(), if all registered buffers are busy the response is
+sent the classic way.
+Large transfers tune themselves (common/transfer.h): every 4 MB the server estimates the bandwidth-delay product
+from TCP_INFO and raises the send buffer if the autotuning of the kernel left it too small, the chunk of splice()
+and pread()/send() follows the buffer. The header of the response goes with MSG_MORE, so it leaves in one segment
+with the first data of the body.
+Open files are kept in the file cache (FileCache) shared by all connections: one descriptor, size and modification
+time per path. The descriptor is shared because every transfer reads the file at its own offset.
+A watcher thread invalidates the cached file by inotify events, so the update request for an unchanged file
+is answered from memory without open() and fstat().
+Contents of the small files are kept in the cache memory within a budget, such a file is sent with one writev()
+of the header and the data.
+If the client accepts it (FLAG_LZ4 or FLAG_DEFLATE), the body is sent as compressed chunks (common/compress.h),
+files which don't compress (the sample from the middle of the file) are sent as they are.
+If the client asks for it (FLAG_CHECKSUM), the response header carries the CRC32C of the body (common/checksum.h).
+The cached file keeps the checksum of every block, so the checksum of any range costs at most two partial blocks
+and the body still goes to the socket without being read by the server. The table is computed by a worker (Job)
+while the request waits parked, the event loop never reads a whole file. The update request carries the checksum
+of the client copy, a copy which is not a prefix of the server file gets STATUS_DIVERGED instead of the appended data.
+The subscribe request (OP_SUBSCRIBE) is answered like the update request and then the connection stays subscribed:
+every shard watches the subscribed files with its own inotify instance in its epoll set, and when the file grows
+the appended bytes are pushed to the client as another response with the id of the subscribe request,
+as soon as the connection has nothing else to send. The client doesn't poll, an idle file costs nothing.
+The manifest request (OP_MANIFEST) lists every file under the directory with its size, modification time and
+CRC32C (common/manifest.h), so the client can mirror the tree by fetching only the new and changed files.
+The checksum of the whole file is kept in the hash cache (HashCache) while the size and the time are the same,
+so only the first manifest reads the files. The tree is listed by a worker thread (Job), the connection waits for it
+parked like a relayed request and the other connections of the shard go on meanwhile. JOB_WORKERS threads take
+the jobs of all shards from one queue of JOB_QUEUE_SIZE jobs, a request which finds the queue full gets STATUS_BUSY.
+Bodies of the responses are scheduled by the shard: every transfer sends at most SCHEDULER_QUANTUM bytes in its turn
+(deficit round robin) and gives the turn to the other ready connections, so a huge download doesn't delay the small
+responses. The rate limits (-g for the whole server, -r for every client, OP_LIMITS from the local host at runtime)
+are token buckets: a transfer without tokens stops watching its socket until the bucket has tokens again.
+With -u the server is a caching relay of another server: a file missing locally is fetched from the upstream
+by a fetch thread into the local directory, the misses of the same file wait for one fetch (Fetch) and the downloads
+of the whole file are sent from the new file as it is written; the thread wakes the shards through their eventfds.
+The data is received into RELAY_STAGING_DIR and moved into place only after its checksum is verified.
+Every event loop thread counts its requests, responses, sent bytes and latencies in its own Metrics structure,
+the stats request (OP_STATS) sums the counters of all threads without locks and returns them as text.
+Log messages are formatted into the ring of the thread and written to the console by the logger thread,
+so the event loop never waits for the terminal. The -l option selects which messages are logged.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <pthread.h>
+
+#include "../common/protocol.h"
+#include "../common/delta.h"
+#include "../common/compress.h"
+#include "../common/checksum.h"
+#include "../common/manifest.h"
+#include "../common/transfer.h"
 
 #define PORT 12345
 #define BUFFER_SIZE 1024
-#define MAX_CLIENTS 10
+#define LISTEN_BACKLOG 4096     // Pending connections the kernel keeps for us between accept() calls
+#define MAX_EVENTS 256          // Maximum number of events we get from one epoll_wait() call
+#define REQUEST_QUEUE_SIZE 8    // Maximum number of pipelined requests waiting in one connection, power of two
+#define RESPONSE_HEADER_SIZE (FRAME_CHECKSUM_HEADER_SIZE + FILE_INFO_SIZE)  // Biggest response header: frame and file information
+#define POOL_SLAB_SIZE (64 * 1024)      // Bytes of the objects allocated together by a pool, a bigger object gets a slab of its own
+#define MEMORY_RETRY_MS 10              // Shard waiting for the memory of the other shards checks the pools again after this time
+#define THREAD_STACK_SIZE (256 * 1024)  // Stack of every thread of the server, the big buffers are allocated from the heap
+#define JOB_WORKERS 4                   // Worker threads of the manifest and delta jobs, shared by all shards
+#define JOB_QUEUE_SIZE 64               // Jobs waiting for a worker, the next requests are answered with STATUS_BUSY
+
+
+#define URING_ENTRIES 256                   // Size of the io_uring submission queue
+#define URING_BUFFER_COUNT 64               // Registered buffers, one io_uring transfer holds one buffer
+#define URING_BUFFER_SIZE (128 * 1024)      // Bytes read and sent by one read->send pair
+#define URING_FILE_SLOTS (URING_BUFFER_COUNT * 2)   // Fixed files: the file and the socket of every transfer
+
+// Operation tags in the low bits of the io_uring user_data, the rest is the Connection pointer or the buffer index
+#define URING_OP_FILES 1        // Putting the file and the socket into the fixed file slots
+#define URING_OP_READ 2         // Reading the file into the registered buffer
+#define URING_OP_SEND 3         // Sending the registered buffer to the socket
+#define URING_OP_CLEAR 4        // Emptying the fixed file slots of the finished transfer
+#define URING_OP_MASK 7
+
+#define FILE_CACHE_BUCKETS 1024         // Hash table size of the file cache, power of two
+#define FILE_CACHE_MAX_FILES 8192       // Files kept open by the cache, the least recently used file is dropped
+#define FILE_CACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+#define COMPRESS_MIN_SIZE 512            // Smaller bodies are not worth compressing
+#define COMPRESS_MAX_RATIO 0.9          // File is sent raw if the sample doesn't get at least 10% smaller
+#define DELTA_CHUNK_SIZE (COMPRESS_CHUNK_SIZE + COMPRESS_CHUNK_HEADER_SIZE + COMPRESS_BUFFER_SIZE)  // Delta instructions encoded at once, in the buffer of compress_pool
+#define SMALL_FILE_SIZE (64 * 1024)             // Files up to this size are kept in memory by default
+#define FILE_MEMORY_BUDGET (64 * 1024 * 1024)   // Memory for the contents of the small files by default
+#define CHECKSUM_BLOCK_SIZE (64 * 1024)         // The cached file keeps the checksum of every block of this size
+#define DELTA_WINDOW_SIZE (1024 * 1024)         // Bytes of the file read at once while the delta checksum rolls over it
+#define HASH_CACHE_BUCKETS 65536        // Hash table size of the hash cache, power of two
+#define HASH_CACHE_MAX_FILES 1048576    // Files with the remembered checksum, the checksums of other files are not kept
+#define SCHEDULER_QUANTUM (256 * 1024)  // Bytes of the body one transfer sends in its turn
+#define RATE_BURST_MS 50                // Token bucket holds the tokens of this time, at least one quantum
+#define RATE_MIN_SEND (4 * 1024)        // Throttled transfer waits for this many tokens at least (rate / 100, up to 64 KB)
+#define RATE_MAX_SEND (64 * 1024)
+#define SUBSCRIPTION_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+#define RELAY_BUFFER_SIZE (256 * 1024)  // Bytes the upstream fetch receives and writes at once, waiting transfers are woken after each
+#define RELAY_TIMEOUT_S 10              // Upstream which doesn't send or take anything for this long fails the fetch
+#define RELAY_REVALIDATE_MS 1000        // Update polls of a file the upstream confirmed this long ago are answered locally
+#define RELAY_STAGING_DIR ".relay-staging"  // Hidden directory of the fetches in progress, never listed or served
+
+#define MAX_THREADS 64                  // Threads which can register their metrics and log ring
+#define METRICS_OPCODES (OP_LIMITS + 1)            // Requests are counted by opcode, unknown opcodes go to slot 0
+#define METRICS_STATUSES (STATUS_BUSY + 1)      // Responses are counted by status
+#define HISTOGRAM_BUCKETS 32            // Latency bucket i counts latencies up to 2^i microseconds
+#define LOG_RING_SIZE 1024              // Messages of one thread waiting for the logger thread, power of two
+#define LOG_MESSAGE_SIZE 256            // Longer messages are cut
+#define LOG_FLUSH_INTERVAL_US 20000     // Logger thread writes the collected messages every 20 ms
+
+// Ways to send the file data to the client
+typedef enum {
+    TRANSFER_SENDFILE,      // sendfile() from the file to the socket
+    TRANSFER_SPLICE,        // splice() from the file to the pipe and from the pipe to the socket
+    TRANSFER_COPY,          // pread() to the buffer and send() from the buffer
+    TRANSFER_URING          // linked read and send operations submitted to io_uring
+} TransferMode;
+
+// Log levels, messages above the selected level are not formatted at all
+typedef enum {
+    LEVEL_ERROR,            // Failures of the server or of the connection
+    LEVEL_WARNING,          // Clients which break the protocol, files changed during the transfer
+    LEVEL_INFO,             // Every connection and request (default)
+    LEVEL_DEBUG             // Everything
+} LogLevel;
+
+// States of the client connection
+typedef enum {
+    STATE_READ_REQUEST,     // Waiting for the client request
+    STATE_SEND_HEADER,      // Sending the size of the data or the status message
+    STATE_SEND_BODY,        // Sending the file data
+    STATE_WAIT_UPSTREAM,    // Relay mode: the request waits for the file from the upstream server
+    STATE_WAIT_JOB          // The request waits for the worker thread which prepares its response
+} ConnectionState;
+
+// Parsed client request
+typedef struct {
+    uint8_t opcode;                     // OP_DOWNLOAD - file request, OP_UPDATE - update request
+    uint8_t flags;                      // Request flags
+    uint32_t request_id;                // Id to put into the response
+    uint64_t offset;                    // Start of the range for file request, size of the client copy for update request
+    uint64_t length;                    // Length of the range for file request, 0 - up to the end of the file
+    char file_name[BUFFER_SIZE];        // Requested file name
+    unsigned char *payload;             // Payload of the delta request (signature), NULL for other requests
+    size_t payload_size;                // Bytes in the payload
+    uint64_t received_us;               // Time when the request was received, start of its latency
+    int has_checksum;                   // Flag that the request header has the checksum field
+    uint32_t checksum;                  // Checksum of the client copy up to offset (update and subscribe requests)
+} Request;
+
+// Open file shared by all responses which send it
+typedef struct CachedFile {
+    char *path;                         // File name as the clients request it
+    uint32_t hash;                      // Hash of the path
+    int fd;                             // Descriptor shared by the transfers, every transfer reads at its own offset
+    struct stat file_stat;              // Size and modification time when the file was opened
+    atomic_int watch;                   // inotify watch of the file, -1 if not in the cache (set under the mutex, read without it)
+    int refs;                           // The cache itself and every response which uses the file
+    _Atomic(unsigned char *) data;      // Contents of the small file, NULL if the file is sent from the descriptor
+    atomic_int compressible;            // 1 - the sample compressed well, -1 - it didn't, 0 - not sampled yet
+    _Atomic(uint32_t *) block_checksums;    // Checksum of every CHECKSUM_BLOCK_SIZE block, NULL - not computed yet
+    _Atomic uint64_t revalidated_us;    // Relay mode: time the upstream last had nothing newer than this file, 0 - never
+    struct CachedFile *hash_next;       // Next file in the same hash bucket
+    struct CachedFile *lru_prev;        // Neighbours in the list from the most to the least recently used file
+    struct CachedFile *lru_next;
+} CachedFile;
+
+// Cache of open files keyed by path, shared by all threads
+// A file is removed when inotify reports any change of it, so the cached size and time are never older than the event
+typedef struct {
+    pthread_mutex_t mutex;
+    int inotify_fd;                     // -1 if inotify is not available, files are opened for every request then
+    CachedFile *buckets[FILE_CACHE_BUCKETS];
+    CachedFile *lru_head;               // Most recently used file
+    CachedFile *lru_tail;               // Least recently used file, dropped when the cache is full
+    int count;                          // Files in the cache
+    int max_files;                      // Limit of files in the cache, a part of the open files limit
+    uint64_t hits;                      // Requests answered with the cached file
+    uint64_t misses;                    // Requests which opened the file
+    size_t small_file_size;             // Files up to this size are kept in memory, 0 - no file is kept in memory
+    size_t data_budget;                 // Limit of the memory for the contents of the small files
+    size_t data_bytes;                  // Memory used by the contents of the files in the cache
+    uint64_t data_evictions;            // Files in memory dropped to make space for other files
+} FileCache;
+
+// Checksum of the whole file listed in a manifest, valid while the file has the same size and modification time
+typedef struct HashEntry {
+    char *path;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t hash;
+    struct HashEntry *next;             // Next file in the same hash bucket
+} HashEntry;
+
+// Checksums of the files listed in the manifests, shared by all threads
+typedef struct {
+    pthread_mutex_t mutex;
+    HashEntry *buckets[HASH_CACHE_BUCKETS];
+    size_t count;                       // Files in the cache
+} HashCache;
+
+// Token bucket of the rate limit: a token is a byte which may be sent, tokens come at rate bytes per second
+typedef struct {
+    uint64_t rate;                      // Bytes per second, 0 - no limit
+    int64_t tokens;                     // Bytes which may be sent now, negative after a send bigger than the tokens
+    uint64_t updated_us;                // Time the tokens were counted
+} TokenBucket;
+
+// Latency histogram with power of two buckets
+typedef struct {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_us;
+} Histogram;
+
+// Counters of one event loop thread
+// Only the owner thread writes them, the stats request reads the counters of all threads at any time
+typedef struct {
+    _Atomic uint64_t requests[METRICS_OPCODES];     // Requests by opcode
+    _Atomic uint64_t responses[METRICS_STATUSES];   // Responses by status
+    _Atomic uint64_t bytes_sent;                    // Headers and bodies of the responses
+    _Atomic uint64_t connections_accepted;
+    _Atomic uint64_t connections_closed;
+    _Atomic uint64_t memory_hits;                   // Small files sent from the memory of the cache
+    _Atomic uint64_t memory_misses;                 // Small files sent from the descriptor, not loaded yet
+    _Atomic uint64_t compressed_responses;          // Responses with the compressed body
+    _Atomic uint64_t compression_skipped;           // Compression requested, but the file doesn't compress
+    _Atomic uint64_t compression_input;             // File bytes of the compressed bodies
+    _Atomic uint64_t compression_output;            // Bytes of the compressed bodies sent to the clients
+    _Atomic uint64_t checksum_mismatches;           // Update requests with the client copy which is not a prefix of the file
+    _Atomic uint64_t subscriptions_started;
+    _Atomic uint64_t subscriptions_ended;
+    _Atomic uint64_t subscription_pushes;           // Appends pushed to the subscribed clients
+    _Atomic uint64_t throttled;                     // Transfers stopped by the rate limits
+    _Atomic uint64_t accepts_deferred;              // Times the shard stopped accepting because of the memory cap
+    _Atomic uint64_t reads_paused;                  // Connections which waited for the I/O buffers because of the memory cap
+    Histogram first_byte;               // From receiving the request to sending the first byte of the response
+    Histogram transfer;                 // From receiving the request to sending the last byte of the response
+    Histogram schedule_wait;            // From giving up the turn (quantum used or no tokens) to the next turn
+} Metrics;
+
+// Log message formatted by the event loop thread
+typedef struct {
+    LogLevel level;
+    char text[LOG_MESSAGE_SIZE];
+} LogMessage;
+
+// Single-producer single-consumer ring of log messages: the event loop thread writes, the logger thread reads
+typedef struct {
+    LogMessage messages[LOG_RING_SIZE];
+    atomic_size_t head;                 // Messages written to the console
+    atomic_size_t tail;                 // Messages put into the ring
+    _Atomic uint64_t dropped;           // Messages lost because the ring was full
+    uint64_t dropped_reported;          // Lost messages the logger thread already reported
+} LogRing;
+
+// Bounded single-producer single-consumer queue of requests
+// Producer (reading side) only moves tail, consumer (sending side) only moves head, so no lock is needed
+typedef struct {
+    Request requests[REQUEST_QUEUE_SIZE];
+    atomic_size_t head;                 // Number of requests taken from the queue
+    atomic_size_t tail;                 // Number of requests put into the queue
+} RequestQueue;
+
+// Receiving side of the connection, taken from the pool of the shard while the connection has requests in progress
+// An idle connection gives it back, so the thousands of idle clients cost only their Connection structures
+typedef struct IoBuffers {
+    unsigned char request[FRAME_CHECKSUM_HEADER_SIZE + BUFFER_SIZE];   // Bytes received from the socket which are not parsed yet
+    RequestQueue queue;                 // Requests waiting for the response
+    Request pending_request;            // Request with the payload too big for the request buffer, waiting for the payload
+} IoBuffers;
+
+// Everything we need to know about one client connection
+typedef struct Connection {
+    int client_socket;                  // Socket of the client
+    ConnectionState state;              // Current state of the connection
+    uint32_t watched_events;            // Events registered in epoll for the socket
+    int client_closed;                  // Flag that the client will not send any more requests
+    IoBuffers *io;                      // Request buffer and queue, NULL while the connection is idle
+    size_t request_length;              // Number of bytes in the request buffer
+    size_t pending_received;            // Bytes of the payload of the pending request received so far
+    int io_waiting;                     // Flag that the connection waits for the I/O buffers, its reads are paused
+    struct Connection *io_next;         // Next connection of the shard waiting for the I/O buffers
+    size_t payload_wanted;              // Memory the paused connection waits for, for the payload of its delta request
+    size_t payload_reserved;            // Memory reserved for that payload when the connection continues
+    unsigned char header[RESPONSE_HEADER_SIZE];     // Response frame header and payload to send to the client
+    size_t header_length;               // Number of bytes in the header
+    size_t header_sent;                 // Number of bytes of the header already sent
+    CachedFile *file;                   // File we are sending to the client, NULL if none
+    int file_fd;                        // Descriptor of the file, -1 if none
+    const unsigned char *file_data;     // Contents of the file in the cache memory, NULL if the body comes from file_fd
+    int compression;                    // COMPRESS_* method of the body, COMPRESS_NONE - the file data as it is
+    unsigned char *compress_buffer;     // Raw chunk and the compressed chunk with its header, taken from the pool for one response
+    size_t chunk_length;                // Bytes of the chunk ready to be sent
+    size_t chunk_sent;                  // Bytes of the chunk already sent
+    unsigned char *body_buffer;         // Body prepared in memory (stats, manifest), NULL if the body comes from the file
+    off_t body_offset;                  // Position in the file of the next byte to send
+    off_t body_end;                     // Position in the file after the last byte to send
+    TransferMode transfer_mode;         // The way we send the file data on this connection
+    int pipe_fds[2];                    // Pipe for splice(), created when the connection needs it
+    size_t pipe_bytes;                  // Bytes of the file already in the pipe but not sent to the socket yet
+    size_t pipe_size;                   // Capacity of the pipe, it grows with the chunk size
+    TransferTuner tuner;                // Socket buffer and chunk size of the large transfers (common/transfer.h)
+    int uring_buffer;                   // Registered buffer and fixed file slots of the io_uring transfer, -1 if none
+    int uring_fds[2];                   // File and socket for the fixed file slots, the kernel reads them on submit
+    int uring_inflight;                 // Operations submitted to io_uring and not completed yet
+    int32_t uring_files_result;         // Results of the operations of the last chain
+    int32_t uring_read_result;
+    int32_t uring_send_result;
+    size_t uring_length;                // Bytes read and sent by the last chain
+    int closing;                        // Connection is closed, but io_uring still uses its memory
+    uint64_t response_start_us;         // Time when the request of the current response was received
+    int first_byte_sent;                // Flag that the first byte of the current response is sent
+    struct Subscription *subscription;  // File the client is subscribed to, NULL if none
+    TokenBucket bucket;                 // Rate limit of the client
+    int64_t deficit;                    // Bytes the transfer may still send in its turn, negative if it sent more
+    uint64_t throttled_until_us;        // Time the rate limits let the transfer continue, 0 if it is not throttled
+    uint64_t waiting_since_us;          // Time the transfer gave up its turn, 0 if it doesn't wait
+    struct Connection *throttled_next;  // Next throttled connection of the shard
+    struct Fetch *fetch;                // Upstream fetch the response waits for or streams from, NULL if none
+    int relayed;                        // Flag that the request is answered after its fetch and doesn't start another
+    int relay_confirmed;                // Flag that this fetch succeeded, the local copy is as new as the upstream copy
+    struct Job *job;                    // Worker job the response waits for, NULL if none
+    CachedFile *job_file;               // File whose block checksums the job computed, the handler takes it
+    int file_checked;                   // Flag that the request continues after the checksum job and doesn't start another
+    int parked;                         // Flag that the connection waits for the progress of the fetch or the job
+    struct Connection *parked_next;     // Next connection of the shard waiting for a fetch or a job
+} Connection;
+
+// Subscription of the connection to the appends of the file, owned by the shard of the connection
+typedef struct Subscription {
+    Connection *connection;             // Connection the appended data is pushed to
+    CachedFile *file;                   // Own descriptor of the file outside the cache, it follows the file as it grows
+    int watch;                          // Watch of the file in the inotify instance of the shard, -1 if it is removed
+    uint8_t flags;                      // Flags of the subscribe request, the pushes are compressed and checksummed the same way
+    uint32_t request_id;                // Id of the subscribe request, every push carries it
+    uint64_t offset;                    // Bytes of the file the client has or will have after the responses in progress
+    int changed;                        // inotify reported a change since the last push
+    int removed;                        // File was removed or renamed, the subscription ends with STATUS_NOT_FOUND
+    struct Subscription *next;          // Next subscription of the shard
+} Subscription;
+
+// Growing buffer for the manifest and the delta steps
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} DeltaBuffer;
+
+// Part of the file read for the delta, the checksum rolls over it and it is read again further on
+// The file may change meanwhile: a read which ends early lowers the size, the delta covers only the bytes read
+typedef struct {
+    int fd;
+    unsigned char *data;
+    size_t capacity;
+    uint64_t start;                     // Offset of the first byte of data in the file
+    size_t length;                      // Bytes of the file in data
+    uint64_t size;                      // Size of the file, lowered if the file ends earlier
+} DeltaWindow;
+
+// Delta instruction before it is encoded: the literal data stays in the file until the instruction is sent
+typedef struct {
+    uint8_t type;                       // DELTA_COPY or DELTA_LITERAL
+    uint32_t count;                     // Blocks to copy or bytes of the literal data
+    uint64_t start;                     // First block to copy or offset of the literal data in the file
+} DeltaStep;
+
+// Request answered by a worker thread: walking a directory tree, rolling the checksum over a whole file or
+// reading a whole file for its block checksums would stop all connections of the shard, so the connection waits
+// for the job the way a relayed request waits for its fetch
+typedef struct Job {
+    Request request;                    // Copy of the request, the job owns its payload
+    int wake_event;                     // eventfd of the shard of the connection, written when the job is done
+    _Atomic int done;                   // Flag that the worker finished, the results below are valid from then on
+    _Atomic int refs;                   // The worker thread and the connection
+    uint8_t status;                     // STATUS_OK or the status of the response without body
+    struct stat file_stat;              // Information of the file or the directory for the response
+    DeltaBuffer body;                   // Manifest, or the DeltaStep array of the delta
+    size_t reserved;                    // Bytes of the body counted under the memory cap
+    CachedFile *file;                   // Delta: file the literal data is read from while the body is sent,
+                                        // other requests: file the block checksums are computed for
+    uint64_t body_size;                 // Delta: bytes of the encoded instructions
+    uint32_t checksum;                  // Delta: CRC32C of the whole file, the client checks the rebuilt copy with it
+    int has_checksum;
+    size_t step;                        // Delta: next step to encode
+    uint64_t step_sent;                 // Delta: bytes of this step already encoded
+    struct Job *next;                   // Next job waiting for a worker
+} Job;
+
+// Jobs waiting for the worker threads, shared by all shards
+// The number of workers is fixed and the queue is bounded, so a burst of manifest or delta requests can't start
+// threads without limit, the requests over the bound get STATUS_BUSY
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;               // Signaled when a job is queued
+    Job *head;                          // Oldest job, taken by the next free worker
+    Job *tail;
+    int count;                          // Jobs in the queue
+    int workers;                        // Started worker threads, without them no job is queued
+} JobQueue;
+
+// io_uring instance of the uring transfer mode, the rings are shared with the kernel
+typedef struct {
+    int ring_fd;                        // io_uring instance, -1 if the uring mode is not used
+    int event_fd;                       // Signaled by the kernel when completions are posted, watched by epoll
+    _Atomic unsigned *sq_head;          // Submission queue: the kernel moves head, we move tail
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;                // Prepared entries not submitted to the kernel yet
+    _Atomic unsigned *cq_head;          // Completion queue: the kernel moves tail, we move head
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned char *buffers;             // URING_BUFFER_COUNT registered buffers of URING_BUFFER_SIZE bytes
+    int free_buffers[URING_BUFFER_COUNT];   // Stack of the buffers which are not used by any transfer
+    int free_count;
+} UringEngine;
+
+// Event loop data
+typedef struct {
+    int epoll_fd;           // epoll instance watching the listening socket and all the client sockets
+    int server_socket;      // Listening socket of this shard
+    int index;              // Number of the shard, selects its CPU
+    TransferMode transfer_mode;     // Transfer mode of the new connections, sendfile if io_uring is not available
+    int wake_event;         // eventfd the upstream fetches and the worker jobs write to when they make progress
+    int accept_deferred;    // Listening socket is not watched, there is no memory for the new connections
+} EventLoop;
+
+// Slab of a pool: objects of one size allocated together, the slab is freed when all its objects are given back
+typedef struct PoolSlab {
+    struct Pool *pool;                  // Pool the slab belongs to
+    struct PoolSlab *next;              // Next and previous slab of the pool with free objects
+    struct PoolSlab *prev;
+    void *free_objects;                 // Objects which are not taken, linked through their first bytes
+    int taken;                          // Objects taken from the slab
+    size_t size;                        // Bytes of the slab, counted in the memory of the pools
+} PoolSlab;
+
+// Header of every object of a pool, the object follows it
+typedef union {
+    PoolSlab *slab;
+    max_align_t align;
+} PoolHeader;
+
+// Allocator of the objects of one size, owned by one shard
+// The slabs of all pools are counted against the memory cap (-M), the pools of one shard are used by its thread only
+typedef struct Pool {
+    size_t object_size;                 // Bytes of one object
+    int keep;                           // Flag that the last slab is never freed, the shard always has objects of this pool
+    PoolSlab *available;                // Slabs with free objects
+} Pool;
+
+// States of the upstream fetch in the relay mode
+typedef enum {
+    FETCH_CONNECTING,       // Request is sent to the upstream, the response didn't come yet
+    FETCH_STREAMING,        // New file is being written, the transfers of the whole file send what is written so far
+    FETCH_DONE,             // Local file is up to date: written, appended or the upstream had nothing new
+    FETCH_MISSING,          // Upstream doesn't have the file either
+    FETCH_FAILED            // Upstream can't be reached or sent damaged data, the local files are as they were
+} FetchState;
+
+// Fetch of one file from the upstream server, shared by all requests which miss the file while it runs
+typedef struct Fetch {
+    char *path;                         // Requested file name
+    uint64_t offset;                    // Bytes of the local file the fetch appends to, 0 - the whole file is fetched
+    uint32_t local_checksum;            // Checksum of these bytes, the upstream checks they are a prefix of its copy
+    _Atomic int state;                  // FetchState, the fields below are valid from FETCH_STREAMING on
+    CachedFile *file;                   // New file being written, outside the cache
+    uint64_t length;                    // Size of the new file
+    uint32_t checksum;                  // Checksum of the new file from the upstream
+    int has_checksum;
+    uint64_t mtime_ns;                  // Modification time of the upstream file, the local copy gets it too
+    _Atomic uint64_t written;           // Bytes of the new file written so far
+    int refs;                           // The fetch thread and every connection which uses the fetch
+    struct Fetch *next;                 // Next fetch in progress
+} Fetch;
+
+// Relay mode: files missing locally are fetched from the upstream server and kept in the local directory
+typedef struct {
+    pthread_mutex_t mutex;              // Protects the list of the fetches and their references
+    int enabled;
+    struct sockaddr_in upstream;        // Address of the upstream server
+    Fetch *fetches;                     // Fetches in progress, one per file
+    int *shard_events;                  // wake_event of every shard
+    _Atomic uint64_t started;           // Fetches started
+    _Atomic uint64_t collapsed;         // Misses which joined the fetch in progress
+    _Atomic uint64_t failed;            // Fetches which failed
+    _Atomic uint64_t bytes;             // Bytes received from the upstream
+} Relay;
+
+TransferMode transfer_mode = TRANSFER_SENDFILE;    // Transfer mode selected at startup
+int server_port = PORT;                             // Port selected at startup
+int worker_count = 1;                               // Shards selected at startup, every shard is an event loop thread
+cpu_set_t allowed_cpus;                             // CPUs the server may use, shards are pinned to them in turn
+_Thread_local UringEngine uring = { .ring_fd = -1, .event_fd = -1 };   // Every shard has its own io_uring instance
+static const int uring_empty_slots[2] = {-1, -1};  // Values to empty the fixed file slots of the finished transfer
+_Thread_local unsigned char *copy_buffer = NULL;    // Buffer of the pread()/send() transfers of the shard
+_Thread_local int subscription_inotify = -1;        // inotify instance of the shard for the subscribed files
+_Thread_local Subscription *subscriptions = NULL;   // Subscriptions of the connections of the shard
+_Atomic uint64_t global_rate_limit = 0;             // Bytes per second of all clients together, 0 - no limit
+_Atomic uint64_t client_rate_limit = 0;             // Bytes per second of every client, 0 - no limit
+_Thread_local TokenBucket shard_bucket;             // Share of the shard in the global limit
+_Thread_local Connection *throttled_connections = NULL;    // Connections waiting for the tokens
+Relay relay = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+_Thread_local Connection *parked_connections = NULL;    // Connections of the shard waiting for the fetches and the jobs
+_Thread_local int shard_wake_event = -1;            // wake_event of the current shard, the jobs of its connections write to it
+atomic_size_t memory_used = 0;                      // Bytes of the slabs of the pools of all shards
+size_t memory_limit = 0;                            // Memory cap of the pools selected at startup, 0 - no limit
+_Thread_local Pool connection_pool = { .object_size = sizeof(Connection), .keep = 1 };
+_Thread_local Pool io_pool = { .object_size = sizeof(IoBuffers), .keep = 1 };
+_Thread_local Pool compress_pool = { .object_size = COMPRESS_CHUNK_SIZE + COMPRESS_CHUNK_HEADER_SIZE + COMPRESS_BUFFER_SIZE };
+_Thread_local Connection *io_waiting = NULL;        // Connections of the shard waiting for the I/O buffers, oldest first
+_Thread_local Connection *io_waiting_tail = NULL;
+FileCache file_cache = { .mutex = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1,
+                         .small_file_size = SMALL_FILE_SIZE, .data_budget = FILE_MEMORY_BUDGET };
+HashCache hash_cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+JobQueue job_queue = { .mutex = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+LogLevel log_level = LEVEL_INFO;                    // Level selected at startup
+int logger_running = 0;                             // Messages are written directly until the logger thread starts
+_Atomic(Metrics *) thread_metrics[MAX_THREADS];     // Metrics of every registered thread, the stats request sums them
+_Atomic(LogRing *) thread_logs[MAX_THREADS];        // Log rings of every registered thread, drained by the logger thread
+atomic_int thread_count = 0;                        // Registered threads
+static _Thread_local Metrics *metrics = NULL;       // Metrics of the current thread
+static _Thread_local LogRing *log_ring = NULL;      // Log ring of the current thread, NULL - messages are written directly
+
+// Function prototypes
+uint64_t nowMicroseconds(void);
+void metricAdd(_Atomic uint64_t *counter, uint64_t value);
+void histogramAdd(Histogram *histogram, uint64_t latency_us);
+int registerThread(void);
+int startThread(void *(*function)(void *), void *arg);
+void logMessage(LogLevel level, const char *format, ...);
+void logFlush(void);
+void *loggerThread(void *arg);
+void loggerInit(void);
+void formatHistogram(FILE *stream, const char *name, Histogram *const histograms[], int count);
+char *formatStats(size_t *size);
+void statsResponse(Connection *connection, const Request *request);
+int requestQueuePush(RequestQueue *queue, const Request *request);
+Request *requestQueueFront(RequestQueue *queue);
+void requestQueuePop(RequestQueue *queue);
+int requestQueueFull(RequestQueue *queue);
+int memoryReserve(size_t size);
+void memoryRelease(size_t size);
+void requestFreePayload(Request *request);
+size_t poolLayout(const Pool *pool, size_t *first, size_t *stride, size_t *count);
+void *poolTake(Pool *pool);
+void poolGive(void *object);
+int poolInit(Pool *pool);
+int poolReady(Pool *pool);
+void setResponse(Connection *connection, const Request *request, uint8_t status);
+void setFileResponse(Connection *connection, const Request *request, CachedFile *file, const struct stat *file_stat,
+                     off_t offset, off_t length);
+uint32_t hashPath(const char *path);
+void fileCacheInit(void);
+CachedFile *fileCacheOpen(const char *path);
+CachedFile *fileOpen(const char *path, uint32_t hash);
+void fileCacheInvalidate(const char *path);
+void fileCacheRelease(CachedFile *file);
+void fileCacheRemove(CachedFile *file);
+void fileCacheUnwatch(int watch);
+void fileCacheLoad(CachedFile *file);
+int fileCompressible(CachedFile *file, unsigned char *buffer);
+int setCompression(Connection *connection, const Request *request, CachedFile *file, off_t length);
+const uint32_t *fileBlockChecksums(CachedFile *file);
+int fileRangeChecksum(CachedFile *file, off_t offset, off_t length, uint32_t *checksum);
+CachedFile *requestFile(Connection *connection, const Request *request);
+int fileChecksumWait(Connection *connection, const Request *request, CachedFile *file, off_t length);
+void *fileCacheWatcher(void *arg);
+void sendFile(Connection *connection, const Request *request);
+void updateFile(Connection *connection, const Request *request);
+void statFile(Connection *connection, const Request *request);
+void subscribeFile(Connection *connection, const Request *request);
+void subscriptionUnwatch(int watch);
+void subscriptionRemove(Connection *connection);
+int subscriptionPush(Connection *connection);
+void subscriptionEvents(EventLoop *loop);
+int fileHash(const char *path, const struct stat *file_stat, uint32_t *hash);
+int manifestDirectory(DeltaBuffer *manifest, char *path, size_t root_length, size_t length, int served_root);
+void manifestFile(Connection *connection, Request *request);
+void manifestBuild(Job *job);
+void manifestResponse(Connection *connection, const Request *request, Job *job);
+void jobInit(void);
+uint8_t jobStart(Connection *connection, const Request *request, CachedFile *file);
+void *jobWorker(void *arg);
+int jobResume(Connection *connection);
+void jobRelease(Job *job);
+void limitsResponse(Connection *connection, const Request *request);
+void tokenBucketRefill(TokenBucket *bucket, uint64_t rate, uint64_t now_us);
+int64_t scheduleTokens(Connection *connection, uint64_t now_us);
+int64_t scheduleTurn(Connection *connection);
+void scheduleChargeTokens(Connection *connection, uint64_t bytes);
+void scheduleCharge(Connection *connection, uint64_t bytes);
+void scheduleThrottle(Connection *connection, uint64_t until_us);
+void scheduleUnthrottle(Connection *connection);
+int scheduleTimeout(void);
+void scheduleWake(EventLoop *loop);
+int relayInit(const char *upstream);
+int relayWait(Connection *connection, const Request *request, uint64_t offset, uint32_t checksum);
+int relayResume(Connection *connection);
+off_t relayAvailable(Fetch *fetch);
+void relayRelease(Fetch *fetch);
+void parkConnection(Connection *connection);
+void unparkConnection(Connection *connection);
+void parkedEvents(EventLoop *loop);
+void relayWake(void);
+int relaySendAll(int socket_fd, const void *buffer, size_t size);
+int relayReceiveAll(int socket_fd, void *buffer, size_t size);
+int relaySkipBytes(int socket_fd, size_t size);
+int relayReceiveResponse(int socket_fd, FrameHeader *header, FileInfo *info);
+int relayReceiveFile(Fetch *fetch, int socket_fd, const FrameHeader *header, const FileInfo *info);
+int relayAppendTail(Fetch *fetch, int staged_fd, uint64_t length, const FileInfo *info);
+int relayStagingPath(const char *path);
+int relayFetchFile(Fetch *fetch);
+void *relayFetchThread(void *arg);
+int deltaBufferAppend(DeltaBuffer *buffer, const void *data, size_t size);
+int deltaAddCopy(DeltaBuffer *buffer, uint32_t *copy_start, uint32_t *copy_count, uint32_t block);
+int deltaAddLiteral(DeltaBuffer *buffer, uint64_t offset, uint64_t size);
+int deltaFlushCopy(DeltaBuffer *buffer, uint32_t *copy_count, uint32_t copy_start);
+int deltaWindowRead(DeltaWindow *window, uint64_t offset, size_t length);
+int computeDelta(int fd, uint64_t *size, const unsigned char *signature, uint32_t block_size,
+                 uint32_t block_count, uint32_t tail_size, DeltaBuffer *delta);
+void deltaFile(Connection *connection, Request *request);
+void deltaBuild(Job *job);
+void deltaResponse(Connection *connection, const Request *request, Job *job);
+size_t deltaEncode(Job *job, unsigned char *buffer, size_t capacity);
+int parseDeltaRequest(Request *request);
+int setNonBlocking(int socket_fd);
+void raiseFileLimit(void);
+Connection *createConnection(int client_socket, TransferMode mode);
+Request *nextRequest(Connection *connection);
+int ioAttach(Connection *connection);
+void ioDetach(Connection *connection);
+void ioPause(Connection *connection);
+void ioUnpause(Connection *connection);
+void deferAccepts(EventLoop *loop);
+void memoryWake(EventLoop *loop);
+void closeConnection(EventLoop *loop, Connection *connection);
+void watchConnection(EventLoop *loop, Connection *connection);
+void acceptConnections(EventLoop *loop);
+int parseRequests(Connection *connection);
+int handleReadRequest(Connection *connection);
+void startResponse(Connection *connection, Request *request);
+void dispatchRequest(Connection *connection, Request *request);
+int handleSendHeader(Connection *connection);
+int sendResponseMemory(Connection *connection);
+int sendBodySendfile(Connection *connection);
+int sendBodySplice(Connection *connection);
+int sendBodyCopy(Connection *connection);
+int sendBodyMemory(Connection *connection);
+int sendBodyDelta(Connection *connection);
+int sendBodyCompressed(Connection *connection);
+int uringInit(void);
+struct io_uring_sqe *uringGetSqe(void);
+void uringSubmit(void);
+void uringRelease(Connection *connection);
+int sendBodyUring(Connection *connection);
+void uringFinishChain(EventLoop *loop, Connection *connection);
+void uringComplete(EventLoop *loop);
+int handleSendBody(Connection *connection);
+int processRequests(Connection *connection);
+void handleConnectionEvent(EventLoop *loop, Connection *connection, uint32_t events);
+int openListener(EventLoop *loop, int reuse_port);
+void pinThread(int index);
+void *runEventLoop(void *arg);
+int parseSize(const char *text, size_t *size);
+
+// Function puts the request to the end of the queue, returns 0 if the queue is full
+int requestQueuePush(RequestQueue *queue, const Request *request) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head == REQUEST_QUEUE_SIZE) {
+        return 0;
+    }
+    queue->requests[tail & (REQUEST_QUEUE_SIZE - 1)] = *request;
+    // Publishing the request only after it is written to the slot
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+// Function returns the oldest request in the queue or NULL if the queue is empty
+Request *requestQueueFront(RequestQueue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    return &queue->requests[head & (REQUEST_QUEUE_SIZE - 1)];
+}
+
+// Function removes the oldest request from the queue, the slot can be reused by the producer afterwards
+void requestQueuePop(RequestQueue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+// Function checks if there is no free slot in the queue
+int requestQueueFull(RequestQueue *queue) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    return tail - head == REQUEST_QUEUE_SIZE;
+}
+
+// Function counts the new memory of the pools, returns -1 if it doesn't fit under the memory cap
+int memoryReserve(size_t size) {
+    size_t used = atomic_fetch_add(&memory_used, size) + size;
+    if (memory_limit != 0 && used > memory_limit) {
+        atomic_fetch_sub(&memory_used, size);
+        return -1;
+    }
+    return 0;
+}
+
+// Function gives back the memory of the freed slab
+void memoryRelease(size_t size) {
+    atomic_fetch_sub(&memory_used, size);
+}
+
+// Function frees the payload of the delta request, its memory was counted under the cap when it was parsed
+void requestFreePayload(Request *request) {
+    if (request->payload != NULL) {
+        memoryRelease(request->payload_size);
+        free(request->payload);
+        request->payload = NULL;
+    }
+}
+
+// Function computes the layout of the slabs of the pool: offset of the first object, distance between the objects
+// and the number of objects, returns the size of the slab
+size_t poolLayout(const Pool *pool, size_t *first, size_t *stride, size_t *count) {
+    *stride = sizeof(PoolHeader) + (pool->object_size + sizeof(PoolHeader) - 1) / sizeof(PoolHeader) * sizeof(PoolHeader);
+    *first = (sizeof(PoolSlab) + sizeof(PoolHeader) - 1) / sizeof(PoolHeader) * sizeof(PoolHeader);
+    *count = POOL_SLAB_SIZE > *first + *stride ? (POOL_SLAB_SIZE - *first) / *stride : 1;
+    return *first + *count * *stride;
+}
+
+// Function takes an object from the pool, a new slab is allocated if no slab has free objects
+// Returns NULL if the slab doesn't fit under the memory cap, the contents of the object are not initialized
+void *poolTake(Pool *pool) {
+    PoolSlab *slab = pool->available;
+    if (slab == NULL) {
+        size_t first, stride, count;
+        size_t size = poolLayout(pool, &first, &stride, &count);
+        if (memoryReserve(size) == -1) {
+            return NULL;
+        }
+        slab = malloc(size);
+        if (slab == NULL) {
+            memoryRelease(size);
+            return NULL;
+        }
+        slab->pool = pool;
+        slab->next = NULL;
+        slab->prev = NULL;
+        slab->free_objects = NULL;
+        slab->taken = 0;
+        slab->size = size;
+        // Objects are linked in the order of their addresses
+        for (size_t i = count; i > 0; i--) {
+            PoolHeader *header = (PoolHeader *)((unsigned char *)slab + first + (i - 1) * stride);
+            header->slab = slab;
+            *(void **)(header + 1) = slab->free_objects;
+            slab->free_objects = header + 1;
+        }
+        pool->available = slab;
+    }
+
+    void *object = slab->free_objects;
+    slab->free_objects = *(void **)object;
+    slab->taken++;
+    if (slab->free_objects == NULL) {
+        // Slab is full, it leaves the list until an object comes back
+        pool->available = slab->next;
+        if (slab->next != NULL) {
+            slab->next->prev = NULL;
+        }
+        slab->next = NULL;
+    }
+    return object;
+}
+
+// Function gives the object back to the pool it was taken from
+// The slab without taken objects is freed, the last one is kept if the pool keeps it or there is no memory cap
+void poolGive(void *object) {
+    PoolSlab *slab = ((PoolHeader *)object - 1)->slab;
+    Pool *pool = slab->pool;
+    if (slab->free_objects == NULL) {
+        slab->prev = NULL;
+        slab->next = pool->available;
+        if (pool->available != NULL) {
+            pool->available->prev = slab;
+        }
+        pool->available = slab;
+    }
+    *(void **)object = slab->free_objects;
+    slab->free_objects = object;
+    slab->taken--;
+    if (slab->taken == 0 && (slab->prev != NULL || slab->next != NULL || (!pool->keep && memory_limit != 0))) {
+        if (slab->prev != NULL) {
+            slab->prev->next = slab->next;
+        } else {
+            pool->available = slab->next;
+        }
+        if (slab->next != NULL) {
+            slab->next->prev = slab->prev;
+        }
+        memoryRelease(slab->size);
+        free(slab);
+    }
+}
+
+// Function allocates the first slab of the pool which keeps it, returns -1 if it doesn't fit under the memory cap
+int poolInit(Pool *pool) {
+    void *object = poolTake(pool);
+    if (object == NULL) {
+        return -1;
+    }
+    poolGive(object);
+    return 0;
+}
+
+// Function checks if an object can be taken from the pool: a slab has a free object or a new slab fits under the cap
+int poolReady(Pool *pool) {
+    if (pool->available != NULL || memory_limit == 0) {
+        return 1;
+    }
+    size_t first, stride, count;
+    return atomic_load(&memory_used) + poolLayout(pool, &first, &stride, &count) <= memory_limit;
+}
+
+// Function returns the current time in microseconds, the clock is read without a system call (vDSO)
+uint64_t nowMicroseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function adds the value to the counter of the current thread
+// Only the owner thread writes the counter, so a plain load and store is enough and no locked instruction is needed,
+// the stats reader may see the value a bit late but never torn
+void metricAdd(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Function counts the latency in its bucket: bucket i gets the latencies from 2^(i-1) + 1 to 2^i microseconds
+void histogramAdd(Histogram *histogram, uint64_t latency_us) {
+    int bucket = latency_us <= 1 ? 0 : 64 - __builtin_clzll(latency_us - 1);
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    metricAdd(&histogram->buckets[bucket], 1);
+    metricAdd(&histogram->count, 1);
+    metricAdd(&histogram->sum_us, latency_us);
+}
+
+// Function gives the current thread its own metrics and log ring, returns -1 if there is no memory or too many threads
+int registerThread(void) {
+    Metrics *new_metrics = calloc(1, sizeof(Metrics));
+    LogRing *new_ring = calloc(1, sizeof(LogRing));
+    int index = atomic_fetch_add(&thread_count, 1);
+    if (new_metrics == NULL || new_ring == NULL || index >= MAX_THREADS) {
+        free(new_metrics);
+        free(new_ring);
+        return -1;
+    }
+    // Readers skip the slot until the pointer is published
+    atomic_store_explicit(&thread_metrics[index], new_metrics, memory_order_release);
+    atomic_store_explicit(&thread_logs[index], new_ring, memory_order_release);
+    metrics = new_metrics;
+    log_ring = new_ring;
+    return 0;
+}
+
+// Function logs the message if its level is selected, the newline is added to the message
+// Registered threads only put the message into their ring, the logger thread writes it to the console later
+void logMessage(LogLevel level, const char *format, ...) {
+    if (level > log_level) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    if (log_ring == NULL || !logger_running) {
+        FILE *stream = level <= LEVEL_WARNING ? stderr : stdout;
+        vfprintf(stream, format, args);
+        fputc('\n', stream);
+        va_end(args);
+        return;
+    }
+
+    size_t tail = atomic_load_explicit(&log_ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&log_ring->head, memory_order_acquire);
+    if (tail - head == LOG_RING_SIZE) {
+        // Console is too slow, losing the message is better than stopping the event loop
+        metricAdd(&log_ring->dropped, 1);
+    } else {
+        LogMessage *message = &log_ring->messages[tail & (LOG_RING_SIZE - 1)];
+        message->level = level;
+        vsnprintf(message->text, sizeof(message->text), format, args);
+        atomic_store_explicit(&log_ring->tail, tail + 1, memory_order_release);
+    }
+    va_end(args);
+}
+
+// Function writes the messages collected in the rings of all threads to the console, called by the logger thread only
+void logFlush(void) {
+    int count = atomic_load(&thread_count);
+    for (int i = 0; i < count && i < MAX_THREADS; i++) {
+        LogRing *ring = atomic_load_explicit(&thread_logs[i], memory_order_acquire);
+        if (ring == NULL) {
+            continue;
+        }
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            LogMessage *message = &ring->messages[head & (LOG_RING_SIZE - 1)];
+            FILE *stream = message->level <= LEVEL_WARNING ? stderr : stdout;
+            fputs(message->text, stream);
+            fputc('\n', stream);
+        }
+        // Giving the slots back to the thread only after the messages are copied to the stream buffer
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+        uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->dropped_reported) {
+            fprintf(stderr, "%" PRIu64 " log messages dropped\n", dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+        }
+    }
+    // One write of all the collected messages instead of one write per message
+    fflush(stdout);
+    fflush(stderr);
+}
+
+// Function of the logger thread: writes the collected messages every LOG_FLUSH_INTERVAL_US
+void *loggerThread(void *arg) {
+    (void)arg;
+    while (1) {
+        usleep(LOG_FLUSH_INTERVAL_US);
+        logFlush();
+    }
+    return NULL;
+}
+
+// Function starts a detached thread with the small stack, returns -1 on error
+// The default stack reserves megabytes for every thread, the threads of the server keep their big buffers on the heap
+int startThread(void *(*function)(void *), void *arg) {
+    pthread_attr_t attributes;
+    pthread_t thread;
+    if (pthread_attr_init(&attributes) != 0) {
+        return -1;
+    }
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attributes, THREAD_STACK_SIZE);
+    int result = pthread_create(&thread, &attributes, function, arg);
+    pthread_attr_destroy(&attributes);
+    return result == 0 ? 0 : -1;
+}
+
+// Function starts the logger thread, without it the messages are written directly by the thread which logs them
+void loggerInit(void) {
+    if (startThread(loggerThread, NULL) == -1) {
+        fprintf(stderr, "Error creating logger thread, messages are written directly\n");
+        return;
+    }
+    // Logger thread flushes the streams itself, the console doesn't get a write for every line
+    setvbuf(stdout, NULL, _IOFBF, 65536);
+    setvbuf(stderr, NULL, _IOFBF, 65536);
+    logger_running = 1;
+}
+
+// Function prints the sum of the histograms of all threads in the Prometheus text format
+void formatHistogram(FILE *stream, const char *name, Histogram *const histograms[], int count) {
+    uint64_t cumulative = 0;
+    uint64_t sum_us = 0;
+    fprintf(stream, "# TYPE %s histogram\n", name);
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        for (int i = 0; i < count; i++) {
+            cumulative += atomic_load_explicit(&histograms[i]->buckets[bucket], memory_order_relaxed);
+        }
+        if (bucket < HISTOGRAM_BUCKETS - 1) {
+            fprintf(stream, "%s_bucket{le=\"%llu\"} %" PRIu64 "\n", name, 1ULL << bucket, cumulative);
+        } else {
+            fprintf(stream, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, cumulative);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        sum_us += atomic_load_explicit(&histograms[i]->sum_us, memory_order_relaxed);
+    }
+    // Count is taken from the buckets, so it always matches the +Inf bucket
+    fprintf(stream, "%s_sum %" PRIu64 "\n%s_count %" PRIu64 "\n", name, sum_us, name, cumulative);
+}
+
+// Function sums the metrics of all threads and formats them as text, one metric per line (Prometheus text format)
+// Returns the allocated text or NULL if there is no memory
+char *formatStats(size_t *size) {
+    static const char *const opcode_names[METRICS_OPCODES] = {"unknown", "download", "update", "delta", "stat", "stats",
+                                                               "subscribe", "manifest", "limits"};
+    static const char *const status_names[METRICS_STATUSES] = {"ok", "not_found", "no_update", "diverged",
+                                                               "bad_request", "unsupported", "error", "busy"};
+    uint64_t requests[METRICS_OPCODES] = {0};
+    uint64_t responses[METRICS_STATUSES] = {0};
+    uint64_t bytes_sent = 0, accepted = 0, closed = 0, log_dropped = 0, memory_hits = 0, memory_misses = 0;
+    uint64_t compressed = 0, compression_skipped = 0, compression_input = 0, compression_output = 0;
+    uint64_t checksum_mismatches = 0, subscriptions_started = 0, subscriptions_ended = 0, subscription_pushes = 0;
+    uint64_t throttled = 0, accepts_deferred = 0, reads_paused = 0;
+    Histogram *first_byte[MAX_THREADS];
+    Histogram *transfer[MAX_THREADS];
+    Histogram *schedule_wait[MAX_THREADS];
+    int histogram_count = 0;
+
+    // Counters are read without stopping the threads, every value is exact on its own
+    int count = atomic_load(&thread_count);
+    for (int i = 0; i < count && i < MAX_THREADS; i++) {
+        Metrics *thread = atomic_load_explicit(&thread_metrics[i], memory_order_acquire);
+        LogRing *ring = atomic_load_explicit(&thread_logs[i], memory_order_acquire);
+        if (thread == NULL) {
+            continue;
+        }
+        for (int opcode = 0; opcode < METRICS_OPCODES; opcode++) {
+            requests[opcode] += atomic_load_explicit(&thread->requests[opcode], memory_order_relaxed);
+        }
+        for (int status = 0; status < METRICS_STATUSES; status++) {
+            responses[status] += atomic_load_explicit(&thread->responses[status], memory_order_relaxed);
+        }
+        bytes_sent += atomic_load_explicit(&thread->bytes_sent, memory_order_relaxed);
+        // Closed connections are read first, so the number of active connections is never negative
+        closed += atomic_load_explicit(&thread->connections_closed, memory_order_relaxed);
+        accepted += atomic_load_explicit(&thread->connections_accepted, memory_order_relaxed);
+        memory_hits += atomic_load_explicit(&thread->memory_hits, memory_order_relaxed);
+        memory_misses += atomic_load_explicit(&thread->memory_misses, memory_order_relaxed);
+        compressed += atomic_load_explicit(&thread->compressed_responses, memory_order_relaxed);
+        compression_skipped += atomic_load_explicit(&thread->compression_skipped, memory_order_relaxed);
+        compression_input += atomic_load_explicit(&thread->compression_input, memory_order_relaxed);
+        compression_output += atomic_load_explicit(&thread->compression_output, memory_order_relaxed);
+        checksum_mismatches += atomic_load_explicit(&thread->checksum_mismatches, memory_order_relaxed);
+        subscriptions_ended += atomic_load_explicit(&thread->subscriptions_ended, memory_order_relaxed);
+        subscriptions_started += atomic_load_explicit(&thread->subscriptions_started, memory_order_relaxed);
+        subscription_pushes += atomic_load_explicit(&thread->subscription_pushes, memory_order_relaxed);
+        throttled += atomic_load_explicit(&thread->throttled, memory_order_relaxed);
+        accepts_deferred += atomic_load_explicit(&thread->accepts_deferred, memory_order_relaxed);
+        reads_paused += atomic_load_explicit(&thread->reads_paused, memory_order_relaxed);
+        if (ring != NULL) {
+            log_dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        }
+        first_byte[histogram_count] = &thread->first_byte;
+        transfer[histogram_count] = &thread->transfer;
+        schedule_wait[histogram_count] = &thread->schedule_wait;
+        histogram_count++;
+    }
+
+    pthread_mutex_lock(&file_cache.mutex);
+    uint64_t cache_hits = file_cache.hits;
+    uint64_t cache_misses = file_cache.misses;
+    int cache_files = file_cache.count;
+    size_t memory_bytes = file_cache.data_bytes;
+    uint64_t memory_evictions = file_cache.data_evictions;
+    pthread_mutex_unlock(&file_cache.mutex);
+
+    char *text = NULL;
+    FILE *stream = open_memstream(&text, size);
+    if (stream == NULL) {
+        return NULL;
+    }
+    fprintf(stream, "# TYPE server_requests_total counter\n");
+    for (int opcode = 0; opcode < METRICS_OPCODES; opcode++) {
+        fprintf(stream, "server_requests_total{op=\"%s\"} %" PRIu64 "\n", opcode_names[opcode], requests[opcode]);
+    }
+    fprintf(stream, "# TYPE server_responses_total counter\n");
+    for (int status = 0; status < METRICS_STATUSES; status++) {
+        fprintf(stream, "server_responses_total{status=\"%s\"} %" PRIu64 "\n", status_names[status], responses[status]);
+    }
+    // Share of the update and delta requests answered without data
+    uint64_t update_requests = requests[OP_UPDATE] + requests[OP_DELTA];
+    fprintf(stream, "# TYPE server_no_update_ratio gauge\nserver_no_update_ratio %.4f\n",
+            update_requests > 0 ? (double)responses[STATUS_NO_UPDATE] / update_requests : 0.0);
+    fprintf(stream, "# TYPE server_bytes_sent_total counter\nserver_bytes_sent_total %" PRIu64 "\n", bytes_sent);
+    fprintf(stream, "# TYPE server_connections_total counter\nserver_connections_total %" PRIu64 "\n", accepted);
+    fprintf(stream, "# TYPE server_connections_active gauge\nserver_connections_active %" PRIu64 "\n", accepted - closed);
+    fprintf(stream, "# TYPE server_file_cache_hits_total counter\nserver_file_cache_hits_total %" PRIu64 "\n", cache_hits);
+    fprintf(stream, "# TYPE server_file_cache_misses_total counter\nserver_file_cache_misses_total %" PRIu64 "\n",
+            cache_misses);
+    fprintf(stream, "# TYPE server_file_cache_files gauge\nserver_file_cache_files %d\n", cache_files);
+    fprintf(stream, "# TYPE server_memory_cache_hits_total counter\nserver_memory_cache_hits_total %" PRIu64 "\n",
+            memory_hits);
+    fprintf(stream, "# TYPE server_memory_cache_misses_total counter\nserver_memory_cache_misses_total %" PRIu64 "\n",
+            memory_misses);
+    fprintf(stream, "# TYPE server_memory_cache_hit_ratio gauge\nserver_memory_cache_hit_ratio %.4f\n",
+            memory_hits + memory_misses > 0 ? (double)memory_hits / (memory_hits + memory_misses) : 0.0);
+    fprintf(stream, "# TYPE server_memory_cache_evictions_total counter\nserver_memory_cache_evictions_total %" PRIu64 "\n",
+            memory_evictions);
+    fprintf(stream, "# TYPE server_memory_cache_bytes gauge\nserver_memory_cache_bytes %zu\n", memory_bytes);
+    fprintf(stream, "# TYPE server_compressed_responses_total counter\nserver_compressed_responses_total %" PRIu64 "\n",
+            compressed);
+    fprintf(stream, "# TYPE server_compression_skipped_total counter\nserver_compression_skipped_total %" PRIu64 "\n",
+            compression_skipped);
+    fprintf(stream, "# TYPE server_compression_input_bytes_total counter\nserver_compression_input_bytes_total %" PRIu64 "\n",
+            compression_input);
+    fprintf(stream, "# TYPE server_compression_output_bytes_total counter\nserver_compression_output_bytes_total %" PRIu64 "\n",
+            compression_output);
+    fprintf(stream, "# TYPE server_checksum_mismatches_total counter\nserver_checksum_mismatches_total %" PRIu64 "\n",
+            checksum_mismatches);
+    fprintf(stream, "# TYPE server_subscriptions_active gauge\nserver_subscriptions_active %" PRIu64 "\n",
+            subscriptions_started - subscriptions_ended);
+    fprintf(stream, "# TYPE server_subscription_pushes_total counter\nserver_subscription_pushes_total %" PRIu64 "\n",
+            subscription_pushes);
+    fprintf(stream, "# TYPE server_rate_limit_bytes gauge\nserver_rate_limit_bytes{scope=\"global\"} %" PRIu64 "\n"
+                    "server_rate_limit_bytes{scope=\"client\"} %" PRIu64 "\n",
+            atomic_load(&global_rate_limit), atomic_load(&client_rate_limit));
+    fprintf(stream, "# TYPE server_throttled_total counter\nserver_throttled_total %" PRIu64 "\n", throttled);
+    fprintf(stream, "# TYPE server_pool_memory_bytes gauge\nserver_pool_memory_bytes %zu\n"
+                    "# TYPE server_pool_memory_limit_bytes gauge\nserver_pool_memory_limit_bytes %zu\n",
+            atomic_load(&memory_used), memory_limit);
+    fprintf(stream, "# TYPE server_accepts_deferred_total counter\nserver_accepts_deferred_total %" PRIu64 "\n"
+                    "# TYPE server_reads_paused_total counter\nserver_reads_paused_total %" PRIu64 "\n",
+            accepts_deferred, reads_paused);
+    pthread_mutex_lock(&job_queue.mutex);
+    int jobs_queued = job_queue.count;
+    pthread_mutex_unlock(&job_queue.mutex);
+    fprintf(stream, "# TYPE server_jobs_queued gauge\nserver_jobs_queued %d\n", jobs_queued);
+    if (relay.enabled) {
+        fprintf(stream, "# TYPE server_relay_fetches_total counter\nserver_relay_fetches_total %" PRIu64 "\n"
+                        "# TYPE server_relay_collapsed_total counter\nserver_relay_collapsed_total %" PRIu64 "\n"
+                        "# TYPE server_relay_failed_total counter\nserver_relay_failed_total %" PRIu64 "\n"
+                        "# TYPE server_relay_bytes_total counter\nserver_relay_bytes_total %" PRIu64 "\n",
+                atomic_load(&relay.started), atomic_load(&relay.collapsed), atomic_load(&relay.failed),
+                atomic_load(&relay.bytes));
+    }
+    fprintf(stream, "# TYPE server_log_dropped_total counter\nserver_log_dropped_total %" PRIu64 "\n", log_dropped);
+    formatHistogram(stream, "server_first_byte_microseconds", first_byte, histogram_count);
+    formatHistogram(stream, "server_transfer_microseconds", transfer, histogram_count);
+    formatHistogram(stream, "server_schedule_wait_microseconds", schedule_wait, histogram_count);
+    if (fclose(stream) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+// Function prepares the response to the stats request: the metrics of the server as text in the body
+void statsResponse(Connection *connection, const Request *request) {
+    logMessage(LEVEL_DEBUG, "Client requested server stats");
+    size_t size = 0;
+    char *text = formatStats(&size);
+    if (text == NULL) {
+        setResponse(connection, request, STATUS_ERROR);
+        return;
+    }
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.opcode = request->opcode;
+    header.status = STATUS_OK;
+    header.flags = size > 0 ? FLAG_BODY : 0;
+    header.request_id = request->request_id;
+    header.length = size;
+    encodeFrameHeader(&header, connection->header);
+    connection->header_length = FRAME_HEADER_SIZE;
+    metricAdd(&metrics->responses[STATUS_OK], 1);
+
+    connection->body_buffer = (unsigned char *)text;
+    connection->body_offset = 0;
+    connection->body_end = size;
+}
+
+// Function prepares the response frame without payload and body
+void setResponse(Connection *connection, const Request *request, uint8_t status) {
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.opcode = request->opcode;
+    header.status = status;
+    header.request_id = request->request_id;
+    header.offset = request->offset;
+    encodeFrameHeader(&header, connection->header);
+    connection->header_length = FRAME_HEADER_SIZE;
+    metricAdd(&metrics->responses[status], 1);
+}
+
+// Function prepares the successful response: frame header, file information and the range of the file as the body
+// The connection takes the reference to the file, file is NULL if the body doesn't come from the file
+// A body prepared in memory is put into body_buffer before the call, so it gets the checksum as well
+void setFileResponse(Connection *connection, const Request *request, CachedFile *file, const struct stat *file_stat,
+                     off_t offset, off_t length) {
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.opcode = request->opcode;
+    header.status = STATUS_OK;
+    header.flags = length > 0 ? FLAG_BODY : 0;
+    header.flags |= setCompression(connection, request, file, length);
+    header.request_id = request->request_id;
+    header.payload_size = FILE_INFO_SIZE;
+    header.offset = offset;
+    header.length = length;
+    // Without the checksum (file can't be read) the response is still valid, the client just can't verify it
+    int has_checksum = 0;
+    if ((request->flags & FLAG_CHECKSUM) && connection->fetch != NULL) {
+        // File streamed from the upstream is not complete yet, the upstream gave the checksum of the whole file
+        header.checksum = connection->fetch->checksum;
+        has_checksum = connection->fetch->has_checksum && offset == 0 && (uint64_t)length == connection->fetch->length;
+    } else if ((request->flags & FLAG_CHECKSUM) && file != NULL) {
+        // Stat response has no body, it carries the checksum of the whole file
+        off_t checksum_length = request->opcode == OP_STAT ? file_stat->st_size : length;
+        has_checksum = fileRangeChecksum(file, offset, checksum_length, &header.checksum) == 0;
+    } else if ((request->flags & FLAG_CHECKSUM) && connection->job != NULL) {
+        // Delta response carries the checksum of the whole file the instructions build
+        header.checksum = connection->job->checksum;
+        has_checksum = connection->job->has_checksum;
+    } else if ((request->flags & FLAG_CHECKSUM) && connection->body_buffer != NULL) {
+        header.checksum = crc32c(0, connection->body_buffer + offset, length);
+        has_checksum = 1;
+    }
+    if (has_checksum) {
+        header.flags |= FLAG_CHECKSUM;
+        header.header_size = FRAME_CHECKSUM_HEADER_SIZE;
+    }
+    size_t header_size = encodeFrameHeader(&header, connection->header);
+
+    FileInfo info;
+    info.file_size = file_stat->st_size;
+    info.mtime_ns = (uint64_t)file_stat->st_mtim.tv_sec * 1000000000ULL + file_stat->st_mtim.tv_nsec;
+    encodeFileInfo(&info, connection->header + header_size);
+    connection->header_length = header_size + FILE_INFO_SIZE;
+    metricAdd(&metrics->responses[STATUS_OK], 1);
+
+    // The range of the file is the body of the response
+    connection->file = file;
+    connection->file_fd = file != NULL ? file->fd : -1;
+    connection->body_offset = offset;
+    connection->body_end = offset + length;
+
+    // Small file in memory goes to the socket together with the header, the file system is not touched
+    connection->file_data = NULL;
+    if (file != NULL && length > 0) {
+        connection->file_data = atomic_load_explicit(&file->data, memory_order_acquire);
+        if (connection->file_data != NULL) {
+            metricAdd(&metrics->memory_hits, 1);
+        } else if ((size_t)file_stat->st_size <= file_cache.small_file_size &&
+                   atomic_load_explicit(&file->watch, memory_order_relaxed) != -1) {
+            metricAdd(&metrics->memory_misses, 1);
+            fileCacheLoad(file);
+            connection->file_data = atomic_load_explicit(&file->data, memory_order_acquire);
+        }
+    }
+}
+
+// Function calculates the hash of the path for the file cache (FNV-1a)
+uint32_t hashPath(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    }
+    return hash;
+}
+
+// Function creates the inotify instance and starts the thread which invalidates the changed files
+// Without inotify the cache is disabled: a changed file could be served with the old size forever
+void fileCacheInit(void) {
+    // Leaving most of the descriptors for the sockets
+    struct rlimit limit;
+    file_cache.max_files = FILE_CACHE_MAX_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur / 4 < FILE_CACHE_MAX_FILES) {
+        file_cache.max_files = limit.rlim_cur / 4;
+    }
+
+    file_cache.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (file_cache.inotify_fd == -1) {
+        perror("Error creating inotify instance, file cache is disabled");
+        return;
+    }
+    if (startThread(fileCacheWatcher, NULL) == -1) {
+        fprintf(stderr, "Error creating file cache watcher thread, file cache is disabled\n");
+        close(file_cache.inotify_fd);
+        file_cache.inotify_fd = -1;
+        return;
+    }
+}
+
+// Function returns the open regular file with its size and modification time, NULL if it can't be opened
+// The caller owns one reference and gives it back with fileCacheRelease()
+// The missing file is opened under the cache mutex, so the watcher can't see the event of the new watch
+// before the file is in the cache
+CachedFile *fileCacheOpen(const char *path) {
+    uint32_t hash = hashPath(path);
+    CachedFile **bucket = &file_cache.buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+    CachedFile *file;
+
+    pthread_mutex_lock(&file_cache.mutex);
+    for (file = *bucket; file != NULL; file = file->hash_next) {
+        if (file->hash == hash && strcmp(file->path, path) == 0) {
+            break;
+        }
+    }
+    if (file != NULL) {
+        // Moving the file to the front of the LRU list
+        if (file != file_cache.lru_head) {
+            file->lru_prev->lru_next = file->lru_next;
+            if (file->lru_next != NULL) {
+                file->lru_next->lru_prev = file->lru_prev;
+            } else {
+                file_cache.lru_tail = file->lru_prev;
+            }
+            file->lru_prev = NULL;
+            file->lru_next = file_cache.lru_head;
+            file_cache.lru_head->lru_prev = file;
+            file_cache.lru_head = file;
+        }
+        file->refs++;
+        file_cache.hits++;
+        pthread_mutex_unlock(&file_cache.mutex);
+        return file;
+    }
+    file_cache.misses++;
+
+    // Watching the file before opening it, so a change right after fstat() still invalidates the cached size
+    int watch = -1;
+    if (file_cache.inotify_fd != -1) {
+        watch = inotify_add_watch(file_cache.inotify_fd, path, FILE_CACHE_EVENTS);
+    }
+    file = fileOpen(path, hash);
+    if (file == NULL) {
+        if (watch != -1) {
+            fileCacheUnwatch(watch);
+        }
+        pthread_mutex_unlock(&file_cache.mutex);
+        return NULL;
+    }
+    if (watch == -1) {
+        // Not cached, the descriptor is closed when the response is sent
+        pthread_mutex_unlock(&file_cache.mutex);
+        return file;
+    }
+
+    // Dropping the least recently used file, it is closed when its last response is sent
+    if (file_cache.count >= file_cache.max_files) {
+        int dropped_watch = file_cache.lru_tail->watch;
+        if (atomic_load(&file_cache.lru_tail->data) != NULL) {
+            file_cache.data_evictions++;
+        }
+        fileCacheRemove(file_cache.lru_tail);
+        fileCacheUnwatch(dropped_watch);
+    }
+    file->watch = watch;
+    file->refs++;
+    file->hash_next = *bucket;
+    *bucket = file;
+    file->lru_next = file_cache.lru_head;
+    if (file_cache.lru_head != NULL) {
+        file_cache.lru_head->lru_prev = file;
+    } else {
+        file_cache.lru_tail = file;
+    }
+    file_cache.lru_head = file;
+    file_cache.count++;
+    pthread_mutex_unlock(&file_cache.mutex);
+    return file;
+}
+
+// Function opens the regular file outside the cache, NULL if it can't be opened
+// The caller owns the only reference and gives it back with fileCacheRelease()
+CachedFile *fileOpen(const char *path, uint32_t hash) {
+    // O_NOATIME: reading doesn't change the file, so the access time update doesn't invalidate it (IN_ATTRIB)
+    int fd = open(path, O_RDONLY | O_NOATIME);
+    if (fd == -1 && errno == EPERM) {
+        fd = open(path, O_RDONLY);  // Only the owner of the file can use O_NOATIME
+    }
+    struct stat file_stat;
+    if (fd != -1 && (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode))) {
+        close(fd);
+        fd = -1;
+    }
+    CachedFile *file = fd == -1 ? NULL : calloc(1, sizeof(CachedFile));
+    if (file != NULL) {
+        file->path = strdup(path);
+    }
+    if (file == NULL || file->path == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        free(file);
+        return NULL;
+    }
+    file->hash = hash;
+    file->fd = fd;
+    file->file_stat = file_stat;
+    file->watch = -1;
+    file->refs = 1;
+    return file;
+}
+
+// Function gives back the reference to the file, the last reference closes it
+void fileCacheRelease(CachedFile *file) {
+    pthread_mutex_lock(&file_cache.mutex);
+    int refs = --file->refs;
+    pthread_mutex_unlock(&file_cache.mutex);
+    if (refs == 0) {
+        close(file->fd);
+        free(atomic_load(&file->data));
+        free(atomic_load(&file->block_checksums));
+        free(file->path);
+        free(file);
+    }
+}
+
+// Function takes the file out of the cache, the caller holds the cache mutex
+// Responses which use the file keep it open until they are sent
+void fileCacheRemove(CachedFile *file) {
+    CachedFile **link = &file_cache.buckets[file->hash & (FILE_CACHE_BUCKETS - 1)];
+    while (*link != file) {
+        link = &(*link)->hash_next;
+    }
+    *link = file->hash_next;
+    if (file->lru_prev != NULL) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        file_cache.lru_head = file->lru_next;
+    }
+    if (file->lru_next != NULL) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        file_cache.lru_tail = file->lru_prev;
+    }
+    file_cache.count--;
+    file->watch = -1;
+    // The contents stay in memory until the last response which sends them is complete
+    if (atomic_load(&file->data) != NULL) {
+        file_cache.data_bytes -= file->file_stat.st_size;
+    }
+    if (--file->refs == 0) {
+        close(file->fd);
+        free(atomic_load(&file->data));
+        free(atomic_load(&file->block_checksums));
+        free(file->path);
+        free(file);
+    }
+}
+
+// Function removes the inotify watch if no cached file uses it, the caller holds the cache mutex
+// Paths of the same file ("a", "./a", hard links) share one watch
+void fileCacheUnwatch(int watch) {
+    for (CachedFile *file = file_cache.lru_head; file != NULL; file = file->lru_next) {
+        if (file->watch == watch) {
+            return;
+        }
+    }
+    inotify_rm_watch(file_cache.inotify_fd, watch);
+}
+
+// Function removes the file from the cache right away, the relay changed it and the inotify event may come later
+void fileCacheInvalidate(const char *path) {
+    uint32_t hash = hashPath(path);
+    pthread_mutex_lock(&file_cache.mutex);
+    for (CachedFile *file = file_cache.buckets[hash & (FILE_CACHE_BUCKETS - 1)]; file != NULL; file = file->hash_next) {
+        if (file->hash == hash && strcmp(file->path, path) == 0) {
+            int watch = file->watch;
+            fileCacheRemove(file);
+            fileCacheUnwatch(watch);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&file_cache.mutex);
+}
+
+// Function reads the contents of the small file into memory, the next responses are sent without the file system
+// The file is read without the cache mutex, the contents are kept only if the file is still in the cache:
+// a change during the reading removes the file from the cache together with the contents
+void fileCacheLoad(CachedFile *file) {
+    size_t size = file->file_stat.st_size;
+    if (size == 0 || size > file_cache.small_file_size || size > file_cache.data_budget ||
+        atomic_load(&file->data) != NULL) {
+        return;
+    }
+    unsigned char *data = malloc(size);
+    if (data == NULL) {
+        return;
+    }
+    if (pread(file->fd, data, size, 0) != (ssize_t)size) {
+        free(data);
+        return;
+    }
+
+    pthread_mutex_lock(&file_cache.mutex);
+    // Another thread may have loaded the same file meanwhile
+    if (file->watch == -1 || atomic_load(&file->data) != NULL) {
+        pthread_mutex_unlock(&file_cache.mutex);
+        free(data);
+        return;
+    }
+    // Dropping the least recently used files in memory until the new one fits into the budget
+    CachedFile *victim = file_cache.lru_tail;
+    while (file_cache.data_bytes + size > file_cache.data_budget && victim != NULL) {
+        CachedFile *previous = victim->lru_prev;
+        if (victim != file && atomic_load(&victim->data) != NULL) {
+            int dropped_watch = victim->watch;
+            fileCacheRemove(victim);
+            fileCacheUnwatch(dropped_watch);
+            file_cache.data_evictions++;
+        }
+        victim = previous;
+    }
+    file_cache.data_bytes += size;
+    // Responses of other threads read the pointer without the mutex
+    atomic_store_explicit(&file->data, data, memory_order_release);
+    pthread_mutex_unlock(&file_cache.mutex);
+}
+
+// Function tells if the file is worth compressing: compresses a sample from the middle of the file with LZ4
+// The answer is kept in the cached file, so the file is sampled again only after it changes
+// buffer has space for the raw chunk and the compressed chunk
+int fileCompressible(CachedFile *file, unsigned char *buffer) {
+    int compressible = atomic_load(&file->compressible);
+    if (compressible != 0) {
+        return compressible > 0;
+    }
+    size_t size = file->file_stat.st_size;
+    size_t sample_size = size < COMPRESS_CHUNK_SIZE ? size : COMPRESS_CHUNK_SIZE;
+    off_t sample_offset = (size - sample_size) / 2;
+    const unsigned char *sample = atomic_load_explicit(&file->data, memory_order_acquire);
+    if (sample != NULL) {
+        sample += sample_offset;
+    } else {
+        if (pread(file->fd, buffer, sample_size, sample_offset) != (ssize_t)sample_size) {
+            return 0;
+        }
+        sample = buffer;
+    }
+    size_t compressed_size = lz4Compress(sample, sample_size, buffer + COMPRESS_CHUNK_SIZE, COMPRESS_BUFFER_SIZE);
+    compressible = compressed_size > 0 && compressed_size <= sample_size * COMPRESS_MAX_RATIO ? 1 : -1;
+    atomic_store(&file->compressible, compressible);
+    return compressible > 0;
+}
+
+// Function selects the compression of the body if the client accepts it and the file compresses
+// Returns the flag for the response header, 0 if the body is sent as it is
+int setCompression(Connection *connection, const Request *request, CachedFile *file, off_t length) {
+    connection->compression = COMPRESS_NONE;
+    // File streamed from the upstream can't be sampled before it is written, it goes as it comes
+    if (file == NULL || connection->fetch != NULL || length < COMPRESS_MIN_SIZE || (request->flags & (FLAG_LZ4 | FLAG_DEFLATE)) == 0) {
+        return 0;
+    }
+    // The buffer goes back to the pool of the shard after the response, without the memory for it the body is sent raw
+    if (connection->compress_buffer == NULL) {
+        connection->compress_buffer = poolTake(&compress_pool);
+        if (connection->compress_buffer == NULL) {
+            return 0;
+        }
+    }
+    if (!fileCompressible(file, connection->compress_buffer)) {
+        metricAdd(&metrics->compression_skipped, 1);
+        return 0;
+    }
+    connection->compression = request->flags & FLAG_LZ4 ? COMPRESS_LZ4 : COMPRESS_DEFLATE;
+    connection->chunk_length = 0;
+    connection->chunk_sent = 0;
+    metricAdd(&metrics->compressed_responses, 1);
+    return connection->compression == COMPRESS_LZ4 ? FLAG_LZ4 : FLAG_DEFLATE;
+}
+
+// Function returns the checksum of every CHECKSUM_BLOCK_SIZE block of the file, NULL if the file can't be read
+// The whole file is read once by a worker thread, on the first request which needs the checksum, the table stays with
+// the cached file until the file changes, so the next checksums of the file cost almost nothing
+const uint32_t *fileBlockChecksums(CachedFile *file) {
+    uint32_t *blocks = atomic_load_explicit(&file->block_checksums, memory_order_acquire);
+    if (blocks != NULL) {
+        return blocks;
+    }
+    size_t size = file->file_stat.st_size;
+    size_t count = (size + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+    blocks = malloc(count > 0 ? count * sizeof(uint32_t) : 1);
+    unsigned char *buffer = malloc(CHECKSUM_BLOCK_SIZE);
+    if (blocks == NULL || buffer == NULL) {
+        free(blocks);
+        free(buffer);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t block_size = size - i * CHECKSUM_BLOCK_SIZE < CHECKSUM_BLOCK_SIZE ? size - i * CHECKSUM_BLOCK_SIZE : CHECKSUM_BLOCK_SIZE;
+        if (pread(file->fd, buffer, block_size, (off_t)i * CHECKSUM_BLOCK_SIZE) != (ssize_t)block_size) {
+            // File got shorter, it is going to be dropped from the cache
+            free(blocks);
+            free(buffer);
+            return NULL;
+        }
+        blocks[i] = crc32c(0, buffer, block_size);
+    }
+    free(buffer);
+
+    // Another thread may have computed the same table meanwhile, its table is used then
+    uint32_t *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&file->block_checksums, &expected, blocks, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        free(blocks);
+        return expected;
+    }
+    return blocks;
+}
+
+// Function computes the checksum of the range of the file, returns -1 if the file can't be read
+// Whole blocks inside the range are taken from the block table, only the partial blocks at the ends are read;
+// without the table every block of the range is read, the event loop checks fileChecksumWait() first
+int fileRangeChecksum(CachedFile *file, off_t offset, off_t length, uint32_t *checksum) {
+    const unsigned char *data = atomic_load_explicit(&file->data, memory_order_acquire);
+    if (data != NULL) {
+        *checksum = crc32c(0, data + offset, length);
+        return 0;
+    }
+    const uint32_t *blocks = atomic_load_explicit(&file->block_checksums, memory_order_acquire);
+
+    uint32_t crc = 0;
+    uint32_t block_shift = crc32cShiftOperator(CHECKSUM_BLOCK_SIZE);
+    unsigned char *buffer = NULL;
+    off_t end = offset + length;
+    off_t file_size = file->file_stat.st_size;
+    while (offset < end) {
+        off_t block = offset / CHECKSUM_BLOCK_SIZE;
+        off_t block_end = (block + 1) * CHECKSUM_BLOCK_SIZE < file_size ? (block + 1) * CHECKSUM_BLOCK_SIZE : file_size;
+        if (blocks != NULL && offset == block * CHECKSUM_BLOCK_SIZE && block_end <= end) {
+            // Only the last block of the file can be shorter than the block size
+            crc = block_end - offset == CHECKSUM_BLOCK_SIZE ? crc32cCombineWith(crc, blocks[block], block_shift)
+                                                            : crc32cCombine(crc, blocks[block], block_end - offset);
+            offset = block_end;
+            continue;
+        }
+        off_t part_end = block_end < end ? block_end : end;
+        if (buffer == NULL && (buffer = malloc(CHECKSUM_BLOCK_SIZE)) == NULL) {
+            return -1;
+        }
+        if (pread(file->fd, buffer, part_end - offset, offset) != part_end - offset) {
+            free(buffer);
+            return -1;
+        }
+        crc = crc32c(crc, buffer, part_end - offset);
+        offset = part_end;
+    }
+    free(buffer);
+    *checksum = crc;
+    return 0;
+}
+
+// Function opens the file of the request, the request continued after the checksum job gets the file of the job
+CachedFile *requestFile(Connection *connection, const Request *request) {
+    CachedFile *file = connection->job_file;
+    if (file != NULL) {
+        connection->job_file = NULL;
+        return file;
+    }
+    return fileCacheOpen(request->file_name);
+}
+
+// Function checks that the checksum of a range of length bytes of the file is cheap for the event loop: the file is
+// in memory, its block table is ready or the range is at most two blocks. Otherwise a worker computes the table
+// and the request is dispatched again when it is ready.
+// Returns 0 if the checksum may be computed now, 1 if the request waits for the job (the job takes the file),
+// -1 if the response with the error is set (the file is released)
+int fileChecksumWait(Connection *connection, const Request *request, CachedFile *file, off_t length) {
+    if (length <= 2 * CHECKSUM_BLOCK_SIZE || atomic_load_explicit(&file->data, memory_order_acquire) != NULL ||
+        atomic_load_explicit(&file->block_checksums, memory_order_acquire) != NULL) {
+        return 0;
+    }
+    // The job ran already and the file couldn't be read
+    uint8_t status = STATUS_ERROR;
+    if (!connection->file_checked) {
+        status = jobStart(connection, request, file);
+        if (status == STATUS_OK) {
+            return 1;
+        }
+    }
+    logMessage(LEVEL_WARNING, "Checksums of the file %s are not computed: %s", request->file_name, statusMessage(status));
+    fileCacheRelease(file);
+    setResponse(connection, request, status);
+    return -1;
+}
+
+// Thread function which drops the changed files from the cache
+// The next request opens the file again and gets the new size and modification time
+void *fileCacheWatcher(void *arg) {
+    (void)arg;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t length = read(file_cache.inotify_fd, buffer, sizeof(buffer));
+        if (length == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error reading inotify events");
+            return NULL;
+        }
+        for (char *position = buffer; position < buffer + length; ) {
+            struct inotify_event *event = (struct inotify_event *)position;
+            position += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_IGNORED) {
+                continue;   // Watch is removed
+            }
+
+            pthread_mutex_lock(&file_cache.mutex);
+            // Events were lost, any cached file may be changed
+            int all = (event->mask & IN_Q_OVERFLOW) != 0;
+            CachedFile *file = file_cache.lru_head;
+            while (file != NULL) {
+                CachedFile *next = file->lru_next;
+                if (all || file->watch == event->wd) {
+                    if (all) {
+                        inotify_rm_watch(file_cache.inotify_fd, file->watch);
+                    }
+                    fileCacheRemove(file);
+                }
+                file = next;
+            }
+            if (!all) {
+                inotify_rm_watch(file_cache.inotify_fd, event->wd);
+            }
+            pthread_mutex_unlock(&file_cache.mutex);
+        }
+    }
+}
+
+// Function prepares the connection to send the file (or the requested range of it) to the client
+void sendFile(Connection *connection, const Request *request) {
+    // Open file, the cache gives the descriptor and the size without system calls if the file didn't change
+    CachedFile *file = requestFile(connection, request);
+    int open_error = errno;
+    logMessage(LEVEL_INFO, "Client requested file %s", request->file_name);
+    // checking if file exists on the server, the relay fetches the missing file from the upstream
+    if (file == NULL && open_error == ENOENT && relayWait(connection, request, 0, 0) == 0) {
+        return;
+    }
+    if (file == NULL) {
+        setResponse(connection, request, STATUS_NOT_FOUND);
+        logMessage(LEVEL_INFO, "Requested file %s not found on the server!\nError message sent to the client.", request->file_name);
+        return;
+    }
+
+    // Range has to start inside the file, length 0 or the range beyond the end of the file means up to the end
+    uint64_t file_size = file->file_stat.st_size;
+    if (request->offset > file_size) {
+        fileCacheRelease(file);
+        setResponse(connection, request, STATUS_BAD_REQUEST);
+        return;
+    }
+    uint64_t length = file_size - request->offset;
+    if (request->length != 0 && request->length < length) {
+        length = request->length;
+    }
+    if ((request->flags & FLAG_CHECKSUM) && fileChecksumWait(connection, request, file, length) != 0) {
+        return;
+    }
+    setFileResponse(connection, request, file, &file->file_stat, request->offset, length);
+}
+
+// Function prepares the connection to send update for the file to the client
+void updateFile(Connection *connection, const Request *request) {
+    // File open, for the unchanged file the size comes from the cache
+    CachedFile *file = requestFile(connection, request);
+    int open_error = errno;
+    logMessage(LEVEL_INFO, "Client requested update for the file %s", request->file_name);
+    // Checking for errors when opening file
+    if (file == NULL && open_error == ENOENT && relayWait(connection, request, 0, 0) == 0) {
+        return;
+    }
+    if (file == NULL) {
+        logMessage(LEVEL_WARNING, "File open error: %s", strerror(open_error));
+        setResponse(connection, request, STATUS_NOT_FOUND);
+        return;
+    }
+    uint64_t client_file_size = request->offset;
+    uint64_t server_file_size = file->file_stat.st_size;
+    // Prefix of the client copy, the local copy for the upstream and the update are checked, together the whole file
+    if ((request->has_checksum || (request->flags & FLAG_CHECKSUM) || relay.enabled) &&
+        fileChecksumWait(connection, request, file, server_file_size) != 0) {
+        return;
+    }
+
+    // Client copy with the other data than the same part of the server file (damaged or changed locally)
+    // can't be updated by appending, the client builds the new copy with the delta then
+    uint32_t prefix_checksum;
+    if (request->has_checksum && client_file_size <= server_file_size &&
+        fileRangeChecksum(file, 0, client_file_size, &prefix_checksum) == 0 && prefix_checksum != request->checksum) {
+        setResponse(connection, request, STATUS_DIVERGED);
+        metricAdd(&metrics->checksum_mismatches, 1);
+        logMessage(LEVEL_INFO, "Client copy of the file %s differs from the server copy", request->file_name);
+        fileCacheRelease(file);
+        return;
+    }
+
+    // Relay has nothing more for the client, the upstream may have: the request waits for the rest of the upstream copy
+    // Polls within RELAY_REVALIDATE_MS after the upstream confirmed the file are answered locally, so the followers
+    // of a file don't send every poll upstream
+    uint64_t now_us = nowMicroseconds();
+    if (connection->relay_confirmed) {
+        atomic_store_explicit(&file->revalidated_us, now_us, memory_order_relaxed);
+    }
+    uint32_t local_checksum;
+    if (client_file_size >= server_file_size && relay.enabled && !connection->relayed &&
+        now_us - atomic_load_explicit(&file->revalidated_us, memory_order_relaxed) >= RELAY_REVALIDATE_MS * 1000ULL &&
+        fileRangeChecksum(file, 0, server_file_size, &local_checksum) == 0 &&
+        relayWait(connection, request, server_file_size, local_checksum) == 0) {
+        fileCacheRelease(file);
+        return;
+    }
+
+    // If file size is the same, no update available on the server, sending a status back to the client
+    if (client_file_size == server_file_size) {
+        setResponse(connection, request, STATUS_NO_UPDATE);
+        logMessage(LEVEL_INFO, "No updates available for the requested file");
+        fileCacheRelease(file);
+        //Checking if file size on the server is bigger than the size of the file on the client side
+    } else if (client_file_size < server_file_size) {
+        // The update is the portion of the file after the client file size
+        setFileResponse(connection, request, file, &file->file_stat, client_file_size, server_file_size - client_file_size);
+    } else {
+        // Client copy is bigger, it can't be updated by appending the data
+        setResponse(connection, request, STATUS_DIVERGED);
+        logMessage(LEVEL_INFO, "Client copy of the file is bigger than the server copy");
+        fileCacheRelease(file);
+    }
+}
+
+// Function prepares the response with the size and modification time of the file and no body
+// Clients use it to split the file into ranges before downloading them over several connections,
+// with FLAG_CHECKSUM the response has the checksum of the whole file to check the file assembled from the ranges
+void statFile(Connection *connection, const Request *request) {
+    CachedFile *file = requestFile(connection, request);
+    if (file == NULL && errno == ENOENT && relayWait(connection, request, 0, 0) == 0) {
+        return;
+    }
+    if (file == NULL) {
+        setResponse(connection, request, STATUS_NOT_FOUND);
+        return;
+    }
+    if ((request->flags & FLAG_CHECKSUM) && fileChecksumWait(connection, request, file, file->file_stat.st_size) != 0) {
+        return;
+    }
+    // The connection keeps the file until the response is sent, there is no body to send from it
+    setFileResponse(connection, request, file, &file->file_stat, 0, 0);
+}
+
+// Function answers the subscribe request like the update request and subscribes the connection to the appends
+// The connection has one subscription, the new subscribe request replaces the old one
+void subscribeFile(Connection *connection, const Request *request) {
+    logMessage(LEVEL_INFO, "Client subscribed to the file %s", request->file_name);
+    if (subscription_inotify == -1) {
+        setResponse(connection, request, STATUS_UNSUPPORTED);
+        return;
+    }
+    subscriptionRemove(connection);
+
+    // The prefix check and the first response use the cached file and its block checksums
+    CachedFile *file = requestFile(connection, request);
+    if (file == NULL) {
+        setResponse(connection, request, STATUS_NOT_FOUND);
+        return;
+    }
+    uint64_t file_size = file->file_stat.st_size;
+    if (request->offset <= file_size && (request->has_checksum || (request->flags & FLAG_CHECKSUM)) &&
+        fileChecksumWait(connection, request, file, file_size) != 0) {
+        return;
+    }
+
+    // Client copy which is bigger than the file or has other data can't follow it by appending
+    uint32_t prefix_checksum;
+    if (request->offset > file_size ||
+        (request->has_checksum && fileRangeChecksum(file, 0, request->offset, &prefix_checksum) == 0 &&
+         prefix_checksum != request->checksum)) {
+        if (request->offset <= file_size) {
+            metricAdd(&metrics->checksum_mismatches, 1);
+        }
+        setResponse(connection, request, STATUS_DIVERGED);
+        logMessage(LEVEL_INFO, "Client copy of the file %s differs from the server copy", request->file_name);
+        fileCacheRelease(file);
+        return;
+    }
+
+    // Watch is added before the followed file is opened, so an append between them is pushed and not lost
+    int watch = inotify_add_watch(subscription_inotify, request->file_name, SUBSCRIPTION_EVENTS);
+    // The subscription has its own descriptor: the cache drops the file on every change, the subscription keeps following it
+    CachedFile *followed = watch == -1 ? NULL : fileOpen(request->file_name, hashPath(request->file_name));
+    Subscription *subscription = followed == NULL ? NULL : calloc(1, sizeof(Subscription));
+    if (subscription == NULL) {
+        setResponse(connection, request, followed == NULL ? STATUS_NOT_FOUND : STATUS_ERROR);
+        fileCacheRelease(file);
+        if (followed != NULL) {
+            fileCacheRelease(followed);
+        }
+        subscriptionUnwatch(watch);
+        return;
+    }
+    subscription->connection = connection;
+    subscription->file = followed;
+    subscription->watch = watch;
+    subscription->flags = request->flags;
+    subscription->request_id = request->request_id;
+    subscription->offset = file_size;
+    // File changed after the cached copy was opened, the difference is pushed after the first response
+    subscription->changed = (uint64_t)followed->file_stat.st_size != file_size;
+    subscription->next = subscriptions;
+    subscriptions = subscription;
+    connection->subscription = subscription;
+    metricAdd(&metrics->subscriptions_started, 1);
+
+    // The first response is the update, empty if the client is up to date; the connection takes the cached file
+    setFileResponse(connection, request, file, &file->file_stat, request->offset, file_size - request->offset);
+}
+
+// Function removes the watch from the inotify instance of the shard if no other subscription uses it
+// inotify gives the same watch to every subscription of the same file
+void subscriptionUnwatch(int watch) {
+    if (watch == -1) {
+        return;
+    }
+    for (Subscription *subscription = subscriptions; subscription != NULL; subscription = subscription->next) {
+        if (subscription->watch == watch) {
+            return;
+        }
+    }
+    inotify_rm_watch(subscription_inotify, watch);
+}
+
+// Function ends the subscription of the connection, if it has one
+void subscriptionRemove(Connection *connection) {
+    Subscription *subscription = connection->subscription;
+    if (subscription == NULL) {
+        return;
+    }
+    Subscription **link = &subscriptions;
+    while (*link != subscription) {
+        link = &(*link)->next;
+    }
+    *link = subscription->next;
+    subscriptionUnwatch(subscription->watch);
+    fileCacheRelease(subscription->file);
+    free(subscription);
+    connection->subscription = NULL;
+    metricAdd(&metrics->subscriptions_ended, 1);
+}
+
+// Function prepares the push of the appended data when the connection has nothing else to send
+// Returns 1 if the response is ready, 0 if there is nothing to push
+int subscriptionPush(Connection *connection) {
+    Subscription *subscription = connection->subscription;
+    if (subscription == NULL || !subscription->changed) {
+        return 0;
+    }
+    subscription->changed = 0;
+
+    // Removed file has no links, the descriptor still reads the old data, so the client is told to stop
+    CachedFile *file = subscription->file;
+    struct stat file_stat;
+    int removed = subscription->removed || fstat(file->fd, &file_stat) == -1 || file_stat.st_nlink == 0;
+    if (!removed && (uint64_t)file_stat.st_size == subscription->offset) {
+        return 0;   // Only the metadata changed or the data was overwritten in place
+    }
+
+    Request request;
+    memset(&request, 0, sizeof(request));
+    request.opcode = OP_SUBSCRIBE;
+    request.flags = subscription->flags;
+    request.request_id = subscription->request_id;
+    request.offset = subscription->offset;
+    request.received_us = nowMicroseconds();
+    connection->header_length = 0;
+    connection->header_sent = 0;
+    connection->response_start_us = request.received_us;
+    connection->first_byte_sent = 0;
+    connection->state = STATE_SEND_HEADER;
+
+    if (removed || (uint64_t)file_stat.st_size < subscription->offset) {
+        // Truncated file can't be followed by appending, the client starts over
+        setResponse(connection, &request, removed ? STATUS_NOT_FOUND : STATUS_DIVERGED);
+        logMessage(LEVEL_INFO, "Subscribed file %s was %s", file->path, removed ? "removed" : "truncated");
+        subscriptionRemove(connection);
+        return 1;
+    }
+    uint64_t length = file_stat.st_size - subscription->offset;
+    logMessage(LEVEL_DEBUG, "Pushing %" PRIu64 " new bytes of the file %s", length, file->path);
+    file->file_stat = file_stat;
+    pthread_mutex_lock(&file_cache.mutex);
+    file->refs++;
+    pthread_mutex_unlock(&file_cache.mutex);
+    setFileResponse(connection, &request, file, &file->file_stat, subscription->offset, length);
+    subscription->offset = file_stat.st_size;
+    metricAdd(&metrics->subscription_pushes, 1);
+    return 1;
+}
+
+// Function reads the inotify events of the subscribed files and pushes the appends to the idle connections
+// Busy connections push after their current response
+void subscriptionEvents(EventLoop *loop) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(subscription_inotify, buffer, sizeof(buffer))) > 0) {
+        for (char *position = buffer; position < buffer + length; ) {
+            struct inotify_event *event = (struct inotify_event *)position;
+            position += sizeof(struct inotify_event) + event->len;
+            // Events were lost, any subscribed file may be changed
+            int all = (event->mask & IN_Q_OVERFLOW) != 0;
+            for (Subscription *subscription = subscriptions; subscription != NULL; subscription = subscription->next) {
+                if (!all && subscription->watch != event->wd) {
+                    continue;
+                }
+                subscription->changed = 1;
+                if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+                    subscription->removed = 1;
+                }
+                if (event->mask & IN_IGNORED) {
+                    subscription->watch = -1;   // The kernel removed the watch itself
+                }
+            }
+        }
+    }
+
+    // Pushing may close the connection, which removes only its own subscription
+    Subscription *subscription = subscriptions;
+    while (subscription != NULL) {
+        Subscription *next = subscription->next;
+        Connection *connection = subscription->connection;
+        if (subscription->changed && connection->state == STATE_READ_REQUEST && connection->uring_inflight == 0) {
+            handleConnectionEvent(loop, connection, 0);
+        }
+        subscription = next;
+    }
+}
+
+// Function gives the checksum of the whole file, from the hash cache if the file didn't change since it was read
+// Returns -1 if the file can't be read
+int fileHash(const char *path, const struct stat *file_stat, uint32_t *hash) {
+    uint64_t mtime_ns = (uint64_t)file_stat->st_mtim.tv_sec * 1000000000ULL + file_stat->st_mtim.tv_nsec;
+    uint32_t bucket = hashPath(path) & (HASH_CACHE_BUCKETS - 1);
+    pthread_mutex_lock(&hash_cache.mutex);
+    HashEntry *entry = hash_cache.buckets[bucket];
+    while (entry != NULL && strcmp(entry->path, path) != 0) {
+        entry = entry->next;
+    }
+    if (entry != NULL && entry->size == (uint64_t)file_stat->st_size && entry->mtime_ns == mtime_ns) {
+        *hash = entry->hash;
+        pthread_mutex_unlock(&hash_cache.mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&hash_cache.mutex);
+
+    // Reading the file without the lock, the data changed during the reading gets the new time and is read again
+    int fd = open(path, O_RDONLY | O_NOATIME);
+    if (fd == -1 && errno == EPERM) {
+        fd = open(path, O_RDONLY);
+    }
+    unsigned char *buffer = fd == -1 ? NULL : malloc(URING_BUFFER_SIZE);
+    if (buffer == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    uint32_t crc = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, URING_BUFFER_SIZE)) > 0) {
+        crc = crc32c(crc, buffer, bytes_read);
+    }
+    free(buffer);
+    close(fd);
+    if (bytes_read == -1) {
+        return -1;
+    }
+    *hash = crc;
+
+    pthread_mutex_lock(&hash_cache.mutex);
+    if (entry == NULL && hash_cache.count < HASH_CACHE_MAX_FILES) {
+        // Another thread may have added the file meanwhile, the newer entry is found first
+        entry = calloc(1, sizeof(HashEntry));
+        if (entry != NULL && (entry->path = strdup(path)) == NULL) {
+            free(entry);
+            entry = NULL;
+        }
+        if (entry != NULL) {
+            entry->next = hash_cache.buckets[bucket];
+            hash_cache.buckets[bucket] = entry;
+            hash_cache.count++;
+        }
+    }
+    if (entry != NULL) {
+        entry->size = file_stat->st_size;
+        entry->mtime_ns = mtime_ns;
+        entry->hash = crc;
+    }
+    pthread_mutex_unlock(&hash_cache.mutex);
+    return 0;
+}
+
+// Function adds the files under the directory to the manifest, subdirectories are listed recursively
+// path holds the directory name of length bytes and has space for PATH_MAX bytes, paths in the manifest start
+// after root_length bytes, served_root 1 - the directory is the served one; returns -1 if there is no memory
+int manifestDirectory(DeltaBuffer *manifest, char *path, size_t root_length, size_t length, int served_root) {
+    DIR *directory = opendir(path);
+    if (directory == NULL) {
+        return 0;   // Directory disappeared or can't be read, the rest of the tree is still listed
+    }
+    struct dirent *item;
+    int result = 0;
+    while (result == 0 && (item = readdir(directory)) != NULL) {
+        // Staging directory of the relay holds the files which are not complete yet
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0 ||
+            (served_root && strcmp(item->d_name, RELAY_STAGING_DIR) == 0)) {
+            continue;
+        }
+        size_t name_length = strlen(item->d_name);
+        if (length + 1 + name_length - root_length > MANIFEST_MAX_PATH || length + 1 + name_length >= PATH_MAX) {
+            logMessage(LEVEL_WARNING, "Path %s/%s is too long for the manifest", path, item->d_name);
+            continue;
+        }
+        // Symbolic links are not followed, a link to a parent would list the tree forever
+        struct stat file_stat;
+        if (fstatat(dirfd(directory), item->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        path[length] = '/';
+        memcpy(path + length + 1, item->d_name, name_length + 1);
+        if (S_ISDIR(file_stat.st_mode)) {
+            result = manifestDirectory(manifest, path, root_length, length + 1 + name_length, 0);
+        } else if (S_ISREG(file_stat.st_mode) && manifestPathSafe(path + root_length)) {
+            // Client refuses the paths which leave the directory, they are never listed
+            ManifestEntry entry;
+            entry.size = file_stat.st_size;
+            entry.mtime_ns = (uint64_t)file_stat.st_mtim.tv_sec * 1000000000ULL + file_stat.st_mtim.tv_nsec;
+            if (fileHash(path, &file_stat, &entry.hash) == 0) {
+                unsigned char header[MANIFEST_ENTRY_HEADER_SIZE];
+                size_t path_size = length + 1 + name_length - root_length;
+                encodeManifestEntry(&entry, path_size, header);
+                if (deltaBufferAppend(manifest, header, sizeof(header)) == -1 ||
+                    deltaBufferAppend(manifest, path + root_length, path_size) == -1) {
+                    result = -1;
+                }
+            }
+        }
+        path[length] = '\0';
+    }
+    closedir(directory);
+    return result;
+}
+
+// Function starts the manifest of the directory: size, time and checksum of every file under it
+// The tree is listed and the files are read by a worker thread, other connections of the shard go on meanwhile
+void manifestFile(Connection *connection, Request *request) {
+    logMessage(LEVEL_INFO, "Client requested manifest of the directory %s", request->file_name);
+    uint8_t status = jobStart(connection, request, NULL);
+    if (status != STATUS_OK) {
+        logMessage(LEVEL_WARNING, "Manifest job of %s is not started: %s", request->file_name, statusMessage(status));
+        setResponse(connection, request, status);
+    }
+}
+
+// Function lists the directory of the manifest request, runs in the worker thread of the job
+// Only a directory under the served one is listed: the name is relative without ".." parts and the resolved
+// directory (symbolic links followed) is still under the resolved served directory
+void manifestBuild(Job *job) {
+    const Request *request = &job->request;
+    // Trailing slashes are not part of the name
+    size_t length = strlen(request->file_name);
+    while (length > 1 && request->file_name[length - 1] == '/') {
+        length--;
+    }
+    char *name = strndup(request->file_name, length);
+    char *path = malloc(PATH_MAX);
+    char *root = malloc(PATH_MAX);
+    if (name == NULL || path == NULL || root == NULL) {
+        job->status = STATUS_ERROR;
+    } else if (!manifestPathSafe(name)) {
+        logMessage(LEVEL_WARNING, "Manifest of %s is refused, the directory is not under the served one", name);
+        job->status = STATUS_BAD_REQUEST;
+    } else if (realpath(".", root) == NULL || realpath(name, path) == NULL) {
+        job->status = STATUS_NOT_FOUND;
+    } else if (strcmp(root, "/") != 0 && (strncmp(path, root, strlen(root)) != 0 ||
+                                          (path[strlen(root)] != '\0' && path[strlen(root)] != '/'))) {
+        logMessage(LEVEL_WARNING, "Manifest of %s is refused, it leads to %s out of the served directory", name, path);
+        job->status = STATUS_BAD_REQUEST;
+    } else if (stat(path, &job->file_stat) == -1 || !S_ISDIR(job->file_stat.st_mode)) {
+        job->status = STATUS_NOT_FOUND;
+    } else {
+        // Paths in the manifest are relative to the resolved directory
+        length = strlen(path);
+        int result = manifestDirectory(&job->body, path, length + 1, length, strcmp(path, root) == 0);
+        job->status = result == -1 ? STATUS_ERROR : STATUS_OK;
+    }
+    free(root);
+    free(path);
+    free(name);
+}
+
+// Function prepares the response with the manifest listed by the job
+void manifestResponse(Connection *connection, const Request *request, Job *job) {
+    if (job->status != STATUS_OK) {
+        setResponse(connection, request, job->status);
+        return;
+    }
+    // Manifest is the body of the response, FileInfo has the time of the directory
+    connection->body_buffer = job->body.data;
+    job->body.data = NULL;
+    setFileResponse(connection, request, NULL, &job->file_stat, 0, job->body.size);
+    logMessage(LEVEL_INFO, "Manifest of the directory %s: %zu bytes", request->file_name, job->body.size);
+}
+
+// Function starts the worker threads of the jobs, without them every job request is answered with STATUS_ERROR
+void jobInit(void) {
+    for (int i = 0; i < JOB_WORKERS; i++) {
+        job_queue.workers += startThread(jobWorker, NULL) == 0;
+    }
+    if (job_queue.workers == 0) {
+        fprintf(stderr, "Error creating job workers, manifest and delta requests are not served\n");
+    }
+}
+
+// Function queues the request for a worker thread, the connection waits for it in STATE_WAIT_JOB
+// The job takes the payload of the request (the caller forgets it) and the reference to the file of the checksum job;
+// returns STATUS_OK if the job is queued, STATUS_BUSY if the queue is full or STATUS_ERROR if there is no memory
+// or no worker, the file and the payload stay with the caller then
+uint8_t jobStart(Connection *connection, const Request *request, CachedFile *file) {
+    Job *job = calloc(1, sizeof(Job));
+    if (job == NULL) {
+        return STATUS_ERROR;
+    }
+    job->request = *request;
+    job->file = file;
+    job->wake_event = shard_wake_event;
+    atomic_init(&job->done, 0);
+    atomic_init(&job->refs, 2);
+    pthread_mutex_lock(&job_queue.mutex);
+    if (job_queue.workers == 0 || job_queue.count >= JOB_QUEUE_SIZE) {
+        uint8_t status = job_queue.workers == 0 ? STATUS_ERROR : STATUS_BUSY;
+        pthread_mutex_unlock(&job_queue.mutex);
+        free(job);
+        return status;
+    }
+    if (job_queue.tail != NULL) {
+        job_queue.tail->next = job;
+    } else {
+        job_queue.head = job;
+    }
+    job_queue.tail = job;
+    job_queue.count++;
+    pthread_cond_signal(&job_queue.ready);
+    pthread_mutex_unlock(&job_queue.mutex);
+    connection->job = job;
+    connection->state = STATE_WAIT_JOB;
+    return STATUS_OK;
+}
+
+// Function of the worker thread: takes the jobs from the queue one by one, prepares their responses
+// and wakes the shards of their connections
+void *jobWorker(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&job_queue.mutex);
+        while (job_queue.head == NULL) {
+            pthread_cond_wait(&job_queue.ready, &job_queue.mutex);
+        }
+        Job *job = job_queue.head;
+        job_queue.head = job->next;
+        if (job_queue.head == NULL) {
+            job_queue.tail = NULL;
+        }
+        job_queue.count--;
+        pthread_mutex_unlock(&job_queue.mutex);
+
+        // Connection closed while the job waited doesn't need the result
+        if (atomic_load(&job->refs) > 1) {
+            if (job->request.opcode == OP_MANIFEST) {
+                manifestBuild(job);
+            } else if (job->request.opcode == OP_DELTA) {
+                deltaBuild(job);
+            } else {
+                job->status = fileBlockChecksums(job->file) != NULL ? STATUS_OK : STATUS_ERROR;
+            }
+        }
+        atomic_store_explicit(&job->done, 1, memory_order_release);
+        uint64_t one = 1;
+        if (write(job->wake_event, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            logMessage(LEVEL_ERROR, "Error waking the shard: %s", strerror(errno));
+        }
+        jobRelease(job);
+    }
+    return NULL;
+}
+
+// Function continues the request at the front of the queue which waits for its job
+// Returns 1 when the response is prepared and the request is taken from the queue, 0 if it still waits
+int jobResume(Connection *connection) {
+    Job *job = connection->job;
+    if (!atomic_load_explicit(&job->done, memory_order_acquire)) {
+        parkConnection(connection);
+        return 0;
+    }
+    Request *request = requestQueueFront(&connection->io->queue);
+    connection->job = NULL;
+    if (request->opcode != OP_MANIFEST && request->opcode != OP_DELTA) {
+        // Block checksums of the file are ready, the request is answered again with the file of the job
+        connection->job_file = job->file;
+        job->file = NULL;
+        jobRelease(job);
+        connection->file_checked = 1;
+        connection->state = STATE_READ_REQUEST;
+        dispatchRequest(connection, request);
+        connection->file_checked = 0;
+        if (connection->state != STATE_WAIT_UPSTREAM && connection->state != STATE_WAIT_JOB) {
+            requestQueuePop(&connection->io->queue);
+        }
+        return 1;
+    }
+    connection->state = STATE_SEND_HEADER;
+    if (request->opcode == OP_MANIFEST) {
+        manifestResponse(connection, request, job);
+    } else {
+        // Job of the delta stays with the connection, the body is encoded from its steps while it is sent
+        deltaResponse(connection, request, job);
+    }
+    if (connection->job != job) {
+        jobRelease(job);
+    }
+    requestQueuePop(&connection->io->queue);
+    return 1;
+}
+
+// Function gives back the reference to the job, the last reference frees it
+void jobRelease(Job *job) {
+    if (atomic_fetch_sub(&job->refs, 1) == 1) {
+        if (job->file != NULL) {
+            fileCacheRelease(job->file);
+        }
+        memoryRelease(job->reserved);
+        requestFreePayload(&job->request);
+        free(job->body.data);
+        free(job);
+    }
+}
+
+// Function changes the rate limits at runtime, only the clients on the same host may do it
+void limitsResponse(Connection *connection, const Request *request) {
+    struct sockaddr_in peer;
+    socklen_t peer_size = sizeof(peer);
+    if (getpeername(connection->client_socket, (struct sockaddr *)&peer, &peer_size) == -1 ||
+        peer.sin_family != AF_INET || (ntohl(peer.sin_addr.s_addr) >> 24) != 127) {
+        logMessage(LEVEL_WARNING, "Rate limits can be changed only from the local host");
+        setResponse(connection, request, STATUS_BAD_REQUEST);
+        return;
+    }
+    atomic_store(&global_rate_limit, request->offset);
+    atomic_store(&client_rate_limit, request->length);
+    logMessage(LEVEL_INFO, "Rate limits: %" PRIu64 " bytes/s for all clients, %" PRIu64 " bytes/s for every client",
+               request->offset, request->length);
+    setResponse(connection, request, STATUS_OK);
+}
+
+// Function sets the rate of the bucket and adds the tokens which came since the last refill
+// The bucket holds at most the tokens of RATE_BURST_MS, so an idle client can't save the bandwidth for later
+void tokenBucketRefill(TokenBucket *bucket, uint64_t rate, uint64_t now_us) {
+    int64_t burst = rate * RATE_BURST_MS / 1000 > SCHEDULER_QUANTUM ? (int64_t)(rate * RATE_BURST_MS / 1000) : SCHEDULER_QUANTUM;
+    if (bucket->rate != rate) {
+        bucket->rate = rate;
+        bucket->tokens = burst;
+        bucket->updated_us = now_us;
+        return;
+    }
+    if (rate == 0) {
+        return;
+    }
+    uint64_t elapsed_us = now_us - bucket->updated_us;
+    if (elapsed_us > (uint64_t)(burst - bucket->tokens) * 1000000 / rate) {
+        bucket->tokens = burst;
+        bucket->updated_us = now_us;
+        return;
+    }
+    // The rest of a token stays in the time of the bucket, so frequent refills don't lose or invent tokens
+    uint64_t credit = elapsed_us * rate;
+    bucket->tokens += credit / 1000000;
+    bucket->updated_us = now_us - (credit % 1000000) / rate;
+}
+
+// Function returns how many bytes the tokens of the client and of the shard let the transfer send,
+// INT64_MAX without limits; without tokens the transfer is throttled until they come and 0 is returned
+int64_t scheduleTokens(Connection *connection, uint64_t now_us) {
+    if (connection->throttled_until_us != 0) {
+        if (now_us < connection->throttled_until_us) {
+            return 0;
+        }
+        scheduleUnthrottle(connection);
+    }
+    if (connection->waiting_since_us != 0) {
+        histogramAdd(&metrics->schedule_wait, now_us - connection->waiting_since_us);
+        connection->waiting_since_us = 0;
+    }
+
+    // Shards split the global limit, every shard counts its own tokens without locks
+    uint64_t global_rate = atomic_load_explicit(&global_rate_limit, memory_order_relaxed);
+    tokenBucketRefill(&shard_bucket, (global_rate + worker_count - 1) / worker_count, now_us);
+    tokenBucketRefill(&connection->bucket, atomic_load_explicit(&client_rate_limit, memory_order_relaxed), now_us);
+    // A few tokens are not worth a system call, the transfer waits until it can send a reasonable piece
+    int64_t allowance = INT64_MAX;
+    uint64_t wait_us = 0;
+    TokenBucket *buckets[2] = {&shard_bucket, &connection->bucket};
+    for (int i = 0; i < 2; i++) {
+        uint64_t rate = buckets[i]->rate;
+        if (rate == 0) {
+            continue;
+        }
+        int64_t needed = rate / 100 < RATE_MIN_SEND ? RATE_MIN_SEND : rate / 100 > RATE_MAX_SEND ? RATE_MAX_SEND : rate / 100;
+        if (needed > connection->body_end - connection->body_offset) {
+            needed = connection->body_end - connection->body_offset;
+        }
+        if (buckets[i]->tokens < needed) {
+            uint64_t bucket_wait_us = (uint64_t)(needed - buckets[i]->tokens) * 1000000 / rate + 1;
+            wait_us = bucket_wait_us > wait_us ? bucket_wait_us : wait_us;
+        } else if (buckets[i]->tokens < allowance) {
+            allowance = buckets[i]->tokens;
+        }
+    }
+    if (wait_us > 0) {
+        scheduleThrottle(connection, now_us + wait_us);
+        return 0;
+    }
+    return allowance;
+}
+
+// Function starts the turn of the transfer and returns how many bytes it may send, 0 if it has to wait
+// Every turn adds the quantum to the deficit (deficit round robin), the tokens of the client and of the shard
+// limit it further
+int64_t scheduleTurn(Connection *connection) {
+    uint64_t now_us = nowMicroseconds();
+    int64_t allowance = scheduleTokens(connection, now_us);
+    if (allowance == 0) {
+        return 0;
+    }
+
+    // Transfer which sent more than its quantum (compressed chunk) skips turns until the deficit is positive
+    connection->deficit += SCHEDULER_QUANTUM;
+    if (connection->deficit <= 0) {
+        connection->waiting_since_us = now_us;
+        return 0;
+    }
+    return connection->deficit < allowance ? connection->deficit : allowance;
+}
+
+// Function takes the sent bytes from the tokens of the shard and of the client
+void scheduleChargeTokens(Connection *connection, uint64_t bytes) {
+    if (shard_bucket.rate != 0) {
+        shard_bucket.tokens -= bytes;
+    }
+    if (connection->bucket.rate != 0) {
+        connection->bucket.tokens -= bytes;
+    }
+}
+
+// Function takes the sent bytes from the deficit of the transfer and from the tokens
+void scheduleCharge(Connection *connection, uint64_t bytes) {
+    connection->deficit -= bytes;
+    scheduleChargeTokens(connection, bytes);
+}
+
+// Function stops the transfer until the time, the socket is not watched for writing meanwhile
+void scheduleThrottle(Connection *connection, uint64_t until_us) {
+    connection->throttled_until_us = until_us;
+    connection->waiting_since_us = nowMicroseconds();
+    connection->throttled_next = throttled_connections;
+    throttled_connections = connection;
+    metricAdd(&metrics->throttled, 1);
+}
+
+// Function removes the connection from the throttled connections of the shard
+void scheduleUnthrottle(Connection *connection) {
+    Connection **link = &throttled_connections;
+    while (*link != NULL && *link != connection) {
+        link = &(*link)->throttled_next;
+    }
+    if (*link != NULL) {
+        *link = connection->throttled_next;
+    }
+    connection->throttled_until_us = 0;
+    connection->throttled_next = NULL;
+}
+
+// Function returns the timeout of epoll_wait(): milliseconds until the first throttled transfer may continue, -1 if none
+int scheduleTimeout(void) {
+    if (throttled_connections == NULL) {
+        return -1;
+    }
+    uint64_t first_us = UINT64_MAX;
+    for (Connection *connection = throttled_connections; connection != NULL; connection = connection->throttled_next) {
+        first_us = connection->throttled_until_us < first_us ? connection->throttled_until_us : first_us;
+    }
+    uint64_t now_us = nowMicroseconds();
+    return first_us <= now_us ? 0 : (int)((first_us - now_us + 999) / 1000);
+}
+
+// Function continues the throttled transfers which may send again
+void scheduleWake(EventLoop *loop) {
+    uint64_t now_us = nowMicroseconds();
+    // The list is taken as a whole: a transfer may be throttled again or closed while it continues
+    Connection *connection = throttled_connections;
+    throttled_connections = NULL;
+    while (connection != NULL) {
+        Connection *next = connection->throttled_next;
+        connection->throttled_next = NULL;
+        if (now_us < connection->throttled_until_us) {
+            connection->throttled_next = throttled_connections;
+            throttled_connections = connection;
+        } else {
+            connection->throttled_until_us = 0;
+            handleConnectionEvent(loop, connection, 0);
+        }
+        connection = next;
+    }
+}
+
+// Function reads the address of the upstream server (IPv4 address, the port is 12345 if not given)
+// Returns -1 if the address is not valid
+int relayInit(const char *upstream) {
+    char host[INET_ADDRSTRLEN];
+    int port = PORT;
+    const char *colon = strchr(upstream, ':');
+    size_t length = colon != NULL ? (size_t)(colon - upstream) : strlen(upstream);
+    if (length >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, upstream, length);
+    host[length] = '\0';
+    if (colon != NULL && ((port = atoi(colon + 1)) <= 0 || port > 65535)) {
+        return -1;
+    }
+    memset(&relay.upstream, 0, sizeof(relay.upstream));
+    relay.upstream.sin_family = AF_INET;
+    relay.upstream.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &relay.upstream.sin_addr) != 1) {
+        return -1;
+    }
+    relay.enabled = 1;
+    return 0;
+}
+
+// Function makes the request wait for the file from the upstream: it joins the fetch of the file in progress
+// or starts a new one, offset is the size of the local copy to append to (0 - the whole file is fetched)
+// Returns 0 if the request waits, -1 if it has to be answered from the local files
+int relayWait(Connection *connection, const Request *request, uint64_t offset, uint32_t checksum) {
+    if (!relay.enabled || connection->relayed) {
+        return -1;
+    }
+    // Fetch writes the file, so only the relative paths without ".." parts are fetched: they stay under the served
+    // directory, other names are answered from the local files as before
+    if (!manifestPathSafe(request->file_name)) {
+        logMessage(LEVEL_WARNING, "Path %s is outside of the served directory, it is not fetched", request->file_name);
+        return -1;
+    }
+    pthread_mutex_lock(&relay.mutex);
+    Fetch *fetch = relay.fetches;
+    while (fetch != NULL && strcmp(fetch->path, request->file_name) != 0) {
+        fetch = fetch->next;
+    }
+    if (fetch != NULL) {
+        // One upstream transfer serves all the misses of the file
+        fetch->refs++;
+        pthread_mutex_unlock(&relay.mutex);
+        atomic_fetch_add(&relay.collapsed, 1);
+    } else {
+        fetch = calloc(1, sizeof(Fetch));
+        if (fetch != NULL && (fetch->path = strdup(request->file_name)) == NULL) {
+            free(fetch);
+            fetch = NULL;
+        }
+        if (fetch != NULL) {
+            fetch->offset = offset;
+            fetch->local_checksum = checksum;
+            fetch->refs = 2;
+            if (startThread(relayFetchThread, fetch) == -1) {
+                free(fetch->path);
+                free(fetch);
+                fetch = NULL;
+            }
+        }
+        if (fetch == NULL) {
+            pthread_mutex_unlock(&relay.mutex);
+            logMessage(LEVEL_ERROR, "Error starting the upstream fetch of %s", request->file_name);
+            return -1;
+        }
+        fetch->next = relay.fetches;
+        relay.fetches = fetch;
+        pthread_mutex_unlock(&relay.mutex);
+        atomic_fetch_add(&relay.started, 1);
+        logMessage(LEVEL_INFO, "Fetching %s from the upstream from byte %" PRIu64, request->file_name, offset);
+    }
+    connection->fetch = fetch;
+    connection->state = STATE_WAIT_UPSTREAM;
+    return 0;
+}
+
+// Function continues the request at the front of the queue which waits for its fetch
+// Returns 1 when the response is prepared and the request is taken from the queue, 0 if it still waits
+int relayResume(Connection *connection) {
+    Request *request = requestQueueFront(&connection->io->queue);
+    Fetch *fetch = connection->fetch;
+    int state = atomic_load_explicit(&fetch->state, memory_order_acquire);
+
+    // Whole file is sent while it is being fetched, the fields of the fetch are set before FETCH_STREAMING
+    if (state == FETCH_STREAMING && fetch->offset == 0 && request->opcode == OP_DOWNLOAD && request->offset == 0 &&
+        (request->length == 0 || request->length >= fetch->length)) {
+        struct stat file_stat = fetch->file->file_stat;
+        file_stat.st_size = fetch->length;
+        file_stat.st_mtim.tv_sec = fetch->mtime_ns / 1000000000ULL;
+        file_stat.st_mtim.tv_nsec = fetch->mtime_ns % 1000000000ULL;
+        pthread_mutex_lock(&file_cache.mutex);
+        fetch->file->refs++;
+        pthread_mutex_unlock(&file_cache.mutex);
+        setFileResponse(connection, request, fetch->file, &file_stat, 0, fetch->length);
+        connection->state = STATE_SEND_HEADER;
+        requestQueuePop(&connection->io->queue);
+        return 1;
+    }
+    if (state == FETCH_CONNECTING || state == FETCH_STREAMING) {
+        parkConnection(connection);
+        return 0;
+    }
+
+    // Fetch is over, the request is answered from the local files as they are now
+    relayRelease(fetch);
+    connection->fetch = NULL;
+    connection->state = STATE_READ_REQUEST;
+    connection->relayed = 1;
+    connection->relay_confirmed = state == FETCH_DONE;
+    dispatchRequest(connection, request);
+    connection->relayed = 0;
+    connection->relay_confirmed = 0;
+    // The answer may wait for the block checksums of the fetched file
+    if (connection->state != STATE_WAIT_JOB) {
+        requestQueuePop(&connection->io->queue);
+    }
+    return 1;
+}
+
+// Function returns the end of the data of the streamed file which may be sent, -1 if the fetch failed
+off_t relayAvailable(Fetch *fetch) {
+    int state = atomic_load_explicit(&fetch->state, memory_order_acquire);
+    if (state == FETCH_DONE) {
+        return fetch->length;
+    }
+    if (state != FETCH_STREAMING) {
+        return -1;
+    }
+    return atomic_load_explicit(&fetch->written, memory_order_acquire);
+}
+
+// Function gives back the reference to the fetch, the last reference frees it
+void relayRelease(Fetch *fetch) {
+    pthread_mutex_lock(&relay.mutex);
+    int refs = --fetch->refs;
+    pthread_mutex_unlock(&relay.mutex);
+    if (refs == 0) {
+        if (fetch->file != NULL) {
+            fileCacheRelease(fetch->file);
+        }
+        free(fetch->path);
+        free(fetch);
+    }
+}
+
+// Function puts the connection to the connections of the shard waiting for the fetches and the jobs, its socket is not watched for writing
+void parkConnection(Connection *connection) {
+    if (!connection->parked) {
+        connection->parked = 1;
+        connection->parked_next = parked_connections;
+        parked_connections = connection;
+    }
+}
+
+// Function removes the connection from the connections waiting for the fetches and the jobs
+void unparkConnection(Connection *connection) {
+    Connection **link = &parked_connections;
+    while (*link != NULL && *link != connection) {
+        link = &(*link)->parked_next;
+    }
+    if (*link != NULL) {
+        *link = connection->parked_next;
+    }
+    connection->parked = 0;
+    connection->parked_next = NULL;
+}
+
+// Function continues the waiting connections after a fetch made progress or a job is done
+// Every waiting connection checks its fetch or job, the ones without progress are parked again
+void parkedEvents(EventLoop *loop) {
+    uint64_t value;
+    if (read(loop->wake_event, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        logMessage(LEVEL_ERROR, "Error reading the wake events: %s", strerror(errno));
+    }
+    Connection *connection = parked_connections;
+    parked_connections = NULL;
+    while (connection != NULL) {
+        Connection *next = connection->parked_next;
+        connection->parked_next = NULL;
+        connection->parked = 0;
+        handleConnectionEvent(loop, connection, 0);
+        connection = next;
+    }
+}
+
+// Function wakes all shards, their waiting connections check the fetches
+void relayWake(void) {
+    uint64_t one = 1;
+    for (int i = 0; i < worker_count; i++) {
+        if (write(relay.shard_events[i], &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            logMessage(LEVEL_ERROR, "Error waking the shard: %s", strerror(errno));
+        }
+    }
+}
+
+// Function sends exactly size bytes to the upstream, returns -1 on error
+int relaySendAll(int socket_fd, const void *buffer, size_t size) {
+    size_t total_sent = 0;
+    while (total_sent < size) {
+        ssize_t bytes_sent = send(socket_fd, (const char *)buffer + total_sent, size - total_sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            return -1;
+        }
+        total_sent += bytes_sent;
+    }
+    return 0;
+}
+
+// Function receives exactly size bytes from the upstream, returns -1 if the connection is closed, times out or fails
+int relayReceiveAll(int socket_fd, void *buffer, size_t size) {
+    size_t total_received = 0;
+    while (total_received < size) {
+        ssize_t received_bytes = recv(socket_fd, (char *)buffer + total_received, size - total_received, 0);
+        if (received_bytes <= 0) {
+            return -1;
+        }
+        total_received += received_bytes;
+    }
+    return 0;
+}
+
+// Function reads and drops size bytes from the upstream, returns -1 if the connection fails
+int relaySkipBytes(int socket_fd, size_t size) {
+    char buffer[BUFFER_SIZE];
+    while (size > 0) {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (relayReceiveAll(socket_fd, buffer, chunk) == -1) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Function receives the response header and FileInfo from the upstream, the body stays in the socket
+// Returns -1 if the connection fails or the upstream doesn't speak our protocol
+int relayReceiveResponse(int socket_fd, FrameHeader *header, FileInfo *info) {
+    unsigned char buffer[FRAME_CHECKSUM_HEADER_SIZE];
+    if (relayReceiveAll(socket_fd, buffer, FRAME_HEADER_SIZE) == -1 || decodeFrameHeader(buffer, header) == -1) {
+        return -1;
+    }
+
+    // Checksum field if the upstream sent it, the header fields of the newer protocol versions are skipped
+    size_t extension = header->header_size - FRAME_HEADER_SIZE;
+    size_t known = extension < FRAME_CHECKSUM_HEADER_SIZE - FRAME_HEADER_SIZE ? extension : FRAME_CHECKSUM_HEADER_SIZE - FRAME_HEADER_SIZE;
+    if (relayReceiveAll(socket_fd, buffer + FRAME_HEADER_SIZE, known) == -1 || relaySkipBytes(socket_fd, extension - known) == -1) {
+        return -1;
+    }
+    if (!decodeFrameChecksum(buffer, header)) {
+        header->flags &= ~FLAG_CHECKSUM;
+    }
+
+    size_t payload_size = header->payload_size;
+    memset(info, 0, sizeof(*info));
+    if (payload_size >= FILE_INFO_SIZE) {
+        if (relayReceiveAll(socket_fd, buffer, FILE_INFO_SIZE) == -1) {
+            return -1;
+        }
+        decodeFileInfo(buffer, info);
+        payload_size -= FILE_INFO_SIZE;
+    }
+    return relaySkipBytes(socket_fd, payload_size);
+}
+
+// Function receives the body from the upstream into a file of RELAY_STAGING_DIR: a new file which replaces
+// the path when it is complete, or the tail which is appended to the local copy after its checksum is verified
+// Transfers of the whole new file send the data as it is written
+// Returns FETCH_DONE or FETCH_FAILED, a failed fetch leaves the local files as they were
+int relayReceiveFile(Fetch *fetch, int socket_fd, const FrameHeader *header, const FileInfo *info) {
+    char temp_path[PATH_MAX];
+    int file_fd;
+    if (header->offset != fetch->offset || (header->flags & (FLAG_LZ4 | FLAG_DEFLATE)) ||
+        (header->length > 0 && !(header->flags & FLAG_BODY))) {
+        logMessage(LEVEL_ERROR, "Unexpected response of the upstream for %s", fetch->path);
+        return FETCH_FAILED;
+    }
+    if (!manifestPathSafe(fetch->path)) {
+        return FETCH_FAILED;     // relayWait() doesn't start such a fetch, no file is created outside of the directory
+    }
+    if (fetch->offset == 0) {
+        // Parent directories are created like the client does, the file appears under its name only when it is complete
+        char *slash = fetch->path;
+        while ((slash = strchr(slash + 1, '/')) != NULL) {
+            *slash = '\0';
+            int result = mkdir(fetch->path, 0755);
+            *slash = '/';
+            if (result == -1 && errno != EEXIST) {
+                break;
+            }
+        }
+    }
+    // Staging directory is under the served one, so the complete file is renamed into place on the same file system,
+    // and the manifests and the requests skip it, so nobody sees a partial or unverified file
+    if ((mkdir(RELAY_STAGING_DIR, 0700) == -1 && errno != EEXIST) ||
+        snprintf(temp_path, sizeof(temp_path), "%s/fetch-XXXXXX", RELAY_STAGING_DIR) >= (int)sizeof(temp_path) ||
+        (file_fd = mkstemp(temp_path)) == -1) {
+        logMessage(LEVEL_ERROR, "Error creating the file for %s: %s", fetch->path, strerror(errno));
+        return FETCH_FAILED;
+    }
+    if (fetch->offset == 0) {
+        fchmod(file_fd, 0644);
+        fetch->file = fileOpen(temp_path, hashPath(fetch->path));
+        if (fetch->file == NULL) {
+            logMessage(LEVEL_ERROR, "Error opening the file for %s: %s", fetch->path, strerror(errno));
+            close(file_fd);
+            unlink(temp_path);
+            return FETCH_FAILED;
+        }
+        fetch->length = header->length;
+        fetch->checksum = header->checksum;
+        fetch->has_checksum = (header->flags & FLAG_CHECKSUM) != 0;
+        fetch->mtime_ns = info->mtime_ns;
+        atomic_store_explicit(&fetch->state, FETCH_STREAMING, memory_order_release);
+        relayWake();
+    }
+
+    unsigned char *buffer = malloc(RELAY_BUFFER_SIZE);
+    uint64_t received = 0;
+    uint32_t crc = 0;
+    while (buffer != NULL && received < header->length) {
+        size_t chunk = header->length - received < RELAY_BUFFER_SIZE ? header->length - received : RELAY_BUFFER_SIZE;
+        if (relayReceiveAll(socket_fd, buffer, chunk) == -1 ||
+            pwrite(file_fd, buffer, chunk, received) != (ssize_t)chunk) {
+            break;
+        }
+        crc = crc32c(crc, buffer, chunk);
+        received += chunk;
+        atomic_fetch_add(&relay.bytes, chunk);
+        if (fetch->offset == 0) {
+            atomic_store_explicit(&fetch->written, received, memory_order_release);
+            relayWake();
+        }
+    }
+    free(buffer);
+
+    int result = FETCH_DONE;
+    if (received < header->length) {
+        logMessage(LEVEL_ERROR, "Error receiving %s from the upstream", fetch->path);
+        result = FETCH_FAILED;
+    } else if ((header->flags & FLAG_CHECKSUM) && crc != header->checksum) {
+        logMessage(LEVEL_ERROR, "Checksum of %s from the upstream doesn't match", fetch->path);
+        result = FETCH_FAILED;
+    }
+    if (result == FETCH_DONE && fetch->offset == 0) {
+        // Local copy gets the time of the upstream copy, so the clients see the same FileInfo from both servers
+        struct timespec times[2] = {
+            { .tv_nsec = UTIME_OMIT },
+            { .tv_sec = info->mtime_ns / 1000000000ULL, .tv_nsec = info->mtime_ns % 1000000000ULL }
+        };
+        futimens(file_fd, times);
+        if (rename(temp_path, fetch->path) == -1) {
+            logMessage(LEVEL_ERROR, "Error renaming the file for %s: %s", fetch->path, strerror(errno));
+            result = FETCH_FAILED;
+        }
+    } else if (result == FETCH_DONE) {
+        result = relayAppendTail(fetch, file_fd, received, info);
+    }
+    close(file_fd);
+    if (fetch->offset > 0 || result == FETCH_FAILED) {
+        unlink(temp_path);
+    }
+    if (result == FETCH_DONE) {
+        fileCacheInvalidate(fetch->path);   // Cached copy of the old file or its absence isn't valid any more
+        logMessage(LEVEL_INFO, "Fetched %" PRIu64 " bytes of %s from the upstream", received, fetch->path);
+    }
+    return result;
+}
+
+// Function appends the verified tail of the staged file to the local copy, which must still end where the fetch
+// started; returns FETCH_DONE or FETCH_FAILED, the local copy is cut back to its old size on error
+int relayAppendTail(Fetch *fetch, int staged_fd, uint64_t length, const FileInfo *info) {
+    int file_fd = open(fetch->path, O_WRONLY);
+    if (file_fd == -1) {
+        logMessage(LEVEL_ERROR, "Error opening %s for the update: %s", fetch->path, strerror(errno));
+        return FETCH_FAILED;
+    }
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) == -1 || (uint64_t)file_stat.st_size != fetch->offset) {
+        logMessage(LEVEL_WARNING, "Local copy of %s changed during the fetch, the tail is not appended", fetch->path);
+        close(file_fd);
+        return FETCH_FAILED;
+    }
+    unsigned char *buffer = malloc(RELAY_BUFFER_SIZE);
+    uint64_t copied = 0;
+    while (buffer != NULL && copied < length) {
+        size_t chunk = length - copied < RELAY_BUFFER_SIZE ? length - copied : RELAY_BUFFER_SIZE;
+        if (pread(staged_fd, buffer, chunk, copied) != (ssize_t)chunk ||
+            pwrite(file_fd, buffer, chunk, fetch->offset + copied) != (ssize_t)chunk) {
+            break;
+        }
+        copied += chunk;
+    }
+    free(buffer);
+
+    int result = FETCH_DONE;
+    if (copied < length) {
+        logMessage(LEVEL_ERROR, "Error appending to %s: %s", fetch->path, strerror(errno));
+        if (ftruncate(file_fd, fetch->offset) == -1) {
+            logMessage(LEVEL_ERROR, "Error truncating %s: %s", fetch->path, strerror(errno));
+        }
+        result = FETCH_FAILED;
+    } else {
+        struct timespec times[2] = {
+            { .tv_nsec = UTIME_OMIT },
+            { .tv_sec = info->mtime_ns / 1000000000ULL, .tv_nsec = info->mtime_ns % 1000000000ULL }
+        };
+        futimens(file_fd, times);
+    }
+    close(file_fd);
+    return result;
+}
+
+// Function checks if the path of the request leads into RELAY_STAGING_DIR, whose files are not complete yet
+int relayStagingPath(const char *path) {
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+        while (path[0] == '/') {
+            path++;
+        }
+    }
+    size_t length = strlen(RELAY_STAGING_DIR);
+    return strncmp(path, RELAY_STAGING_DIR, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+// Function fetches the file from the upstream: the whole file, or the bytes after the local copy if the upstream
+// copy continues it, the whole file again if it doesn't. Returns the final FetchState
+int relayFetchFile(Fetch *fetch) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socket_fd == -1) {
+            logMessage(LEVEL_ERROR, "Error creating the upstream socket: %s", strerror(errno));
+            return FETCH_FAILED;
+        }
+        // Blocking socket with the timeouts, a stuck upstream fails the fetch instead of keeping the requests forever
+        struct timeval timeout = { .tv_sec = RELAY_TIMEOUT_S };
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        FrameHeader header;
+        memset(&header, 0, sizeof(header));
+        header.opcode = fetch->offset > 0 ? OP_UPDATE : OP_DOWNLOAD;
+        header.flags = FLAG_CHECKSUM;
+        header.request_id = 1;
+        header.payload_size = strlen(fetch->path);
+        header.offset = fetch->offset;
+        if (fetch->offset > 0) {
+            header.header_size = FRAME_CHECKSUM_HEADER_SIZE;
+            header.checksum = fetch->local_checksum;
+        }
+        unsigned char request[FRAME_CHECKSUM_HEADER_SIZE + BUFFER_SIZE];
+        size_t header_size = encodeFrameHeader(&header, request);
+        memcpy(request + header_size, fetch->path, header.payload_size);
+
+        FileInfo info;
+        if (connect(socket_fd, (struct sockaddr *)&relay.upstream, sizeof(relay.upstream)) == -1 ||
+            relaySendAll(socket_fd, request, header_size + header.payload_size) == -1 ||
+            relayReceiveResponse(socket_fd, &header, &info) == -1) {
+            logMessage(LEVEL_ERROR, "Error requesting %s from the upstream: %s", fetch->path, strerror(errno));
+            close(socket_fd);
+            return FETCH_FAILED;
+        }
+
+        int result;
+        if (header.status == STATUS_DIVERGED && fetch->offset > 0) {
+            // Local copy isn't a prefix of the upstream copy, the whole file replaces it
+            close(socket_fd);
+            fetch->offset = 0;
+            continue;
+        } else if (header.status == STATUS_NO_UPDATE) {
+            result = FETCH_DONE;
+        } else if (header.status == STATUS_NOT_FOUND) {
+            result = fetch->offset > 0 ? FETCH_DONE : FETCH_MISSING;    // Local copy stays as it is
+        } else if (header.status == STATUS_OK) {
+            result = relayReceiveFile(fetch, socket_fd, &header, &info);
+        } else {
+            logMessage(LEVEL_ERROR, "Upstream answered %s for %s", statusMessage(header.status), fetch->path);
+            result = FETCH_FAILED;
+        }
+        close(socket_fd);
+        return result;
+    }
+    return FETCH_FAILED;
+}
+
+// Function of the fetch thread: fetches the file, then the waiting requests are continued
+void *relayFetchThread(void *arg) {
+    Fetch *fetch = arg;
+    int state = relayFetchFile(fetch);
+    if (state == FETCH_FAILED) {
+        atomic_fetch_add(&relay.failed, 1);
+    }
+
+    // Fetch is finished before it leaves the list, a new miss after that starts a new fetch
+    pthread_mutex_lock(&relay.mutex);
+    Fetch **link = &relay.fetches;
+    while (*link != fetch) {
+        link = &(*link)->next;
+    }
+    *link = fetch->next;
+    pthread_mutex_unlock(&relay.mutex);
+    atomic_store_explicit(&fetch->state, state, memory_order_release);
+    relayWake();
+    relayRelease(fetch);
+    return NULL;
+}
+
+// Function adds data to the end of the delta buffer, returns -1 if there is no memory
+int deltaBufferAppend(DeltaBuffer *buffer, const void *data, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? BUFFER_SIZE : buffer->capacity;
+        while (capacity < buffer->size + size) {
+            capacity *= 2;
+        }
+        unsigned char *new_data = realloc(buffer->data, capacity);
+        if (new_data == NULL) {
+            return -1;
+        }
+        buffer->data = new_data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return 0;
+}
+
+// Function adds the step to copy the run of the client blocks
+int deltaFlushCopy(DeltaBuffer *buffer, uint32_t *copy_count, uint32_t copy_start) {
+    if (*copy_count == 0) {
+        return 0;
+    }
+    DeltaStep step = { DELTA_COPY, *copy_count, copy_start };
+    *copy_count = 0;
+    return deltaBufferAppend(buffer, &step, sizeof(step));
+}
+
+// Function adds the matched block, the blocks following each other are sent as one instruction
+int deltaAddCopy(DeltaBuffer *buffer, uint32_t *copy_start, uint32_t *copy_count, uint32_t block) {
+    if (*copy_count > 0 && *copy_start + *copy_count == block) {
+        (*copy_count)++;
+        return 0;
+    }
+    if (deltaFlushCopy(buffer, copy_count, *copy_start) == -1) {
+        return -1;
+    }
+    *copy_start = block;
+    *copy_count = 1;
+    return 0;
+}
+
+// Function adds the steps with the range of the file the client doesn't have, one step per instruction
+int deltaAddLiteral(DeltaBuffer *buffer, uint64_t offset, uint64_t size) {
+    while (size > 0) {
+        DeltaStep step = { DELTA_LITERAL, size > UINT32_MAX ? UINT32_MAX : size, offset };
+        if (deltaBufferAppend(buffer, &step, sizeof(step)) == -1) {
+            return -1;
+        }
+        offset += step.count;
+        size -= step.count;
+    }
+    return 0;
+}
+
+// Function makes the bytes [offset, offset + length) of the file available in the window, the bytes before offset
+// are dropped and the window is filled up with the next ones
+// Returns 1 if the file ends before these bytes (the size of the window is lowered), -1 on read error
+int deltaWindowRead(DeltaWindow *window, uint64_t offset, size_t length) {
+    if (offset >= window->start && offset + length <= window->start + window->length) {
+        return 0;
+    }
+    if (offset >= window->start && offset <= window->start + window->length) {
+        size_t shift = offset - window->start;
+        memmove(window->data, window->data + shift, window->length - shift);
+        window->length -= shift;
+    } else {
+        window->length = 0;
+    }
+    window->start = offset;
+    while (window->length < window->capacity && window->start + window->length < window->size) {
+        uint64_t left = window->size - window->start - window->length;
+        size_t chunk = window->capacity - window->length < left ? window->capacity - window->length : left;
+        ssize_t bytes_read = pread(window->fd, window->data + window->length, chunk, window->start + window->length);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read == -1) {
+            return -1;
+        }
+        if (bytes_read == 0) {
+            // File was cut after the size was taken
+            window->size = window->start + window->length;
+            break;
+        }
+        window->length += bytes_read;
+    }
+    return offset + length <= window->start + window->length ? 0 : 1;
+}
+
+// Function finds the client blocks in the server copy and adds the steps to build the server copy
+// The file is read through a window of DELTA_WINDOW_SIZE bytes, if it gets shorter meanwhile the size is lowered
+// to the bytes which were read; returns -1 if there is no memory or the file can't be read
+int computeDelta(int fd, uint64_t *size, const unsigned char *signature, uint32_t block_size,
+                 uint32_t block_count, uint32_t tail_size, DeltaBuffer *delta) {
+    // Short last block is checked only at the end of the file, the rest of the blocks go to the hash table
+    uint32_t full_blocks = tail_size > 0 ? block_count - 1 : block_count;
+
+    // Hash table of the weak checksums of the client blocks, blocks with the same bucket are chained
+    size_t table_size = 1;
+    while (table_size < (size_t)full_blocks * 2) {
+        table_size *= 2;
+    }
+    int64_t *bucket_head = malloc(table_size * sizeof(int64_t));
+    int64_t *next_block = malloc((block_count + 1) * sizeof(int64_t));
+    DeltaWindow window = { .fd = fd, .capacity = DELTA_WINDOW_SIZE, .size = *size };
+    window.data = malloc(window.capacity);
+    if (bucket_head == NULL || next_block == NULL || window.data == NULL) {
+        free(bucket_head);
+        free(next_block);
+        free(window.data);
+        return -1;
+    }
+    for (size_t i = 0; i < table_size; i++) {
+        bucket_head[i] = -1;
+    }
+    // Adding the blocks in reverse order, so the chain starts with the first block with this checksum
+    for (int64_t block = (int64_t)full_blocks - 1; block >= 0; block--) {
+        uint32_t weak = deltaGet32(signature + block * DELTA_BLOCK_SIGNATURE_SIZE);
+        size_t bucket = (weak * 2654435761u) & (table_size - 1);
+        next_block[block] = bucket_head[bucket];
+        bucket_head[bucket] = block;
+    }
+
+    int result = 0;
+    size_t position = 0;            // Start of the window
+    size_t literal_start = 0;       // Start of the data which didn't match any block
+    uint32_t copy_start = 0, copy_count = 0;
+    uint32_t weak = 0;
+    int weak_valid = 0;
+
+    while (full_blocks > 0 && position + block_size <= window.size) {
+        // Block and the byte after it, which comes into the window next
+        size_t needed = position + block_size < window.size ? block_size + 1 : block_size;
+        int read_result = deltaWindowRead(&window, position, needed);
+        if (read_result == -1) {
+            logMessage(LEVEL_ERROR, "File read error: %s", strerror(errno));
+            result = -1;
+            break;
+        }
+        if (read_result == 1 && position + block_size > window.size) {
+            break;
+        }
+        const unsigned char *data = window.data + (position - window.start);
+        if (!weak_valid) {
+            weak = rollingChecksum(data, block_size);
+            weak_valid = 1;
+        }
+
+        // Looking for the client block with the same weak checksum and strong hash
+        int64_t match = -1;
+        uint64_t strong = 0;
+        int strong_valid = 0;
+        for (int64_t block = bucket_head[(weak * 2654435761u) & (table_size - 1)]; block != -1; block = next_block[block]) {
+            const unsigned char *block_signature = signature + block * DELTA_BLOCK_SIGNATURE_SIZE;
+            if (deltaGet32(block_signature) != weak) {
+                continue;
+            }
+            if (!strong_valid) {
+                strong = strongHash(data, block_size, 0);
+                strong_valid = 1;
+            }
+            if (deltaGet64(block_signature + 4) == strong) {
+                match = block;
+                break;
+            }
+        }
+
+        if (match != -1) {
+            // Sending the data before the block as literal and the block as the reference
+            if (position > literal_start) {
+                if (deltaFlushCopy(delta, &copy_count, copy_start) == -1 ||
+                    deltaAddLiteral(delta, literal_start, position - literal_start) == -1) {
+                    result = -1;
+                    break;
+                }
+            }
+            if (deltaAddCopy(delta, &copy_start, &copy_count, match) == -1) {
+                result = -1;
+                break;
+            }
+            position += block_size;
+            literal_start = position;
+            weak_valid = 0;
+        } else {
+            // Moving the window one byte forward
+            if (position + block_size < window.size) {
+                weak = rollChecksum(weak, block_size, data[0], data[block_size]);
+            }
+            position++;
+        }
+    }
+
+    // Checking if the file ends with the short last block of the client
+    if (result == 0 && tail_size > 0 && window.size >= literal_start + tail_size &&
+        deltaWindowRead(&window, window.size - tail_size, tail_size) == -1) {
+        logMessage(LEVEL_ERROR, "File read error: %s", strerror(errno));
+        result = -1;
+    }
+    size_t literal_end = window.size;
+    if (result == 0 && tail_size > 0 && window.size >= literal_start + tail_size &&
+        window.start + window.length >= window.size && window.start <= window.size - tail_size) {
+        const unsigned char *tail_signature = signature + (size_t)full_blocks * DELTA_BLOCK_SIGNATURE_SIZE;
+        const unsigned char *tail = window.data + (window.size - tail_size - window.start);
+        if (deltaGet32(tail_signature) == rollingChecksum(tail, tail_size) &&
+            deltaGet64(tail_signature + 4) == strongHash(tail, tail_size, 0)) {
+            literal_end = window.size - tail_size;
+        }
+    }
+
+    // Rest of the file after the last matched block is literal
+    if (result == 0 && literal_end > literal_start) {
+        if (deltaFlushCopy(delta, &copy_count, copy_start) == -1 ||
+            deltaAddLiteral(delta, literal_start, literal_end - literal_start) == -1) {
+            result = -1;
+        }
+    }
+    if (result == 0 && literal_end < window.size && deltaAddCopy(delta, &copy_start, &copy_count, full_blocks) == -1) {
+        result = -1;
+    }
+    if (result == 0 && deltaFlushCopy(delta, &copy_count, copy_start) == -1) {
+        result = -1;
+    }
+    free(bucket_head);
+    free(next_block);
+    free(window.data);
+    *size = window.size;
+    return result;
+}
+
+// Function checks the signature in the payload of the delta request and takes the file name from it
+// Returns -1 if the payload is malformed
+int parseDeltaRequest(Request *request) {
+    if (request->payload_size < DELTA_SIGNATURE_HEADER_SIZE) {
+        return -1;
+    }
+    uint32_t block_size = deltaGet32(request->payload);
+    uint32_t block_count = deltaGet32(request->payload + 4);
+    uint32_t tail_size = deltaGet32(request->payload + 8);
+    uint16_t name_size;
+    memcpy(&name_size, request->payload + 12, 2);
+    name_size = be16toh(name_size);
+    if (block_size < DELTA_MIN_BLOCK_SIZE || block_size > DELTA_MAX_BLOCK_SIZE || name_size == 0 ||
+        name_size >= BUFFER_SIZE || tail_size >= block_size || (tail_size > 0 && block_count == 0) ||
+        request->payload_size != DELTA_SIGNATURE_HEADER_SIZE + name_size + (size_t)block_count * DELTA_BLOCK_SIGNATURE_SIZE) {
+        return -1;
+    }
+    memcpy(request->file_name, request->payload + DELTA_SIGNATURE_HEADER_SIZE, name_size);
+    request->file_name[name_size] = '\0';
+    return 0;
+}
+
+// Function starts the delta response: instructions to build the server copy of the file from the client blocks
+// The checksum is rolled over the file by a worker thread, other connections of the shard go on meanwhile
+void deltaFile(Connection *connection, Request *request) {
+    logMessage(LEVEL_INFO, "Client requested delta for the file %s", request->file_name);
+    uint8_t status = jobStart(connection, request, NULL);
+    if (status != STATUS_OK) {
+        logMessage(LEVEL_WARNING, "Delta job of %s is not started: %s", request->file_name, statusMessage(status));
+        setResponse(connection, request, status);
+        return;
+    }
+    request->payload = NULL;    // The job took the signature
+}
+
+// Function finds the steps of the delta, runs in the worker thread of the job
+// Only the steps are kept, the literal data is read from the file when the body is sent
+void deltaBuild(Job *job) {
+    const Request *request = &job->request;
+    CachedFile *file = fileCacheOpen(request->file_name);
+    if (file == NULL) {
+        job->status = STATUS_NOT_FOUND;
+        return;
+    }
+    job->file_stat = file->file_stat;
+
+    uint32_t block_size = deltaGet32(request->payload);
+    uint32_t block_count = deltaGet32(request->payload + 4);
+    uint32_t tail_size = deltaGet32(request->payload + 8);
+    uint16_t name_size;
+    memcpy(&name_size, request->payload + 12, 2);
+    const unsigned char *signature = request->payload + DELTA_SIGNATURE_HEADER_SIZE + be16toh(name_size);
+
+    // File is read with pread, not mapped: a writer which cuts the file meanwhile only makes the delta shorter
+    uint64_t size = job->file_stat.st_size;
+    int result = computeDelta(file->fd, &size, signature, block_size, block_count, tail_size, &job->body);
+    if (size < (uint64_t)job->file_stat.st_size) {
+        logMessage(LEVEL_WARNING, "File %s got shorter while its delta was computed", request->file_name);
+        job->file_stat.st_size = size;
+    }
+    // Signature is not needed anymore, the steps are counted under the memory cap while the body is sent
+    requestFreePayload(&job->request);
+    if (result == 0 && memoryReserve(job->body.capacity) == 0) {
+        job->reserved = job->body.capacity;
+    } else {
+        logMessage(LEVEL_WARNING, "No memory for the delta of %s", request->file_name);
+        fileCacheRelease(file);
+        job->status = STATUS_ERROR;
+        return;
+    }
+
+    // All blocks of the client matched in order and nothing else, the copies are the same
+    const DeltaStep *steps = (const DeltaStep *)job->body.data;
+    size_t step_count = job->body.size / sizeof(DeltaStep);
+    uint64_t client_file_size = (uint64_t)block_size * (tail_size > 0 ? block_count - 1 : block_count) + tail_size;
+    if ((uint64_t)job->file_stat.st_size == client_file_size && block_count > 0 && step_count == 1 &&
+        steps[0].type == DELTA_COPY && steps[0].start == 0 && steps[0].count == block_count) {
+        fileCacheRelease(file);
+        job->status = STATUS_NO_UPDATE;
+        return;
+    }
+    for (size_t i = 0; i < step_count; i++) {
+        job->body_size += steps[i].type == DELTA_COPY ? DELTA_COPY_SIZE : DELTA_LITERAL_HEADER_SIZE + (uint64_t)steps[i].count;
+    }
+    // Instructions are not worth checking one by one, the client checks the copy it built from them
+    if (request->flags & FLAG_CHECKSUM) {
+        job->has_checksum = fileBlockChecksums(file) != NULL &&
+                            fileRangeChecksum(file, 0, job->file_stat.st_size, &job->checksum) == 0;
+    }
+    job->file = file;
+    job->status = STATUS_OK;
+}
+
+// Function prepares the delta response from the steps found by the job
+// The connection keeps the job and sends the instructions through a chunk buffer from the pool of the shard
+void deltaResponse(Connection *connection, const Request *request, Job *job) {
+    if (job->status == STATUS_NO_UPDATE) {
+        setResponse(connection, request, STATUS_NO_UPDATE);
+        logMessage(LEVEL_INFO, "No updates available for the requested file");
+        return;
+    }
+    if (job->status == STATUS_OK && connection->compress_buffer == NULL) {
+        connection->compress_buffer = poolTake(&compress_pool);
+    }
+    if (job->status != STATUS_OK || connection->compress_buffer == NULL) {
+        setResponse(connection, request, job->status != STATUS_OK ? job->status : STATUS_ERROR);
+        return;
+    }
+    // Instructions are the body of the response, FileInfo tells the client the size of the result
+    connection->job = job;
+    connection->chunk_length = 0;
+    connection->chunk_sent = 0;
+    setFileResponse(connection, request, NULL, &job->file_stat, 0, job->body_size);
+    logMessage(LEVEL_INFO, "Delta for the file %s: %" PRIu64 " bytes instead of %lld", request->file_name,
+               job->body_size, (long long)job->file_stat.st_size);
+}
+
+// Function encodes the next instructions of the delta into the buffer, the literal data is read from the file
+// Returns the bytes encoded, 0 if the file can't be read
+size_t deltaEncode(Job *job, unsigned char *buffer, size_t capacity) {
+    const DeltaStep *steps = (const DeltaStep *)job->body.data;
+    size_t step_count = job->body.size / sizeof(DeltaStep);
+    size_t length = 0;
+    while (job->step < step_count) {
+        const DeltaStep *step = &steps[job->step];
+        if (step->type == DELTA_COPY) {
+            if (capacity - length < DELTA_COPY_SIZE) {
+                break;
+            }
+            buffer[length] = DELTA_COPY;
+            deltaPut32(buffer + length + 1, step->start);
+            deltaPut32(buffer + length + 5, step->count);
+            length += DELTA_COPY_SIZE;
+            job->step++;
+            continue;
+        }
+        if (job->step_sent == 0) {
+            if (capacity - length < DELTA_LITERAL_HEADER_SIZE) {
+                break;
+            }
+            buffer[length] = DELTA_LITERAL;
+            deltaPut32(buffer + length + 1, step->count);
+            length += DELTA_LITERAL_HEADER_SIZE;
+        }
+        size_t size = step->count - job->step_sent;
+        if (size > capacity - length) {
+            size = capacity - length;
+        }
+        if (size == 0) {
+            break;
+        }
+        ssize_t bytes_read = pread(job->file->fd, buffer + length, size, step->start + job->step_sent);
+        if (bytes_read <= 0) {
+            logMessage(LEVEL_ERROR, "File read error: %s", bytes_read == -1 ? strerror(errno) : "file is shorter");
+            return 0;
+        }
+        length += bytes_read;
+        job->step_sent += bytes_read;
+        if (job->step_sent == step->count) {
+            job->step++;
+            job->step_sent = 0;
+        }
+    }
+    return length;
+}
+
+// Function switches the socket to the non-blocking mode
+int setNonBlocking(int socket_fd) {
+    int flags = fcntl(socket_fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Function raises the limit of open files, every connection needs a socket and a file descriptor
+void raiseFileLimit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            perror("Error raising open files limit");
+        }
+    }
+}
+
+// Function takes the state of the new connection from the pool of the shard and initializes it
+// Returns NULL if the memory cap is reached
+Connection *createConnection(int client_socket, TransferMode mode) {
+    Connection *connection = poolTake(&connection_pool);
+    if (connection == NULL) {
+        return NULL;
+    }
+    memset(connection, 0, sizeof(Connection));
+    connection->client_socket = client_socket;
+    connection->state = STATE_READ_REQUEST;
+    connection->file_fd = -1;
+    connection->transfer_mode = mode;
+    connection->pipe_fds[0] = -1;
+    connection->pipe_fds[1] = -1;
+    connection->uring_buffer = -1;
+    transferTunerInit(&connection->tuner, client_socket, SO_SNDBUF);
+    return connection;
+}
+
+// Function closes the client socket and frees the connection
+void closeConnection(EventLoop *loop, Connection *connection) {
+    // Closing the socket removes it from the epoll set as well
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, connection->client_socket, NULL);
+    subscriptionRemove(connection);
+    if (connection->throttled_until_us != 0) {
+        scheduleUnthrottle(connection);
+    }
+    if (connection->parked) {
+        unparkConnection(connection);
+    }
+    if (connection->fetch != NULL) {
+        relayRelease(connection->fetch);
+        connection->fetch = NULL;
+    }
+    if (connection->job != NULL) {
+        jobRelease(connection->job);
+        connection->job = NULL;
+    }
+    if (connection->uring_inflight > 0) {
+        // io_uring still reads the buffer and writes the results into the connection,
+        // shutdown() makes the send fail quickly and the last completion closes the connection
+        if (!connection->closing) {
+            shutdown(connection->client_socket, SHUT_RDWR);
+            connection->closing = 1;
+        }
+        return;
+    }
+    uringRelease(connection);
+    close(connection->client_socket);
+    if (connection->file != NULL) {
+        fileCacheRelease(connection->file);
+    }
+    if (connection->pipe_fds[0] != -1) {
+        close(connection->pipe_fds[0]);
+        close(connection->pipe_fds[1]);
+    }
+    if (connection->io != NULL) {
+        // Freeing the payloads of the requests which will never be answered
+        Request *request;
+        while ((request = requestQueueFront(&connection->io->queue)) != NULL) {
+            requestFreePayload(request);
+            requestQueuePop(&connection->io->queue);
+        }
+        requestFreePayload(&connection->io->pending_request);
+        poolGive(connection->io);
+    }
+    memoryRelease(connection->payload_reserved);
+    if (connection->io_waiting) {
+        ioUnpause(connection);
+    }
+    if (connection->compress_buffer != NULL) {
+        poolGive(connection->compress_buffer);
+    }
+    free(connection->body_buffer);
+    poolGive(connection);
+    metricAdd(&metrics->connections_closed, 1);
+}
+
+// Function returns the oldest request of the connection waiting for the response, NULL if there is none
+Request *nextRequest(Connection *connection) {
+    return connection->io != NULL ? requestQueueFront(&connection->io->queue) : NULL;
+}
+
+// Function gives the I/O buffers from the pool of the shard to the connection which is going to read
+// Returns -1 if the memory cap is reached
+int ioAttach(Connection *connection) {
+    if (connection->io != NULL) {
+        return 0;
+    }
+    IoBuffers *io = poolTake(&io_pool);
+    if (io == NULL) {
+        return -1;
+    }
+    atomic_init(&io->queue.head, 0);
+    atomic_init(&io->queue.tail, 0);
+    io->pending_request.payload = NULL;
+    connection->io = io;
+    return 0;
+}
+
+// Function gives the I/O buffers back to the pool when the connection has no request in the queue and no unparsed bytes
+// The response in progress doesn't need them, a long download holds only its Connection structure
+void ioDetach(Connection *connection) {
+    IoBuffers *io = connection->io;
+    if (io == NULL || connection->request_length > 0 || io->pending_request.payload != NULL ||
+        requestQueueFront(&io->queue) != NULL) {
+        return;
+    }
+    poolGive(io);
+    connection->io = NULL;
+}
+
+// Function stops reading from the connection until the I/O buffers are available, the oldest waiting connection gets them first
+void ioPause(Connection *connection) {
+    if (connection->io_waiting) {
+        return;
+    }
+    connection->io_waiting = 1;
+    connection->io_next = NULL;
+    if (io_waiting_tail != NULL) {
+        io_waiting_tail->io_next = connection;
+    } else {
+        io_waiting = connection;
+    }
+    io_waiting_tail = connection;
+    metricAdd(&metrics->reads_paused, 1);
+}
+
+// Function removes the closed connection from the connections waiting for the I/O buffers
+void ioUnpause(Connection *connection) {
+    Connection **link = &io_waiting;
+    Connection *previous = NULL;
+    while (*link != NULL && *link != connection) {
+        previous = *link;
+        link = &(*link)->io_next;
+    }
+    if (*link != NULL) {
+        *link = connection->io_next;
+        if (io_waiting_tail == connection) {
+            io_waiting_tail = previous;
+        }
+    }
+    connection->io_waiting = 0;
+    connection->io_next = NULL;
+}
+
+// Function stops watching the listening socket, new clients wait in the backlog of the kernel until there is memory for them
+void deferAccepts(EventLoop *loop) {
+    if (loop->accept_deferred) {
+        return;
+    }
+    struct epoll_event event;
+    event.events = 0;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->server_socket, &event) == -1) {
+        logMessage(LEVEL_ERROR, "Error deferring the accepts: %s", strerror(errno));
+        return;
+    }
+    loop->accept_deferred = 1;
+    metricAdd(&metrics->accepts_deferred, 1);
+    logMessage(LEVEL_WARNING, "Memory cap is reached, new connections wait");
+}
+
+// Function continues the connections waiting for the memory: the paused reads first, then the deferred accepts
+void memoryWake(EventLoop *loop) {
+    while (io_waiting != NULL && ioAttach(io_waiting) == 0) {
+        // Connection which waits for the memory of the payload takes it here, so it can't pause again at once
+        if (io_waiting->payload_wanted > 0 && io_waiting->payload_reserved == 0) {
+            if (memoryReserve(io_waiting->payload_wanted) == -1) {
+                break;
+            }
+            io_waiting->payload_reserved = io_waiting->payload_wanted;
+        }
+        Connection *connection = io_waiting;
+        io_waiting = connection->io_next;
+        if (io_waiting == NULL) {
+            io_waiting_tail = NULL;
+        }
+        connection->io_waiting = 0;
+        connection->io_next = NULL;
+        handleConnectionEvent(loop, connection, EPOLLIN);
+    }
+    if (loop->accept_deferred && io_waiting == NULL && poolReady(&connection_pool)) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->server_socket, &event) == -1) {
+            logMessage(LEVEL_ERROR, "Error resuming the accepts: %s", strerror(errno));
+            return;
+        }
+        loop->accept_deferred = 0;
+    }
+}
+
+// Function registers the events we are waiting for in the current state of the connection
+void watchConnection(EventLoop *loop, Connection *connection) {
+    uint32_t events = 0;
+    // Reading new requests while there is a free slot for them in the queue and the memory for the buffers
+    if (!connection->client_closed && !connection->io_waiting &&
+        (connection->io == NULL || !requestQueueFull(&connection->io->queue))) {
+        events |= EPOLLIN;
+    }
+    // Waiting until we can send while the response is in progress, io_uring waits for the socket itself
+    // Throttled transfer is woken by the timer of the event loop, the transfer waiting for the upstream by the fetch
+    // and the request waiting for its worker by the job
+    if (connection->state != STATE_READ_REQUEST && connection->state != STATE_WAIT_UPSTREAM &&
+        connection->state != STATE_WAIT_JOB && connection->uring_inflight == 0 &&
+        connection->throttled_until_us == 0 && !connection->parked) {
+        events |= EPOLLOUT;
+    }
+    if (events == connection->watched_events) {
+        return;
+    }
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = connection;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, connection->client_socket, &event) == -1) {
+        logMessage(LEVEL_ERROR, "Error watching the client socket: %s", strerror(errno));
+    }
+    connection->watched_events = events;
+}
+
+// Function accepts all pending connections from the listening socket
+void acceptConnections(EventLoop *loop) {
+    struct sockaddr_in client_addr;
+    socklen_t addr_size;
+
+    while (1) {
+        // New clients wait while the connections of the shard wait for the memory or there is no memory for one more
+        if (io_waiting != NULL || !poolReady(&connection_pool)) {
+            deferAccepts(loop);
+            return;
+        }
+        addr_size = sizeof(client_addr);
+        int client_socket = accept4(loop->server_socket, (struct sockaddr *)&client_addr, &addr_size, SOCK_NONBLOCK);
+        if (client_socket == -1) {
+            // No more pending connections
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                logMessage(LEVEL_ERROR, "Error accepting connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        logMessage(LEVEL_INFO, "Accepted connection from %s:%d", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+        Connection *connection = createConnection(client_socket, loop->transfer_mode);
+        if (connection == NULL) {
+            logMessage(LEVEL_ERROR, "Error allocating connection: %s", strerror(errno));
+            close(client_socket);
+            continue;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+            logMessage(LEVEL_ERROR, "Error watching the client socket: %s", strerror(errno));
+            close(client_socket);
+            poolGive(connection);
+            continue;
+        }
+        connection->watched_events = EPOLLIN;
+        metricAdd(&metrics->connections_accepted, 1);
+    }
+}
+
+// Function moves the complete requests from the request buffer to the queue
+// Returns the number of requests put into the queue or -1 if the client sent something which is not a request
+int parseRequests(Connection *connection) {
+    IoBuffers *io = connection->io;
+    int queued = 0;
+    size_t parsed = 0;
+    if (io == NULL) {
+        return 0;   // Idle connection has nothing to parse
+    }
+
+    // Every request is a frame: header and the file name (or the signature for the delta request) as the payload
+    // Nothing to parse while the payload of the previous request is not received
+    while (io->pending_request.payload == NULL && connection->request_length - parsed >= FRAME_HEADER_SIZE) {
+        if (requestQueueFull(&io->queue)) {
+            break;      // The rest stays in the buffer until the responses free the queue
+        }
+        unsigned char *frame = io->request + parsed;
+        FrameHeader header;
+        if (decodeFrameHeader(frame, &header) == -1) {
+            logMessage(LEVEL_WARNING, "Client sent something which is not a request");
+            return -1;
+        }
+        Request request;
+        request.opcode = header.opcode;
+        request.flags = header.flags;
+        request.request_id = header.request_id;
+        request.offset = header.offset;
+        request.length = header.length;
+        request.file_name[0] = '\0';
+        request.payload = NULL;
+        request.payload_size = 0;
+        request.received_us = nowMicroseconds();
+        request.has_checksum = 0;
+        request.checksum = 0;
+
+        // Signature of the delta request doesn't fit into the request buffer, it goes to its own buffer
+        if (header.opcode == OP_DELTA) {
+            if (header.payload_size > DELTA_MAX_SIGNATURE_SIZE || header.header_size > sizeof(io->request)) {
+                logMessage(LEVEL_WARNING, "Client request is too long");
+                return -1;
+            }
+            if (connection->request_length - parsed < header.header_size) {
+                break;      // Waiting for the rest of the header
+            }
+            // Signature counts under the memory cap, without the memory the reads stop until it is given back
+            if (connection->payload_reserved > 0 && connection->payload_reserved == header.payload_size) {
+                connection->payload_reserved = 0;
+            } else if (header.payload_size > 0 && memoryReserve(header.payload_size) == -1) {
+                connection->payload_wanted = header.payload_size;
+                ioPause(connection);
+                break;
+            }
+            connection->payload_wanted = 0;
+            request.payload_size = header.payload_size;
+            request.payload = malloc(header.payload_size > 0 ? header.payload_size : 1);
+            if (request.payload == NULL) {
+                logMessage(LEVEL_ERROR, "Error allocating request payload: %s", strerror(errno));
+                memoryRelease(header.payload_size);
+                return -1;
+            }
+            size_t available = connection->request_length - parsed - header.header_size;
+            if (available > request.payload_size) {
+                available = request.payload_size;
+            }
+            memcpy(request.payload, frame + header.header_size, available);
+            parsed += header.header_size + available;
+            if (available < request.payload_size) {
+                // The rest of the payload is received directly into its buffer
+                io->pending_request = request;
+                connection->pending_received = available;
+                break;
+            }
+            if (parseDeltaRequest(&request) == -1) {
+                request.file_name[0] = '\0';
+            }
+            requestQueuePush(&io->queue, &request);
+            queued++;
+            continue;
+        }
+
+        // The file name has to fit into the request, otherwise we can't find the start of the next request
+        size_t frame_size = (size_t)header.header_size + header.payload_size;
+        if (header.payload_size >= BUFFER_SIZE || frame_size > sizeof(io->request)) {
+            logMessage(LEVEL_WARNING, "Client request is too long");
+            return -1;
+        }
+        if (connection->request_length - parsed < frame_size) {
+            break;      // Waiting for the rest of the request
+        }
+
+        // Header may be longer than we know if the client uses the newer version, skipping the unknown fields
+        request.has_checksum = decodeFrameChecksum(frame, &header);
+        request.checksum = header.checksum;
+        memcpy(request.file_name, frame + header.header_size, header.payload_size);
+        request.file_name[header.payload_size] = '\0';
+        requestQueuePush(&io->queue, &request);
+        queued++;
+        parsed += frame_size;
+    }
+
+    // Moving the incomplete request to the beginning of the buffer
+    memmove(io->request, io->request + parsed, connection->request_length - parsed);
+    connection->request_length -= parsed;
+    return queued;
+}
+
+// Function receives the client requests, returns -1 if the connection has to be closed
+int handleReadRequest(Connection *connection) {
+    // Buffers come from the pool of the shard, without the memory for them the connection waits
+    if (!connection->client_closed && ioAttach(connection) == -1) {
+        ioPause(connection);
+        return 0;
+    }
+    IoBuffers *io = connection->io;
+
+    // Receiving while the client has something for us and we have space for it
+    while (!connection->client_closed && !requestQueueFull(&io->queue)) {
+        Request *pending = &io->pending_request;
+        if (pending->payload != NULL) {
+            // Receiving the big payload directly into its buffer
+            ssize_t bytes_received = recv(connection->client_socket, pending->payload + connection->pending_received,
+                                          pending->payload_size - connection->pending_received, 0);
+            if (bytes_received == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return -1;
+            }
+            if (bytes_received == 0) {
+                return -1;  // Client closed the connection in the middle of the request
+            }
+            connection->pending_received += bytes_received;
+            if (connection->pending_received == pending->payload_size) {
+                // The queue had a free slot when the request was parsed, nobody else puts requests into it
+                if (parseDeltaRequest(pending) == -1) {
+                    pending->file_name[0] = '\0';
+                }
+                requestQueuePush(&io->queue, pending);
+                pending->payload = NULL;
+            }
+            continue;
+        }
+
+        // Full buffer of the connection which waited for the memory of the payload is parsed before reading more
+        if (connection->request_length == sizeof(io->request)) {
+            if (parseRequests(connection) == -1) {
+                return -1;
+            }
+            if (connection->io_waiting || connection->request_length == sizeof(io->request)) {
+                break;
+            }
+            continue;
+        }
+        ssize_t bytes_received = recv(connection->client_socket, io->request + connection->request_length,
+                                      sizeof(io->request) - connection->request_length, 0);
+        if (bytes_received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;      // Nothing to read yet
+            }
+            return -1;      // Error
+        }
+        if (bytes_received == 0) {
+            // Client finished sending requests, we still answer the requests in the queue
+            connection->client_closed = 1;
+            break;
+        }
+        connection->request_length += bytes_received;
+        if (parseRequests(connection) == -1) {
+            return -1;
+        }
+        if (connection->io_waiting) {
+            break;      // Payload of the next request waits for the memory
+        }
+    }
+    return 0;
+}
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; // Initialization of mutex to use with threads
-char buffer[BUFFER_SIZE];   // Buffer to exchange data between sockets
-int buffer_empty = 1;       // Flag to indicate if the buffer is empty
+// Function prepares the response to the request and moves the connection to the sending state
+void startResponse(Connection *connection, Request *request) {
+    connection->header_length = 0;
+    connection->header_sent = 0;
+    connection->response_start_us = request->received_us;
+    connection->first_byte_sent = 0;
+    metricAdd(&metrics->requests[request->opcode < METRICS_OPCODES ? request->opcode : 0], 1);
+    dispatchRequest(connection, request);
+}
 
-// Function prototypes
-void sendFile(const char *file_name, int client_socket);
-void updateFile(const char *file_name, ssize_t client_file_size, int client_socket);
-void *handleReadSocket(void *arg);
-void *handleWriteSocket(void *arg);
-
-//Function sends file to the client
-void sendFile(const char *file_name, int client_socket) {
-    // Open file
-    FILE *file = fopen(file_name, "rb");
-    printf("Client requested file %s\n", file_name);
-    // checking if file exists on the server
-    if (file == NULL) {
-        char error_message[] = "File not found";
-        send(client_socket, error_message, sizeof(error_message), 0);
-        printf("Requested file %s not found on the server!\nError message sent to the client.\n", file_name);
+// Function prepares the response to the request by its type, the request waiting for the upstream or for its job
+// stays in the queue
+void dispatchRequest(Connection *connection, Request *request) {
+    // Checking type of request
+    if (request->opcode == OP_STATS) {
+        // Stats request has no file name
+        statsResponse(connection, request);
+    } else if (request->opcode == OP_LIMITS) {
+        // Limits request has no file name either
+        limitsResponse(connection, request);
+    } else if (request->file_name[0] == '\0') {
+        setResponse(connection, request, STATUS_BAD_REQUEST);
+    } else if (relayStagingPath(request->file_name)) {
+        // Files of the fetches in progress are not served, they appear under their names when they are verified
+        setResponse(connection, request, STATUS_NOT_FOUND);
+    } else if (request->opcode == OP_DOWNLOAD) {
+        // We send file or the range of the file
+        sendFile(connection, request);
+    } else if (request->opcode == OP_UPDATE) {
+        // We send update for the file
+        updateFile(connection, request);
+    } else if (request->opcode == OP_DELTA) {
+        // We send the instructions to build the server copy from the client copy
+        deltaFile(connection, request);
+    } else if (request->opcode == OP_STAT) {
+        // We send the size and the modification time of the file
+        statFile(connection, request);
+    } else if (request->opcode == OP_SUBSCRIBE) {
+        // We send the update and then every append of the file
+        subscribeFile(connection, request);
+    } else if (request->opcode == OP_MANIFEST) {
+        // We send the list of the files under the directory
+        manifestFile(connection, request);
     } else {
+        // Unknown request type, the client may be newer than the server
+        logMessage(LEVEL_WARNING, "Invalid request type: %d", request->opcode);
+        setResponse(connection, request, STATUS_UNSUPPORTED);
+    }
+    // Signature is not needed anymore, the response is ready or its job took it
+    requestFreePayload(request);
+    if (connection->state != STATE_WAIT_UPSTREAM && connection->state != STATE_WAIT_JOB) {
+        connection->state = STATE_SEND_HEADER;
+    }
+}
 
-        //File exists, calculating the size of the file
-        fseek(file, 0, SEEK_END);               // Move pointer to the end of the file
-        uint64_t req_file_size = ftell(file);   // Get the current position, this is the file size
-        fseek(file, 0, SEEK_SET);               // Move pointer back to the beginning of the file
-
-        //converting the integer value of file size to the big-endian format used with network communications 
-        uint64_t network_value = htobe64(req_file_size);
-
-        // Send the file size to the client
-        ssize_t bytes_sent = send(client_socket, &network_value, sizeof(network_value), 0);
-        if (bytes_sent < 0) {
-            perror("Error sending data");
-        }
-        
-        // Send the file to the client
-        char send_buffer[BUFFER_SIZE];
-        size_t bytes_read;
-        size_t total_sent = 0;
-        // Cycle to read from the file in chunks of the buffer size and sending it to the client
-        while ((bytes_read = fread(send_buffer, 1, sizeof(send_buffer), file)) > 0) {
-            ssize_t bytes_sent = send(client_socket, send_buffer, bytes_read, 0);
-            if (bytes_sent < 0) {
-                perror("Error sending file data");
-                break;
+// Function sends the header, returns 1 when the whole header is sent, 0 if socket is full, -1 on error
+int handleSendHeader(Connection *connection) {
+    // Header of the response with a body waits in the socket for the first data, so they leave in one segment
+    int flags = connection->body_offset < connection->body_end ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+    while (connection->header_sent < connection->header_length) {
+        ssize_t bytes_sent = send(connection->client_socket, connection->header + connection->header_sent,
+                                  connection->header_length - connection->header_sent, flags);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
             }
-            //Checking if we sent all bytes from the entire file
-            total_sent += bytes_sent;
-            if (total_sent >= req_file_size) {
-                // We've sent the entire file, exit from the cycle
-                break;
+            logMessage(LEVEL_ERROR, "Error sending data: %s", strerror(errno));
+            return -1;
+        }
+        connection->header_sent += bytes_sent;
+        metricAdd(&metrics->bytes_sent, bytes_sent);
+        if (!connection->first_byte_sent) {
+            connection->first_byte_sent = 1;
+            histogramAdd(&metrics->first_byte, nowMicroseconds() - connection->response_start_us);
+        }
+    }
+    return 1;
+}
+
+// Function sends the rest of the header and the body from the cache memory with one writev()
+// Returns 1 when the whole response is sent, 0 if socket is full, -1 on error
+int sendResponseMemory(Connection *connection) {
+    while (connection->header_sent < connection->header_length || connection->body_offset < connection->body_end) {
+        struct iovec parts[2];
+        int count = 0;
+        size_t header_left = connection->header_length - connection->header_sent;
+        if (header_left > 0) {
+            parts[count].iov_base = connection->header + connection->header_sent;
+            parts[count].iov_len = header_left;
+            count++;
+        }
+        parts[count].iov_base = (void *)(connection->file_data + connection->body_offset);
+        parts[count].iov_len = connection->body_end - connection->body_offset;
+        count++;
+
+        ssize_t bytes_sent = writev(connection->client_socket, parts, count);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
             }
+            logMessage(LEVEL_ERROR, "Error sending data: %s", strerror(errno));
+            return -1;
+        }
+        metricAdd(&metrics->bytes_sent, bytes_sent);
+        if (!connection->first_byte_sent) {
+            connection->first_byte_sent = 1;
+            histogramAdd(&metrics->first_byte, nowMicroseconds() - connection->response_start_us);
+        }
+        // Bytes sent go to the header first, the rest to the body
+        size_t header_part = (size_t)bytes_sent < header_left ? (size_t)bytes_sent : header_left;
+        connection->header_sent += header_part;
+        connection->body_offset += bytes_sent - header_part;
+    }
+    return 1;
+}
+
+// Function sends the body as the compressed chunks (common/compress.h)
+// The next chunk is read and compressed only when the previous one is sent, body_offset is the end of the read data
+// Returns 1 when the whole body is sent, 0 if socket is full, -1 on error
+int sendBodyCompressed(Connection *connection) {
+    unsigned char *chunk = connection->compress_buffer + COMPRESS_CHUNK_SIZE;
+    while (1) {
+        if (connection->chunk_sent == connection->chunk_length) {
+            if (connection->body_offset >= connection->body_end) {
+                return 1;
+            }
+            size_t raw_size = COMPRESS_CHUNK_SIZE;
+            if ((off_t)raw_size > connection->body_end - connection->body_offset) {
+                raw_size = connection->body_end - connection->body_offset;
+            }
+            // Small files in memory are compressed right from the cache
+            const unsigned char *raw = connection->compress_buffer;
+            if (connection->file_data != NULL) {
+                raw = connection->file_data + connection->body_offset;
+            } else {
+                ssize_t bytes_read = pread(connection->file_fd, connection->compress_buffer, raw_size, connection->body_offset);
+                if (bytes_read == -1) {
+                    logMessage(LEVEL_ERROR, "Error reading file data: %s", strerror(errno));
+                    return -1;
+                }
+                if ((size_t)bytes_read != raw_size) {
+                    logMessage(LEVEL_WARNING, "File is shorter than expected");
+                    return -1;
+                }
+            }
+            // The part of the file which doesn't compress goes raw
+            size_t stored_size = compressChunk(connection->compression, raw, raw_size, chunk + COMPRESS_CHUNK_HEADER_SIZE,
+                                               COMPRESS_BUFFER_SIZE);
+            if (stored_size == 0) {
+                memcpy(chunk + COMPRESS_CHUNK_HEADER_SIZE, raw, raw_size);
+                stored_size = raw_size;
+            }
+            encodeChunkHeader(chunk, raw_size, stored_size);
+            connection->chunk_length = COMPRESS_CHUNK_HEADER_SIZE + stored_size;
+            connection->chunk_sent = 0;
+            connection->body_offset += raw_size;
+            metricAdd(&metrics->compression_input, raw_size);
+            metricAdd(&metrics->compression_output, connection->chunk_length);
         }
 
-        printf("Requested file has been sent!\n");
-        //Closing file
-        fclose(file);
+        ssize_t bytes_sent = send(connection->client_socket, chunk + connection->chunk_sent,
+                                  connection->chunk_length - connection->chunk_sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            logMessage(LEVEL_ERROR, "Error sending file data: %s", strerror(errno));
+            return -1;
+        }
+        connection->chunk_sent += bytes_sent;
+        metricAdd(&metrics->bytes_sent, bytes_sent);
     }
 }
 
-// Function sends update for the file to the client
-void updateFile(const char *file_name, ssize_t client_file_size, int client_socket) {
-    // File open
-    FILE *file = fopen(file_name, "rb");
-    printf("Client requested update for the file %s\n", file_name);
-    // Checking for errors when opening file
-    if (file == NULL) {
-        perror("File open error");
-        close(client_socket);
-        pthread_exit(NULL);
+// Function sends the file data with sendfile(), the kernel copies the data from the page cache to the socket
+// Returns 1 when the whole body is sent, 0 if socket is full, -1 on error, -2 if sendfile() can't send this file
+int sendBodySendfile(Connection *connection) {
+    while (connection->body_offset < connection->body_end) {
+        // sendfile() moves body_offset forward by the number of bytes sent
+        ssize_t bytes_sent = sendfile(connection->client_socket, connection->file_fd, &connection->body_offset,
+                                      connection->body_end - connection->body_offset);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                return -2;
+            }
+            logMessage(LEVEL_ERROR, "Error sending file data: %s", strerror(errno));
+            return -1;
+        }
+        if (bytes_sent == 0) {
+            logMessage(LEVEL_WARNING, "File is shorter than expected");
+            return -1;
+        }
     }
+    return 1;
+}
 
-    // Checking the file size of the requested file on the server
-    ssize_t server_file_size = 0;
-    fseek(file, 0, SEEK_END);
-    server_file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    fclose(file);
+// Function sends the file data with splice() through the pipe of the connection
+// Returns 1 when the whole body is sent, 0 if socket is full, -1 on error, -2 if splice() can't send this file
+int sendBodySplice(Connection *connection) {
+    if (connection->pipe_fds[0] == -1) {
+        if (pipe2(connection->pipe_fds, O_NONBLOCK) == -1) {
+            logMessage(LEVEL_ERROR, "Error creating pipe: %s", strerror(errno));
+            return -2;
+        }
+        connection->pipe_size = fcntl(connection->pipe_fds[1], F_GETPIPE_SZ);
+    }
+    // Empty pipe grows to the chunk size, the size stays the same if the limit of the pipes doesn't let it grow
+    if (connection->pipe_bytes == 0 && connection->pipe_size < connection->tuner.chunk_size) {
+        int pipe_size = fcntl(connection->pipe_fds[1], F_SETPIPE_SZ, (int)connection->tuner.chunk_size);
+        if (pipe_size > 0) {
+            connection->pipe_size = pipe_size;
+        }
+    }
 
-    // If file size is the same, no update available on the server, sending a message back to the client
-    if (client_file_size == server_file_size) {
-        char no_update_message[] = "NO_UPDATE";
-        send(client_socket, no_update_message, sizeof(no_update_message), 0);
-        printf("No updates available for the requested file\n");
-        //Checking if file size on the server is bigger than the size of the file on the client side
-    } else if (client_file_size < (size_t)server_file_size) {
-        FILE *update_file = fopen(file_name, "rb");
-        // Checking errors with opening file
-        if (update_file == NULL) {
-            perror("File update failed");
-            close(client_socket);
-            pthread_exit(NULL);
-        }
-        // Calculating size of the update to send
-        ssize_t update_size = server_file_size - client_file_size;
-        uint64_t network_bytes = htobe64(update_size);
-
-        // Send the update size to the client
-        ssize_t bytes_sent = send(client_socket, &network_bytes, sizeof(network_bytes), 0);
-        if (bytes_sent < 0) {
-            perror("Error sending data");
-        }
-
-        //Preparing to send the update - identifying the portion of the file to send
-        fseek(update_file, client_file_size, SEEK_SET); // setting the pointer to the right position
-        
-        char update_buffer[BUFFER_SIZE];
-        size_t bytes_read;
-        size_t total_sent = 0;
-
-        // Cycle to send bytes from the file on the server to the client
-        while ((bytes_read = fread(update_buffer, 1, sizeof(update_buffer), update_file)) > 0) {
-            ssize_t bytes_sent = send(client_socket, update_buffer, bytes_read, 0);
-            if (bytes_sent < 0) {
-                perror("Error sending file data");
-                break;
+    while (connection->body_offset < connection->body_end) {
+        // Filling the pipe from the file, the bytes in the pipe go right after body_offset
+        off_t read_offset = connection->body_offset + connection->pipe_bytes;
+        if (connection->pipe_bytes == 0) {
+            size_t bytes_to_move = connection->pipe_size;
+            if ((off_t)bytes_to_move > connection->body_end - read_offset) {
+                bytes_to_move = connection->body_end - read_offset;
             }
-            total_sent += bytes_sent;
-            // Checking if we sent all bytes for the update
-            if (total_sent >= update_size) {
-                // We've sent the entire file
-                break;
+            ssize_t bytes_moved = splice(connection->file_fd, &read_offset, connection->pipe_fds[1], NULL,
+                                         bytes_to_move, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes_moved == -1) {
+                if (errno == EINVAL || errno == ENOSYS) {
+                    return -2;
+                }
+                logMessage(LEVEL_ERROR, "Error reading file data: %s", strerror(errno));
+                return -1;
+            }
+            if (bytes_moved == 0) {
+                logMessage(LEVEL_WARNING, "File is shorter than expected");
+                return -1;
+            }
+            connection->pipe_bytes = bytes_moved;
+        }
+
+        // Draining the pipe to the socket, the last piece of the body is not held back for more data
+        unsigned int more = connection->body_offset + (off_t)connection->pipe_bytes < connection->body_end ? SPLICE_F_MORE : 0;
+        ssize_t bytes_sent = splice(connection->pipe_fds[0], NULL, connection->client_socket, NULL,
+                                    connection->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
             }
+            logMessage(LEVEL_ERROR, "Error sending file data: %s", strerror(errno));
+            return -1;
         }
+        connection->pipe_bytes -= bytes_sent;
+        connection->body_offset += bytes_sent;
+    }
+    return 1;
+}
 
-        printf("Updates for the file %s have been sent\n", file_name);
+// Function sends the file data through the buffer, returns 1 when the whole body is sent, 0 if socket is full, -1 on error
+int sendBodyCopy(Connection *connection) {
+    // One buffer of the biggest chunk serves all connections of the shard, the data not sent is read again next time
+    if (copy_buffer == NULL && (copy_buffer = malloc(TRANSFER_MAX_CHUNK)) == NULL) {
+        logMessage(LEVEL_ERROR, "Error allocating copy buffer");
+        return -1;
+    }
 
-        fclose(update_file);
+    // Cycle to read from the file in chunks of the tuned size and sending it to the client
+    // We read the file at the position of the next byte to send, so a partial send just continues from there
+    while (connection->body_offset < connection->body_end) {
+        size_t bytes_to_read = connection->tuner.chunk_size;
+        if ((off_t)bytes_to_read > connection->body_end - connection->body_offset) {
+            bytes_to_read = connection->body_end - connection->body_offset;
+        }
+        ssize_t bytes_read = pread(connection->file_fd, copy_buffer, bytes_to_read, connection->body_offset);
+        if (bytes_read <= 0) {
+            logMessage(LEVEL_ERROR, "Error reading file data: %s", strerror(errno));
+            return -1;
+        }
+        int flags = connection->body_offset + bytes_read < connection->body_end ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+        ssize_t bytes_sent = send(connection->client_socket, copy_buffer, bytes_read, flags);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            logMessage(LEVEL_ERROR, "Error sending file data: %s", strerror(errno));
+            return -1;
+        }
+        connection->body_offset += bytes_sent;
     }
+    return 1;
 }
 
-// Thread function to receive data from the client
-void *handleReadSocket(void *arg) {
-    int client_socket = *((int *)arg);
-    char receive_buffer[BUFFER_SIZE];
-    // Receiving the client request 
-    while (1) {
-        ssize_t bytes_received = recv(client_socket, receive_buffer, sizeof(receive_buffer), 0);
-        if (bytes_received <= 0) {
-            break;
+// Function sends the body prepared in memory, returns 1 when the whole body is sent, 0 if socket is full, -1 on error
+int sendBodyMemory(Connection *connection) {
+    while (connection->body_offset < connection->body_end) {
+        ssize_t bytes_sent = send(connection->client_socket, connection->body_buffer + connection->body_offset,
+                                  connection->body_end - connection->body_offset, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            logMessage(LEVEL_ERROR, "Error sending data: %s", strerror(errno));
+            return -1;
         }
-        // Null-tterminating the string to correclty process
-        receive_buffer[bytes_received] = '\0';
-        // Locking the buffer not to allow other threads to make changes to it
-        pthread_mutex_lock(&mutex);
-        //printf("Received: %s\n", receive_buffer);
-        // Checking the flag if buffer for data exchange with handleWriteSocket is empty
-        while (!buffer_empty) {
-            pthread_mutex_unlock(&mutex);
-            sched_yield();              // Let other threads run
-            pthread_mutex_lock(&mutex);
-        }
-        // writing the data from the receive buffer (client request) to the buffer to send to handleWriteSocket
-        strcpy(buffer, receive_buffer);
-        buffer_empty = 0;
-        // Setting the flag that buffer was read (empty) and unlocking the receive buffer
-        pthread_mutex_unlock(&mutex);
-    }
-    // Exit from the receive thread
-    pthread_exit(NULL);
-}
-
-// Thread function to send data to the client
-void *handleWriteSocket(void *arg) {
-    int client_socket = *((int *)arg);
-    char message[BUFFER_SIZE];
-    int continue_processing = 1; // Flag to indicate if there is another request to process
-
-    // We sendin the data if handleReadSocket thansfers us the client request 
-    while (continue_processing) {
-        pthread_mutex_lock(&mutex);
-        // Checking the flag if something is written into the buffer
-        while (buffer_empty) {
-            pthread_mutex_unlock(&mutex);
-            sched_yield(); // Let other threads run
-            pthread_mutex_lock(&mutex);
-        }
-        
-        // Processing the request we got from the client
-        int request_type;
-        char file_name[BUFFER_SIZE];
-        size_t file_size;
-
-        // Parsing the string sent through the buffer <requesttype>|<file name>|<file size>
-        // 1 - file request, 2 - update request, anything else - invalid request
-        sscanf(buffer, "%d|%[^|]|%zu", &request_type, file_name, &file_size);
-
-        // Checking type of request
-        if (request_type == 1) {
-            // If type is 1, we send file using function sendFile()
-            sendFile(file_name, client_socket);
-            // Closing socket
-            close(client_socket);
-            // If type is 2, we send update for the file using function updateFile()
-        } else if (request_type == 2) {
-            updateFile(file_name, file_size, client_socket);
+        connection->body_offset += bytes_sent;
+    }
+    return 1;
+}
+
+// Function sends the delta instructions encoded chunk by chunk into the buffer of the connection
+// Returns 1 when the whole body is sent, 0 if socket is full, -1 on error
+int sendBodyDelta(Connection *connection) {
+    while (connection->body_offset < connection->body_end) {
+        if (connection->chunk_sent == connection->chunk_length) {
+            connection->chunk_length = deltaEncode(connection->job, connection->compress_buffer, DELTA_CHUNK_SIZE);
+            connection->chunk_sent = 0;
+            if (connection->chunk_length == 0) {
+                return -1;
+            }
+        }
+        size_t length = connection->chunk_length - connection->chunk_sent;
+        if ((off_t)length > connection->body_end - connection->body_offset) {
+            length = connection->body_end - connection->body_offset;
+        }
+        ssize_t bytes_sent = send(connection->client_socket, connection->compress_buffer + connection->chunk_sent,
+                                  length, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            logMessage(LEVEL_ERROR, "Error sending data: %s", strerror(errno));
+            return -1;
+        }
+        connection->chunk_sent += bytes_sent;
+        connection->body_offset += bytes_sent;
+    }
+    return 1;
+}
+
+// Function creates the io_uring instance, registers the buffers, the fixed file slots and the eventfd
+// Returns -1 if io_uring can't be used, the caller falls back to the classic transfer
+int uringInit(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    uring.ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.ring_fd == -1) {
+        perror("Error creating io_uring instance");
+        return -1;
+    }
+
+    // Mapping the submission queue, the completion queue and the array of submission entries
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    unsigned char *sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  uring.ring_fd, IORING_OFF_SQ_RING);
+    unsigned char *cq_ring = sq_ring;
+    if (sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring.ring_fd, IORING_OFF_CQ_RING);
+    }
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        perror("Error mapping io_uring queues");
+        return -1;
+    }
+    uring.sq_head = (_Atomic unsigned *)(sq_ring + params.sq_off.head);
+    uring.sq_tail = (_Atomic unsigned *)(sq_ring + params.sq_off.tail);
+    uring.sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+    uring.cq_head = (_Atomic unsigned *)(cq_ring + params.cq_off.head);
+    uring.cq_tail = (_Atomic unsigned *)(cq_ring + params.cq_off.tail);
+    uring.cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+    // Registering the buffers once, so the kernel doesn't map the pages of the buffer for every read
+    uring.buffers = mmap(NULL, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring.buffers == MAP_FAILED) {
+        perror("Error allocating io_uring buffers");
+        return -1;
+    }
+    struct iovec buffers[URING_BUFFER_COUNT];
+    for (int i = 0; i < URING_BUFFER_COUNT; i++) {
+        buffers[i].iov_base = uring.buffers + (size_t)i * URING_BUFFER_SIZE;
+        buffers[i].iov_len = URING_BUFFER_SIZE;
+        uring.free_buffers[i] = URING_BUFFER_COUNT - 1 - i;
+    }
+    uring.free_count = URING_BUFFER_COUNT;
+    if (syscall(__NR_io_uring_register, uring.ring_fd, IORING_REGISTER_BUFFERS, buffers, URING_BUFFER_COUNT) == -1) {
+        perror("Error registering io_uring buffers");
+        return -1;
+    }
+
+    // Registering empty fixed file slots, transfers put their file and socket there with IORING_OP_FILES_UPDATE
+    int slots[URING_FILE_SLOTS];
+    for (int i = 0; i < URING_FILE_SLOTS; i++) {
+        slots[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, uring.ring_fd, IORING_REGISTER_FILES, slots, URING_FILE_SLOTS) == -1) {
+        perror("Error registering io_uring files");
+        return -1;
+    }
+
+    uring.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (uring.event_fd == -1 ||
+        syscall(__NR_io_uring_register, uring.ring_fd, IORING_REGISTER_EVENTFD, &uring.event_fd, 1) == -1) {
+        perror("Error registering io_uring eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+// Function returns the next free submission entry, cleared, the entry is submitted by uringSubmit()
+// The queue can't overflow: every transfer holds a buffer and has at most 3 entries in the queue
+struct io_uring_sqe *uringGetSqe(void) {
+    unsigned tail = atomic_load_explicit(uring.sq_tail, memory_order_relaxed) + uring.sq_pending;
+    unsigned index = tail & uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[index] = index;
+    uring.sq_pending++;
+    return sqe;
+}
+
+// Function publishes the prepared entries and submits all of them with one system call
+void uringSubmit(void) {
+    if (uring.sq_pending == 0) {
+        return;
+    }
+    // Entries have to be written before the kernel sees the new tail
+    unsigned tail = atomic_load_explicit(uring.sq_tail, memory_order_relaxed);
+    atomic_store_explicit(uring.sq_tail, tail + uring.sq_pending, memory_order_release);
+    unsigned to_submit = uring.sq_pending;
+    uring.sq_pending = 0;
+    while (to_submit > 0) {
+        long submitted = syscall(__NR_io_uring_enter, uring.ring_fd, to_submit, 0, 0, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            logMessage(LEVEL_ERROR, "Error submitting to io_uring: %s", strerror(errno));
+            return;
+        }
+        to_submit -= submitted;
+    }
+}
+
+// Function gives the buffer of the finished transfer back and empties its fixed file slots,
+// otherwise the slots would keep the file and the socket open after close()
+// The buffer is reused only after the slots are emptied
+void uringRelease(Connection *connection) {
+    if (connection->uring_buffer == -1) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uringGetSqe();
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)uring_empty_slots;
+    sqe->len = 2;
+    sqe->off = connection->uring_buffer * 2;
+    sqe->user_data = ((uint64_t)connection->uring_buffer << 3) | URING_OP_CLEAR;
+    connection->uring_buffer = -1;
+}
+
+// Function sends the next chunk of the file data with the linked read->send pair of io_uring operations
+// The first chunk of the response also puts the file and the socket into the fixed file slots of its buffer
+// Returns 1 when the whole body is sent, 0 while the operations are in progress, -1 on error,
+// -2 if all registered buffers are busy and this part of the body has to be sent the classic way
+int sendBodyUring(Connection *connection) {
+    if (connection->uring_inflight > 0) {
+        return 0;   // Completion of the chain continues the transfer
+    }
+    if (connection->body_offset >= connection->body_end) {
+        uringRelease(connection);
+        return 1;
+    }
+
+    uint64_t connection_data = (uint64_t)(uintptr_t)connection;
+    struct io_uring_sqe *sqe;
+    if (connection->uring_buffer == -1) {
+        if (uring.free_count == 0) {
+            return -2;
+        }
+        connection->uring_buffer = uring.free_buffers[--uring.free_count];
+        connection->uring_fds[0] = connection->file_fd;
+        connection->uring_fds[1] = connection->client_socket;
+        sqe = uringGetSqe();
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->addr = (uint64_t)(uintptr_t)connection->uring_fds;
+        sqe->len = 2;
+        sqe->off = connection->uring_buffer * 2;
+        sqe->user_data = connection_data | URING_OP_FILES;
+        connection->uring_inflight++;
+    }
+
+    size_t length = URING_BUFFER_SIZE;
+    if ((off_t)length > connection->body_end - connection->body_offset) {
+        length = connection->body_end - connection->body_offset;
+    }
+    unsigned char *buffer = uring.buffers + (size_t)connection->uring_buffer * URING_BUFFER_SIZE;
+    connection->uring_length = length;
+    connection->uring_files_result = 0;
+
+    // A short read breaks the link, so the send never sends the bytes which were not read
+    sqe = uringGetSqe();
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = connection->uring_buffer * 2;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = connection->body_offset;
+    sqe->buf_index = connection->uring_buffer;
+    sqe->user_data = connection_data | URING_OP_READ;
+
+    // MSG_WAITALL makes the kernel wait for the space in the socket instead of completing the send partially
+    sqe = uringGetSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connection->uring_buffer * 2 + 1;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = connection_data | URING_OP_SEND;
+    connection->uring_inflight += 2;
+    return 0;
+}
+
+// Function checks the results of the completed read->send chain and continues the connection
+void uringFinishChain(EventLoop *loop, Connection *connection) {
+    if (connection->closing) {
+        closeConnection(loop, connection);
+        return;
+    }
+    if (connection->uring_files_result < 0) {
+        logMessage(LEVEL_ERROR, "Error setting io_uring files: %s", strerror(-connection->uring_files_result));
+        closeConnection(loop, connection);
+        return;
+    }
+    if (connection->uring_read_result < 0 || (size_t)connection->uring_read_result != connection->uring_length) {
+        if (connection->uring_read_result < 0) {
+            logMessage(LEVEL_ERROR, "Error reading file data: %s", strerror(-connection->uring_read_result));
         } else {
-            // Handle invalid request type
-            printf("Invalid request type: %d\n", request_type);
+            logMessage(LEVEL_WARNING, "File is shorter than expected");
         }
+        closeConnection(loop, connection);
+        return;
+    }
+    if (connection->uring_send_result == -EAGAIN) {
+        // Socket was full and the kernel didn't wait for it, the next chain sends the same chunk again
+        connection->uring_send_result = 0;
+    }
+    if (connection->uring_send_result < 0) {
+        logMessage(LEVEL_ERROR, "Error sending file data: %s", strerror(-connection->uring_send_result));
+        closeConnection(loop, connection);
+        return;
+    }
+    connection->body_offset += connection->uring_send_result;
+    metricAdd(&metrics->bytes_sent, connection->uring_send_result);
+    scheduleCharge(connection, connection->uring_send_result);
+    transferTune(&connection->tuner, connection->client_socket, SO_SNDBUF, connection->uring_send_result);
+    // Sending the next chunk or finishing the response and taking the next request
+    handleConnectionEvent(loop, connection, 0);
+}
 
-        buffer[0] = '\0';               // Clearing the buffer
-        buffer_empty = 1;               // Flag to indicate that buffer is empty
-        pthread_mutex_unlock(&mutex);
+// Function takes the completions posted by the kernel, called when the eventfd of io_uring is signaled
+void uringComplete(EventLoop *loop) {
+    uint64_t counter;
+    if (read(uring.event_fd, &counter, sizeof(counter)) == -1 && errno != EAGAIN) {
+        logMessage(LEVEL_ERROR, "Error reading io_uring eventfd: %s", strerror(errno));
+    }
 
-        // Check if there are more requests to process
-        continue_processing = !buffer_empty;
+    unsigned head = atomic_load_explicit(uring.cq_head, memory_order_relaxed);
+    while (head != atomic_load_explicit(uring.cq_tail, memory_order_acquire)) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int32_t result = cqe->res;
+        // Giving the entry back to the kernel before the handlers submit new operations
+        head++;
+        atomic_store_explicit(uring.cq_head, head, memory_order_release);
 
+        int operation = user_data & URING_OP_MASK;
+        if (operation == URING_OP_CLEAR) {
+            uring.free_buffers[uring.free_count++] = user_data >> 3;
+            continue;
+        }
+        Connection *connection = (Connection *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+        if (operation == URING_OP_FILES) {
+            connection->uring_files_result = result;
+        } else if (operation == URING_OP_READ) {
+            connection->uring_read_result = result;
+        } else {
+            connection->uring_send_result = result;
+        }
+        if (--connection->uring_inflight == 0) {
+            uringFinishChain(loop, connection);
+        }
     }
-    // Closing socket and exiting from the thread
-    close(client_socket);
-    pthread_exit(NULL);
 }
 
-// main function
-int main() {
-    // init
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_size = sizeof(client_addr);
-    pthread_mutex_init(&mutex, NULL);
-    
+// Function sends the file data in the transfer mode of the connection
+// If the kernel can't send the file with zero-copy, the connection falls back to the next mode and continues from the same offset
+// Returns 1 when the whole body is sent, 0 if socket is full, -1 on error
+int handleSendBody(Connection *connection) {
+    int result;
+    if (connection->body_buffer != NULL) {
+        return sendBodyMemory(connection);
+    }
+    if (connection->job != NULL) {
+        return sendBodyDelta(connection);
+    }
+    if (connection->compression != COMPRESS_NONE) {
+        return sendBodyCompressed(connection);
+    }
+    if (connection->transfer_mode == TRANSFER_URING) {
+        result = sendBodyUring(connection);
+        if (result != -2) {
+            return result;
+        }
+        // All registered buffers are busy, this part of the body goes without io_uring
+        result = sendBodySendfile(connection);
+        if (result != -2) {
+            return result;
+        }
+        return sendBodyCopy(connection);
+    }
+    if (connection->transfer_mode == TRANSFER_SENDFILE) {
+        result = sendBodySendfile(connection);
+        if (result != -2) {
+            return result;
+        }
+        connection->transfer_mode = TRANSFER_SPLICE;
+    }
+    if (connection->transfer_mode == TRANSFER_SPLICE) {
+        result = sendBodySplice(connection);
+        if (result != -2) {
+            return result;
+        }
+        // Nothing was read into the pipe if splice() failed on the file
+        connection->transfer_mode = TRANSFER_COPY;
+    }
+    return sendBodyCopy(connection);
+}
+
+// Function answers the queued requests in order until the socket is full
+// Returns -1 if the connection has to be closed
+int processRequests(Connection *connection) {
+    while (1) {
+        if (connection->state == STATE_READ_REQUEST) {
+            // Taking the next request from the queue
+            Request *request = nextRequest(connection);
+            if (request == NULL) {
+                // Nothing requested, pushing the appends of the subscribed file
+                if (subscriptionPush(connection)) {
+                    continue;
+                }
+                return 0;
+            }
+            startResponse(connection, request);
+            if (connection->state != STATE_WAIT_UPSTREAM && connection->state != STATE_WAIT_JOB) {
+                requestQueuePop(&connection->io->queue);
+            }
+            continue;
+        }
+
+        if (connection->state == STATE_WAIT_JOB) {
+            if (!jobResume(connection)) {
+                return 0;   // Worker of the job wakes the connection
+            }
+            continue;
+        }
+
+        if (connection->state == STATE_WAIT_UPSTREAM) {
+            if (!relayResume(connection)) {
+                return 0;   // Progress of the fetch wakes the connection
+            }
+            continue;
+        }
+
+        if (connection->state == STATE_SEND_HEADER) {
+            int result;
+            if (connection->file_data != NULL && connection->compression == COMPRESS_NONE) {
+                // Small file leaves with its header in one writev(): it doesn't wait for a quantum,
+                // but it pays the tokens and waits for them like any other body
+                if (connection->body_offset < connection->body_end &&
+                    scheduleTokens(connection, nowMicroseconds()) == 0) {
+                    return 0;
+                }
+                off_t body_offset = connection->body_offset;
+                result = sendResponseMemory(connection);
+                scheduleChargeTokens(connection, connection->body_offset - body_offset);
+            } else {
+                result = handleSendHeader(connection);
+            }
+            if (result != 1) {
+                return result;
+            }
+            connection->state = STATE_SEND_BODY;
+        }
+
+        if (connection->state == STATE_SEND_BODY) {
+            if (connection->uring_inflight > 0) {
+                return 0;   // Completion of the io_uring chain continues the transfer
+            }
+            off_t body_offset = connection->body_offset;
+            off_t body_end = connection->body_end;
+            int result = 1;
+            // File streamed from the upstream is sent up to the data written so far
+            off_t available = connection->fetch != NULL ? relayAvailable(connection->fetch) : body_end;
+            if (available == -1) {
+                logMessage(LEVEL_WARNING, "Upstream fetch of the file failed, closing the connection");
+                return -1;
+            }
+            if (body_offset < body_end && body_offset >= available) {
+                parkConnection(connection);
+                return 0;
+            }
+            if (body_offset < body_end && (connection->file_fd != -1 || connection->body_buffer != NULL ||
+                                           connection->job != NULL)) {
+                // The transfer sends up to its quantum and the tokens it has, the rest waits for the next turn
+                int64_t allowance = scheduleTurn(connection);
+                if (allowance == 0) {
+                    return 0;
+                }
+                if (body_end - body_offset > allowance) {
+                    connection->body_end = body_offset + allowance;
+                }
+                if (connection->body_end > available) {
+                    connection->body_end = available;
+                }
+                uint64_t bytes_sent = atomic_load_explicit(&metrics->bytes_sent, memory_order_relaxed);
+                result = handleSendBody(connection);
+                connection->body_end = body_end;
+                // Compressed body counts the bytes it sends itself, body_offset moves by the file bytes
+                if (connection->compression == COMPRESS_NONE) {
+                    metricAdd(&metrics->bytes_sent, connection->body_offset - body_offset);
+                }
+                bytes_sent = atomic_load_explicit(&metrics->bytes_sent, memory_order_relaxed) - bytes_sent;
+                scheduleCharge(connection, bytes_sent);
+                transferTune(&connection->tuner, connection->client_socket, SO_SNDBUF, bytes_sent);
+                if (result == 1 && connection->body_offset < body_end) {
+                    // Quantum or tokens are used, the socket is still writable
+                    connection->waiting_since_us = nowMicroseconds();
+                    return 0;
+                }
+                if (result == 0 && connection->deficit > 0) {
+                    connection->deficit = 0;    // Socket is full, the transfer leaves the round
+                }
+            }
+            if (result != 1) {
+                return result;
+            }
+            connection->deficit = 0;
+            // Response is complete
+            histogramAdd(&metrics->transfer, nowMicroseconds() - connection->response_start_us);
+            if (connection->fetch != NULL) {
+                relayRelease(connection->fetch);
+                connection->fetch = NULL;
+            }
+            if (connection->file_fd != -1 || connection->body_buffer != NULL || connection->job != NULL) {
+                logMessage(LEVEL_INFO, "Requested data has been sent!");
+            }
+            if (connection->job != NULL) {
+                jobRelease(connection->job);
+                connection->job = NULL;
+            }
+            if (connection->file != NULL) {
+                fileCacheRelease(connection->file);
+                connection->file = NULL;
+                connection->file_fd = -1;
+                connection->file_data = NULL;
+            }
+            connection->compression = COMPRESS_NONE;
+            if (connection->compress_buffer != NULL) {
+                poolGive(connection->compress_buffer);
+                connection->compress_buffer = NULL;
+            }
+            free(connection->body_buffer);
+            connection->body_buffer = NULL;
+            connection->state = STATE_READ_REQUEST;
+        }
+    }
+}
+
+// Function advances the state machine of the connection when its socket is ready
+void handleConnectionEvent(EventLoop *loop, Connection *connection, uint32_t events) {
+    // Connection waiting for the I/O buffers doesn't read, the hangup of its client would be reported again and again
+    if ((events & EPOLLERR) || (connection->io_waiting && (events & EPOLLHUP))) {
+        closeConnection(loop, connection);
+        return;
+    }
+
+    // Reading the requests first, the queue may get new requests for the sending side
+    if ((events & (EPOLLIN | EPOLLHUP)) && handleReadRequest(connection) == -1) {
+        closeConnection(loop, connection);
+        return;
+    }
+
+    int queued;
+    do {
+        if (processRequests(connection) == -1) {
+            closeConnection(loop, connection);
+            return;
+        }
+        // Socket is full, continuing when it is writable again
+        if (connection->state != STATE_READ_REQUEST) {
+            break;
+        }
+        // Responses freed the queue, parsing the requests which are already in the buffer
+        queued = parseRequests(connection);
+        if (queued == -1) {
+            closeConnection(loop, connection);
+            return;
+        }
+    } while (queued > 0);
+
+    // Client will not send more requests and all its requests are answered
+    if (connection->client_closed && connection->state == STATE_READ_REQUEST &&
+        nextRequest(connection) == NULL) {
+        closeConnection(loop, connection);
+        return;
+    }
+    ioDetach(connection);
+    watchConnection(loop, connection);
+}
+
+// Function creates the listening socket and the epoll instance of the shard, returns -1 on error
+// With several shards every shard has its own socket on the same port (SO_REUSEPORT), the kernel spreads the connections
+int openListener(EventLoop *loop, int reuse_port) {
+    struct sockaddr_in server_addr;
+    int reuse = 1;
+
     // Creating server socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
+    loop->server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (loop->server_socket == -1) {
         perror("Error creating socket");
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+    setsockopt(loop->server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuse_port && setsockopt(loop->server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+        perror("Error setting SO_REUSEPORT");
+        return -1;
     }
-    // File doesn't exist
+
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-    
+    server_addr.sin_port = htons(server_port);
+
     // Binding server socket to the server address
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+    if (bind(loop->server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
         perror("Error binding");
-        exit(EXIT_FAILURE);
+        return -1;
     }
-    
-    // Listebing for incoming connections
-    if (listen(server_socket, MAX_CLIENTS) == -1) {
+
+    // Listening for incoming connections
+    if (listen(loop->server_socket, LISTEN_BACKLOG) == -1) {
         perror("Error listening");
+        return -1;
+    }
+    if (setNonBlocking(loop->server_socket) == -1) {
+        perror("Error setting non-blocking mode");
+        return -1;
+    }
+
+    // Creating epoll instance and adding the listening socket to it
+    loop->epoll_fd = epoll_create1(0);
+    if (loop->epoll_fd == -1) {
+        perror("Error creating epoll instance");
+        return -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;      // NULL marks the listening socket
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->server_socket, &event) == -1) {
+        perror("Error adding listening socket to epoll");
+        return -1;
+    }
+    return 0;
+}
+
+// Function binds the current thread to the CPU of the shard, shards go round-robin over the CPUs the server may use
+void pinThread(int index) {
+    int cpu_count = CPU_COUNT(&allowed_cpus);
+    if (cpu_count == 0) {
+        return;
+    }
+    int target = index % cpu_count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed_cpus) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (result != 0) {
+                logMessage(LEVEL_WARNING, "Error pinning shard %d to CPU %d: %s", index, cpu, strerror(result));
+            }
+            return;
+        }
+    }
+}
+
+// Function runs the event loop of one shard: waiting for the sockets to be ready and advancing the state of every
+// ready connection. The shard accepts the connections from its own listening socket and serves them until they are
+// closed, so the shards share nothing but the file cache
+void *runEventLoop(void *arg) {
+    EventLoop *loop = arg;
+
+    // Every shard counts its metrics and logs through its own ring
+    if (registerThread() == -1) {
+        fprintf(stderr, "Error allocating metrics\n");
+        exit(EXIT_FAILURE);
+    }
+    if (worker_count > 1) {
+        pinThread(loop->index);
+    }
+    if (poolInit(&connection_pool) == -1 || poolInit(&io_pool) == -1) {
+        fprintf(stderr, "Error allocating the connection pools\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Starting io_uring of the shard, the completions are signaled through the eventfd in the same epoll set
+    if (loop->transfer_mode == TRANSFER_URING) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &uring;
+        if (uringInit() == -1 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, uring.event_fd, &event) == -1) {
+            logMessage(LEVEL_INFO, "io_uring is not available, using sendfile()");
+            loop->transfer_mode = TRANSFER_SENDFILE;
+        }
+    }
+
+    // Subscribed files of the shard are watched by its own inotify instance, the events come through the same epoll set
+    subscription_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (subscription_inotify != -1) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &subscription_inotify;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, subscription_inotify, &event) == -1) {
+            close(subscription_inotify);
+            subscription_inotify = -1;
+        }
+    }
+    if (subscription_inotify == -1) {
+        logMessage(LEVEL_WARNING, "inotify is not available, subscriptions are not supported");
+    }
+
+    // Upstream fetches of the relay and the worker jobs wake the waiting connections through the eventfd of the shard
+    shard_wake_event = loop->wake_event;
+    struct epoll_event wake;
+    wake.events = EPOLLIN;
+    wake.data.ptr = &parked_connections;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_event, &wake) == -1) {
+        logMessage(LEVEL_ERROR, "Error watching the wake events: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    
-    printf("Server listening on port %d\n", PORT);
-    
-    // Waiting for the connection and accepting client connection
+
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_size);
-        if (client_socket == -1) {
-            perror("Error accepting connection");
+        // Operations prepared during the last pass go to the kernel with one system call
+        uringSubmit();
+        int timeout = scheduleTimeout();
+        // Memory given back by the other shards doesn't wake this shard, it checks the pools again after a while
+        if ((io_waiting != NULL || loop->accept_deferred) && (timeout == -1 || timeout > MEMORY_RETRY_MS)) {
+            timeout = MEMORY_RETRY_MS;
+        }
+        int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logMessage(LEVEL_ERROR, "Error waiting for events: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                acceptConnections(loop);
+            } else if (events[i].data.ptr == &uring) {
+                uringComplete(loop);
+            } else if (events[i].data.ptr == &subscription_inotify) {
+                subscriptionEvents(loop);
+            } else if (events[i].data.ptr == &parked_connections) {
+                parkedEvents(loop);
+            } else {
+                handleConnectionEvent(loop, events[i].data.ptr, events[i].events);
+            }
+        }
+        // Throttled transfers which got their tokens continue
+        scheduleWake(loop);
+        // Connections waiting for the memory continue if the pools have it again
+        memoryWake(loop);
+    }
+    // Closing epoll instance and server socket
+    close(loop->epoll_fd);
+    close(loop->server_socket);
+    return NULL;
+}
+
+// Function reads the size with an optional K, M or G suffix, returns -1 if the text is not a size
+int parseSize(const char *text, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || text[0] == '-') {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        value <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value <<= 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        value <<= 30;
+        end++;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+// main function
+int main(int argc, char *argv[]) {
+    int option;
+    size_t rate;
+
+    // Reading command line options
+    while ((option = getopt(argc, argv, "m:p:l:w:s:c:g:r:u:M:")) != -1) {
+        if (option == 'm' && strcmp(optarg, "sendfile") == 0) {
+            transfer_mode = TRANSFER_SENDFILE;
+        } else if (option == 'm' && strcmp(optarg, "splice") == 0) {
+            transfer_mode = TRANSFER_SPLICE;
+        } else if (option == 'm' && strcmp(optarg, "copy") == 0) {
+            transfer_mode = TRANSFER_COPY;
+        } else if (option == 'm' && strcmp(optarg, "uring") == 0) {
+            transfer_mode = TRANSFER_URING;
+        } else if (option == 'p' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+            server_port = atoi(optarg);
+        } else if (option == 'l' && strcmp(optarg, "error") == 0) {
+            log_level = LEVEL_ERROR;
+        } else if (option == 'l' && strcmp(optarg, "warning") == 0) {
+            log_level = LEVEL_WARNING;
+        } else if (option == 'l' && strcmp(optarg, "info") == 0) {
+            log_level = LEVEL_INFO;
+        } else if (option == 'l' && strcmp(optarg, "debug") == 0) {
+            log_level = LEVEL_DEBUG;
+        } else if (option == 'w' && atoi(optarg) > 0 && atoi(optarg) <= MAX_THREADS) {
+            worker_count = atoi(optarg);
+        } else if (option == 's' && parseSize(optarg, &file_cache.small_file_size) == 0) {
+            continue;
+        } else if (option == 'c' && parseSize(optarg, &file_cache.data_budget) == 0) {
+            continue;
+        } else if ((option == 'g' || option == 'r') && parseSize(optarg, &rate) == 0) {
+            atomic_store(option == 'g' ? &global_rate_limit : &client_rate_limit, rate);
+        } else if (option == 'u' && relayInit(optarg) == 0) {
+            continue;
+        } else if (option == 'M' && parseSize(optarg, &memory_limit) == 0) {
             continue;
+        } else {
+            fprintf(stderr, "Usage: %s [-m sendfile|splice|copy|uring] [-p port] [-l error|warning|info|debug] [-w shards]\n"
+                            "       [-s small file size] [-c memory budget] [-g global rate] [-r client rate] [-u upstream[:port]]\n"
+                            "       [-M connection memory cap]\n", argv[0]);
+            exit(EXIT_FAILURE);
         }
-        
-        printf("Accepted connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        
-        // Creating threads
-        // handleReadSocket to receive data from the client
-        // handleWriteSocket to send data to the client 
-        pthread_t socket_read_thread, socket_write_thread;
-        if (pthread_create(&socket_read_thread, NULL, handleReadSocket, (void *)&client_socket) != 0 ||
-            pthread_create(&socket_write_thread, NULL, handleWriteSocket, (void *)&client_socket) != 0) {
-            perror("Error creating thread");
-            close(client_socket);
+    }
+
+    // Every shard keeps a slab of the connections and a slab of the I/O buffers, so it can always serve its clients
+    size_t first, stride, count;
+    size_t shard_memory = poolLayout(&connection_pool, &first, &stride, &count) + poolLayout(&io_pool, &first, &stride, &count);
+    if (memory_limit != 0 && memory_limit < worker_count * shard_memory) {
+        fprintf(stderr, "Memory cap has to be at least %zu KB, %zu KB for every shard\n",
+                (worker_count * shard_memory + 1023) / 1024, (shard_memory + 1023) / 1024);
+        exit(EXIT_FAILURE);
+    }
+
+    // Sending to the socket closed by the client should return an error instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
+    loggerInit();
+    raiseFileLimit();
+    fileCacheInit();
+    jobInit();
+    if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) == -1) {
+        CPU_ZERO(&allowed_cpus);
+    }
+
+    // All listening sockets are created before the shards start, so a busy port stops the server right away
+    EventLoop *loops = calloc(worker_count, sizeof(EventLoop));
+    if (loops == NULL) {
+        perror("Error allocating shards");
+        exit(EXIT_FAILURE);
+    }
+    relay.shard_events = malloc(worker_count * sizeof(int));
+    if (relay.shard_events == NULL) {
+        perror("Error allocating shards");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        loops[i].index = i;
+        loops[i].transfer_mode = transfer_mode;
+        if ((loops[i].wake_event = relay.shard_events[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+            perror("Error creating wake eventfd");
+            exit(EXIT_FAILURE);
+        }
+        if (openListener(&loops[i], worker_count > 1) == -1) {
+            exit(EXIT_FAILURE);
         }
+    }
+
+    if (relay.enabled) {
+        printf("Relay of the upstream server %s:%d\n", inet_ntoa(relay.upstream.sin_addr), ntohs(relay.upstream.sin_port));
+    }
+    if (worker_count > 1) {
+        printf("Server listening on port %d with %d shards\n", server_port, worker_count);
+    } else {
+        printf("Server listening on port %d\n", server_port);
+    }
 
-        // Wait for threads to finish
-        pthread_join(socket_read_thread, NULL);
-        pthread_join(socket_write_thread, NULL);
-        printf("Waiting for the new client request...");
+    // The first shard runs in the main thread
+    for (int i = 1; i < worker_count; i++) {
+        if (startThread(runEventLoop, &loops[i]) == -1) {
+            fprintf(stderr, "Error creating shard thread\n");
+            exit(EXIT_FAILURE);
+        }
     }
-    // Freeing memory aloocated for mutex and closing server socket 
-    pthread_mutex_destroy(&mutex);
-    close(server_socket);
+    runEventLoop(&loops[0]);
     return 0;
 }